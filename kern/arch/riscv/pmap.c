@@ -150,3 +150,13 @@ int unmap_segment(pgdir_t pgdir, uintptr_t va, size_t size)
 {
 	#error "Implement me"
 }
+
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int create)
+{
+	#error "Implement me"
+}
+
+void pgdir_split_jumbo(pgdir_t pgdir, const void *va)
+{
+	#error "Implement me"
+}
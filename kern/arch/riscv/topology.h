@@ -8,3 +8,21 @@
  * riscv. */
 static void topology_init(void) {}
 static void print_cpu_topology(void) {}
+
+#define num_numa 1
+
+static inline int numa_id(void)
+{
+	return 0;
+}
+
+static inline int numa_id_of_core(int coreid)
+{
+	return 0;
+}
+
+static inline void numa_foreach_mem_range(void (*cb)(int, physaddr_t, size_t,
+                                                     void *),
+                                          void *arg)
+{
+}
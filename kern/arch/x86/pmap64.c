@@ -397,6 +397,41 @@ pte_t pgdir_walk(pgdir_t pgdir, const void *va, int create)
 	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
 }
 
+/* Like pgdir_walk, but stops at the PML2, for 2MB jumbo pages.  The returned
+ * PTE could be unmapped, a jumbo, or an intermediate PTE pointing to a PML1;
+ * the caller needs to check which. */
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int create)
+{
+	int flags = PML2_SHIFT;
+
+	if (create == 1)
+		flags |= PG_WALK_CREATE;
+	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
+}
+
+/* Splits the PML2 jumbo mapping va into NPTENTRIES PML1 mappings with the same
+ * settings (minus PTE_PS).  The caller holds the pte_lock and handles the TLB
+ * and the underlying memory. */
+void pgdir_split_jumbo(pgdir_t pgdir, const void *va)
+{
+	kpte_t *kpte = pgdir_walk_jumbo(pgdir, va, FALSE);
+	kpte_t *new_pml;
+	physaddr_t pa;
+	int settings;
+
+	assert(kpte && kpte_is_jumbo(kpte));
+	/* The PML1 and its EPT twin are allocated together, like in __pml_walk */
+	new_pml = kpages_zalloc(2 * PGSIZE, MEM_WAIT);
+	pa = pte_get_paddr(kpte);
+	/* PTE_PS is the PAT bit in a PML1 */
+	settings = pte_get_settings(kpte) & ~PTE_PS;
+	for (int i = 0; i < NPTENTRIES; i++)
+		pte_write(&new_pml[i], pa + i * PGSIZE, settings);
+	*kpte = PADDR(new_pml) | PTE_P | PTE_U | PTE_W;
+	*kpte_to_epte(kpte) = (PADDR(new_pml) + PGSIZE) | EPTE_R | EPTE_X |
+	                      EPTE_W;
+}
+
 static int pml_perm_walk(kpte_t *pml, const void *va, int pml_shift)
 {
 	kpte_t *kpte;
@@ -18,7 +18,6 @@ int *os_coreid_lookup;
 
 #define num_cpus            (cpu_topology_info.num_cpus)
 #define num_sockets         (cpu_topology_info.num_sockets)
-#define num_numa            (cpu_topology_info.num_numa)
 #define cores_per_numa      (cpu_topology_info.cores_per_numa)
 #define cores_per_socket    (cpu_topology_info.cores_per_socket)
 #define cores_per_cpu       (cpu_topology_info.cores_per_cpu)
@@ -370,6 +369,39 @@ void topology_init(void)
 		build_flat_topology();
 }
 
+/* Finds the numa_id the cores use for SRAT proximity domain @dom.  Returns -1
+ * if no core is in that domain. */
+static int srat_dom_to_numa_id(int dom)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (find_numa_domain(core_list[i].apic_id) == dom)
+			return core_list[i].numa_id;
+	}
+	return -1;
+}
+
+/* Calls @cb for each memory range that SRAT assigns to a NUMA domain that has
+ * cores.  Does nothing on flat topologies. */
+void numa_foreach_mem_range(void (*cb)(int numa_id, physaddr_t start,
+                                       size_t len, void *arg),
+                            void *arg)
+{
+	struct Srat *temp;
+	int numa;
+
+	if (srat == NULL || num_numa <= 1)
+		return;
+	for (int i = 0; i < srat->nchildren; i++) {
+		temp = srat->children[i]->tbl;
+		if (temp == NULL || temp->type != SRmem || !temp->mem.len)
+			continue;
+		numa = srat_dom_to_numa_id(temp->mem.dom);
+		if (numa < 0)
+			continue;
+		cb(numa, temp->mem.addr, temp->mem.len, arg);
+	}
+}
+
 void print_cpu_topology()
 {
 	printk("num_numa: %d, num_sockets: %d, num_cpus: %d, num_cores: %d\n",
@@ -35,9 +35,13 @@ struct topology_info {
 extern struct topology_info cpu_topology_info;
 extern int *os_coreid_lookup;
 #define num_cores (cpu_topology_info.num_cores)
+#define num_numa (cpu_topology_info.num_numa)
 
 void topology_init();
 void print_cpu_topology();
+void numa_foreach_mem_range(void (*cb)(int numa_id, physaddr_t start,
+                                       size_t len, void *arg),
+                            void *arg);
 
 static inline int get_hw_coreid(uint32_t coreid)
 {
@@ -60,6 +64,12 @@ static inline int numa_id(void)
 	return cpu_topology_info.core_list[os_coreid].numa_id;
 }
 
+/* Cheaper than numa_id() when you already know the OS coreid. */
+static inline int numa_id_of_core(int coreid)
+{
+	return cpu_topology_info.core_list[coreid].numa_id;
+}
+
 static inline int core_id(void)
 {
 	int coreid;
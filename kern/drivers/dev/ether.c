@@ -36,6 +36,8 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <core_set.h>
+#include <corerequest.h>
 #include <net/ip.h>
 
 struct dev etherdevtab;
@@ -47,11 +49,18 @@ static char *devname(void)
 
 enum {
 	Type8021Q = 0x8100,			/* value of type field for 802.1[pQ] tags */
+	Type4 = 0x0800,
+	Type6 = 0x86DD,
+	Tcpproto = 6,
+	Udpproto = 17,
 };
 
+static qlock_t etherrxqlock = QLOCK_INITIALIZER(etherrxqlock);
+
 static struct ether *etherxx[MaxEther];	/* real controllers */
 static struct ether *vlanalloc(struct ether *, int);
 static void vlanoq(struct ether *, struct block *);
+static long etherifstat(struct ether *, void *, long, uint32_t);
 
 struct chan *etherattach(char *spec)
 {
@@ -208,7 +217,7 @@ static size_t etherread(struct chan *chan, void *buf, size_t n, off64_t off)
 		 * into the chip to extract statistics.
 		 */
 		if (NETTYPE(chan->qid.path) == Nifstatqid) {
-			r = ether->ifstat(ether, buf, n, offset);
+			r = etherifstat(ether, buf, n, offset);
 			goto out;
 		}
 		if (NETTYPE(chan->qid.path) == Nstatqid)
@@ -300,7 +309,24 @@ static inline int eaddrcmp(uint8_t *x, uint8_t *y)
 	return (a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]);
 }
 
-struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
+/* Hands bp to f.  The worker for RX queue rxq can call the in-kernel
+ * consumer directly; anyone else (rxq == -1) might be in IRQ context. */
+static void etherpass(struct ether *ether, struct netfile *f, struct block *bp,
+                      int rxq)
+{
+	void (*rx)(void *, struct block *, int);
+
+	rx = READ_ONCE(f->rx);
+	if (rxq >= 0 && rx) {
+		rx(f->rxarg, bp, rxq);
+		return;
+	}
+	if (qpass(f->in, bp) < 0)
+		ether->soverflows++;
+}
+
+static struct block *__etheriq(struct ether *ether, struct block *bp,
+                               int fromwire, int rxq)
 {
 	struct etherpkt *pkt;
 	uint16_t type;
@@ -326,7 +352,7 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 					assert(BHLEN(bp) >= 4 + 2 * Eaddrlen);
 					memmove(bp->rp + 4, bp->rp, 2 * Eaddrlen);
 					bp->rp += 4;
-					return etheriq(vlan, bp, fromwire);
+					return __etheriq(vlan, bp, fromwire, rxq);
 				}
 			}
 			/* allow normal type handling to accept or discard it */
@@ -378,14 +404,12 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 					ether->soverflows++;
 					continue;
 				}
-				if (qpass(f->in, xbp) < 0)
-					ether->soverflows++;
+				etherpass(ether, f, xbp, rxq);
 			}
 	}
 
 	if (fx) {
-		if (qpass(fx->in, bp) < 0)
-			ether->soverflows++;
+		etherpass(ether, fx, bp, rxq);
 		return 0;
 	}
 	if (fromwire) {
@@ -396,6 +420,408 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	return bp;
 }
 
+/* The Microsoft RSS key, which most NICs default to.  Using the same key means
+ * our software hash matches what an RSS NIC would compute. */
+static const uint8_t rss_key[40] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static uint32_t toeplitz_hash(const uint8_t *key, const uint8_t *data,
+                              size_t len)
+{
+	uint32_t hash = 0;
+	uint32_t v = (key[0] << 24) | (key[1] << 16) | (key[2] << 8) | key[3];
+
+	for (size_t i = 0; i < len; i++) {
+		for (int b = 7; b >= 0; b--) {
+			if (data[i] & (1 << b))
+				hash ^= v;
+			v <<= 1;
+			if (key[i + 4] & (1 << b))
+				v |= 1;
+		}
+	}
+	return hash;
+}
+
+/* Software RSS: the Toeplitz hash of the addresses and, for TCP and UDP, the
+ * ports.  Returns 0 for anything we don't parse; those all go to queue 0. */
+static uint32_t ether_flow_hash(struct block *bp)
+{
+	uint8_t *p = bp->rp, *ep = bp->wp;
+	uint8_t tuple[36];
+	size_t len;
+	uint16_t type;
+	uint8_t proto;
+
+	if (ep - p < ETHERHDRSIZE)
+		return 0;
+	type = nhgets(p + 2 * Eaddrlen);
+	p += ETHERHDRSIZE;
+	if (type == Type8021Q) {
+		if (ep - p < 4)
+			return 0;
+		type = nhgets(p + 2);
+		p += 4;
+	}
+	switch (type) {
+	case Type4:
+		if (ep - p < 20)
+			return 0;
+		proto = p[9];
+		memcpy(tuple, p + 12, 8);
+		len = 8;
+		/* fragments after the first don't have ports, so none of them use
+		 * the ports. */
+		if (nhgets(p + 6) & 0x3fff)
+			goto out;
+		p += (p[0] & 0xf) << 2;
+		break;
+	case Type6:
+		if (ep - p < 40)
+			return 0;
+		proto = p[6];
+		memcpy(tuple, p + 8, 32);
+		len = 32;
+		p += 40;
+		break;
+	default:
+		return 0;
+	}
+	if ((proto == Tcpproto || proto == Udpproto) && ep - p >= 4) {
+		memcpy(tuple + len, p, 4);
+		len += 4;
+	}
+out:
+	return toeplitz_hash(rss_key, tuple, len);
+}
+
+static void __etherrxq_kick(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct ether_rxq *rxq = (struct ether_rxq*)a0;
+
+	rendez_wakeup(&rxq->rv);
+}
+
+/* Can be called from IRQ context. */
+static void etherrxq_steer(struct ether *ether, struct block *bp, int nrxq)
+{
+	struct ether_rxq *rxq;
+	bool kick;
+
+	if (!bp->rx_hash)
+		bp->rx_hash = ether_flow_hash(bp);
+	rxq = &ether->rxq[((uint64_t)bp->rx_hash * nrxq) >> 32];
+
+	spin_lock_irqsave(&rxq->lock);
+	if (rxq->len >= Maxrxqlen) {
+		rxq->drops++;
+		spin_unlock_irqsave(&rxq->lock);
+		freeb(bp);
+		return;
+	}
+	bp->list = NULL;
+	if (rxq->tail)
+		rxq->tail->list = bp;
+	else
+		rxq->head = bp;
+	rxq->tail = bp;
+	kick = rxq->len++ == 0;
+	rxq->packets++;
+	rxq->bytes += BLEN(bp);
+	if (kick)
+		rxq->kicks++;
+	spin_unlock_irqsave(&rxq->lock);
+
+	/* The worker runs wherever it was woken up, so wake it on its own core. */
+	if (kick) {
+		if (rxq->core == core_id())
+			rendez_wakeup(&rxq->rv);
+		else
+			send_kernel_message(rxq->core, __etherrxq_kick, (long)rxq, 0, 0,
+			                    KMSG_IMMEDIATE);
+	}
+}
+
+static int etherrxq_has_work(void *arg)
+{
+	struct ether_rxq *rxq = arg;
+
+	return READ_ONCE(rxq->len) != 0;
+}
+
+static void etherrxflush_one(struct ether *ether, int q)
+{
+	struct netfile *f;
+	void (*rxflush)(void *, int);
+
+	for (int i = 0; i < ether->nfile; i++) {
+		f = ether->f[i];
+		if (!f)
+			continue;
+		rxflush = READ_ONCE(f->rxflush);
+		if (rxflush)
+			rxflush(f->rxarg, q);
+	}
+}
+
+/* Tells the consumers that queue q is empty for now, so they can pass up
+ * anything they were holding on to (e.g. GRO). */
+static void etherrxflush(struct ether *ether, int q)
+{
+	struct ether *vlan;
+
+	etherrxflush_one(ether, q);
+	if (!ether->nvlan)
+		return;
+	for (int i = 0; i < ARRAY_SIZE(ether->vlans); i++) {
+		vlan = ether->vlans[i];
+		if (vlan != NULL && vlan->vlanid)
+			etherrxflush_one(vlan, q);
+	}
+}
+
+static void etherrxq_ktask(void *arg)
+{
+	struct ether_rxq *rxq = arg;
+	struct ether *ether = rxq->ether;
+	int q = rxq - ether->rxq;
+	struct block *bp, *next;
+
+	for (;;) {
+		rendez_sleep(&rxq->rv, etherrxq_has_work, rxq);
+		spin_lock_irqsave(&rxq->lock);
+		bp = rxq->head;
+		rxq->head = rxq->tail = NULL;
+		rxq->len = 0;
+		spin_unlock_irqsave(&rxq->lock);
+		/* Pairs with the mb in etherrxq_quiesce() */
+		WRITE_ONCE(rxq->seq, rxq->seq + 1);
+		mb();
+		for (; bp; bp = next) {
+			next = bp->list;
+			bp->list = NULL;
+			__etheriq(ether, bp, TRUE, q);
+		}
+		etherrxflush(ether, q);
+		mb();
+		WRITE_ONCE(rxq->seq, rxq->seq + 1);
+	}
+}
+
+/*
+ * Packets from the wire go through the RX queues, if there are any.  Everyone
+ * else gets demuxed right away.
+ */
+struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
+{
+	int nrxq = READ_ONCE(ether->nrxq);
+
+	if (fromwire && nrxq) {
+		etherrxq_steer(ether, bp, nrxq);
+		return 0;
+	}
+	return __etheriq(ether, bp, fromwire, -1);
+}
+
+/* Returns the next core in cores after prev, wrapping around. */
+static int etherrxq_next_core(const struct core_set *cores, int prev)
+{
+	int core;
+
+	for (int i = 1; i <= num_cores; i++) {
+		core = (prev + i) % num_cores;
+		if (core_set_getcpu(cores, core))
+			return core;
+	}
+	panic("No cores for RX queues");
+}
+
+/*
+ * Sets the number of RX queues, spread round-robin over cores.  0 turns them
+ * off.  Without cores, queues only go on the LL cores: the rest can be handed
+ * to MCPs, and an RX worker would steal time from them.  We allocate the queues
+ * the first time and never free them, so etheriq doesn't need a lock; a queue's
+ * ktask starts the first time the queue is used.  Drivers with RSS can call
+ * this at reset and put the NIC's hash in bp->rx_hash.
+ */
+void etherrxqinit(struct ether *ether, int n, const struct core_set *cores)
+{
+	struct core_set ll_cores;
+	struct ether_rxq *rxq;
+	int core = -1;
+
+	if (n < 0 || n > num_cores)
+		error(EINVAL, "RX queues must be between 0 and %d", num_cores);
+	if (!cores) {
+		core_set_init(&ll_cores);
+		for (int i = 0; i < num_cores; i++) {
+			if (is_ll_core(i))
+				core_set_setcpu(&ll_cores, i);
+		}
+		cores = &ll_cores;
+	}
+	if (n && !core_set_count(cores))
+		error(EINVAL, "RX queues need at least one core");
+	qlock(&etherrxqlock);
+	if (!ether->maxrxq && n) {
+		ether->rxq = kzmalloc_align(sizeof(struct ether_rxq) * num_cores,
+		                            MEM_WAIT, ARCH_CL_SIZE);
+		wmb();
+		ether->maxrxq = num_cores;
+	}
+	for (int i = 0; i < n; i++) {
+		rxq = &ether->rxq[i];
+		core = etherrxq_next_core(cores, core);
+		WRITE_ONCE(rxq->core, core);
+		if (!rxq->ether) {
+			spinlock_init_irqsave(&rxq->lock);
+			rendez_init(&rxq->rv);
+			rxq->ether = ether;
+			ktask("etherrxq", etherrxq_ktask, rxq);
+		}
+	}
+	wmb();	/* queues are set up before etheriq can pick them */
+	WRITE_ONCE(ether->nrxq, n);
+	qunlock(&etherrxqlock);
+}
+
+/* Waits for every RX queue worker that was calling into consumers to finish
+ * that batch.  Any batch after that sees the hooks as they are now. */
+static void etherrxq_quiesce(struct ether *ether)
+{
+	int maxrxq = READ_ONCE(ether->maxrxq);
+	struct ether_rxq *rxq;
+	unsigned long seq;
+
+	mb();	/* the hook change is visible before we look at seq */
+	for (int i = 0; i < maxrxq; i++) {
+		rxq = &ether->rxq[i];
+		if (!READ_ONCE(rxq->ether))
+			continue;
+		seq = READ_ONCE(rxq->seq);
+		if (!(seq & 1))
+			continue;
+		while (READ_ONCE(rxq->seq) == seq)
+			kthread_yield();
+	}
+}
+
+/*
+ * Lets an in-kernel consumer of a data chan, e.g. the IP stack, take packets
+ * straight from the RX queue workers.  rx runs on the queue's worker, and can
+ * block.  Each queue calls rxflush when it runs dry.  Only one worker calls
+ * into the consumer for a given queue, so per-queue state needs no locks.
+ * Without RX queues, packets still show up on the chan.
+ *
+ * Unhook with a NULL rx.  Once that returns, no worker is still in the old
+ * hooks, so the consumer can free arg.
+ */
+void etherrxhook(struct chan *c, void (*rx)(void *, struct block *, int),
+                 void (*rxflush)(void *, int), void *arg)
+{
+	struct ether *ether = c->aux;
+	struct netfile *f;
+
+	if (NETTYPE(c->qid.path) != Ndataqid)
+		error(EINVAL, "RX hook needs a data chan");
+	f = ether->f[NETID(c->qid.path)];
+	qlock(&f->qlock);
+	f->rxarg = arg;
+	wmb();
+	WRITE_ONCE(f->rxflush, rxflush);
+	WRITE_ONCE(f->rx, rx);
+	qunlock(&f->qlock);
+	/* A vlan's packets come in on its parent's queues */
+	if (!rx)
+		etherrxq_quiesce(etherxx[c->dev & 0xFF]);
+}
+
+/*
+ * Called by a driver's RX ktask after each pass over its ring, with the number
+ * of descriptors it handled.  Returns TRUE if the driver should poll again with
+ * its RX interrupt still masked; we've already given other kthreads a chance to
+ * run.  FALSE means unmask the interrupt and sleep.
+ */
+bool etherpoll(struct ether *ether, int work)
+{
+	struct ether_poll *p = &ether->poll;
+	int budget = READ_ONCE(p->budget);
+
+	p->polls++;
+	p->pkts += work;
+	/* A budget of 0 means interrupts only, even if we were polling. */
+	if (!budget) {
+		p->polling = FALSE;
+		p->idle = 0;
+		return FALSE;
+	}
+	if (work >= budget) {
+		if (!p->polling) {
+			p->polling = TRUE;
+			p->switches++;
+		}
+		p->idle = 0;
+	} else if (p->polling) {
+		if (work) {
+			p->idle = 0;
+		} else {
+			p->idle_polls++;
+			if (++p->idle > p->idle_max) {
+				p->polling = FALSE;
+				p->idle = 0;
+			}
+		}
+	}
+	if (p->polling)
+		kthread_yield();
+	return p->polling;
+}
+
+/* The driver's ifstats, followed by our polling and RX queue stats. */
+static long etherifstat(struct ether *ether, void *a, long n, uint32_t offset)
+{
+	ERRSTACK(1);
+	struct ether_rxq *rxq;
+	char *s, *p, *e;
+	size_t sz = READSTR + ether->maxrxq * 96;
+
+	p = s = kzmalloc(sz, MEM_WAIT);
+	e = s + sz;
+	if (waserror()) {
+		kfree(s);
+		nexterror();
+	}
+	p += ether->ifstat(ether, p, READSTR, 0);
+	if (ether->poll.polls) {
+		struct ether_poll *pl = &ether->poll;
+
+		p = seprintf(p, e, "poll: budget %d %s irqs %llu polls %llu "
+		             "pkts %llu (%llu/poll) idle %llu switches %llu\n",
+		             pl->budget, pl->polling ? "polling" : "irq", pl->irqs,
+		             pl->polls, pl->pkts, pl->pkts / pl->polls,
+		             pl->idle_polls, pl->switches);
+	}
+	if (ether->maxrxq)
+		p = seprintf(p, e, "rxqueues: %d\n", ether->nrxq);
+	for (int i = 0; i < ether->maxrxq; i++) {
+		rxq = &ether->rxq[i];
+		if (!rxq->packets)
+			continue;
+		p = seprintf(p, e, "rxq%d: core %d pkts %llu bytes %llu drops %llu kicks %llu\n",
+		             i, rxq->core, rxq->packets, rxq->bytes, rxq->drops,
+		             rxq->kicks);
+	}
+	n = readstr(offset, a, n, s);
+	poperror();
+	kfree(s);
+	return n;
+}
+
 static int etheroq(struct ether *ether, struct block *bp)
 {
 	int len, loopback;
@@ -472,6 +898,44 @@ static size_t etherwrite(struct chan *chan, void *buf, size_t n, off64_t unused)
 			kfree(cb);
 			error(EFAIL, "short control request");
 		}
+		if (strcmp(cb->f[0], "pollbudget") == 0) {
+			if (cb->nf != 2) {
+				kfree(cb);
+				error(EINVAL, "usage: pollbudget N");
+			}
+			onoff = atoi(cb->f[1]);
+			kfree(cb);
+			if (onoff < 0)
+				error(EINVAL, "poll budget must be >= 0");
+			WRITE_ONCE(ether->poll.budget, onoff);
+			l = n;
+			goto out;
+		}
+		if (strcmp(cb->f[0], "rxqueues") == 0) {
+			struct core_set cores;
+			bool some_cores;
+			int core;
+
+			if (cb->nf < 2) {
+				kfree(cb);
+				error(EINVAL, "usage: rxqueues N [core ...]");
+			}
+			onoff = atoi(cb->f[1]);
+			core_set_init(&cores);
+			for (int i = 2; i < cb->nf; i++) {
+				core = atoi(cb->f[i]);
+				if (core < 0 || core >= num_cores) {
+					kfree(cb);
+					error(EINVAL, "No core %d", core);
+				}
+				core_set_setcpu(&cores, core);
+			}
+			some_cores = cb->nf > 2;
+			kfree(cb);
+			etherrxqinit(ether, onoff, some_cores ? &cores : NULL);
+			l = n;
+			goto out;
+		}
 		if (strcmp(cb->f[0], "nonblocking") == 0) {
 			if (cb->nf <= 1)
 				onoff = 1;
@@ -509,6 +973,79 @@ out:
 	return l;
 }
 
+/*
+ * Software TSO: cuts a big TCP/IPv4 segment from tcpoutput into MSS-sized
+ * frames.  Each frame gets a copy of the headers, fixed up, and points at its
+ * slice of the original payload, so the payload is only copied if the device
+ * can't do scatter/gather.  The TCP checksum is left for etheroq to finish, in
+ * hardware if it can.
+ */
+static void ethergso(struct ether *ether, struct block *bp)
+{
+	ERRSTACK(1);
+	uint8_t *ip, *tcp;
+	int iphlen, hlen, len, seglen;
+	uint32_t seq;
+	uint16_t id;
+	uint8_t flags, ph[12];
+	struct block *nb;
+
+	ip = bp->rp + ETHERHDRSIZE;
+	iphlen = (ip[0] & 0xf) << 2;
+	tcp = ip + iphlen;
+	if (BHLEN(bp) < ETHERHDRSIZE + iphlen + 20
+	    || nhgets(bp->rp + 2 * Eaddrlen) != Type4 || ip[9] != Tcpproto) {
+		etheroq(ether, bp);
+		return;
+	}
+	hlen = tcp + ((tcp[12] >> 4) << 2) - bp->rp;
+	if (BHLEN(bp) < hlen || !bp->mss) {
+		etheroq(ether, bp);
+		return;
+	}
+	len = BLEN(bp) - hlen;
+	seq = nhgetl(tcp + 4);
+	id = nhgets(ip + 4);
+	flags = tcp[13];
+	/* pseudo-header: the addresses and proto stay the same, only the length
+	 * changes per frame */
+	ph[0] = 0;
+	ph[1] = ip[9];
+	memmove(ph + 4, ip + 12, 8);
+
+	if (waserror()) {
+		freeb(bp);
+		nexterror();
+	}
+	for (int off = 0; off < len; off += seglen) {
+		seglen = MIN(bp->mss, len - off);
+		nb = blist_clone(bp, hlen, seglen, hlen + off);
+		memmove(nb->wp, bp->rp, hlen);
+		nb->wp += hlen;
+		block_copy_metadata(nb, bp);
+		nb->flag &= ~Btso;
+		nb->mss = 0;
+
+		ip = nb->rp + ETHERHDRSIZE;
+		tcp = ip + iphlen;
+		hnputs(ip + 2, hlen - ETHERHDRSIZE + seglen);
+		hnputs(ip + 4, id++);
+		ip[10] = ip[11] = 0;
+		hnputs(ip + 10, ipcsum(ip));
+		hnputl(tcp + 4, seq + off);
+		/* PSH and FIN only go on the last one */
+		if (off + seglen < len)
+			tcp[13] = flags & ~0x09;
+		if (nb->flag & Btcpck) {
+			hnputs(ph + 2, hlen - (tcp - nb->rp) + seglen);
+			hnputs(tcp + 16, ptclbsum(ph, sizeof(ph)));
+		}
+		etheroq(ether, nb);
+	}
+	poperror();
+	freeb(bp);
+}
+
 static size_t etherbwrite(struct chan *chan, struct block *bp, off64_t unused)
 {
 	ERRSTACK(1);
@@ -536,7 +1073,10 @@ static size_t etherbwrite(struct chan *chan, struct block *bp, off64_t unused)
 		freeb(bp);
 		error(E2BIG, ERROR_FIXME);
 	}
-	n = etheroq(ether, bp);
+	if (bp->flag & Btso && !(ether->feat & NETF_TSO))
+		ethergso(ether, bp);
+	else
+		n = etheroq(ether, bp);
 	poperror();
 	runlock(&ether->rwlock);
 	return n;
@@ -699,6 +1239,8 @@ static void etherreset(void)
 		ether->mtu = ETHERMAXTU;
 		ether->min_mtu = ETHERMINTU;
 		ether->max_mtu = ETHERMAXTU;
+		ether->poll.budget = Etherpollbudget;
+		ether->poll.idle_max = Etherpollidle;
 		/* looked like irq type, we don't have these yet */
 		//ether->netif.itype = -1;
 
@@ -726,6 +1268,8 @@ static void etherreset(void)
 #endif
 			if (cards[n].reset(ether))
 				continue;
+			/* whatever the card can't do, etherbwrite can */
+			ether->feat |= NETF_GSO;
 			/* might be fucked a bit - reset() doesn't know the type.  might not
 			 * even matter, except for debugging. */
 			ether->type = cards[n].type;
@@ -26,6 +26,7 @@ static char *devname(void)
 struct gtfs {
 	struct tree_filesystem		tfs;
 	struct kref					users;
+	struct pm_flusher			flusher;
 };
 
 /* Blob hanging off the fs_file->priv.  The backend chans are only accessed,
@@ -191,6 +192,7 @@ static void __gtfs_destroy(uint32_t srcid, long a0, long a1, long a2)
 {
 	struct gtfs *gtfs = (struct gtfs*)a0;
 
+	pm_flusher_unregister(&gtfs->flusher);
 	tfs_frontend_purge(&gtfs->tfs, purge_cb);
 	/* this is the ref from attach */
 	assert(kref_refcnt(&gtfs->tfs.root->kref) == 1);
@@ -388,7 +390,7 @@ static size_t gtfs_read(struct chan *c, void *ubuf, size_t n, off64_t off)
 
 	if (tree_file_is_dir(tf))
 		return gtfs_fsf_read(&tf->file, ubuf, n, off);
-	return fs_file_read(&tf->file, ubuf, n, off);
+	return fs_file_read(&tf->file, ubuf, n, off, &c->ra);
 }
 
 /* Given a file (with dir->name set), couple it and sync to the backend chan.
@@ -595,6 +597,37 @@ static int gtfs_pm_readpage(struct page_map *pm, struct page *pg)
 	return 0;
 }
 
+/* Fills a run of consecutive pages with a single backend read.  The backend
+ * read may still be split into several RPCs, but no smaller than the mount's
+ * iounit, instead of one RPC per page. */
+static int gtfs_pm_readpages(struct page_map *pm, struct page **pages,
+                             unsigned int nr)
+{
+	ERRSTACK(1);
+	off64_t offset = pages[0]->pg_index << PGSHIFT;
+	size_t amt = nr * PGSIZE;
+	uint8_t *buf;
+	size_t ret;
+
+	buf = kmalloc(amt, MEM_WAIT);
+	if (waserror()) {
+		kfree(buf);
+		poperror();
+		return -get_errno();
+	}
+	ret = gtfs_fsf_read(pm->pm_file, buf, amt, offset);
+	poperror();
+	if (ret < amt)
+		memset(buf + ret, 0, amt - ret);
+	for (int i = 0; i < nr; i++) {
+		assert(pages[i]->pg_index == pages[0]->pg_index + i);
+		memcpy(page2kva(pages[i]), buf + i * PGSIZE, PGSIZE);
+		atomic_or(&pages[i]->pg_flags, PG_UPTODATE);
+	}
+	kfree(buf);
+	return 0;
+}
+
 /* Meant to take the page from PM and flush to backing store. */
 static int gtfs_pm_writepage(struct page_map *pm, struct page *pg)
 {
@@ -623,6 +656,44 @@ static int gtfs_pm_writepage(struct page_map *pm, struct page *pg)
 	return 0;
 }
 
+/* Flushes a run of consecutive pages with a single backend write. */
+static int gtfs_pm_writepages(struct page_map *pm, struct page **pages,
+                              unsigned int nr)
+{
+	ERRSTACK(1);
+	struct fs_file *f = pm->pm_file;
+	off64_t offset = pages[0]->pg_index << PGSHIFT;
+	uint8_t *buf;
+	size_t amt;
+
+	buf = kmalloc(nr * PGSIZE, MEM_WAIT);
+	qlock(&f->qlock);
+	if (waserror()) {
+		qunlock(&f->qlock);
+		kfree(buf);
+		poperror();
+		return -get_errno();
+	}
+	/* Same as writepage: don't writeback beyond the length of the file. */
+	if (offset >= fs_file_get_length(f)) {
+		qunlock(&f->qlock);
+		poperror();
+		kfree(buf);
+		return 0;
+	}
+	amt = MIN(nr * PGSIZE, fs_file_get_length(f) - offset);
+	for (int i = 0; i * PGSIZE < amt; i++) {
+		assert(pages[i]->pg_index == pages[0]->pg_index + i);
+		memcpy(buf + i * PGSIZE, page2kva(pages[i]),
+		       MIN(PGSIZE, amt - i * PGSIZE));
+	}
+	__gtfs_fsf_write(f, buf, amt, offset);
+	qunlock(&f->qlock);
+	poperror();
+	kfree(buf);
+	return 0;
+}
+
 /* Caller holds the file's qlock */
 static void __trunc_to(struct fs_file *f, off64_t begin)
 {
@@ -705,7 +776,10 @@ static bool gtfs_fs_can_grow_to(struct fs_file *f, size_t len)
 
 struct fs_file_ops gtfs_fs_ops = {
 	.readpage = gtfs_pm_readpage,
+	.readpages = gtfs_pm_readpages,
 	.writepage = gtfs_pm_writepage,
+	.writepages = gtfs_pm_writepages,
+	.writeback = TRUE,
 	.punch_hole = gtfs_fs_punch_hole,
 	.can_grow_to = gtfs_fs_can_grow_to,
 };
@@ -737,6 +811,8 @@ struct fs_file_ops gtfs_fs_ops = {
  * All walks from this attach point will get chans with TFs from this TFS and
  * will incref the struct gtfs.
  */
+static void gtfs_flush(struct pm_flusher *pf, int why);
+
 static struct chan *gtfs_attach(char *arg)
 {
 	ERRSTACK(2);
@@ -777,6 +853,8 @@ static struct chan *gtfs_attach(char *arg)
 	/* need another ref on root for the frontend chan */
 	tf_kref_get(tfs->root);
 	chan_set_tree_file(frontend, tfs->root);
+	gtfs->flusher.flush = gtfs_flush;
+	pm_flusher_register(&gtfs->flusher);
 	poperror();
 	return frontend;
 }
@@ -830,6 +908,30 @@ static void gtfs_sync_gtfs(struct gtfs *gtfs)
 	tfs_frontend_for_each(&gtfs->tfs, gtfs_sync_tf);
 }
 
+static void flush_expired_cb(struct tree_file *tf)
+{
+	if (!tree_file_is_dir(tf) && pm_dirty_expired(tf->file.pm))
+		purge_cb(tf);
+}
+
+/* Called by the PM flusher ktask.  Errors are dropped, like in purge_cb. */
+static void gtfs_flush(struct pm_flusher *pf, int why)
+{
+	struct gtfs *gtfs = container_of(pf, struct gtfs, flusher);
+
+	switch (why) {
+	case PM_FLUSH_EXPIRED:
+		tfs_frontend_for_each(&gtfs->tfs, flush_expired_cb);
+		break;
+	case PM_FLUSH_ALL:
+		tfs_frontend_for_each(&gtfs->tfs, purge_cb);
+		break;
+	case PM_FLUSH_PRESSURE:
+		gtfs_free_memory(gtfs);
+		break;
+	}
+}
+
 /* chan_ctl or something can hook into these functions */
 static void gtfs_sync_chan(struct chan *c)
 {
@@ -7,6 +7,9 @@
 
 #include <ns.h>
 #include <kmalloc.h>
+#include <page_alloc.h>
+#include <pagemap.h>
+#include <mm.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
@@ -27,14 +30,26 @@ enum {
 	Qslab_stats,
 	Qfree,
 	Qkmemstat,
+	Qslab_reclaim,
+	Qkmalloc_stats,
+	Qnuma,
+	Qarena_lockstat,
+	Qreadahead,
+	Qwriteback,
 };
 
 static struct dirtab mem_dir[] = {
 	{".", {Qdir, 0, QTDIR}, 0, DMDIR | 0555},
 	{"arena_stats", {Qarena_stats, 0, QTFILE}, 0, 0444},
-	{"slab_stats", {Qslab_stats, 0, QTFILE}, 0, 0444},
+	{"slab_stats", {Qslab_stats, 0, QTFILE}, 0, 0644},
 	{"free", {Qfree, 0, QTFILE}, 0, 0444},
 	{"kmemstat", {Qkmemstat, 0, QTFILE}, 0, 0444},
+	{"slab_reclaim", {Qslab_reclaim, 0, QTFILE}, 0, 0644},
+	{"kmalloc_stats", {Qkmalloc_stats, 0, QTFILE}, 0, 0444},
+	{"numa", {Qnuma, 0, QTFILE}, 0, 0444},
+	{"arena_lockstat", {Qarena_lockstat, 0, QTFILE}, 0, 0444},
+	{"readahead", {Qreadahead, 0, QTFILE}, 0, 0644},
+	{"writeback", {Qwriteback, 0, QTFILE}, 0, 0644},
 };
 
 static struct chan *mem_attach(char *spec)
@@ -132,6 +147,26 @@ static size_t fetch_arena_stats(struct arena *arena, struct sized_alloc *sza,
 	                  "\t\tNr hash %d, empty hash: %d, longest hash %d\n",
 	                  arena->hh.nr_hash_lists, empty_hash_chain,
 					  longest_hash_chain);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "\t\tLock acquires: %llu, contended %llu, held %llu nsec\n",
+	                  arena->nr_lock_acquires, arena->nr_lock_contended,
+	                  tsc2nsec(arena->lock_hold_ticks));
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "\t\tBtag stalls: %llu\n", arena->nr_btag_stalls);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "\t\tInstantfit %llu, bestfit %llu, nextfit %llu, xalloc %llu\n",
+	                  arena->nr_instantfit, arena->nr_bestfit,
+	                  arena->nr_nextfit, arena->nr_xalloc);
+	for (int i = 0; i < ARENA_NR_FAST_LISTS; i++) {
+		struct arena_fast_list *fl = &arena->fast_lists[i];
+
+		if (!fl->nr_hits && !fl->nr_frees)
+			continue;
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\t\tFast list %p: segs %d, hits %llu, misses %llu, frees %llu\n",
+		                  arena->quantum << i, fl->nr_segs, fl->nr_hits,
+		                  fl->nr_misses, fl->nr_frees);
+	}
 	spin_unlock_irqsave(&arena->lock);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "\tImporting Arenas:\n\t-----------------\n");
@@ -156,7 +191,7 @@ static struct sized_alloc *build_arena_stats(void)
 	qlock(&arenas_and_slabs_lock);
 	/* Rough guess about how many chars per arena we'll need. */
 	TAILQ_FOREACH(a_i, &all_arenas, next)
-		alloc_amt += 1000;
+		alloc_amt += 1800;
 	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
 	TAILQ_FOREACH(a_i, &all_arenas, next)
 		sofar = fetch_arena_stats(a_i, sza, sofar);
@@ -211,10 +246,20 @@ static size_t fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza,
 	spin_lock_irqsave(&kc->depot.lock);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "Depot magsize: %d\n", kc->depot.magsize);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Max magsize: %d, resizes: %lu, contended locks: %lu\n",
+	                  kc->depot.magsize_max, kc->depot.nr_resizes,
+	                  kc->depot.nr_contended);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "Nr empty mags: %d\n", kc->depot.nr_empty);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "Nr non-empty mags: %d\n", kc->depot.nr_not_empty);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Working set (last interval), non-empty min %d max %d, empty min %d max %d\n",
+	                  kc->depot.last_ws_not_empty.min,
+	                  kc->depot.last_ws_not_empty.max,
+	                  kc->depot.last_ws_empty.min,
+	                  kc->depot.last_ws_empty.max);
 	spin_unlock_irqsave(&kc->depot.lock);
 	return sofar;
 }
@@ -228,7 +273,7 @@ static struct sized_alloc *build_slab_stats(void)
 
 	qlock(&arenas_and_slabs_lock);
 	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
-		alloc_amt += 500;
+		alloc_amt += 700;
 	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
 	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
 		sofar = fetch_slab_stats(kc_i, sza, sofar);
@@ -243,8 +288,9 @@ static struct sized_alloc *build_free(void)
 	size_t sofar = 0;
 	size_t amt_total = 0;
 	size_t amt_alloc = 0;
+	struct pcp_page_stats pcp;
 
-	sza = sized_kzmalloc(500, MEM_WAIT);
+	sza = sized_kzmalloc(700, MEM_WAIT);
 	qlock(&arenas_and_slabs_lock);
 	TAILQ_FOREACH(a_i, &all_arenas, next) {
 		if (!a_i->is_base)
@@ -259,6 +305,20 @@ static struct sized_alloc *build_free(void)
 	                  "Used Memory  : %15llu\n", amt_alloc);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "Free Memory  : %15llu\n", amt_total - amt_alloc);
+	kpages_pcp_get_stats(&pcp);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "\nPer-core page caches\n");
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Cached Memory: %15llu\n", pcp.nr_cached * PGSIZE);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Allocs       : %15llu (%llu hits)\n", pcp.nr_allocs,
+	                  pcp.nr_hits);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Frees        : %15llu\n", pcp.nr_frees);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Refills      : %15llu\n", pcp.nr_refills);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Drains       : %15llu\n", pcp.nr_drains);
 	return sza;
 }
 
@@ -371,6 +431,203 @@ static struct sized_alloc *build_kmemstat(void)
 	return sza;
 }
 
+static size_t fetch_reclaim_line(struct kmem_cache *kc, struct sized_alloc *sza,
+                                 size_t sofar)
+{
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "%-*s:%10lu:%12lu:%15llu\n",
+	                  KMEMSTAT_NAME, kc->name,
+	                  kc->nr_reclaimed_mags,
+	                  kc->nr_reclaimed_rounds,
+	                  kc->amt_reclaimed);
+	return sofar;
+}
+
+static struct sized_alloc *build_slab_reclaim(void)
+{
+	struct kmem_cache *kc_i;
+	struct sized_alloc *sza;
+	size_t sofar = 0;
+	size_t alloc_amt = 300;
+
+	qlock(&arenas_and_slabs_lock);
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
+		alloc_amt += 100;
+	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Reclaim period (msec): %llu\n", kmc_reclaim_period_ms);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Reclaim passes: %lu\n", kmc_nr_reclaim_passes);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Total reclaimed: %llu\n\n", kmc_amt_reclaimed);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "%-*s:%10s:%12s:%15s\n", KMEMSTAT_NAME, "Slab Name",
+	                  "Mags", "Rounds", "Reclaimed Amt");
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
+		sofar = fetch_reclaim_line(kc_i, sza, sofar);
+	qunlock(&arenas_and_slabs_lock);
+	return sza;
+}
+
+static const char kmalloc_stats_fmt[] = "%10s:%12llu:%15llu:%15llu:%15llu\n";
+
+/* Reports requested vs allocated bytes for every kmalloc class, along with
+ * what the allocations would have cost with power-of-two classes. */
+static struct sized_alloc *build_kmalloc_stats(void)
+{
+	struct kmalloc_class_stats stats;
+	struct sized_alloc *sza;
+	size_t sofar = 0;
+	char objsize[20];
+	uint64_t tot_req = 0, tot_alloc = 0, tot_pwr2 = 0, pwr2;
+
+	sza = sized_kzmalloc((NUM_KMALLOC_CACHES + 6) * 80, MEM_WAIT);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "%10s:%12s:%15s:%15s:%15s\n", "Objsize", "Allocs",
+	                  "Requested", "Allocated", "Pwr2 Alloc");
+	for (int i = 0; i <= NUM_KMALLOC_CACHES; i++) {
+		kmalloc_get_class_stats(i, &stats);
+		if (i < NUM_KMALLOC_CACHES) {
+			snprintf(objsize, sizeof(objsize), "%lu",
+			         kmalloc_caches[i]->obj_size);
+			pwr2 = stats.nr_allocs * ROUNDUPPWR2(kmalloc_caches[i]->obj_size);
+		} else {
+			snprintf(objsize, sizeof(objsize), "pages");
+			pwr2 = stats.amt_alloc;
+		}
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  kmalloc_stats_fmt, objsize, stats.nr_allocs,
+		                  stats.amt_requested, stats.amt_alloc, pwr2);
+		tot_req += stats.amt_requested;
+		tot_alloc += stats.amt_alloc;
+		tot_pwr2 += pwr2;
+	}
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "\nTotal requested: %llu\nTotal allocated: %llu\n"
+	                  "Saved vs pwr2 : %llu\n", tot_req, tot_alloc,
+	                  tot_pwr2 - tot_alloc);
+	return sza;
+}
+
+static struct sized_alloc *build_numa(void)
+{
+	struct numa_node_stats stats;
+	struct sized_alloc *sza;
+	size_t sofar = 0;
+	int nr_nodes = kpages_numa_nr_nodes();
+
+	sza = sized_kzmalloc(200 + nr_nodes * 100, MEM_WAIT);
+	if (!nr_nodes) {
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "No NUMA page pools\n");
+		return sza;
+	}
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "%4s:%15s:%15s:%15s:%12s:%12s\n", "Node", "Total",
+	                  "Used", "Free", "Allocs", "Remote");
+	for (int i = 0; i < nr_nodes; i++) {
+		kpages_numa_get_stats(i, &stats);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "%4d:%15llu:%15llu:%15llu:%12llu:%12llu\n", i,
+		                  stats.amt_total, stats.amt_alloc,
+		                  stats.amt_total - MIN(stats.amt_total,
+		                                        stats.amt_alloc),
+		                  stats.nr_allocs, stats.nr_remote_allocs);
+	}
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "\nFallbacks to kpages: %llu\n",
+	                  kpages_numa_nr_fallbacks());
+	return sza;
+}
+
+static size_t fetch_lockstat_line(struct arena *arena, struct sized_alloc *sza,
+                                  size_t sofar)
+{
+	size_t nr_hits = 0;
+
+	for (int i = 0; i < ARENA_NR_FAST_LISTS; i++)
+		nr_hits += arena->fast_lists[i].nr_hits;
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "%-*s:%12llu:%12llu:%10llu:%10llu:%12llu\n",
+	                  KMEMSTAT_NAME, arena->name, arena->nr_lock_acquires,
+	                  arena->nr_lock_contended,
+	                  tsc2nsec(arena->lock_hold_ticks) /
+	                  MAX(arena->nr_lock_acquires, 1),
+	                  arena->nr_btag_stalls, nr_hits);
+	return sofar;
+}
+
+/* One line per arena: lock acquisitions, how many were contended, average lock
+ * hold time, btag stalls, and fast list hits. */
+static struct sized_alloc *build_arena_lockstat(void)
+{
+	struct sized_alloc *sza;
+	size_t sofar = 0;
+	size_t alloc_amt = 100;
+	struct arena *a_i;
+
+	qlock(&arenas_and_slabs_lock);
+	TAILQ_FOREACH(a_i, &all_arenas, next)
+		alloc_amt += 100;
+	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "%-*s:%12s:%12s:%10s:%10s:%12s\n", KMEMSTAT_NAME,
+	                  "Arena Name", "Acquires", "Contended", "Hold nsec",
+	                  "Btag Stall", "Fast Hits");
+	TAILQ_FOREACH(a_i, &all_arenas, next)
+		sofar = fetch_lockstat_line(a_i, sza, sofar);
+	qunlock(&arenas_and_slabs_lock);
+	return sza;
+}
+
+/* Page cache readahead, summed over all page maps */
+static struct sized_alloc *build_readahead(void)
+{
+	struct pm_ra_stats stats;
+	struct sized_alloc *sza;
+	size_t sofar = 0;
+
+	pm_get_ra_stats(&stats);
+	sza = sized_kzmalloc(500, MEM_WAIT);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Fault-around (pages): %d\n\n", fault_around_pages);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Readahead pages: %llu\n"
+	                  "Batched reads  : %llu\n"
+	                  "Hits           : %llu\n"
+	                  "Misses         : %llu\n"
+	                  "Wasted pages   : %llu\n",
+	                  stats.nr_ra_pages, stats.nr_batches, stats.nr_hits,
+	                  stats.nr_misses, stats.nr_wasted);
+	return sza;
+}
+
+static struct sized_alloc *build_writeback(void)
+{
+	struct pm_wb_stats stats;
+	struct sized_alloc *sza;
+	size_t sofar = 0;
+
+	pm_get_wb_stats(&stats);
+	sza = sized_kzmalloc(500, MEM_WAIT);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Flush period (msec): %llu\n"
+	                  "Dirty expire (msec): %llu\n"
+	                  "Background dirty %%: %lu\n"
+	                  "Max dirty %%       : %lu\n\n",
+	                  pm_flush_period_ms, pm_dirty_expire_ms, pm_dirty_bg_pct,
+	                  pm_dirty_max_pct);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Dirty pages     : %llu\n"
+	                  "Pages written   : %llu\n"
+	                  "Backend writes  : %llu\n"
+	                  "Flusher passes  : %llu\n"
+	                  "Throttled writes: %llu\n",
+	                  stats.nr_dirty, stats.nr_wb_pages, stats.nr_wb_ops,
+	                  stats.nr_flushes, stats.nr_throttles);
+	return sza;
+}
+
 static struct chan *mem_open(struct chan *c, int omode)
 {
 	if (c->qid.type & QTDIR) {
@@ -390,6 +647,24 @@ static struct chan *mem_open(struct chan *c, int omode)
 	case Qkmemstat:
 		c->synth_buf = build_kmemstat();
 		break;
+	case Qslab_reclaim:
+		c->synth_buf = build_slab_reclaim();
+		break;
+	case Qkmalloc_stats:
+		c->synth_buf = build_kmalloc_stats();
+		break;
+	case Qnuma:
+		c->synth_buf = build_numa();
+		break;
+	case Qarena_lockstat:
+		c->synth_buf = build_arena_lockstat();
+		break;
+	case Qreadahead:
+		c->synth_buf = build_readahead();
+		break;
+	case Qwriteback:
+		c->synth_buf = build_writeback();
+		break;
 	}
 	c->mode = openmode(omode);
 	c->flag |= COPEN;
@@ -406,6 +681,12 @@ static void mem_close(struct chan *c)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qslab_reclaim:
+	case Qkmalloc_stats:
+	case Qnuma:
+	case Qarena_lockstat:
+	case Qreadahead:
+	case Qwriteback:
 		kfree(c->synth_buf);
 		break;
 	}
@@ -423,6 +704,12 @@ static size_t mem_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qslab_reclaim:
+	case Qkmalloc_stats:
+	case Qnuma:
+	case Qarena_lockstat:
+	case Qreadahead:
+	case Qwriteback:
 		sza = c->synth_buf;
 		return readmem(offset, ubuf, n, sza->buf, sza->size);
 	default:
@@ -431,12 +718,113 @@ static size_t mem_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 	return -1;
 }
 
+static const char slab_reclaim_usage[] = "period MSEC|now";
+static const char readahead_usage[] = "fault_around 1-64";
+static const char writeback_usage[] =
+	"period MSEC|expire MSEC|background PCT|max PCT|now";
+static const char slab_stats_usage[] =
+	"magsize_max CACHE NR|resize_threshold NR|resize_timeout NSEC";
+
+static void slab_stats_write(struct cmdbuf *cb)
+{
+	struct kmem_cache *kc_i;
+
+	if (cb->nf < 2)
+		error(EINVAL, slab_stats_usage);
+	if (!strcmp(cb->f[0], "resize_threshold")) {
+		resize_threshold = strtoul(cb->f[1], NULL, 0);
+	} else if (!strcmp(cb->f[0], "resize_timeout")) {
+		resize_timeout_ns = strtoul(cb->f[1], NULL, 0);
+	} else if (!strcmp(cb->f[0], "magsize_max")) {
+		if (cb->nf < 3)
+			error(EINVAL, slab_stats_usage);
+		qlock(&arenas_and_slabs_lock);
+		TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link) {
+			if (!strcmp(kc_i->name, cb->f[1]))
+				break;
+		}
+		if (kc_i)
+			kmem_cache_set_magsize_max(kc_i, strtoul(cb->f[2], NULL, 0));
+		qunlock(&arenas_and_slabs_lock);
+		if (!kc_i)
+			error(ENOENT, "No kmem_cache named %s", cb->f[1]);
+	} else {
+		error(EINVAL, slab_stats_usage);
+	}
+}
+
+static void writeback_write(struct cmdbuf *cb)
+{
+	if (cb->nf < 1)
+		error(EINVAL, writeback_usage);
+	if (!strcmp(cb->f[0], "now")) {
+		pm_flusher_kick();
+		return;
+	}
+	if (cb->nf < 2)
+		error(EINVAL, writeback_usage);
+	if (!strcmp(cb->f[0], "period")) {
+		pm_flush_period_ms = strtoul(cb->f[1], NULL, 0);
+		/* Let the ktask pick up the new period */
+		pm_flusher_kick();
+	} else if (!strcmp(cb->f[0], "expire")) {
+		pm_dirty_expire_ms = strtoul(cb->f[1], NULL, 0);
+	} else if (!strcmp(cb->f[0], "background")) {
+		pm_dirty_bg_pct = strtoul(cb->f[1], NULL, 0);
+	} else if (!strcmp(cb->f[0], "max")) {
+		pm_dirty_max_pct = strtoul(cb->f[1], NULL, 0);
+	} else {
+		error(EINVAL, writeback_usage);
+	}
+}
+
 static size_t mem_write(struct chan *c, void *ubuf, size_t n, off64_t offset)
 {
+	ERRSTACK(1);
+	struct cmdbuf *cb = parsecmd(ubuf, n);
+
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
 	switch (c->qid.path) {
+	case Qslab_stats:
+		slab_stats_write(cb);
+		break;
+	case Qslab_reclaim:
+		if (cb->nf < 1)
+			error(EINVAL, slab_reclaim_usage);
+		if (!strcmp(cb->f[0], "now")) {
+			kmem_reclaim_all();
+		} else if (!strcmp(cb->f[0], "period")) {
+			if (cb->nf < 2)
+				error(EINVAL, slab_reclaim_usage);
+			kmc_reclaim_period_ms = strtoul(cb->f[1], NULL, 0);
+			/* Let the ktask pick up the new period */
+			kmem_reclaim_kick();
+		} else {
+			error(EINVAL, slab_reclaim_usage);
+		}
+		break;
+	case Qreadahead: {
+		long nr;
+
+		if (cb->nf < 2 || strcmp(cb->f[0], "fault_around"))
+			error(EINVAL, readahead_usage);
+		nr = strtol(cb->f[1], NULL, 0);
+		if (nr < 1 || nr > FAULT_AROUND_MAX_PAGES)
+			error(EINVAL, readahead_usage);
+		fault_around_pages = nr;
+		break;
+	}
+	case Qwriteback:
+		writeback_write(cb);
+		break;
 	default:
 		error(EFAIL, "Unable to write to %s", devname());
 	}
+	kfree(cb);
+	poperror();
 	return n;
 }
 
@@ -62,6 +62,7 @@ enum {
 	Qstrace,
 	Qstrace_traceset,
 	Qvmstatus,
+	Qmemstat,
 	Qtext,
 	Qwait,
 	Qprofile,
@@ -110,6 +111,7 @@ struct dirtab procdir[] = {
 	{"strace", {Qstrace}, 0, 0444},
 	{"strace_traceset", {Qstrace_traceset}, 0, 0666},
 	{"vmstatus", {Qvmstatus}, 0, 0444},
+	{"memstat", {Qmemstat}, 0, 0444},
 	{"text", {Qtext}, 0, 0000},
 	{"wait", {Qwait}, 0, 0400},
 	{"profile", {Qprofile}, 0, 0400},
@@ -581,6 +583,7 @@ static struct chan *procopen(struct chan *c, int omode)
 		case Quser:
 		case Qstatus:
 		case Qvmstatus:
+		case Qmemstat:
 		case Qctl:
 			break;
 
@@ -998,6 +1001,32 @@ static size_t procread(struct chan *c, void *va, size_t n, off64_t off)
 				kfree(buf);
 				return n;
 			}
+		case Qmemstat:
+			{
+				struct mm_stats *ms = &p->mm_stats;
+				char *buf = kmalloc(512, MEM_WAIT);
+				char *s = buf, *e = buf + 512;
+
+				s = seprintf(s, e, "Huge pages mapped: %lu (%lu MB)\n",
+				             ms->nr_huge_mapped,
+				             ms->nr_huge_mapped * PML2_PTE_REACH >> 20);
+				s = seprintf(s, e, "Huge page maps:    %lu\n",
+				             ms->nr_huge_maps);
+				s = seprintf(s, e, "Small page maps:   %lu\n",
+				             ms->nr_small_maps);
+				s = seprintf(s, e, "Huge fallbacks:    %lu\n",
+				             ms->nr_huge_fallbacks);
+				s = seprintf(s, e, "Huge splits:       %lu\n",
+				             ms->nr_huge_splits);
+				s = seprintf(s, e, "Fault-arounds:     %lu\n",
+				             ms->nr_fault_around);
+				s = seprintf(s, e, "Readahead kicks:   %lu\n",
+				             ms->nr_readahead);
+				proc_decref(p);
+				n = readstr(off, va, n, buf);
+				kfree(buf);
+				return n;
+			}
 		case Qns:
 			//qlock(&p->debug);
 			if (waserror()) {
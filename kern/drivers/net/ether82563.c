@@ -616,6 +616,7 @@ struct ctlr {
 
 	struct rendez rrendez;
 	int rim;
+	bool rxpolling;				/* rproc reaps the tx ring, no Txdw */
 	int rdfree;					/* rx descriptors awaiting packets */
 	struct rd *rdba;			/* receive descriptor base address */
 	struct block **rb;			/* receive buffers */
@@ -985,6 +986,14 @@ static void i82563im(struct ctlr *ctlr, int im)
 	spin_unlock_irqsave(&ctlr->imlock);
 }
 
+static void i82563imc(struct ctlr *ctlr, int im)
+{
+	spin_lock_irqsave(&ctlr->imlock);
+	ctlr->im &= ~im;
+	csr32w(ctlr, Imc, im);
+	spin_unlock_irqsave(&ctlr->imlock);
+}
+
 static void i82563txinit(struct ctlr *ctlr)
 {
 	int i, r, tctl;
@@ -1083,8 +1092,11 @@ static void i82563transmit(struct ether *edev)
 	tdt = ctlr->tdt;
 	for (;;) {
 		if (NEXT_RING(tdt, Ntd) == tdh) {	/* ring full? */
-			ctlr->txdw++;
-			i82563im(ctlr, Txdw);
+			/* a polling rproc will be back soon enough */
+			if (!ctlr->rxpolling) {
+				ctlr->txdw++;
+				i82563im(ctlr, Txdw);
+			}
 			break;
 		}
 		bp = qget(edev->oq);
@@ -1260,7 +1272,8 @@ static void i82563rproc(void *arg)
 	struct rd *rd;
 	struct block *bp;
 	struct ctlr *ctlr;
-	int rdh, rim, passed;
+	int rdh, rim, passed, work, budget;
+	bool polling = FALSE, was_polling;
 	struct ether *edev;
 
 	edev = arg;
@@ -1276,13 +1289,17 @@ static void i82563rproc(void *arg)
 
 	for (;;) {
 		i82563replenish(ctlr);
-		i82563im(ctlr, Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
-		ctlr->rsleep++;
-		rendez_sleep(&ctlr->rrendez, i82563rim, ctlr);
+		/* while polling, the RX interrupts stay masked */
+		if (!polling) {
+			i82563im(ctlr, Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
+			ctlr->rsleep++;
+			rendez_sleep(&ctlr->rrendez, i82563rim, ctlr);
+		}
 
 		rdh = ctlr->rdh;
 		passed = 0;
-		for (;;) {
+		budget = etherpollbudget(edev, Nrd);
+		for (work = 0; work < budget; work++) {
 			rim = ctlr->rim;
 			ctlr->rim = 0;
 			rd = &ctlr->rdba[rdh];
@@ -1319,6 +1336,20 @@ static void i82563rproc(void *arg)
 			if (ctlr->rdfree <= Nrd - 32 || (rim & Rxdmt0))
 				i82563replenish(ctlr);
 		}
+		/* no Txdw interrupts either; reap and refill the tx ring here */
+		if (polling)
+			i82563transmit(edev);
+		was_polling = polling;
+		polling = etherpoll(edev, work);
+		if (polling != was_polling) {
+			qlock(&ctlr->tlock);
+			ctlr->rxpolling = polling;
+			qunlock(&ctlr->tlock);
+			if (polling)
+				i82563imc(ctlr, Txdw);
+			else
+				i82563transmit(edev);	/* rearms Txdw if the ring is full */
+		}
 	}
 }
 
@@ -1691,6 +1722,7 @@ static void i82563interrupt(struct hw_trapframe *unused_hw_trapframe, void *arg)
 			im &= ~(Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
 			rendez_wakeup(&ctlr->rrendez);
 			ctlr->rintr++;
+			etherpollirq(edev);
 		}
 		if (icr & Txdw) {
 			im &= ~Txdw;
@@ -511,6 +511,7 @@ struct ctlr {
 
 	struct rendez	rrendez;
 	int	rim;
+	bool	rxpolling;		/* rproc reaps the tx ring, no Txdw */
 	int	rdfree;
 	Rd*	rdba;			/* receive descriptor base address */
 	struct block**	rb;			/* receive buffers */
@@ -808,6 +809,15 @@ igbeim(struct ctlr* ctlr, int im)
 	iunlock(&ctlr->imlock);
 }
 
+static void
+igbeimc(struct ctlr* ctlr, int im)
+{
+	ilock(&ctlr->imlock);
+	ctlr->im &= ~im;
+	csr32w(ctlr, Imc, im);
+	iunlock(&ctlr->imlock);
+}
+
 static int
 igbelim(void* ctlr)
 {
@@ -1032,7 +1042,9 @@ igbetransmit(struct ether* edev)
 			ctlr->txdw++;
 			ctlr->tdt = tdt;
 			csr32w(ctlr, Tdt, tdt);
-			igbeim(ctlr, Txdw);
+			/* a polling rproc will be back soon enough */
+			if(!ctlr->rxpolling)
+				igbeim(ctlr, Txdw);
 			break;
 		}
 		ctlr->tdt = tdt;
@@ -1133,7 +1145,8 @@ igberproc(void* arg)
 	Rd *rd;
 	struct block *bp;
 	struct ctlr *ctlr;
-	int r, rdh;
+	int r, rdh, work, budget;
+	bool polling = FALSE, was_polling;
 	struct ether *edev;
 
 	edev = arg;
@@ -1145,13 +1158,17 @@ igberproc(void* arg)
 	csr32w(ctlr, Rctl, r);
 
 	for(;;){
-		ctlr->rim = 0;
-		igbeim(ctlr, Rxt0|Rxo|Rxdmt0|Rxseq);
-		ctlr->rsleep++;
-		rendez_sleep(&ctlr->rrendez, igberim, ctlr);
+		/* while polling, the RX interrupts stay masked */
+		if(!polling){
+			ctlr->rim = 0;
+			igbeim(ctlr, Rxt0|Rxo|Rxdmt0|Rxseq);
+			ctlr->rsleep++;
+			rendez_sleep(&ctlr->rrendez, igberim, ctlr);
+		}
 
 		rdh = ctlr->rdh;
-		for(;;){
+		budget = etherpollbudget(edev, ctlr->nrd);
+		for(work = 0; work < budget; work++){
 			rd = &ctlr->rdba[rdh];
 
 			if(!(rd->status & Rdd))
@@ -1205,6 +1222,24 @@ igberproc(void* arg)
 
 		if(ctlr->rdfree < ctlr->nrd/2 || (ctlr->rim & Rxdmt0))
 			igbereplenish(ctlr);
+		/* no Txdw interrupts either; reap and refill the tx ring here */
+		if(polling)
+			igbetransmit(edev);
+		was_polling = polling;
+		polling = etherpoll(edev, work);
+		if(polling != was_polling){
+			ilock(&ctlr->tlock);
+			ctlr->rxpolling = polling;
+			iunlock(&ctlr->tlock);
+			if(polling){
+				igbeimc(ctlr, Txdw);
+			}else{
+				/* Rs only goes on the descriptor that filled the ring, so
+				 * unmasking Txdw is enough to hear about it. */
+				igbetransmit(edev);
+				igbeim(ctlr, Txdw);
+			}
+		}
 	}
 }
 
@@ -1296,6 +1331,7 @@ static void igbeinterrupt(struct hw_trapframe *hw_tf, void *arg)
 			ctlr->rim = icr & (Rxt0|Rxo|Rxdmt0|Rxseq);
 			rendez_wakeup(&ctlr->rrendez);
 			ctlr->rintr++;
+			etherpollirq(edev);
 		}
 		if(icr & Txdw){
 			im &= ~Txdw;
@@ -95,6 +95,10 @@ int get_user_page(struct proc *p, unsigned long uvastart, int write, int force,
 	int		ret = -1;
 	struct page	*pp;
 
+	/* The caller will put_page() what we return, which has to be a whole
+	 * page, not part of a huge one. */
+	mm_split_huge(p, uvastart);
+
 	spin_lock(&p->pte_lock);
 
 	pte = pgdir_walk(p->env_pgdir, (void*)uvastart, TRUE);
@@ -116,6 +120,12 @@ int get_user_page(struct proc *p, unsigned long uvastart, int write, int force,
 			goto err1;
 		pte_write(pte, page2pa(pp), prot);
 	} else {
+		/* Only if a fault mapped a huge page since we split */
+		if (pte_is_jumbo(pte)) {
+			printk("[akaros]: get_user_page() uva=0x%llx huge page\n",
+			    uvastart);
+			goto err1;
+		}
 		pp = pa2page(pte_get_paddr(pte));
 
 		/* __vmr_free_pgs() refcnt's pagemap pages differently */
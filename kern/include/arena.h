@@ -43,6 +43,21 @@ BSD_LIST_HEAD(btag_list, btag);
 #define ARENA_NR_FREE_LISTS		64
 #define ARENA_NAME_SZ			32
 
+/* Power-of-two segments that were freed whole, kept for the next instant-fit
+ * alloc of that size.  List i holds segments of quantum << i.  Each list has its
+ * own lock, so hits don't touch the arena lock. */
+#define ARENA_NR_FAST_LISTS		8
+#define ARENA_FAST_DEPTH		4
+
+struct arena_fast_list {
+	spinlock_t					lock;
+	unsigned int				nr_segs;
+	void						*segs[ARENA_FAST_DEPTH];
+	size_t						nr_hits;
+	size_t						nr_misses;
+	size_t						nr_frees;
+};
+
 /* Forward declarations of import lists */
 struct arena;
 TAILQ_HEAD(arena_tailq, arena);
@@ -72,6 +87,19 @@ struct arena {
 	uintptr_t					last_nextfit_alloc;
 	struct btag_list			free_segs[ARENA_NR_FREE_LISTS];
 	struct btag_list			static_hash[HASH_INIT_SZ];
+	bool						has_fast_lists;
+	struct arena_fast_list		fast_lists[ARENA_NR_FAST_LISTS];
+
+	/* Lock and policy stats, protected by the lock (or racy) */
+	size_t						nr_lock_acquires;
+	size_t						nr_lock_contended;
+	uint64_t					lock_hold_ticks;
+	uint64_t					lock_start_tsc;
+	size_t						nr_btag_stalls;
+	size_t						nr_bestfit;
+	size_t						nr_instantfit;
+	size_t						nr_nextfit;
+	size_t						nr_xalloc;
 
 	/* Accounting */
 	char						name[ARENA_NAME_SZ];
@@ -110,6 +138,9 @@ void arena_xfree(struct arena *arena, void *addr, size_t size);
 
 size_t arena_amt_free(struct arena *arena);
 size_t arena_amt_total(struct arena *arena);
+/* Returns segments on the fast lists to the arena.  Returns the amount freed. */
+size_t arena_drain_fast_lists(struct arena *arena);
+void print_arena_stats(struct arena *arena, bool verbose);
 
 /* All lists that track the existence of arenas, slabs, and the connections
  * between them are tracked by a global qlock.  For the most part, slabs/arenas
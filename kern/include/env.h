@@ -82,7 +82,9 @@ struct proc {
 	spinlock_t vmr_lock;		/* Protects VMR tree (mem mgmt) */
 	spinlock_t pte_lock;		/* Protects page tables (mem mgmt) */
 	struct vmr_tailq vm_regions;
+	struct mm_pin_tailq mm_pins;	/* protected by the vmr_lock */
 	int vmr_history;
+	struct mm_stats mm_stats;
 
 	// Per process info and data pages
  	procinfo_t *procinfo;       // KVA of per-process shared info table (RO)
@@ -78,6 +78,10 @@ struct fs_file_ops {
 
 #define FSF_DIRTY				(1 << 1)
 
+/* Readahead window bounds for sequential readers, in pages */
+#define FSF_RA_MIN_PAGES		4
+#define FSF_RA_MAX_PAGES		64
+
 struct fs_file {
 	struct dir					dir;
 	int							flags;
@@ -128,7 +132,7 @@ void set_acmtime_noperm(struct fs_file *f, int which);
 size_t fs_file_stat(struct fs_file *f, uint8_t *m_buf, size_t m_buf_sz);
 void fs_file_truncate(struct fs_file *f, off64_t to);
 size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
-                    off64_t offset);
+                    off64_t offset, struct file_ra_state *ra);
 size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
                      off64_t offset);
 size_t fs_file_wstat(struct fs_file *f, uint8_t *m_buf, size_t m_buf_sz);
@@ -10,10 +10,17 @@
 #include <ros/common.h>
 #include <kref.h>
 
-#define NUM_KMALLOC_CACHES 6
+/* Kmalloc size classes span KMALLOC_NR_PWR2 powers of two, starting at
+ * KMALLOC_SMALLEST.  Each power of two is split into KMALLOC_CLASSES_PER_PWR2
+ * evenly spaced classes (e.g. 256, 320, 384, 448, 512), which bounds the
+ * internal fragmentation to about 20%, instead of 50% with just powers of two.
+ * All class sizes are multiples of KMALLOC_ALIGNMENT. */
+#define KMALLOC_NR_PWR2 6
+#define KMALLOC_CLASSES_PER_PWR2 4
+#define NUM_KMALLOC_CACHES (1 + (KMALLOC_NR_PWR2 - 1) * KMALLOC_CLASSES_PER_PWR2)
 #define KMALLOC_ALIGNMENT 16
 #define KMALLOC_SMALLEST (sizeof(struct kmalloc_tag) << 1)
-#define KMALLOC_LARGEST KMALLOC_SMALLEST << NUM_KMALLOC_CACHES
+#define KMALLOC_LARGEST (KMALLOC_SMALLEST << (KMALLOC_NR_PWR2 - 1))
 
 void kmalloc_init(void);
 void *kmalloc(size_t size, int flags);
@@ -29,6 +36,19 @@ void kfree(void *buf);
 void kmalloc_canary_check(char *str);
 void *debug_canary;
 
+/* Per size class stats.  amt_requested is what callers asked for, amt_alloc is
+ * what they got, including the tag.  The extra class, NUM_KMALLOC_CACHES, is
+ * for allocations that went straight to kpages. */
+struct kmalloc_class_stats {
+	uint64_t					nr_allocs;
+	uint64_t					amt_requested;
+	uint64_t					amt_alloc;
+};
+
+struct kmem_cache;
+extern struct kmem_cache *kmalloc_caches[NUM_KMALLOC_CACHES];
+void kmalloc_get_class_stats(int class_id, struct kmalloc_class_stats *sum);
+
 #define MEM_ATOMIC				(1 << 1)
 #define MEM_WAIT				(1 << 2)
 #define MEM_ERROR				(1 << 3)
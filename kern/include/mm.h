@@ -18,6 +18,7 @@
 struct chan;
 struct fd_table;
 struct proc;								/* preprocessor games */
+struct page;
 
 #define F_OR_C_CHAN 2
 
@@ -59,6 +60,29 @@ struct vm_region {
 };
 TAILQ_HEAD(vmr_tailq, vm_region);			/* Declares 'struct vmr_tailq' */
 
+/* Per-process counts of how memory got mapped.  Protected by the vmr_lock. */
+struct mm_stats {
+	unsigned long				nr_huge_mapped;	/* huge pages mapped now */
+	unsigned long				nr_huge_maps;
+	unsigned long				nr_small_maps;
+	unsigned long				nr_huge_fallbacks;	/* out of huge pages */
+	unsigned long				nr_huge_splits;
+	unsigned long				nr_fault_around;	/* neighbors mapped */
+	unsigned long				nr_readahead;	/* async readahead kicks */
+};
+
+/* A range of a process's anonymous memory that the kernel is still using after
+ * the syscall that handed it over returned, e.g. for a zero-copy send.  The
+ * range can't be unmapped while pinned, and the pin holds a ref on the proc, so
+ * the pages stay put.  Protected by the vmr_lock. */
+struct mm_pin {
+	TAILQ_ENTRY(mm_pin)			link;
+	struct proc					*proc;
+	uintptr_t					start;
+	uintptr_t					end;
+};
+TAILQ_HEAD(mm_pin_tailq, mm_pin);
+
 static inline bool vmr_has_file(struct vm_region *vmr)
 {
 	return vmr->__vm_foc ? true : false;
@@ -92,6 +116,13 @@ int munmap(struct proc *p, uintptr_t addr, size_t len);
 int handle_page_fault(struct proc *p, uintptr_t va, int prot);
 int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot);
 unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs);
+int mm_pin(struct proc *p, struct mm_pin *pin, uintptr_t va, size_t len,
+           struct page **pages);
+void mm_unpin(struct mm_pin *pin);
+void mm_split_huge(struct proc *p, uintptr_t va);
+bool mm_has_pins(struct proc *p);
+extern int fault_around_pages;
+#define FAULT_AROUND_MAX_PAGES		64	/* Kconfig's range for the window */
 
 /* These assume the mm_lock is held already */
 int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot);
@@ -33,6 +33,8 @@
 enum {
 	Addrlen = 64,
 	Maxproto = 20,
+	Maxconv = 1 << 18,	/* per proto, limited by the qid bits in devip */
+	Zcopymin = 16 * 1024,	/* default minimum for zero-copy writes */
 	Nhash = 64,
 	Maxincall = 500,
 	Nchans = 256,
@@ -87,6 +89,11 @@ struct conv {
 	uint32_t ttl;				/* max time to live */
 	uint32_t tos;				/* type of service */
 	int ignoreadvice;			/* don't terminate connection on icmp errors */
+	size_t zcopy;				/* zero-copy writes of at least this, if set */
+	struct rxring *rxring;		/* user receive ring, if set */
+	unsigned int mdata_max;		/* datagrams per mdata read, 0 for no limit */
+	bool reuseport;				/* can share its port with other reuseports */
+	int reuseport_core;			/* core whose flows it prefers, or -1 */
 
 	uint8_t ipversion;
 	uint8_t laddr[IPaddrlen];	/* local IP address */
@@ -108,6 +115,8 @@ struct conv {
 
 	struct conv *incall;		/* calls waiting to be listened for */
 	struct conv *next;
+	struct conv *freenext;		/* on p->freeconv, under p->freelock */
+	bool onfreelist;
 
 	struct queue *rq;			/* queued data waiting to be read */
 	struct queue *wq;			/* queued data waiting to be written */
@@ -262,9 +271,17 @@ struct Ipmulti {
 
 /*
  *  hash table for 2 ip addresses + 2 ports
+ *
+ *  Lookups are lockless, under RCU.  Adds and removes lock one of a fixed set
+ *  of lock stripes, picked by the low bits of the hash.  The table doubles in
+ *  the background once it averages more than one conv per bucket.  A resize
+ *  holds every stripe and relinks each entry through its other link, so
+ *  readers of the old table can keep walking it until the grace period ends.
  */
 enum {
-	Nipht = 521,				/* convenient prime */
+	Nipht = 512,				/* initial buckets, power of 2 */
+	Nipht_max = 1 << 20,
+	Nipht_locks = 256,			/* lock stripes, <= Nipht */
 
 	IPmatchexact = 0,	/* match on 4 tuple */
 	IPmatchany,	/* *!* */
@@ -273,22 +290,51 @@ enum {
 	IPmatchpa,	/* addr!port */
 };
 struct Iphash {
-	struct Iphash *next;
+	struct hlist_node link[2];	/* indexed by the table's generation */
+	struct rcu_head rcu;
+	uint32_t hv;
 	struct conv *c;
 	int match;
 };
 
-struct Iphash;
+struct iphtab {
+	unsigned int gen;
+	unsigned int nr_buckets;
+	struct hlist_head buckets[];
+};
+
 struct Ipht {
-	spinlock_t lock;
-	struct Iphash *tab[Nipht];
+	struct iphtab *tab;			/* rcu protected */
+	atomic_t nr_items;
+	atomic_t resizing;
+	spinlock_t locks[Nipht_locks];
 };
+void iphtinit(struct Ipht *);
 void iphtadd(struct Ipht *, struct conv *);
 void iphtrem(struct Ipht *, struct conv *);
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp);
 void dump_ipht(struct Ipht *ht);
 
+/*
+ *  longest prefix match trie over the routes, see iptrie.c
+ */
+enum {
+	Iptrie_stride = 8,			/* key bits per level */
+};
+
+struct iptrie {
+	struct iptrie_node *root;
+	int keylen;					/* bytes */
+};
+void iptrie_init(struct iptrie *t, int keylen);
+void iptrie_add(struct iptrie *t, uint8_t *key, int plen, struct route *r);
+void iptrie_del(struct iptrie *t, uint8_t *key, int plen, struct route *repl,
+                int repl_plen);
+struct route *iptrie_lookup(struct iptrie *t, uint8_t *key);
+bool iptrie_empty(struct iptrie *t);
+void iptrie_destroy(struct iptrie *t);
+
 /*
  *  one per multiplexed Protocol
  */
@@ -319,7 +365,10 @@ struct Proto {
 	struct conv **conv;			/* array of conversations */
 	int ptclsize;				/* size of per protocol ctl block */
 	int nc;						/* number of conversations */
+	int maxnc;					/* nc can grow up to this, 0 for fixed */
 	int ac;
+	spinlock_t freelock;
+	struct conv *freeconv;		/* convs that are probably reusable */
 	struct qid qid;				/* qid for protocol directory */
 	uint16_t nextport;
 	uint16_t nextrport;
@@ -358,6 +407,8 @@ struct Fs {
 	struct route *v4root[1 << Lroot];	/* v4 routing forest */
 	struct route *v6root[1 << Lroot];	/* v6 routing forest */
 	struct route *queue;		/* used as temp when reinjecting routes */
+	struct iptrie v4trie;		/* lookups into the forests */
+	struct iptrie v6trie;
 
 	struct Netlog *alog;
 	struct Ifclog *ilog;
@@ -396,6 +447,7 @@ int Fspcolstats(char *unused_char_p_t, int);
 int Fsproto(struct Fs *, struct Proto *);
 int Fsbuiltinproto(struct Fs *, uint8_t unused_uint8_t);
 struct conv *Fsprotoclone(struct Proto *, char *unused_char_p_t);
+void Fsconvrelease(struct conv *);
 struct Proto *Fsrcvpcol(struct Fs *, uint8_t unused_uint8_t);
 struct Proto *Fsrcvpcolx(struct Fs *, uint8_t unused_uint8_t);
 void Fsstdconnect(struct conv *, char **, int);
@@ -533,14 +585,19 @@ extern struct IPaux *newipaux(char *unused_char_p_t, char *);
  *  arp.c
  */
 struct arpent {
+	struct hlist_node link[2];	/* indexed by the table's generation */
+	struct rcu_head rcu;
+	TAILQ_ENTRY(arpent) lru;
+	seq_ctr_t seq;				/* for lockless readers of mac, type, state */
+	uint32_t hv;
 	uint8_t ip[IPaddrlen];
 	uint8_t mac[MAClen];
 	struct medium *type;		/* media type */
-	struct arpent *hash;
 	struct block *hold;
 	struct block *last;
 	uint64_t ctime;			/* time entry was created or refreshed */
 	uint64_t utime;			/* time entry was last used */
+	uint64_t lru_time;			/* utime when last moved up the lru */
 	uint8_t state;
 	struct arpent *nextrxt;		/* re-transmit chain */
 	uint64_t rtime;			/* time for next retransmission */
@@ -651,6 +708,49 @@ extern void ipifc_trace_block(struct Ipifc *ifc, struct block *bp);
 extern long ipselftabread(struct Fs *, char *a, uint32_t offset, int n);
 extern void ipsendra6(struct Fs *f, int on);
 
+/*
+ *  gro.c: software receive offload.  Coalesces in-order TCP segments of a flow
+ *  into one block before ipiput4.  One gro per stream of packets (e.g. per RX
+ *  queue); it is not locked.
+ */
+enum {
+	Groflows = 8,				/* flows held at once */
+	Gromaxsegs = 64,			/* segments per merged block */
+};
+
+struct gro_flow {
+	struct block *bp;			/* first segment, the rest are extra_data */
+	uint8_t src[IPv4addrlen];
+	uint8_t dst[IPv4addrlen];
+	uint16_t sport;
+	uint16_t dport;
+	uint32_t seq;				/* next seq we can merge */
+	uint16_t mss;				/* payload of the first segment */
+	uint16_t nsegs;
+};
+
+struct gro {
+	struct Fs *f;
+	struct Ipifc *ifc;
+	unsigned int evict;
+	struct gro_flow flows[Groflows];
+};
+
+extern void gro_init(struct gro *, struct Fs *, struct Ipifc *);
+extern void gro_receive(struct gro *, struct block *);
+extern void gro_flush(struct gro *);
+extern void gro_drop(struct gro *);
+
+/*
+ *  rxring.c: receive rings in user memory, see ros/rxring.h.
+ */
+struct rxring;
+extern void rxring_attach(struct conv *, uintptr_t, size_t);
+extern void rxring_detach(struct conv *);
+extern void rxring_fill(struct conv *, int);
+extern void rxring_wake(struct conv *);
+extern size_t rxring_read(struct conv *, size_t, bool);
+
 /*
  *  ip.c
  */
@@ -992,6 +1092,11 @@ struct netfile {
 	int nmaddr;					/* number of multicast addresses */
 
 	struct queue *in;			/* input buffer */
+	/* in-kernel consumer, called by the RX queue workers instead of passing
+	 * to 'in'.  see etherrxhook(). */
+	void (*rx)(void *arg, struct block *bp, int rxq);
+	void (*rxflush)(void *arg, int rxq);
+	void *rxarg;
 };
 
 /*
@@ -1013,6 +1118,7 @@ struct netaddr {
 #define NETF_SG_SHIFT		(NETF_BASE_SHIFT + 1)
 #define NETF_LRO_SHIFT		(NETF_BASE_SHIFT + 2)
 #define NETF_RXCSUM_SHIFT	(NETF_BASE_SHIFT + 3)
+#define NETF_GSO_SHIFT		(NETF_BASE_SHIFT + 4)
 enum {
 	NETF_IPCK = (1 << NS_IPCK_SHIFT),	/* xmit ip checksum */
 	NETF_UDPCK = (1 << NS_UDPCK_SHIFT),	/* xmit udp checksum */
@@ -1022,6 +1128,7 @@ enum {
 	NETF_TSO = (1 << NS_TSO_SHIFT),		/* device can do TSO */
 	NETF_LRO = (1 << NETF_LRO_SHIFT),	/* device can do LRO */
 	NETF_RXCSUM = (1 << NETF_RXCSUM_SHIFT),	/* device can do rx checksums */
+	NETF_GSO = (1 << NETF_GSO_SHIFT),	/* TSO in software, for v4 TCP */
 };
 
 /* Linux's rtnl_link_stats64 */
@@ -1062,6 +1169,7 @@ struct netif_stats {
  *  a network interface
  */
 struct ether;
+struct core_set;
 struct netif {
 	qlock_t qlock;
 
@@ -1147,8 +1255,45 @@ enum {
 	MaxEther = 32,
 	MaxFID = 16,
 	Ntypes = 8,
+	Maxrxqlen = 1024,	/* packets backlogged per RX queue */
+	Etherpollbudget = 64,	/* default packets per poll */
+	Etherpollidle = 2,	/* empty polls before going back to IRQs */
+};
+
+/* Adaptive interrupt/polling (NAPI-style) for a driver's RX ktask.  The IRQ
+ * handler masks RX interrupts and wakes the ktask, which drains at most
+ * 'budget' descriptors per pass.  While passes keep using up the budget, the
+ * ktask keeps polling with the IRQ masked.  See etherpoll(). */
+struct ether_poll {
+	int budget;					/* descriptors per pass, 0 for IRQs only */
+	int idle_max;
+	int idle;					/* empty passes in a row */
+	bool polling;
+	uint64_t irqs;
+	uint64_t polls;
+	uint64_t pkts;
+	uint64_t idle_polls;
+	uint64_t switches;			/* IRQ to polling transitions */
 };
 
+/* An RX queue: packets the NIC (RSS) or etheriq (a software Toeplitz hash,
+ * for single queue NICs) steered to one core.  Each queue has a ktask that
+ * only runs on that core, so a flow is always processed on the same core. */
+struct ether_rxq {
+	spinlock_t lock;
+	struct block *head;			/* linked by bp->list */
+	struct block *tail;
+	unsigned int len;
+	struct rendez rv;
+	struct ether *ether;
+	int core;
+	unsigned long seq;			/* odd while calling consumers */
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t drops;
+	uint64_t kicks;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 struct ether {
 	rwlock_t rwlock;
 	int ctlrno;
@@ -1181,6 +1326,12 @@ struct ether {
 	int nvlan;
 	struct ether *vlans[MaxFID];
 
+	struct ether_poll poll;
+
+	int nrxq;					/* RX queues in use, 0 for none */
+	int maxrxq;					/* RX queues allocated, never freed */
+	struct ether_rxq *rxq;
+
 	struct netif;
 };
 
@@ -1200,12 +1351,31 @@ static inline void netif_carrier_off(struct ether *edev)
 	edev->link_is_up = FALSE;
 }
 
+/* Called from a driver's IRQ handler when it masks RX and wakes its ktask. */
+static inline void etherpollirq(struct ether *edev)
+{
+	edev->poll.irqs++;
+}
+
+/* How many descriptors the RX ktask may handle in one pass. */
+static inline int etherpollbudget(struct ether *edev, int ring_size)
+{
+	int budget = READ_ONCE(edev->poll.budget);
+
+	return budget ? MIN(budget, ring_size) : ring_size;
+}
+
 static void netif_wait_for_carrier(struct ether *edev)
 {
 	rendez_sleep(&edev->link_rz, (rendez_cond_t)netif_carrier_ok, edev);
 }
 
 extern struct block *etheriq(struct ether *, struct block *, int);
+extern void etherrxqinit(struct ether *, int, const struct core_set *);
+extern bool etherpoll(struct ether *, int);
+extern void etherrxhook(struct chan *,
+                        void (*rx)(void *, struct block *, int),
+                        void (*rxflush)(void *, int), void *arg);
 extern void addethercard(char *unused_char_p_t, int (*)(struct ether *));
 extern int archether(int unused_int, struct ether *);
 
@@ -116,22 +116,45 @@ enum {
 	Maxlimbo = 1000,	/* maximum procs waiting for response to SYN ACK */
 	NLHT = 256,	/* hash table size, must be a power of 2 */
 	LHTMASK = NLHT - 1,
+	NLIMBOWHEEL = 64,	/* limbo rexmit ticks, must cover 6 SYNACK_RXTIMERs */
+	SYNCOOKIE_PERIOD = 64 * 1000,	/* ms a syn cookie's counter lasts */
 
 	HaveWS = 1 << 8,
 };
 
+struct tcp_twheel;
+
 typedef struct tcptimer Tcptimer;
 struct tcptimer {
-	Tcptimer *next;
-	Tcptimer *prev;
+	BSD_LIST_ENTRY(tcptimer) link;	/* on a wheel slot, when ON */
 	Tcptimer *readynext;
+	struct tcp_twheel *wheel;
 	int state;
 	uint64_t start;
-	uint64_t count;
+	uint64_t count;					/* ticks left, when not ON */
+	uint64_t expires;				/* wheel tick, when ON */
 	void (*func) (void *);
 	void *arg;
 };
 
+BSD_LIST_HEAD(tcptimer_list, tcptimer);
+
+/* Hierarchical timing wheel: level 0 has a slot per tick, and each higher level
+ * has a slot per lap of the level below it.  Timers cascade down a level when
+ * the lower level wraps.  Each tick costs the expiring timers plus whatever
+ * cascades, instead of every armed timer.  There is one wheel per core; a TCB's
+ * timers live on the wheel of the core that set up the TCB. */
+#define TCP_TW_BITS		6
+#define TCP_TW_SIZE		(1 << TCP_TW_BITS)
+#define TCP_TW_MASK		(TCP_TW_SIZE - 1)
+#define TCP_TW_LEVELS	4
+
+struct tcp_twheel {
+	spinlock_t lock;
+	uint64_t now;					/* in ticks */
+	struct tcptimer_list slots[TCP_TW_LEVELS][TCP_TW_SIZE];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 struct tcphdr {
 	uint8_t tcpsport[2];
 	uint8_t tcpdport[2];
@@ -220,6 +243,27 @@ struct reseq {
 	uint16_t length;
 };
 
+/*
+ *  congestion control.  An algorithm owns cwind and ssthresh.  tcp.c tells it
+ *  about new acks outside of loss recovery and about losses; it keeps its own
+ *  per connection state in the Tcpctl's cong_priv.  Called with the conv
+ *  qlocked.
+ */
+struct tcpctl;
+struct tcp_cong_ops {
+	const char *name;
+	void (*init)(struct tcpctl *tcb);
+	/* acked bytes were newly acked, rtt is this ack's sample (ms) or 0 */
+	void (*ack)(struct tcpctl *tcb, uint32_t acked, int rtt);
+	void (*loss)(struct tcpctl *tcb);
+	/* bytes per second we'd like to send at, 0 if we don't know */
+	uint64_t (*pacing_rate)(struct tcpctl *tcb);
+};
+
+enum {
+	TCP_CONG_PRIV_SZ = 128,
+};
+
 /*
  *  the qlock in the Conv locks this structure
  */
@@ -260,6 +304,9 @@ struct tcpctl {
 	uint32_t cwind;				/* Congestion window */
 	int scale;					/* desired snd.scale */
 	uint32_t ssthresh;			/* Slow start threshold */
+	const struct tcp_cong_ops *cong;	/* Congestion control algorithm */
+	const struct tcp_cong_ops *cong_pick;	/* Picked before connecting */
+	uint64_t cong_priv[TCP_CONG_PRIV_SZ / sizeof(uint64_t)];
 	int irs;					/* Initial received squence */
 	uint16_t mss;				/* Max segment size */
 	uint16_t typical_mss;		/* MSS for most packets (< MSS for some opts) */
@@ -276,6 +323,7 @@ struct tcpctl {
 	uint32_t rttseq;			/* Round trip sequence */
 	int srtt;					/* Shortened round trip */
 	int mdev;					/* Mean deviation of round trip */
+	uint32_t min_rtt;			/* Smallest round trip seen (ms) */
 	int kacounter;				/* count down for keep alive */
 	uint64_t sndsyntime;		/* time syn sent */
 	uint64_t time;				/* time Finwait2 was sent */
@@ -300,13 +348,18 @@ struct tcpctl {
  *  In particular they aren't on a listener's queue so that they don't figure in
  *  the input queue limit.
  *
- *  If 1/2 of a T3 was attacking SYN packets, we'ld have a permanent queue of
- *  70000 limbo'd calls.  Not great for a linear list but doable.  Therefore
- *  there is no hashing of this list.
+ *  Once Maxlimbo calls are waiting, we stop keeping state for new ones and
+ *  answer with a SYN cookie instead: the call's details are hashed into our
+ *  ISS, and checked when the ACK comes back.
+ *
+ *  Each limbo is also on the rexmit wheel, in the slot for the tick its next
+ *  SYN ACK is due, so limborexmit() only looks at the calls that are due.
  */
 typedef struct limbo Limbo;
 struct limbo {
 	Limbo *next;
+	TAILQ_ENTRY(limbo) wheel_link;
+	uint64_t wheel_tick;		/* tick of the next SYN ACK */
 
 	uint8_t laddr[IPaddrlen];
 	uint8_t raddr[IPaddrlen];
@@ -324,6 +377,7 @@ struct limbo {
 	uint32_t ts_val;			/* timestamp val from sender */
 	struct Ipifc *ifc;			/* Uncounted ref */
 };
+TAILQ_HEAD(limbo_tailq, limbo);
 
 enum {
 	/* MIB stats */
@@ -344,15 +398,18 @@ enum {
 	HlenErrs,
 	LenErrs,
 	OutOfOrder,
+	LimboOverflows,
+	SynCookiesSent,
+	SynCookiesValid,
+	SynCookiesFailed,
 
 	Nstats
 };
 
 typedef struct tcppriv Tcppriv;
 struct tcppriv {
-	/* List of active timers */
-	qlock_t tl;
-	Tcptimer *timers;
+	/* Timing wheels for active timers, one per core */
+	struct tcp_twheel *wheels;
 
 	/* hash table for matching conversations */
 	struct Ipht ht;
@@ -360,6 +417,11 @@ struct tcppriv {
 	/* calls in limbo waiting for an ACK to our SYN ACK */
 	int nlimbo;
 	Limbo *lht[NLHT];
+	struct limbo_tailq limbo_wheel[NLIMBOWHEEL];
+	uint64_t limbo_tick;		/* last tick limborexmit() did */
+	uint64_t last_overflow;		/* when we last sent a syn cookie */
+	uint8_t syncookie_secret[16];
+	bool syncookie_keyed;
 
 	/* for keeping track of tcpackproc */
 	qlock_t apl;
@@ -410,6 +472,20 @@ static inline uint32_t seq_min(uint32_t x, uint32_t y)
 	return seq_le(x, y) ? x : y;
 }
 
+/* tcp_cong.c */
+extern const struct tcp_cong_ops tcp_reno;
+extern const struct tcp_cong_ops tcp_cubic;
+extern const struct tcp_cong_ops tcp_bbr;
+extern const struct tcp_cong_ops *tcp_cong_default;
+const struct tcp_cong_ops *tcp_cong_find(const char *name);
+void tcp_cong_set(Tcpctl *tcb, const char *name);
+void tcp_cong_grow(Tcpctl *tcb, uint32_t expand);
+
+static inline void *tcp_cong_priv(Tcpctl *tcb)
+{
+	return tcb->cong_priv;
+}
+
 /* Caller needs to know we're TCP and with transport_offset set, which is
  * usually on the outbound network path. */
 static inline struct tcphdr *tcp_hdr(struct block *bp)
@@ -37,6 +37,7 @@
 #include <ros/fs.h>
 #include <bitmask.h>
 #include <mm.h>
+#include <ros/event.h>
 #include <sys/uio.h>
 #include <time.h>
 
@@ -430,11 +431,22 @@ enum {
 #define BLOCK_TRANS_TX_CSUM (Budpck | Btcpck)
 #define BLOCK_RX_CSUM (Bipck | Budpck | Btcpck)
 
+/* User memory lent to blocks as extra_data, for zero-copy writes.  Each
+ * extra_data pointing into it holds a ref.  When the last one goes away, the
+ * memory is unpinned and msg goes to the process's EV_ZCOPY_DONE ev_q. */
+struct block_ubuf {
+	struct kref kref;
+	struct mm_pin pin;
+	struct event_msg msg;
+};
+
 struct extra_bdata {
 	uintptr_t base;
 	/* using u32s for packing reasons.  this means no extras > 4GB */
 	uint32_t off;
 	uint32_t len;
+	/* if set, base is a page of user memory held by ubuf, o/w it's kmalloc'd */
+	struct block_ubuf *ubuf;
 };
 
 struct block {
@@ -450,6 +462,7 @@ struct block {
 	uint16_t network_offset;	/* offset from start */
 	uint16_t transport_offset;	/* offset from start */
 	uint16_t tx_csum_offset;	/* offset from tx_offset to store csum */
+	uint32_t rx_hash;			/* flow hash from the NIC (RSS), 0 if none */
 	/* might want something to track the next free extra_data slot */
 	size_t extra_len;
 	unsigned int nr_extra_bufs;
@@ -459,6 +472,13 @@ struct block {
 #define BHLEN(s) ((s)->wp - (s)->rp)
 #define BALLOC(s) ((s)->lim - (s)->base + (s)->extra_len)
 
+/* Per-open readahead state for page-cached files.  See fs_file_read(). */
+struct file_ra_state {
+	unsigned long next_idx;		/* page a sequential reader wants next */
+	unsigned long ra_end;		/* first page past what we've read ahead */
+	unsigned int window;		/* readahead size in pages, 0 == random */
+};
+
 struct chan {
 	spinlock_t lock;
 	struct kref ref;
@@ -499,6 +519,7 @@ struct chan {
 	 * user can read from (including offsets) while the underlying file changes.
 	 * Hang that buffer here. */
 	void *synth_buf;
+	struct file_ra_state ra;
 };
 
 extern struct chan *kern_slash;
@@ -781,6 +802,14 @@ struct block *block_alloc(size_t, int);
 int block_add_extd(struct block *b, unsigned int nr_bufs, int mem_flags);
 int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
                        uint32_t len, int mem_flags);
+int block_append_ubuf(struct block *b, struct block_ubuf *ubuf, uintptr_t base,
+                      uint32_t off, uint32_t len, int mem_flags);
+struct block_ubuf *block_ubuf_pin(void *uva, size_t len, struct page **pages,
+                                  struct event_msg *msg);
+void block_ubuf_decref(struct block_ubuf *ubuf);
+void ebd_incref(struct extra_bdata *ebd);
+void ebd_decref(struct extra_bdata *ebd);
+int block_append_block(struct block *to, struct block *from, int mem_flags);
 void block_copy_metadata(struct block *new_b, struct block *old_b);
 void block_reset_metadata(struct block *b);
 int anyhigher(void);
@@ -956,6 +985,8 @@ void qflush(struct queue *);
 void qfree(struct queue *);
 int qfull(struct queue *);
 struct block *qget(struct queue *);
+struct block *qget_upto(struct queue *q, size_t len, int mem_flags);
+struct block *qget_whole(struct queue *q, size_t len);
 void qhangup(struct queue *, char *unused_char_p_t);
 int qisclosed(struct queue *);
 ssize_t qiwrite(struct queue *, void *, int);
@@ -976,6 +1007,10 @@ size_t qgetlimit(struct queue *);
 int qwindow(struct queue *);
 ssize_t qwrite(struct queue *, void *, int);
 ssize_t qwrite_nonblock(struct queue *, void *, int);
+ssize_t qwrite_zcopy(struct queue *q, void *uva, size_t len,
+                     struct event_msg *msg);
+ssize_t qwrite_zcopy_nonblock(struct queue *q, void *uva, size_t len,
+                              struct event_msg *msg);
 typedef void (*qio_wake_cb_t)(struct queue *q, void *data, int filter);
 void qio_set_wake_cb(struct queue *q, qio_wake_cb_t func, void *data);
 bool qreadable(struct queue *q);
@@ -32,6 +32,8 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 #define PG_BUFFER		0x008	/* is a buffer page, has BHs */
 #define PG_PAGEMAP		0x010	/* belongs to a page map */
 #define PG_REMOVAL		0x020	/* Working flag for page map removal */
+#define PG_HUGE			0x040	/* piece of a split jumbo page */
+#define PG_READAHEAD	0x080	/* page map, read ahead and not yet used */
 
 /* TODO: this struct is not protected from concurrent operations in some
  * functions.  If you want to lock on it, use the spinlock in the semaphore.
@@ -49,6 +51,8 @@ struct page {
 	uint64_t				gpa;		/* physical address in guest */
 
 	bool						pg_is_free;	/* TODO: will remove */
+	uint8_t						pg_numa_src; /* 0: kpages, else node + 1 */
+	atomic_t					pg_huge_refs;	/* jumbo head: pieces left */
 };
 
 /******** Externally visible global variables ************/
@@ -74,6 +78,40 @@ void free_cont_pages(void *buf, size_t order);
 
 void page_decref(page_t *page);
 
+/* PML2-sized pages, e.g. for user huge pages.  A split jumbo's 4K pieces are
+ * freed individually with page_decref(). */
+void jumbo_arena_init(void);
+void *jumbo_page_alloc(size_t nr, int flags);
+void jumbo_page_free(void *buf, size_t nr);
+void jumbo_page_split(void *buf);
+
+/* NUMA-local page pools.  Once initialized, the kpages and page allocation
+ * functions prefer the calling core's NUMA node. */
+struct numa_node_stats {
+	size_t						amt_total;
+	int64_t						amt_alloc;
+	int64_t						nr_allocs;
+	int64_t						nr_remote_allocs;
+};
+
+void kpages_numa_init(void);
+int kpages_numa_nr_nodes(void);
+void kpages_numa_get_stats(int node, struct numa_node_stats *stats);
+uint64_t kpages_numa_nr_fallbacks(void);
+
+/* Per-core caches of single pages, in front of the kpages functions. */
+struct pcp_page_stats {
+	uint64_t					nr_cached;
+	uint64_t					nr_allocs;
+	uint64_t					nr_hits;
+	uint64_t					nr_frees;
+	uint64_t					nr_refills;
+	uint64_t					nr_drains;
+};
+
+void kpages_pcp_get_stats(struct pcp_page_stats *stats);
+void kpages_pcp_drain(void);
+
 int page_is_free(size_t ppn);
 void lock_page(struct page *page);
 void unlock_page(struct page *page);
@@ -29,6 +29,8 @@ struct page_map {
 	struct page_map_operations	*pm_op;
 	spinlock_t					pm_lock;		/* for the VMR list */
 	struct vmr_tailq			pm_vmrs;
+	atomic_t					pm_nr_dirty;
+	uint64_t					pm_dirty_since;	/* tsc, 0 if clean */
 };
 
 /* Operations performed on a page_map.  These are usually FS specific, which
@@ -37,9 +39,15 @@ struct page_map {
 struct page_map_operations {
 	int (*readpage) (struct page_map *, struct page *);
 	int (*writepage) (struct page_map *, struct page *);
-/*	readpages: read a list of pages
-	writepage: write from a page to its backing store
-	writepages: write a list of pages
+	/* Optional.  Fills nr locked pages with consecutive indexes, starting at
+	 * pages[0]->pg_index, ideally with one backend op. */
+	int (*readpages) (struct page_map *, struct page **, unsigned int nr);
+	/* Optional.  Writes back nr pages with consecutive indexes. */
+	int (*writepages) (struct page_map *, struct page **, unsigned int nr);
+	/* Has a backing store that a pm_flusher writes to.  Only these PMs count
+	 * towards the dirty thresholds; RAM-only FSs never get clean. */
+	bool writeback;
+/*	writepage: write from a page to its backing store
 	sync_page: start the IO of already scheduled ops
 	set_page_dirty: mark the given page dirty
 	prepare_write: prepare to write (disk backed pages)
@@ -50,17 +58,65 @@ struct page_map_operations {
 	direct_io: bypass the page cache */
 };
 
+/* Readahead accounting for all page maps.  A readahead page is a hit once
+ * someone loads it from the PM, and wasted if it is removed before then. */
+struct pm_ra_stats {
+	uint64_t					nr_ra_pages;	/* pages read ahead of use */
+	uint64_t					nr_batches;		/* multi-page backend reads */
+	uint64_t					nr_hits;
+	uint64_t					nr_misses;		/* reads that waited on IO */
+	uint64_t					nr_wasted;
+};
+
+struct pm_wb_stats {
+	uint64_t					nr_dirty;		/* currently dirty pages */
+	uint64_t					nr_wb_pages;	/* pages written back */
+	uint64_t					nr_wb_ops;		/* backend write ops */
+	uint64_t					nr_flushes;		/* flusher passes */
+	uint64_t					nr_throttles;	/* writers that had to flush */
+};
+
+/* Filesystems with a backing store hook in here so the flusher ktask can write
+ * back their dirty pages.  flush() is called with one of the PM_FLUSH_ reasons,
+ * and may block.  Once pm_flusher_unregister() returns, flush() will not be
+ * called again. */
+#define PM_FLUSH_EXPIRED		1	/* just PMs that have been dirty a while */
+#define PM_FLUSH_ALL			2	/* too many dirty pages */
+#define PM_FLUSH_PRESSURE		3	/* low on memory, free what you can too */
+
+struct pm_flusher {
+	void (*flush)(struct pm_flusher *pf, int why);
+	TAILQ_ENTRY(pm_flusher)		link;
+};
+
+extern uint64_t pm_flush_period_ms;
+extern uint64_t pm_dirty_expire_ms;
+extern unsigned long pm_dirty_bg_pct;
+extern unsigned long pm_dirty_max_pct;
+
 /* Page cache functions */
 void pm_init(struct page_map *pm, struct page_map_operations *op, void *host);
 int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
 void pm_put_page(struct page *page);
+unsigned long pm_readahead(struct page_map *pm, unsigned long index,
+                           unsigned long nr);
+void pm_ra_note_miss(void);
+void pm_get_ra_stats(struct pm_ra_stats *stats);
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_or_zero_pages(struct page_map *pm, unsigned long start_idx,
                              unsigned long nr_pgs);
 void pm_writeback_pages(struct page_map *pm);
+void pm_set_page_dirty(struct page *page);
+bool pm_dirty_expired(struct page_map *pm);
+void pm_throttle_dirty(struct page_map *pm);
+void pm_get_wb_stats(struct pm_wb_stats *stats);
+void pm_flusher_register(struct pm_flusher *pf);
+void pm_flusher_unregister(struct pm_flusher *pf);
+void pm_flusher_kick(void);
+void pm_flusher_init(void);
 void pm_free_unused_pages(struct page_map *pm);
 void pm_destroy(struct page_map *pm);
 void pm_page_asserter(struct page *page, char *str);
@@ -34,6 +34,7 @@
 #define EV_SYSCALL				10
 #define EV_CHECK_MSGS			11
 #define EV_POSIX_SIGNAL			12
+#define EV_ZCOPY_DONE			13	/* kernel is done with a zero-copy buffer */
 #define NR_EVENT_TYPES			25 /* keep me last (and 1 > the last one) */
 
 /* Will probably have dynamic notifications later */
@@ -0,0 +1,36 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Batched datagrams: the mdata file of a UDP conversation.
+ *
+ * A read or write of mdata moves a batch of datagrams in one syscall.  The
+ * buffer is a sequence of records, each a struct mdata_hdr followed by len bytes
+ * of datagram, exactly what one read or write of the data file would carry,
+ * including the Udphdr if the conversation has "headers" turned on.  Records
+ * start on MDATA_ALIGN boundaries.
+ *
+ * A read blocks (unless O_NONBLOCK) until a datagram arrives, then adds every
+ * datagram already queued that fits in the buffer.  It returns the bytes of
+ * records it filled in.  If the first datagram does not fit, it is truncated,
+ * as with the data file, and its record gets MDATA_TRUNC.  "mdatamax n" on the
+ * ctl file limits a read to n datagrams.
+ *
+ * A write sends each record as its own datagram; flags must be 0.  The padding
+ * after the last record may be left off.  If a datagram fails after others went
+ * out, the write returns the bytes of the records that were sent. */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define MDATA_ALIGN				8
+#define MDATA_TRUNC				(1 << 0)
+
+struct mdata_hdr {
+	uint32_t					len;
+	uint32_t					flags;
+};
+
+/* Bytes taken by a record of len bytes of datagram, padding included. */
+#define MDATA_REC_SZ(len) \
+	ROUNDUP(sizeof(struct mdata_hdr) + (len), MDATA_ALIGN)
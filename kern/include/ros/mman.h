@@ -35,6 +35,7 @@
 #define MAP_POPULATE	0x08000
 #define MAP_NONBLOCK	0x10000
 #define MAP_STACK		0x20000
+#define MAP_HUGETLB		0x40000
 
 #define MAP_FAILED		((void*)-1)
 
@@ -0,0 +1,42 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Receive ring: a region of the process's memory that the kernel fills with a
+ * conversation's incoming data, so the process can consume it without a read()
+ * per chunk.
+ *
+ * The region is page aligned and a whole number of pages.  The first page is a
+ * struct rxring_hdr; each page after it is one buffer.  Buffer i is described
+ * by desc[i % nr_bufs].
+ *
+ * The kernel produces, the process consumes.  prod and cons are free running
+ * counts of buffers: the filled buffers are [cons, prod).  The kernel writes the
+ * data and the desc, then advances prod.  The process reads desc[cons % nr_bufs]
+ * and its buffer, then advances cons to hand the buffer back.  The kernel never
+ * trusts cons beyond keeping it in range.
+ *
+ * A read() of the data file blocks until the ring has something in it, then
+ * returns the number of bytes in the ring (at most the count asked for), without
+ * copying anything.  It returns 0 at end of file. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <ros/arch/mmu.h>
+
+#define RXRING_BUF_SZ			PGSIZE
+
+struct rxring_desc {
+	uint32_t					len;
+};
+
+struct rxring_hdr {
+	uint32_t					nr_bufs;		/* set by the kernel */
+	uint32_t					prod;			/* written by the kernel */
+	uint32_t					cons;			/* written by the process */
+	uint32_t					flags;
+	struct rxring_desc			desc[];
+};
+
+#define RXRING_MAX_BUFS \
+	((PGSIZE - sizeof(struct rxring_hdr)) / sizeof(struct rxring_desc))
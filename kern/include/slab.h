@@ -62,15 +62,31 @@ struct kmem_pcpu_cache {
 	size_t						nr_allocs_ever;
 } __attribute__((aligned(ARCH_CL_SIZE)));
 
+/* Working set of one of the depot's magazine lists over the current reclaim
+ * interval.  Magazines below 'min' were never touched during the interval, so
+ * the reclaimer can give them back. */
+struct kmem_depot_ws {
+	unsigned int				min;
+	unsigned int				max;
+};
+
 struct kmem_depot {
 	spinlock_t					lock;
 	struct kmem_mag_slist		not_empty;
 	struct kmem_mag_slist		empty;
 	unsigned int				magsize;
+	unsigned int				magsize_max;
 	unsigned int				nr_empty;
 	unsigned int				nr_not_empty;
 	unsigned int				busy_count;
 	uint64_t					busy_start;
+	unsigned long				nr_contended;
+	unsigned long				nr_resizes;
+	struct kmem_depot_ws		ws_not_empty;
+	struct kmem_depot_ws		ws_empty;
+	/* Snapshot of the last completed interval, for diagnostics */
+	struct kmem_depot_ws		last_ws_not_empty;
+	struct kmem_depot_ws		last_ws_empty;
 };
 
 struct kmem_slab;
@@ -117,6 +133,10 @@ struct kmem_cache {
 	void *priv;
 	unsigned long nr_cur_alloc;
 	unsigned long nr_direct_allocs_ever;
+	/* Reclaim stats, protected by the arenas_and_slabs_lock */
+	unsigned long nr_reclaimed_mags;
+	unsigned long nr_reclaimed_rounds;
+	size_t amt_reclaimed;
 	struct hash_helper hh;
 	struct kmem_bufctl_list *alloc_hash;
 	struct kmem_bufctl_list static_hash[HASH_INIT_SZ];
@@ -126,6 +146,17 @@ struct kmem_cache {
 
 extern struct kmem_cache_tailq all_kmem_caches;
 
+/* Magazine resize tunables: grow when there are more than resize_threshold
+ * contended depot locks within resize_timeout_ns. */
+extern uint64_t resize_timeout_ns;
+extern unsigned int resize_threshold;
+
+/* Reclaim tunables and stats.  A period of 0 disables the periodic reclaim;
+ * you can still kick it manually. */
+extern uint64_t kmc_reclaim_period_ms;
+extern unsigned long kmc_nr_reclaim_passes;
+extern size_t kmc_amt_reclaimed;
+
 /* Cache management */
 struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size,
                                      int align, int flags,
@@ -139,8 +170,13 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags);
 void kmem_cache_free(struct kmem_cache *cp, void *buf);
 /* Back end: internal functions */
 void kmem_cache_init(void);
-void kmem_cache_reap(struct kmem_cache *cp);
+size_t kmem_cache_reap(struct kmem_cache *cp);
+size_t kmem_cache_reclaim(struct kmem_cache *kc);
+size_t kmem_reclaim_all(void);
+void kmem_reclaim_kick(void);
+void kmem_reclaim_init(void);
 unsigned int kmc_nr_pcpu_caches(void);
+void kmem_cache_set_magsize_max(struct kmem_cache *kc, unsigned int max);
 /* Low-level interface for initializing a cache. */
 void __kmem_cache_create(struct kmem_cache *kc, const char *name,
                          size_t obj_size, int align, int flags,
@@ -69,6 +69,15 @@
  *   will have their own stats, and it'd be a minor pain to sync up with them
  *   all the time.  Also, the important stat is when the base arena starts to
  *   run out of memory, and base arenas don't have qcaches, so it's moot.
+ * - What are the fast lists?  Segments above qcache_max that are freed whole
+ *   and have a power-of-two size (in quanta, up to quantum << 7) are parked on
+ *   a small per-size list instead of going back to the free segs.  The next
+ *   instant-fit alloc of that size pops one off without taking the arena lock.
+ *   Each list has its own lock, so different sizes don't serialize on each
+ *   other, and the critical section is a couple of instructions.  Like the
+ *   qcaches, parked segments are still 'allocated' as far as the segment stats
+ *   go.  We drain the lists before importing more resources, so they never
+ *   cause an allocation failure.
  */
 
 #include <arena.h>
@@ -78,6 +87,7 @@
 #include <hash.h>
 #include <slab.h>
 #include <kthread.h>
+#include <time.h>
 
 struct arena_tailq all_arenas = TAILQ_HEAD_INITIALIZER(all_arenas);
 qlock_t arenas_and_slabs_lock = QLOCK_INITIALIZER(arenas_and_slabs_lock);
@@ -94,7 +104,6 @@ static void *__xalloc_nextfit(struct arena *arena, size_t size, size_t align,
 static void __try_hash_resize(struct arena *arena, int flags,
                               void **to_free_addr, size_t *to_free_sz);
 static void __arena_asserter(struct arena *arena);
-void print_arena_stats(struct arena *arena, bool verbose);
 
 /* For NUMA situations, where there are multiple base arenas, we'll need a way
  * to find *some* base arena.  Ideally, it'll be in the same NUMA domain as
@@ -107,6 +116,28 @@ static struct arena *find_my_base(struct arena *arena)
 	return base_arena;
 }
 
+/* Lock helpers: these track contention and how long we hold the lock.  The
+ * stats are protected by the lock itself. */
+static void __arena_lock(struct arena *arena)
+{
+	bool contended = FALSE;
+
+	if (!spin_trylock_irqsave(&arena->lock)) {
+		spin_lock_irqsave(&arena->lock);
+		contended = TRUE;
+	}
+	arena->nr_lock_acquires++;
+	if (contended)
+		arena->nr_lock_contended++;
+	arena->lock_start_tsc = read_tsc();
+}
+
+static void __arena_unlock(struct arena *arena)
+{
+	arena->lock_hold_ticks += read_tsc() - arena->lock_start_tsc;
+	spin_unlock_irqsave(&arena->lock);
+}
+
 static void setup_qcaches(struct arena *arena, size_t quantum,
                           size_t qcache_max)
 {
@@ -153,6 +184,24 @@ static void arena_init(struct arena *arena, char *name, size_t quantum,
 	arena->amt_total_segs = 0;
 	arena->amt_alloc_segs = 0;
 	arena->nr_allocs_ever = 0;
+	arena->nr_lock_acquires = 0;
+	arena->nr_lock_contended = 0;
+	arena->lock_hold_ticks = 0;
+	arena->nr_btag_stalls = 0;
+	arena->nr_bestfit = 0;
+	arena->nr_instantfit = 0;
+	arena->nr_nextfit = 0;
+	arena->nr_xalloc = 0;
+	/* Fast lists need a power-of-two quantum so that 'size is a power of two'
+	 * and 'size is a power-of-two number of quanta' agree. */
+	arena->has_fast_lists = IS_PWR2(quantum);
+	for (int i = 0; i < ARENA_NR_FAST_LISTS; i++) {
+		spinlock_init_irqsave(&arena->fast_lists[i].lock);
+		arena->fast_lists[i].nr_segs = 0;
+		arena->fast_lists[i].nr_hits = 0;
+		arena->fast_lists[i].nr_misses = 0;
+		arena->fast_lists[i].nr_frees = 0;
+	}
 
 	arena->all_segs = RB_ROOT;
 	BSD_LIST_INIT(&arena->unused_btags);
@@ -205,6 +254,7 @@ void arena_destroy(struct arena *arena)
 {
 	struct btag *bt_i, *temp;
 
+	arena_drain_fast_lists(arena);
 	qlock(&arenas_and_slabs_lock);
 	TAILQ_REMOVE(&all_arenas, arena, next);
 	qunlock(&arenas_and_slabs_lock);
@@ -318,24 +368,24 @@ static void __try_hash_resize(struct arena *arena, int flags,
 	 * excessive hash resizers as well as base arena deadlocks (base_alloc must
 	 * not call into base_alloc infinitely) */
 	hash_set_load_limit(&arena->hh, SIZE_MAX);
-	spin_unlock_irqsave(&arena->lock);
+	__arena_unlock(arena);
 	new_tbl_sz = new_tbl_nr_lists * sizeof(struct btag_list);
 	/* Regardless of the caller's style, we'll try and be quick with INSTANT. */
 	flags &= ~ARENA_ALLOC_STYLES;
 	flags |= ARENA_INSTANTFIT;
 	new_tbl = base_zalloc(arena, new_tbl_sz, flags);
-	spin_lock_irqsave(&arena->lock);
+	__arena_lock(arena);
 	if (!new_tbl) {
 		/* Need to reset so future callers will try to grow. */
 		hash_reset_load_limit(&arena->hh);
-		spin_unlock_irqsave(&arena->lock);
+		__arena_unlock(arena);
 		return;
 	}
 	/* After relocking, we need to re-verify that we want to go ahead.  It's
 	 * possible that another thread resized the hash already, which we can
 	 * detect because our alloc size is wrong. */
 	if (new_tbl_nr_lists != hash_next_nr_lists(&arena->hh)) {
-		spin_unlock_irqsave(&arena->lock);
+		__arena_unlock(arena);
 		base_free(arena, new_tbl, new_tbl_sz);
 		return;
 	}
@@ -410,10 +460,10 @@ static struct btag *__add_more_btags(struct arena *arena, int mem_flags)
 		}
 	} else {
 		/* Here's where we unlock and relock around a blocking call */
-		spin_unlock_irqsave(&arena->lock);
+		__arena_unlock(arena);
 		tags = arena_alloc(find_my_base(arena), PGSIZE,
 		                   mem_flags | ARENA_INSTANTFIT);
-		spin_lock_irqsave(&arena->lock);
+		__arena_lock(arena);
 		if (!tags)
 			return 0;
 	}
@@ -436,6 +486,7 @@ static bool __get_enough_btags(struct arena *arena, size_t nr_needed,
 {
 	if (__has_enough_btags(arena, nr_needed))
 		return TRUE;
+	arena->nr_btag_stalls++;
 	/* This will unlock and relock, and maybe block. */
 	if (!__add_more_btags(arena, mem_flags)) {
 		/* This is the only failure scenario */
@@ -582,20 +633,24 @@ static void *alloc_from_arena(struct arena *arena, size_t size, int flags)
 	void *to_free_addr = 0;
 	size_t to_free_sz = 0;
 
-	spin_lock_irqsave(&arena->lock);
+	__arena_lock(arena);
 	if (!__get_enough_btags(arena, 1, flags & MEM_FLAGS)) {
-		spin_unlock_irqsave(&arena->lock);
+		__arena_unlock(arena);
 		return NULL;
 	}
-	if (flags & ARENA_BESTFIT)
+	if (flags & ARENA_BESTFIT) {
+		arena->nr_bestfit++;
 		ret = __alloc_bestfit(arena, size);
-	else if (flags & ARENA_NEXTFIT)
+	} else if (flags & ARENA_NEXTFIT) {
+		arena->nr_nextfit++;
 		ret = __alloc_nextfit(arena, size);
-	else
+	} else {
+		arena->nr_instantfit++;
 		ret = __alloc_instantfit(arena, size);
+	}
 	/* Careful, this will unlock and relock.  It's OK right before an unlock. */
 	__try_hash_resize(arena, flags, &to_free_addr, &to_free_sz);
-	spin_unlock_irqsave(&arena->lock);
+	__arena_unlock(arena);
 	if (to_free_addr)
 		base_free(arena, to_free_addr, to_free_sz);
 	return ret;
@@ -627,10 +682,10 @@ static void *__arena_add(struct arena *arena, void *base, size_t size,
 	 * mess with us in other ways, such as adding overlapping spans. */
 	assert_quantum_alignment(arena, base, size);
 	assert(base < base + size);
-	spin_lock_irqsave(&arena->lock);
+	__arena_lock(arena);
 	/* Make sure there are two, bt and span. */
 	if (!__get_enough_btags(arena, 2, flags & MEM_FLAGS)) {
-		spin_unlock_irqsave(&arena->lock);
+		__arena_unlock(arena);
 		return NULL;
 	}
 	bt = __get_btag(arena);
@@ -647,7 +702,7 @@ static void *__arena_add(struct arena *arena, void *base, size_t size,
 	arena->amt_total_segs += size;
 	__track_free_seg(arena, bt);
 	__insert_btag(&arena->all_segs, bt);
-	spin_unlock_irqsave(&arena->lock);
+	__arena_unlock(arena);
 	return base;
 }
 
@@ -698,6 +753,62 @@ static struct kmem_cache *size_to_qcache(struct arena *arena, size_t size)
 	return &arena->qcaches[(size / arena->quantum) - 1];
 }
 
+/* Returns the fast list for segments of @size, or NULL if there isn't one.
+ * Callers already handled sizes that go to the qcaches. */
+static struct arena_fast_list *size_to_fast_list(struct arena *arena,
+                                                 size_t size)
+{
+	int idx;
+
+	if (!arena->has_fast_lists || !IS_PWR2(size))
+		return NULL;
+	idx = LOG2_DOWN(size) - LOG2_DOWN(arena->quantum);
+	if (idx >= ARENA_NR_FAST_LISTS)
+		return NULL;
+	return &arena->fast_lists[idx];
+}
+
+static void *fast_list_alloc(struct arena *arena, size_t size)
+{
+	struct arena_fast_list *fl = size_to_fast_list(arena, size);
+	void *ret = NULL;
+
+	if (!fl)
+		return NULL;
+	/* Racy peek, so that misses don't bounce the list's lock around. */
+	if (!fl->nr_segs) {
+		fl->nr_misses++;
+		return NULL;
+	}
+	spin_lock_irqsave(&fl->lock);
+	if (fl->nr_segs) {
+		ret = fl->segs[--fl->nr_segs];
+		fl->nr_hits++;
+	} else {
+		fl->nr_misses++;
+	}
+	spin_unlock_irqsave(&fl->lock);
+	return ret;
+}
+
+/* Returns TRUE if we parked @addr on a fast list. */
+static bool fast_list_free(struct arena *arena, void *addr, size_t size)
+{
+	struct arena_fast_list *fl = size_to_fast_list(arena, size);
+	bool ret = FALSE;
+
+	if (!fl)
+		return FALSE;
+	spin_lock_irqsave(&fl->lock);
+	if (fl->nr_segs < ARENA_FAST_DEPTH) {
+		fl->segs[fl->nr_segs++] = addr;
+		fl->nr_frees++;
+		ret = TRUE;
+	}
+	spin_unlock_irqsave(&fl->lock);
+	return ret;
+}
+
 void *arena_alloc(struct arena *arena, size_t size, int flags)
 {
 	void *ret;
@@ -713,6 +824,11 @@ void *arena_alloc(struct arena *arena, size_t size, int flags)
 			      arena->name);
 		return kmem_cache_alloc(size_to_qcache(arena, size), flags);
 	}
+	if (!(flags & (ARENA_BESTFIT | ARENA_NEXTFIT))) {
+		ret = fast_list_alloc(arena, size);
+		if (ret)
+			return ret;
+	}
 	while (1) {
 		ret = alloc_from_arena(arena, size, flags);
 		if (ret)
@@ -733,6 +849,9 @@ void *arena_alloc(struct arena *arena, size_t size, int flags)
 		 * the BESTFIT list is likely ours, downgrading makes sense. */
 		flags &= ~ARENA_ALLOC_STYLES;
 		flags |= ARENA_BESTFIT;
+		/* Parked segments might be enough; try them before importing. */
+		if (arena_drain_fast_lists(arena))
+			continue;
 		if (!get_more_resources(arena, size, flags))
 			return NULL;
 	}
@@ -922,12 +1041,13 @@ static void *xalloc_from_arena(struct arena *arena, size_t size,
 	void *to_free_addr = 0;
 	size_t to_free_sz = 0;
 
-	spin_lock_irqsave(&arena->lock);
+	__arena_lock(arena);
 	/* Need two, since we might split a BT into 3 BTs. */
 	if (!__get_enough_btags(arena, 2, flags & MEM_FLAGS)) {
-		spin_unlock_irqsave(&arena->lock);
+		__arena_unlock(arena);
 		return NULL;
 	}
+	arena->nr_xalloc++;
 	if (minaddr || maxaddr) {
 		ret = __xalloc_min_max(arena, size, align, phase, nocross,
 		                       (uintptr_t)minaddr, (uintptr_t)maxaddr);
@@ -944,7 +1064,7 @@ static void *xalloc_from_arena(struct arena *arena, size_t size,
 	}
 	/* Careful, this will unlock and relock.  It's OK right before an unlock. */
 	__try_hash_resize(arena, flags, &to_free_addr, &to_free_sz);
-	spin_unlock_irqsave(&arena->lock);
+	__arena_unlock(arena);
 	if (to_free_addr)
 		base_free(arena, to_free_addr, to_free_sz);
 	return ret;
@@ -1017,6 +1137,11 @@ void *arena_xalloc(struct arena *arena, size_t size, size_t align, size_t phase,
 		if (req_size < size)
 			panic("Arena %s, size %p + align %p + phase %p overflow",
 			      arena->name, size, align, phase);
+		if (arena_drain_fast_lists(arena)) {
+			flags &= ~ARENA_ALLOC_STYLES;
+			flags |= ARENA_BESTFIT;
+			continue;
+		}
 		if (!get_more_resources(arena, req_size, flags))
 			return NULL;
 		/* Our source may have given us a segment that is on the BESTFIT list,
@@ -1097,7 +1222,7 @@ static void free_from_arena(struct arena *arena, void *addr, size_t size)
 	void *to_free_addr = 0;
 	size_t to_free_sz = 0;
 
-	spin_lock_irqsave(&arena->lock);
+	__arena_lock(arena);
 	bt = __untrack_alloc_seg(arena, (uintptr_t)addr);
 	if (!bt)
 		panic("Free of unallocated addr %p from arena %s", addr, arena->name);
@@ -1108,7 +1233,7 @@ static void free_from_arena(struct arena *arena, void *addr, size_t size)
 	__track_free_seg(arena, bt);
 	__coalesce_free_seg(arena, bt, &to_free_addr, &to_free_sz);
 	arena->amt_total_segs -= to_free_sz;
-	spin_unlock_irqsave(&arena->lock);
+	__arena_unlock(arena);
 	if (to_free_addr)
 		arena->ffunc(arena->source, to_free_addr, to_free_sz);
 }
@@ -1118,6 +1243,8 @@ void arena_free(struct arena *arena, void *addr, size_t size)
 	size = ROUNDUP(size, arena->quantum);
 	if (size <= arena->qcache_max)
 		return kmem_cache_free(size_to_qcache(arena, size), addr);
+	if (fast_list_free(arena, addr, size))
+		return;
 	free_from_arena(arena, addr, size);
 }
 
@@ -1127,6 +1254,31 @@ void arena_xfree(struct arena *arena, void *addr, size_t size)
 	free_from_arena(arena, addr, size);
 }
 
+size_t arena_drain_fast_lists(struct arena *arena)
+{
+	struct arena_fast_list *fl;
+	void *segs[ARENA_FAST_DEPTH];
+	unsigned int nr_segs;
+	size_t seg_size;
+	size_t amt = 0;
+
+	for (int i = 0; i < ARENA_NR_FAST_LISTS; i++) {
+		fl = &arena->fast_lists[i];
+		if (!fl->nr_segs)
+			continue;
+		spin_lock_irqsave(&fl->lock);
+		nr_segs = fl->nr_segs;
+		memcpy(segs, fl->segs, nr_segs * sizeof(void*));
+		fl->nr_segs = 0;
+		spin_unlock_irqsave(&fl->lock);
+		seg_size = arena->quantum << i;
+		for (int j = 0; j < nr_segs; j++)
+			free_from_arena(arena, segs[j], seg_size);
+		amt += nr_segs * seg_size;
+	}
+	return amt;
+}
+
 /* Low-level arena builder.  Pass in a page address, and this will build an
  * arena in that memory.
  *
@@ -1183,6 +1335,33 @@ static void __arena_asserter(struct arena *arena)
 	assert(arena->hh.nr_items == nr_allocs);
 }
 
+/* Dumps the lock, btag, and fit policy stats.  Racy, but they are just stats. */
+void print_arena_stats(struct arena *arena, bool verbose)
+{
+	struct arena_fast_list *fl;
+	size_t nr_acq = MAX(arena->nr_lock_acquires, 1);
+
+	printk("Arena %s (%p), quantum %d, qcache_max %d\n", arena->name, arena,
+	       arena->quantum, arena->qcache_max);
+	printk("\tAmt total segs %llu, amt alloc segs %llu\n",
+	       arena->amt_total_segs, arena->amt_alloc_segs);
+	printk("\tLock: %llu acquires, %llu contended, %llu nsec avg hold\n",
+	       arena->nr_lock_acquires, arena->nr_lock_contended,
+	       tsc2nsec(arena->lock_hold_ticks) / nr_acq);
+	printk("\tBtag stalls: %llu\n", arena->nr_btag_stalls);
+	printk("\tAllocs: %llu instantfit, %llu bestfit, %llu nextfit, %llu xalloc\n",
+	       arena->nr_instantfit, arena->nr_bestfit, arena->nr_nextfit,
+	       arena->nr_xalloc);
+	if (!verbose || !arena->has_fast_lists)
+		return;
+	for (int i = 0; i < ARENA_NR_FAST_LISTS; i++) {
+		fl = &arena->fast_lists[i];
+		printk("\tFast list %p: %d segs, %llu hits, %llu misses, %llu frees\n",
+		       arena->quantum << i, fl->nr_segs, fl->nr_hits, fl->nr_misses,
+		       fl->nr_frees);
+	}
+}
+
 size_t arena_amt_free(struct arena *arena)
 {
 	return arena->amt_total_segs - arena->amt_alloc_segs;
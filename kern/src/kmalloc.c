@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <slab.h>
 #include <assert.h>
+#include <percpu.h>
 
 #define kmallocdebug(args...)  //printk(args)
 
@@ -21,24 +22,88 @@ static page_list_t pages_list;
 
 struct kmem_cache *kmalloc_caches[NUM_KMALLOC_CACHES];
 
+/* Maps (ksize - 1) / KMALLOC_ALIGNMENT to the smallest class that fits ksize,
+ * so picking a cache is a single lookup. */
+#define KMALLOC_NR_LOOKUPS (KMALLOC_LARGEST / KMALLOC_ALIGNMENT)
+static uint8_t kmalloc_size_to_class[KMALLOC_NR_LOOKUPS];
+
+/* These are racy with IRQs on the same core, but they are just stats. */
+static DEFINE_PERCPU(struct kmalloc_class_stats[NUM_KMALLOC_CACHES + 1],
+                     kmalloc_stats);
+
 static void __kfree_release(struct kref *kref);
 
+/* percpu_init() copies core 0's counts to every core; start over instead. */
+DEFINE_PERCPU_INIT(kmalloc_stats_init);
+static void kmalloc_stats_init(void)
+{
+	for (int i = 0; i < num_cores; i++)
+		memset(_PERCPU_VARPTR(kmalloc_stats, i), 0,
+		       sizeof(kmalloc_stats));
+}
+
+static size_t kmalloc_class_size(int class_id)
+{
+	size_t pwr2, step;
+
+	if (!class_id)
+		return KMALLOC_SMALLEST;
+	class_id--;
+	pwr2 = KMALLOC_SMALLEST << (class_id / KMALLOC_CLASSES_PER_PWR2);
+	step = pwr2 / KMALLOC_CLASSES_PER_PWR2;
+	return pwr2 + step * (class_id % KMALLOC_CLASSES_PER_PWR2 + 1);
+}
+
+static void kmalloc_account(int class_id, size_t size, size_t amt_alloc)
+{
+	struct kmalloc_class_stats *stats = &PERCPU_VAR(kmalloc_stats)[class_id];
+
+	stats->nr_allocs++;
+	stats->amt_requested += size;
+	stats->amt_alloc += amt_alloc;
+}
+
+/* Sums up the stats for @class_id across all cores. */
+void kmalloc_get_class_stats(int class_id, struct kmalloc_class_stats *sum)
+{
+	struct kmalloc_class_stats *stats;
+
+	memset(sum, 0, sizeof(struct kmalloc_class_stats));
+	for (int i = 0; i < num_cores; i++) {
+		stats = &_PERCPU_VAR(kmalloc_stats, i)[class_id];
+		sum->nr_allocs += stats->nr_allocs;
+		sum->amt_requested += stats->amt_requested;
+		sum->amt_alloc += stats->amt_alloc;
+	}
+}
+
 void kmalloc_init(void)
 {
 	char kc_name[KMC_NAME_SZ];
+	size_t ksize;
+	int class_id = 0;
 
 	/* we want at least a 16 byte alignment of the tag so that the bufs kmalloc
 	 * returns are 16 byte aligned.  we used to check the actual size == 16,
 	 * since we adjusted the KMALLOC_SMALLEST based on that. */
 	static_assert(ALIGNED(sizeof(struct kmalloc_tag), 16));
+	/* the smallest step between classes must keep the alignment */
+	static_assert(ALIGNED(KMALLOC_SMALLEST / KMALLOC_CLASSES_PER_PWR2,
+	                      KMALLOC_ALIGNMENT));
+	static_assert(NUM_KMALLOC_CACHES <= UINT8_MAX);
 	/* build caches of common sizes.  this size will later include the tag and
 	 * the actual returned buffer. */
-	size_t ksize = KMALLOC_SMALLEST;
 	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
+		ksize = kmalloc_class_size(i);
 		snprintf(kc_name, KMC_NAME_SZ, "kmalloc_%d", ksize);
 		kmalloc_caches[i] = kmem_cache_create(kc_name, ksize, KMALLOC_ALIGNMENT,
 		                                      0, NULL, 0, 0, NULL);
-		ksize <<= 1;
+	}
+	for (int i = 0; i < KMALLOC_NR_LOOKUPS; i++) {
+		ksize = (i + 1) * KMALLOC_ALIGNMENT;
+		while (kmalloc_caches[class_id]->obj_size < ksize)
+			class_id++;
+		kmalloc_size_to_class[i] = class_id;
 	}
 }
 
@@ -48,13 +113,9 @@ void *kmalloc(size_t size, int flags)
 	size_t ksize = size + sizeof(struct kmalloc_tag);
 	void *buf;
 	int cache_id;
-	// determine cache to pull from
-	if (ksize <= KMALLOC_SMALLEST)
-		cache_id = 0;
-	else
-		cache_id = LOG2_UP(ksize) - LOG2_UP(KMALLOC_SMALLEST);
+
 	// if we don't have a cache to handle it, alloc cont pages
-	if (cache_id >= NUM_KMALLOC_CACHES) {
+	if (ksize > KMALLOC_LARGEST) {
 		/* The arena allocator will round up too, but we want to know in advance
 		 * so that krealloc can avoid extra allocations. */
 		size_t amt_alloc = ROUNDUP(size + sizeof(struct kmalloc_tag), PGSIZE);
@@ -68,9 +129,11 @@ void *kmalloc(size_t size, int flags)
 		tag->amt_alloc = amt_alloc;
 		tag->canary = KMALLOC_CANARY;
 		kref_init(&tag->kref, __kfree_release, 1);
+		kmalloc_account(NUM_KMALLOC_CACHES, size, amt_alloc);
 		return buf + sizeof(struct kmalloc_tag);
 	}
 	// else, alloc from the appropriate cache
+	cache_id = kmalloc_size_to_class[(ksize - 1) / KMALLOC_ALIGNMENT];
 	buf = kmem_cache_alloc(kmalloc_caches[cache_id], flags);
 	if (!buf)
 		panic("Kmalloc failed!  Handle me!");
@@ -80,6 +143,7 @@ void *kmalloc(size_t size, int flags)
 	tag->my_cache = kmalloc_caches[cache_id];
 	tag->canary = KMALLOC_CANARY;
 	kref_init(&tag->kref, __kfree_release, 1);
+	kmalloc_account(cache_id, size, tag->my_cache->obj_size);
 	return buf + sizeof(struct kmalloc_tag);
 }
 
@@ -1,6 +1,8 @@
 #include <net/ip.h>
 #include <ktest.h>
 #include <linker_func.h>
+#include <kthread.h>
+#include <rcu.h>
 
 KTEST_SUITE("NET")
 
@@ -80,10 +82,225 @@ bool test_ptclbsum_bench(void)
 	return true;
 }
 
+#define IPHT_BENCH_NR_CONVS	50000
+#define IPHT_BENCH_PORT		80
+
+static void ipht_bench_wait_resize(struct Ipht *ht)
+{
+	while (atomic_read(&ht->resizing))
+		kthread_usleep(1000);
+}
+
+/* Fills an Ipht with a listener plus IPHT_BENCH_NR_CONVS connected convs, then
+ * times lookups of every conv and of unknown 4-tuples that land on the
+ * listener. */
+bool test_ipht_lookup_bench(void)
+{
+	struct Ipht *ht = kzmalloc(sizeof(struct Ipht), MEM_WAIT);
+	struct conv *convs, *listener, *c;
+	uint8_t laddr[IPaddrlen], raddr[IPaddrlen];
+	uint64_t t0, hit_ns, miss_ns;
+	bool ret = false;
+
+	convs = kzmalloc((IPHT_BENCH_NR_CONVS + 1) * sizeof(struct conv),
+	                 MEM_WAIT);
+	iphtinit(ht);
+	hnputl(laddr + IPaddrlen - 4, 0x0a000001);
+	listener = &convs[IPHT_BENCH_NR_CONVS];
+	listener->lport = IPHT_BENCH_PORT;
+	iphtadd(ht, listener);
+	for (int i = 0; i < IPHT_BENCH_NR_CONVS; i++) {
+		c = &convs[i];
+		c->x = i;
+		memcpy(c->laddr, laddr, IPaddrlen);
+		hnputl(c->raddr + IPaddrlen - 4, 0x0b000000 + i / 1000);
+		c->lport = IPHT_BENCH_PORT;
+		c->rport = 1024 + i % 1000;
+		iphtadd(ht, c);
+		if (i % 1000 == 999)
+			ipht_bench_wait_resize(ht);
+	}
+	ipht_bench_wait_resize(ht);
+
+	t0 = read_tsc();
+	for (int i = 0; i < IPHT_BENCH_NR_CONVS; i++) {
+		c = &convs[i];
+		if (iphtlook(ht, c->raddr, c->rport, c->laddr, c->lport) != c) {
+			printk("Lookup of conv %d failed\n", i);
+			goto out;
+		}
+	}
+	hit_ns = tsc2nsec(read_tsc() - t0);
+
+	memcpy(raddr, laddr, IPaddrlen);
+	hnputl(raddr + IPaddrlen - 4, 0x0c000000);
+	t0 = read_tsc();
+	for (int i = 0; i < IPHT_BENCH_NR_CONVS; i++) {
+		if (iphtlook(ht, raddr, i, laddr, IPHT_BENCH_PORT) != listener) {
+			printk("Listener lookup %d failed\n", i);
+			goto out;
+		}
+	}
+	miss_ns = tsc2nsec(read_tsc() - t0);
+
+	printk("Ipht: %d convs, %u buckets\n", atomic_read(&ht->nr_items),
+	       ht->tab->nr_buckets);
+	printk("\tConnected lookups: %llu nsec each\n",
+	       hit_ns / IPHT_BENCH_NR_CONVS);
+	printk("\tListener lookups : %llu nsec each\n",
+	       miss_ns / IPHT_BENCH_NR_CONVS);
+	if (ht->tab->nr_buckets < IPHT_BENCH_NR_CONVS / 2) {
+		printk("Ipht did not grow with the convs\n");
+		goto out;
+	}
+	ret = true;
+out:
+	for (int i = 0; i <= IPHT_BENCH_NR_CONVS; i++)
+		iphtrem(ht, &convs[i]);
+	if (atomic_read(&ht->nr_items)) {
+		printk("Ipht has %d items after removing all convs\n",
+		       atomic_read(&ht->nr_items));
+		ret = false;
+	}
+	rcu_barrier();
+	kfree(ht->tab);
+	kfree(ht);
+	kfree(convs);
+	return ret;
+}
+
+#define IPTRIE_BENCH_NR_AGGS		400
+#define IPTRIE_BENCH_NR_PREFIXES	100000
+#define IPTRIE_BENCH_NR_LOOKUPS		1000000
+
+/* Prefixes look like a routing table: each aggregate (a /16 or /32) has a
+ * couple hundred more specifics (/24 or /48) in it. */
+static int iptrie_bench_key(uint8_t *key, int keylen, int agg, int sub,
+                            uint32_t host)
+{
+	memset(key, 0, keylen);
+	if (keylen == IPv4addrlen) {
+		key[0] = 1 + agg % 223;
+		key[1] = agg / 223 * 41;
+		key[2] = sub;
+		key[3] = host;
+		return sub < 0 ? 16 : 24;
+	}
+	hnputs(key, 0x2001);
+	hnputs(key + 2, agg);
+	hnputs(key + 4, sub);
+	hnputl(key + 12, host);
+	return sub < 0 ? 32 : 48;
+}
+
+static bool iptrie_bench_one(int keylen)
+{
+	struct iptrie trie, *t = &trie;
+	struct route *routes, *dflt, *r;
+	uint8_t key[IPaddrlen];
+	int nr = IPTRIE_BENCH_NR_AGGS + IPTRIE_BENCH_NR_PREFIXES;
+	int per_agg = IPTRIE_BENCH_NR_PREFIXES / IPTRIE_BENCH_NR_AGGS;
+	int plen, i, j;
+	uint32_t x = 12345;
+	uint64_t t0, ns;
+	bool ret = false;
+
+	routes = kzmalloc((nr + 2) * sizeof(struct route), MEM_WAIT);
+	dflt = &routes[nr];
+	iptrie_init(t, keylen);
+	iptrie_add(t, key, 0, dflt);
+	for (i = 0; i < IPTRIE_BENCH_NR_AGGS; i++) {
+		plen = iptrie_bench_key(key, keylen, i, -1, 0);
+		iptrie_add(t, key, plen, &routes[i]);
+	}
+	for (j = 0; j < IPTRIE_BENCH_NR_PREFIXES; j++) {
+		plen = iptrie_bench_key(key, keylen, j % IPTRIE_BENCH_NR_AGGS,
+		                        j / IPTRIE_BENCH_NR_AGGS, 0);
+		iptrie_add(t, key, plen, &routes[IPTRIE_BENCH_NR_AGGS + j]);
+	}
+
+	for (j = 0; j < IPTRIE_BENCH_NR_PREFIXES; j++) {
+		iptrie_bench_key(key, keylen, j % IPTRIE_BENCH_NR_AGGS,
+		                 j / IPTRIE_BENCH_NR_AGGS, j);
+		if (iptrie_lookup(t, key) != &routes[IPTRIE_BENCH_NR_AGGS + j]) {
+			printk("Lookup of prefix %d failed\n", j);
+			goto out;
+		}
+	}
+	iptrie_bench_key(key, keylen, 0, per_agg, 0);
+	if (iptrie_lookup(t, key) != &routes[0]) {
+		printk("Lookup in an aggregate failed\n");
+		goto out;
+	}
+	iptrie_bench_key(key, keylen, IPTRIE_BENCH_NR_AGGS, 0, 0);
+	if (iptrie_lookup(t, key) != dflt) {
+		printk("Lookup of the default route failed\n");
+		goto out;
+	}
+
+	/* A shorter prefix at the same level takes over when one goes away. */
+	plen = iptrie_bench_key(key, keylen, 0, 0, 0) - 4;
+	r = &routes[nr + 1];
+	iptrie_add(t, key, plen, r);
+	iptrie_del(t, key, plen + 4, r, plen);
+	if (iptrie_lookup(t, key) != r) {
+		printk("Lookup after removing a more specific failed\n");
+		goto out;
+	}
+	iptrie_del(t, key, plen, NULL, 0);
+	if (iptrie_lookup(t, key) != &routes[0]) {
+		printk("Lookup after removing both failed\n");
+		goto out;
+	}
+
+	t0 = read_tsc();
+	for (i = 0; i < IPTRIE_BENCH_NR_LOOKUPS; i++) {
+		x = x * 1103515245 + 12345;
+		j = (x >> 8) % IPTRIE_BENCH_NR_PREFIXES;
+		iptrie_bench_key(key, keylen, j % IPTRIE_BENCH_NR_AGGS,
+		                 j / IPTRIE_BENCH_NR_AGGS, x);
+		if (iptrie_lookup(t, key) == NULL)
+			goto out;
+	}
+	ns = tsc2nsec(read_tsc() - t0);
+	printk("IPv%d trie: %d prefixes, %llu lookups/sec, %llu nsec each\n",
+	       keylen == IPv4addrlen ? 4 : 6, nr,
+	       IPTRIE_BENCH_NR_LOOKUPS * 1000000000ULL / MAX(ns, 1),
+	       ns / IPTRIE_BENCH_NR_LOOKUPS);
+	ret = true;
+out:
+	for (j = 0; j < IPTRIE_BENCH_NR_PREFIXES; j++) {
+		plen = iptrie_bench_key(key, keylen, j % IPTRIE_BENCH_NR_AGGS,
+		                        j / IPTRIE_BENCH_NR_AGGS, 0);
+		iptrie_del(t, key, plen, NULL, 0);
+	}
+	for (i = 0; i < IPTRIE_BENCH_NR_AGGS; i++) {
+		plen = iptrie_bench_key(key, keylen, i, -1, 0);
+		iptrie_del(t, key, plen, NULL, 0);
+	}
+	iptrie_del(t, key, 0, NULL, 0);
+	if (!iptrie_empty(t) || iptrie_lookup(t, key)) {
+		printk("Trie not empty after removing all prefixes\n");
+		return false;
+	}
+	rcu_barrier();
+	iptrie_destroy(t);
+	kfree(routes);
+	return ret;
+}
+
+/* Fills v4 and v6 tries with 100k prefixes each and times lookups. */
+bool test_iptrie_lookup_bench(void)
+{
+	return iptrie_bench_one(IPv4addrlen) && iptrie_bench_one(IPaddrlen);
+}
+
 static struct ktest ktests[] = {
 	KTEST_REG(ptclbsum,				CONFIG_TEST_ptclbsum),
 	KTEST_REG(simplesum_bench,		CONFIG_TEST_simplesum_bench),
 	KTEST_REG(ptclbsum_bench,		CONFIG_TEST_ptclbsum_bench),
+	KTEST_REG(ipht_lookup_bench,	CONFIG_TEST_ipht_lookup_bench),
+	KTEST_REG(iptrie_lookup_bench,	CONFIG_TEST_iptrie_lookup_bench),
 };
 
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
@@ -2014,6 +2014,162 @@ static bool test_percpu_increment(void)
 	return true;
 }
 
+#define PAGE_BENCH_ITERS		10000
+#define PAGE_BENCH_BATCH		8
+
+struct page_bench {
+	atomic_t					nr_ready;
+	atomic_t					nr_done;
+	int							nr_cores;
+	bool						failed;
+	uint64_t					*ticks;
+};
+
+static void __page_bench(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct page_bench *pb = (struct page_bench*)a0;
+	void *pages[PAGE_BENCH_BATCH];
+	uint64_t start;
+
+	/* Start together, so the cores actually contend. */
+	atomic_inc(&pb->nr_ready);
+	while (atomic_read(&pb->nr_ready) < pb->nr_cores)
+		cpu_relax();
+	start = read_tsc();
+	for (int i = 0; i < PAGE_BENCH_ITERS; i++) {
+		for (int j = 0; j < PAGE_BENCH_BATCH; j++) {
+			pages[j] = kpage_alloc_addr();
+			if (!pages[j])
+				pb->failed = true;
+		}
+		for (int j = 0; j < PAGE_BENCH_BATCH; j++) {
+			if (pages[j])
+				kpages_free(pages[j], PGSIZE);
+		}
+	}
+	pb->ticks[core_id()] = read_tsc() - start;
+	atomic_inc(&pb->nr_done);
+}
+
+/* Measures single-page alloc/free throughput on 1, 2, 4, ... cores. */
+static bool test_page_alloc_scaling(void)
+{
+	struct page_bench pb;
+	uint64_t nr_ops, tot_nsec, max_nsec, nsec;
+	int coreid;
+
+	pb.ticks = kzmalloc(sizeof(uint64_t) * num_cores, MEM_WAIT);
+	for (int nr = 1; ; nr = MIN(nr * 2, num_cores)) {
+		atomic_set(&pb.nr_ready, 0);
+		atomic_set(&pb.nr_done, 0);
+		pb.nr_cores = nr;
+		pb.failed = false;
+		/* Our core, if it participates, must be last.  Its handler runs
+		 * immediately and spins until everyone else has started. */
+		for (int i = 1; i <= nr; i++) {
+			coreid = (core_id() + i) % num_cores;
+			send_kernel_message(coreid, __page_bench, (long)&pb, 0, 0,
+			                    KMSG_IMMEDIATE);
+		}
+		while (atomic_read(&pb.nr_done) < nr)
+			cpu_relax();
+		KT_ASSERT_M("Page allocation failed", !pb.failed);
+		tot_nsec = 0;
+		max_nsec = 0;
+		for (int i = 1; i <= nr; i++) {
+			nsec = tsc2nsec(pb.ticks[(core_id() + i) % num_cores]);
+			tot_nsec += nsec;
+			max_nsec = MAX(max_nsec, nsec);
+		}
+		/* An alloc and a free per page */
+		nr_ops = 2 * nr * PAGE_BENCH_ITERS * PAGE_BENCH_BATCH;
+		printk("Page alloc/free: %3d cores, %6llu nsec/op, %12llu ops/sec\n",
+		       nr, tot_nsec / nr_ops, nr_ops * NSEC_PER_SEC / max_nsec);
+		if (nr == num_cores)
+			break;
+	}
+	kfree(pb.ticks);
+	return true;
+}
+
+#define FAULT_BENCH_FILE		"/lib/libc.so.6"
+
+/* Touches every page of a mapping, sequentially or in a scattered order, the
+ * way mmap_file would.  Like the hardware, we only fault on unmapped pages.
+ * Returns the number of faults, and the ticks spent in *ticks. */
+static long __fault_bench_touch(struct proc *p, uintptr_t base,
+                                unsigned long nr_pgs, bool scattered,
+                                uint64_t *ticks)
+{
+	unsigned long idx;
+	uintptr_t va;
+	long nr_faults = 0;
+	uint64_t start = read_tsc();
+
+	for (unsigned long i = 0; i < nr_pgs; i++) {
+		/* 7919 is prime, so this visits every page unless it divides nr_pgs */
+		idx = scattered ? (i * 7919) % nr_pgs : i;
+		va = base + idx * PGSIZE;
+		if (page_lookup(p->env_pgdir, (void*)va, NULL))
+			continue;
+		if (handle_page_fault(p, va, PROT_READ))
+			return -1;
+		nr_faults++;
+	}
+	*ticks = read_tsc() - start;
+	return nr_faults;
+}
+
+/* Benchmarks faulting in a cached file mapping with and without fault-around.
+ * The page cache is warmed first; the bench proc never runs, so it can't block
+ * in a fault. */
+static bool test_fault_around(void)
+{
+	struct file_or_chan *foc;
+	struct proc *p;
+	unsigned long nr_pgs;
+	int saved_window = fault_around_pages;
+	int windows[2] = {1, saved_window};
+	long nr_faults[2][2];
+	uint64_t ticks;
+	void *base;
+
+	foc = foc_open(FAULT_BENCH_FILE, O_READ, 0);
+	KT_ASSERT_M("We should be able to find " FAULT_BENCH_FILE, foc);
+	nr_pgs = nr_pages(foc_get_len(foc));
+	KT_ASSERT_M("Bench file should not be empty", nr_pgs);
+	KT_ASSERT_M("Should be able to alloc a proc", !proc_alloc(&p, NULL, 0));
+	/* Warm the page cache */
+	base = do_mmap(p, 0, nr_pgs * PGSIZE, PROT_READ, MAP_SHARED, foc, 0);
+	KT_ASSERT_M("mmap failed", base != MAP_FAILED);
+	KT_ASSERT_M("Populate failed",
+	            populate_va(p, (uintptr_t)base, nr_pgs) == nr_pgs);
+	munmap(p, (uintptr_t)base, nr_pgs * PGSIZE);
+	for (int w = 0; w < 2; w++) {
+		fault_around_pages = windows[w];
+		for (int scattered = 0; scattered < 2; scattered++) {
+			base = do_mmap(p, 0, nr_pgs * PGSIZE, PROT_READ, MAP_SHARED, foc,
+			               0);
+			KT_ASSERT_M("mmap failed", base != MAP_FAILED);
+			nr_faults[w][scattered] =
+				__fault_bench_touch(p, (uintptr_t)base, nr_pgs, scattered,
+				                    &ticks);
+			munmap(p, (uintptr_t)base, nr_pgs * PGSIZE);
+			KT_ASSERT_M("Page fault failed", nr_faults[w][scattered] >= 0);
+			printk("Fault-around %2d, %s: %5lu pages, %5ld faults, %8llu nsec\n",
+			       windows[w], scattered ? "scattered " : "sequential", nr_pgs,
+			       nr_faults[w][scattered], tsc2nsec(ticks));
+		}
+	}
+	fault_around_pages = saved_window;
+	proc_decref(p);
+	foc_decref(foc);
+	KT_ASSERT_M("Fault-around should cut sequential faults",
+	            (saved_window <= 1) || (nr_pgs < 2) ||
+	            (nr_faults[1][0] < nr_faults[0][0]));
+	return true;
+}
+
 static struct ktest ktests[] = {
 #ifdef CONFIG_X86
 	KTEST_REG(ipi_sending,        CONFIG_TEST_ipi_sending),
@@ -2050,6 +2206,8 @@ static struct ktest ktests[] = {
 	KTEST_REG(cmdline_parse,      CONFIG_TEST_cmdline_parse),
 	KTEST_REG(percpu_zalloc,      CONFIG_TEST_percpu_zalloc),
 	KTEST_REG(percpu_increment,   CONFIG_TEST_percpu_increment),
+	KTEST_REG(page_alloc_scaling, CONFIG_TEST_page_alloc_scaling),
+	KTEST_REG(fault_around,       CONFIG_TEST_fault_around),
 };
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
 linker_func_1(register_pb_ktests)
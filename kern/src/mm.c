@@ -29,7 +29,8 @@
 
 /* These are the only mmap flags that are saved in the VMR.  If we implement
  * more of the mmap interface, we may need to grow this. */
-#define MAP_PERSIST_FLAGS		(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS)
+#define MAP_PERSIST_FLAGS		(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS | \
+                                 MAP_HUGETLB)
 
 struct kmem_cache *vmr_kcache;
 
@@ -455,9 +456,180 @@ static void isolate_vmrs(struct proc *p, uintptr_t va, size_t len)
 		split_vmr(vmr, va + len);
 }
 
+/* Huge pages: 2MB-aligned blocks of anonymous private VMRs can be backed by a
+ * single PML2 jumbo page, either when asked for with MAP_HUGETLB or by default
+ * with CONFIG_THP_DEFAULT.  A block is only eligible if its VMR covers all of
+ * it.  We try for a huge page at fault or populate time, and use 4K pages if we
+ * can't get one or if the block already has a PML1.
+ *
+ * Anything that cuts through a block (munmap or mprotect of a sub-range) splits
+ * the jumbo PTE into PML1 PTEs and splits the jumbo page, so that its pieces
+ * get freed like any other user page.  Once split, a block stays in 4K pages.
+ *
+ * Huge mappings aren't seen by env_user_mem_walk(), so the unmappers deal with
+ * them separately. */
+#define HUGE_PGSIZE				PML2_PTE_REACH
+
+static bool vmr_wants_huge(struct vm_region *vmr)
+{
+	if (vmr_has_file(vmr) || !(vmr->vm_flags & MAP_PRIVATE))
+		return false;
+	if (vmr->vm_flags & MAP_HUGETLB)
+		return true;
+#ifdef CONFIG_THP_DEFAULT
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Returns true if the huge block holding va is entirely within vmr. */
+static bool vmr_covers_huge_block(struct vm_region *vmr, uintptr_t va)
+{
+	uintptr_t huge_va = ROUNDDOWN(va, HUGE_PGSIZE);
+
+	return (vmr->vm_base <= huge_va) && (huge_va + HUGE_PGSIZE <= vmr->vm_end);
+}
+
+/* Helper, maps a zeroed huge page for the block holding va, unless one is
+ * already there.  Returns 0 if a huge page is mapped.  Otherwise the caller
+ * should use 4K pages: -ENOMEM if we're out of huge pages, or -EEXIST if the
+ * block already has a PML1 of small pages. */
+static int map_huge_at_addr(struct proc *p, uintptr_t va, int prot)
+{
+	uintptr_t huge_va = ROUNDDOWN(va, HUGE_PGSIZE);
+	void *kva;
+	pte_t pte;
+
+	/* Peek first, so we don't zero 2MB just to find a PML1 */
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)huge_va, FALSE);
+	if (pte_walk_okay(pte) && !pte_is_unmapped(pte)) {
+		spin_unlock(&p->pte_lock);
+		return pte_is_jumbo(pte) ? 0 : -EEXIST;
+	}
+	spin_unlock(&p->pte_lock);
+	kva = jumbo_page_alloc(1, MEM_ATOMIC);
+	if (!kva)
+		return -ENOMEM;
+	memset(kva, 0, HUGE_PGSIZE);
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)huge_va, TRUE);
+	if (!pte_walk_okay(pte) || !pte_is_unmapped(pte)) {
+		spin_unlock(&p->pte_lock);
+		jumbo_page_free(kva, 1);
+		if (!pte_walk_okay(pte))
+			return -ENOMEM;
+		return pte_is_jumbo(pte) ? 0 : -EEXIST;
+	}
+	pte_write(pte, PADDR(kva), prot | PTE_PS);
+	spin_unlock(&p->pte_lock);
+	p->mm_stats.nr_huge_mapped++;
+	p->mm_stats.nr_huge_maps++;
+	return 0;
+}
+
+/* Helper, splits the huge mapping holding va, if there is one, into small
+ * pages.  Returns true if we split, in which case the caller needs to shootdown
+ * the whole block.  Hold the pte_lock. */
+static bool __split_huge_block(struct proc *p, uintptr_t va)
+{
+	pte_t pte;
+	void *kva;
+
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, FALSE);
+	if (!pte_walk_okay(pte) || !pte_is_jumbo(pte))
+		return false;
+	kva = KADDR(pte_get_paddr(pte));
+	pgdir_split_jumbo(p->env_pgdir, (void*)va);
+	jumbo_page_split(kva);
+	p->mm_stats.nr_huge_mapped--;
+	p->mm_stats.nr_huge_splits++;
+	return true;
+}
+
+/* Helper, splits the huge mapping holding va, if any, so that va can be the
+ * edge of an munmap or mprotect.  Same return and locking as above. */
+static bool __split_huge_at(struct proc *p, uintptr_t va)
+{
+	if (!(va & (HUGE_PGSIZE - 1)))
+		return false;
+	return __split_huge_block(p, va);
+}
+
+/* Splits the huge mapping holding va, if any, e.g. so that a driver can pin
+ * one 4K piece of it and later page_decref() that piece on its own. */
+void mm_split_huge(struct proc *p, uintptr_t va)
+{
+	uintptr_t block = ROUNDDOWN(va, HUGE_PGSIZE);
+	bool split;
+
+	spin_lock(&p->pte_lock);
+	split = __split_huge_block(p, block);
+	spin_unlock(&p->pte_lock);
+	if (split)
+		proc_tlbshootdown(p, block, block + HUGE_PGSIZE);
+}
+
+/* Helper, splits huge pages that straddle either edge of [addr, addr + len).
+ * A split block's old TLB entry covers both sides of the edge, so we widen
+ * [*sd_start, *sd_end) to cover it.  Returns true if we split anything.  Hold
+ * the pte_lock. */
+static bool __split_huge_edges(struct proc *p, uintptr_t addr, size_t len,
+                               uintptr_t *sd_start, uintptr_t *sd_end)
+{
+	bool split = false;
+
+	if (__split_huge_at(p, addr)) {
+		*sd_start = ROUNDDOWN(addr, HUGE_PGSIZE);
+		*sd_end = MAX(*sd_end, *sd_start + HUGE_PGSIZE);
+		split = true;
+	}
+	if (__split_huge_at(p, addr + len)) {
+		*sd_end = ROUNDUP(addr + len, HUGE_PGSIZE);
+		split = true;
+	}
+	return split;
+}
+
+/* Helper, clears the huge mappings of every block within [start, end), putting
+ * their pages on to_free.  Free those with __free_huge_list() once the TLB is
+ * clean.  Returns true if anything was unmapped.  Hold the pte_lock. */
+static bool __unmap_huge_range(struct proc *p, uintptr_t start, uintptr_t end,
+                               page_list_t *to_free)
+{
+	bool unmapped = false;
+	pte_t pte;
+
+	for (uintptr_t va = ROUNDUP(start, HUGE_PGSIZE); va + HUGE_PGSIZE <= end;
+	     va += HUGE_PGSIZE) {
+		pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, FALSE);
+		if (!pte_walk_okay(pte) || !pte_is_jumbo(pte))
+			continue;
+		BSD_LIST_INSERT_HEAD(to_free, pa2page(pte_get_paddr(pte)), pg_link);
+		pte_clear(pte);
+		p->mm_stats.nr_huge_mapped--;
+		unmapped = true;
+	}
+	return unmapped;
+}
+
+static void __free_huge_list(page_list_t *to_free)
+{
+	struct page *page;
+
+	while ((page = BSD_LIST_FIRST(to_free))) {
+		BSD_LIST_REMOVE(page, pg_link);
+		jumbo_page_free(page2kva(page), 1);
+	}
+}
+
 void unmap_and_destroy_vmrs(struct proc *p)
 {
 	struct vm_region *vmr_i, *vmr_temp;
+	page_list_t huge_pgs;
+
+	BSD_LIST_INIT(&huge_pgs);
 	/* this only gets called from __proc_free, so there should be no sync
 	 * concerns.  still, better safe than sorry. */
 	spin_lock(&p->vmr_lock);
@@ -467,8 +639,11 @@ void unmap_and_destroy_vmrs(struct proc *p)
 		/* note this CB sets the PTE = 0, regardless of if it was P or not */
 		env_user_mem_walk(p, (void*)vmr_i->vm_base,
 		                  vmr_i->vm_end - vmr_i->vm_base, __vmr_free_pgs, 0);
+		if (vmr_wants_huge(vmr_i))
+			__unmap_huge_range(p, vmr_i->vm_base, vmr_i->vm_end, &huge_pgs);
 	}
 	spin_unlock(&p->pte_lock);
+	__free_huge_list(&huge_pgs);
 	/* need the safe style, since destroy_vmr modifies the list.  also, we want
 	 * to do this outside the pte lock, since it grabs the pm lock. */
 	TAILQ_FOREACH_SAFE(vmr_i, &p->vm_regions, vm_link, vmr_temp)
@@ -476,11 +651,69 @@ void unmap_and_destroy_vmrs(struct proc *p)
 	spin_unlock(&p->vmr_lock);
 }
 
+/* Helper: copies the huge page at va in p into new_p as small pages, for when
+ * we can't get a huge page.  The copy has the same settings, minus the jumbo.
+ * Hold p's pte_lock. */
+static int __copy_huge_as_small(struct proc *p, struct proc *new_p,
+                                uintptr_t va, pte_t pte)
+{
+	void *src = KADDR(pte_get_paddr(pte));
+	int settings = pte_get_settings(pte) & ~PTE_PS;
+	struct page *pp;
+
+	for (size_t off = 0; off < HUGE_PGSIZE; off += PGSIZE) {
+		if (upage_alloc(new_p, &pp, 0))
+			return -ENOMEM;
+		memcpy(page2kva(pp), src + off, PGSIZE);
+		if (page_insert(new_p->env_pgdir, pp, (void*)(va + off), settings)) {
+			page_decref(pp);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/* Helper: gives new_p its own copy of each of p's huge pages in [start, end).
+ * If there's no huge page for a copy, it gets small pages instead; fork
+ * shouldn't fail just because memory is fragmented.  Hold p's pte_lock. */
+static int __copy_huge_pages(struct proc *p, struct proc *new_p,
+                             uintptr_t start, uintptr_t end)
+{
+	pte_t pte, new_pte;
+	void *kva;
+	int ret;
+
+	for (uintptr_t va = ROUNDUP(start, HUGE_PGSIZE); va + HUGE_PGSIZE <= end;
+	     va += HUGE_PGSIZE) {
+		pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, FALSE);
+		if (!pte_walk_okay(pte) || !pte_is_jumbo(pte))
+			continue;
+		kva = jumbo_page_alloc(1, MEM_ATOMIC);
+		if (!kva) {
+			ret = __copy_huge_as_small(p, new_p, va, pte);
+			if (ret)
+				return ret;
+			continue;
+		}
+		memcpy(kva, KADDR(pte_get_paddr(pte)), HUGE_PGSIZE);
+		new_pte = pgdir_walk_jumbo(new_p->env_pgdir, (void*)va, TRUE);
+		if (!pte_walk_okay(new_pte)) {
+			jumbo_page_free(kva, 1);
+			return -ENOMEM;
+		}
+		pte_write(new_pte, PADDR(kva), pte_get_settings(pte));
+		new_p->mm_stats.nr_huge_mapped++;
+		new_p->mm_stats.nr_huge_maps++;
+	}
+	return 0;
+}
+
 /* Helper: copies the contents of pages from p to new p.  For pages that aren't
  * present, once we support swapping or CoW, we can do something more
- * intelligent.  0 on success, -ERROR on failure.  Can't handle jumbos. */
+ * intelligent.  0 on success, -ERROR on failure.  Only looks for (PML2) jumbos
+ * if huge is set. */
 static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
-                      uintptr_t va_end)
+                      uintptr_t va_end, bool huge)
 {
 	int ret;
 
@@ -502,7 +735,6 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		/* pages could be !P, but right now that's only for file backed VMRs
 		 * undergoing page removal, which isn't the caller of copy_pages. */
 		if (pte_is_mapped(pte)) {
-			/* TODO: check for jumbos */
 			if (upage_alloc(new_p, &pp, 0))
 				return -ENOMEM;
 			memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
@@ -521,8 +753,10 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		return 0;
 	}
 	spin_lock(&p->pte_lock);	/* walking and changing PTEs */
-	ret = env_user_mem_walk(p, (void*)va_start, va_end - va_start, &copy_page,
-	                        new_p);
+	ret = huge ? __copy_huge_pages(p, new_p, va_start, va_end) : 0;
+	if (!ret)
+		ret = env_user_mem_walk(p, (void*)va_start, va_end - va_start,
+		                        &copy_page, new_p);
 	spin_unlock(&p->pte_lock);
 	return ret;
 }
@@ -534,7 +768,8 @@ static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr)
 	if (!vmr_has_file(vmr) || (vmr->vm_flags & MAP_PRIVATE)) {
 		/* We don't support ANON + SHARED yet */
 		assert(!(vmr->vm_flags & MAP_SHARED));
-		ret = copy_pages(p, new_p, vmr->vm_base, vmr->vm_end);
+		ret = copy_pages(p, new_p, vmr->vm_base, vmr->vm_end,
+		                 vmr_wants_huge(vmr));
 	} else {
 		/* non-private file, i.e. page cacheable.  we have to honor MAP_LOCKED,
 		 * (but we might be able to ignore MAP_POPULATE). */
@@ -756,20 +991,148 @@ static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
 	return 0;
 }
 
+/* Fault-around: a fault in a file-backed VMR also maps whatever is already in
+ * the page cache in the surrounding window, so that sequential access doesn't
+ * trap once per page.  When the fault had to go to the backing store, we also
+ * kick off async readahead of the next window, so that the following faults
+ * find their pages cached.  The window is in pages, and <= 1 turns it off.
+ * Set it with "fault_around NR" on #mem/readahead. */
+int fault_around_pages = CONFIG_FAULT_AROUND_PAGES;
+
+/* Helper, maps page cache pages into [va, va + nr_pgs * PGSIZE), in one pass of
+ * the pte_lock.  Slots that are already mapped are left alone.  Pages that
+ * aren't cached are skipped if skip_missing, o/w we stop at the first one.
+ * Returns how many pages we got through, or -ENOMEM, and adds the number we
+ * mapped to *nr_mapped, if set.  Hold the vmr_lock, which keeps the PM pages
+ * from being removed while we map them. */
+static long __map_cached_pages(struct proc *p, uintptr_t va,
+                               unsigned long nr_pgs, int pte_prot,
+                               struct page_map *pm, size_t offset, int flags,
+                               bool exec, bool skip_missing,
+                               unsigned long *nr_mapped)
+{
+	unsigned long pm_idx0 = offset >> PGSHIFT;
+	struct page *page;
+	long i, ret = 0;
+	pte_t pte;
+
+	spin_lock(&p->pte_lock);
+	for (i = 0; i < nr_pgs; i++) {
+		pte = pgdir_walk(p->env_pgdir, (void*)(va + i * PGSIZE), TRUE);
+		if (!pte_walk_okay(pte)) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (!pte_is_unmapped(pte))
+			continue;
+		if (pm_load_page_nowait(pm, pm_idx0 + i, &page)) {
+			if (skip_missing)
+				continue;
+			break;
+		}
+		if (flags & MAP_PRIVATE) {
+			if (__copy_and_swap_pmpg(p, &page)) {
+				pm_put_page(page);
+				ret = -ENOMEM;
+				break;
+			}
+		}
+		if (exec)
+			icache_flush_page((void*)(va + i * PGSIZE), page2kva(page));
+		/* PM pages stay alive via the VMR; private pages are owned by the PTE */
+		pte_write(pte, page2pa(page), pte_prot);
+		if (page_is_pagemap(page))
+			pm_put_page(page);
+		if (nr_mapped)
+			(*nr_mapped)++;
+	}
+	spin_unlock(&p->pte_lock);
+	return ret ? ret : i;
+}
+
+/* Helper, maps the cached neighbors of va within its fault-around window.
+ * Writable private mappings are left alone: each neighbor would cost a page
+ * and a copy up front, for memory the process may never touch. */
+static void fault_around(struct proc *p, struct vm_region *vmr, uintptr_t va,
+                         int pte_prot)
+{
+	unsigned long nr_file_pgs = nr_pages(foc_get_len(vmr->__vm_foc));
+	size_t window = fault_around_pages * PGSIZE;
+	uintptr_t start, end;
+	size_t foff;
+
+	if (fault_around_pages <= 1)
+		return;
+	if ((vmr->vm_flags & MAP_PRIVATE) && (vmr->vm_prot & PROT_WRITE))
+		return;
+	start = MAX(ROUNDDOWN(va, window), vmr->vm_base);
+	end = MIN(ROUNDDOWN(va, window) + window, vmr->vm_end);
+	foff = start - vmr->vm_base + vmr->vm_foff;
+	/* Don't map past EOF; that should still fault (and fail) */
+	if ((foff >> PGSHIFT) >= nr_file_pgs)
+		return;
+	end = MIN(end, start + ((nr_file_pgs - (foff >> PGSHIFT)) << PGSHIFT));
+	__map_cached_pages(p, start, (end - start) >> PGSHIFT, pte_prot,
+	                   vmr_to_pm(vmr), foff, vmr->vm_flags,
+	                   vmr->vm_prot & PROT_EXEC, TRUE,
+	                   &p->mm_stats.nr_fault_around);
+}
+
+static void __readahead_kmsg(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct file_or_chan *foc = (struct file_or_chan*)a0;
+
+	pm_readahead(foc_to_pm(foc), a1, a2);
+	foc_decref(foc);
+}
+
+/* Helper, starts loading the window of file pages from idx on, in a kthread.
+ * The fault that got us here blocks (or reflects to userspace) on its own page
+ * while the readahead fills in the rest. */
+static void kick_readahead(struct proc *p, struct file_or_chan *foc,
+                           unsigned long idx)
+{
+	unsigned long nr_file_pgs = nr_pages(foc_get_len(foc));
+
+	if ((fault_around_pages <= 1) || (idx >= nr_file_pgs))
+		return;
+	foc_incref(foc);
+	send_kernel_message(core_id(), __readahead_kmsg, (long)foc, idx,
+	                    MIN((unsigned long)fault_around_pages,
+	                        nr_file_pgs - idx),
+	                    KMSG_ROUTINE);
+	p->mm_stats.nr_readahead++;
+}
+
 /* Hold the VMR lock when you call this - it'll assume the entire VA range is
- * mappable, which isn't true if there are concurrent changes to the VMRs. */
-static int populate_anon_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
-                            int pte_prot)
+ * mappable, which isn't true if there are concurrent changes to the VMRs.  The
+ * range is within vmr, and whole huge blocks get huge pages if vmr wants them. */
+static int populate_anon_va(struct proc *p, struct vm_region *vmr, uintptr_t va,
+                            unsigned long nr_pgs, int pte_prot)
 {
 	struct page *page;
+	uintptr_t end = va + (nr_pgs << PGSHIFT);
+	bool huge = vmr_wants_huge(vmr);
 	int ret;
-	for (long i = 0; i < nr_pgs; i++) {
+
+	while (va < end) {
+		if (huge && !(va & (HUGE_PGSIZE - 1)) && (va + HUGE_PGSIZE <= end)) {
+			ret = map_huge_at_addr(p, va, pte_prot);
+			if (!ret) {
+				va += HUGE_PGSIZE;
+				continue;
+			}
+			if (ret == -ENOMEM)
+				p->mm_stats.nr_huge_fallbacks++;
+		}
 		if (upage_alloc(p, &page, TRUE))
 			return -ENOMEM;
 		/* could imagine doing a memwalk instead of a for loop */
-		ret = map_page_at_addr(p, page, va + i * PGSIZE, pte_prot);
+		ret = map_page_at_addr(p, page, va, pte_prot);
 		if (ret)
 			return ret;
+		p->mm_stats.nr_small_maps++;
+		va += PGSIZE;
 	}
 	return 0;
 }
@@ -780,6 +1143,7 @@ static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
                           int flags, bool exec)
 {
 	int ret = 0;
+	long done;
 	unsigned long pm_idx0 = offset >> PGSHIFT;
 	int vmr_history = ACCESS_ONCE(p->vmr_history);
 	struct page *page;
@@ -790,43 +1154,37 @@ static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
 	if (pm_idx0 + nr_pgs > nr_pages(fs_file_get_length(pm->pm_file)))
 		return -ESPIPE;
 	/* locking rules: start the loop holding the vmr lock, enter and exit the
-	 * entire func holding the lock. */
-	for (long i = 0; i < nr_pgs; i++) {
-		ret = pm_load_page_nowait(pm, pm_idx0 + i, &page);
-		if (ret) {
-			if (ret != -EAGAIN)
-				break;
-			spin_unlock(&p->vmr_lock);
-			/* might block here, can't hold the spinlock */
-			ret = pm_load_page(pm, pm_idx0 + i, &page);
-			spin_lock(&p->vmr_lock);
-			if (ret)
-				break;
-			/* while we were sleeping, the VMRs could have changed on us. */
-			if (vmr_history != ACCESS_ONCE(p->vmr_history)) {
-				pm_put_page(page);
-				printk("[kernel] FYI: VMR changed during populate\n");
-				break;
-			}
-		}
-		if (flags & MAP_PRIVATE) {
-			ret = __copy_and_swap_pmpg(p, &page);
-			if (ret) {
-				pm_put_page(page);
-				break;
-			}
+	 * entire func holding the lock.  Each pass maps the run of cached pages,
+	 * then blocks on the first page that isn't, reading ahead behind it. */
+	for (unsigned long i = 0; i < nr_pgs; ) {
+		done = __map_cached_pages(p, va + i * PGSIZE, nr_pgs - i, pte_prot, pm,
+		                          offset + i * PGSIZE, flags, exec, FALSE,
+		                          NULL);
+		if (done < 0) {
+			ret = done;
+			break;
 		}
-		/* if this is an executable page, we might have to flush the
-		 * instruction cache if our HW requires it.
-		 * TODO: is this still needed?  andrew put this in a while ago*/
-		if (exec)
-			icache_flush_page(0, page2kva(page));
-		/* The page could be either in the PM, or a private, now-anon page. */
-		ret = map_page_at_addr(p, page, va + i * PGSIZE, pte_prot);
-		if (page_is_pagemap(page))
+		i += done;
+		if (i == nr_pgs)
+			break;
+		spin_unlock(&p->vmr_lock);
+		/* might block here, can't hold the spinlock */
+		ret = pm_load_page(pm, pm_idx0 + i, &page);
+		if (!ret) {
 			pm_put_page(page);
+			if (fault_around_pages > 1)
+				pm_readahead(pm, pm_idx0 + i + 1,
+				             MIN((unsigned long)fault_around_pages - 1,
+				                 nr_pgs - i - 1));
+		}
+		spin_lock(&p->vmr_lock);
 		if (ret)
 			break;
+		/* while we were sleeping, the VMRs could have changed on us. */
+		if (vmr_history != ACCESS_ONCE(p->vmr_history)) {
+			printk("[kernel] FYI: VMR changed during populate\n");
+			break;
+		}
 	}
 	return ret;
 }
@@ -890,8 +1248,15 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 	 * We just need to split on the end points (if they exist), and then remove
 	 * everything in between.  __do_munmap() will do this.  Careful, this means
 	 * an mmap can be an implied munmap() (not my call...). */
-	if (flags & MAP_FIXED)
-		__do_munmap(p, addr, len);
+	if ((flags & MAP_FIXED) && __do_munmap(p, addr, len)) {
+		spin_unlock(&p->vmr_lock);
+		if (vmr_has_file(vmr)) {
+			pm_remove_vmr(vmr_to_pm(vmr), vmr);
+			foc_decref(vmr->__vm_foc);
+		}
+		vmr_free(vmr);
+		return MAP_FAILED;
+	}
 	if (!vmr_insert(vmr, p, addr, len)) {
 		spin_unlock(&p->vmr_lock);
 		if (vmr_has_file(vmr)) {
@@ -915,7 +1280,7 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 		unsigned long nr_pgs = len >> PGSHIFT;
 		int ret = 0;
 		if (!file) {
-			ret = populate_anon_va(p, addr, nr_pgs, pte_prot);
+			ret = populate_anon_va(p, vmr, addr, nr_pgs, pte_prot);
 		} else {
 			/* Note: this will unlock if it blocks.  our refcnt on the file
 			 * keeps the pm alive when we unlock */
@@ -969,6 +1334,7 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 	pte_t pte;
 	bool shootdown_needed = FALSE;
 	bool file_access_failure = FALSE;
+	uintptr_t shootdown_start = addr, shootdown_end = addr + len;
 	int pte_prot = (prot & PROT_WRITE) ? PTE_USER_RW :
 	               (prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : PTE_NONE;
 
@@ -976,6 +1342,10 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 	 * prots are the same as the previous.  Plus, there are three excessive
 	 * scans. */
 	isolate_vmrs(p, addr, len);
+	spin_lock(&p->pte_lock);
+	if (__split_huge_edges(p, addr, len, &shootdown_start, &shootdown_end))
+		shootdown_needed = TRUE;
+	spin_unlock(&p->pte_lock);
 	vmr = find_first_vmr(p, addr);
 	while (vmr && vmr->vm_base < addr + len) {
 		if (vmr->vm_prot == prot)
@@ -996,6 +1366,9 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 			if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
 				pte_replace_perm(pte, pte_prot);
 				shootdown_needed = TRUE;
+				/* huge blocks are entirely within the VMR, after the split */
+				if (pte_is_jumbo(pte))
+					va = ROUNDUP(va + 1, HUGE_PGSIZE) - PGSIZE;
 			}
 		}
 		spin_unlock(&p->pte_lock);
@@ -1010,7 +1383,7 @@ next_vmr:
 		vmr = next_vmr;
 	}
 	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+		proc_tlbshootdown(p, shootdown_start, shootdown_end);
 	if (file_access_failure) {
 		set_errno(EACCES);
 		return -1;
@@ -1052,7 +1425,8 @@ static int __munmap_pte(struct proc *p, pte_t pte, void *va, void *arg)
 		return 0;
 	if (pte_is_dirty(pte)) {
 		page = pa2page(pte_get_paddr(pte));
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		if (page_is_pagemap(page))
+			pm_set_page_dirty(page);
 	}
 	pte_clear_present(pte);
 	*shootdown_needed = TRUE;
@@ -1084,30 +1458,57 @@ static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg)
 	return 0;
 }
 
+/* Is any of [addr, addr + len) pinned?  Hold the vmr_lock. */
+static bool __range_is_pinned(struct proc *p, uintptr_t addr, size_t len)
+{
+	struct mm_pin *pin;
+
+	TAILQ_FOREACH(pin, &p->mm_pins, link) {
+		if (pin->start < addr + len && addr < pin->end)
+			return TRUE;
+	}
+	return FALSE;
+}
+
 int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 {
 	struct vm_region *vmr, *next_vmr, *first_vmr;
 	bool shootdown_needed = FALSE;
+	uintptr_t shootdown_start = addr, shootdown_end = addr + len;
+	page_list_t huge_pgs;
 
+	/* The kernel is still using those pages; see mm_pin(). */
+	if (__range_is_pinned(p, addr, len)) {
+		set_error(EBUSY, "memory is pinned for I/O");
+		return -1;
+	}
+	BSD_LIST_INIT(&huge_pgs);
 	/* TODO: this will be a bit slow, since we end up doing three linear
 	 * searches (two in isolate, one in find_first). */
 	isolate_vmrs(p, addr, len);
 	first_vmr = find_first_vmr(p, addr);
 	vmr = first_vmr;
 	spin_lock(&p->pte_lock);	/* changing PTEs */
+	if (__split_huge_edges(p, addr, len, &shootdown_start, &shootdown_end))
+		shootdown_needed = TRUE;
 	while (vmr && vmr->vm_base < addr + len) {
 		/* It's important that we call __munmap_pte and sync the PG_DIRTY bit
 		 * before we unhook the VMR from the PM (in destroy_vmr). */
 		env_user_mem_walk(p, (void*)vmr->vm_base, vmr->vm_end - vmr->vm_base,
 		                  __munmap_pte, &shootdown_needed);
+		if (vmr_wants_huge(vmr) &&
+		    __unmap_huge_range(p, vmr->vm_base, vmr->vm_end, &huge_pgs))
+			shootdown_needed = TRUE;
 		vmr = TAILQ_NEXT(vmr, vm_link);
 	}
 	spin_unlock(&p->pte_lock);
 	/* we haven't freed the pages yet; still using the PTEs to store the them.
 	 * There should be no races with inserts/faults, since we still hold the mm
-	 * lock since the previous CB. */
+	 * lock since the previous CB.  The huge pages are already out of the PTEs,
+	 * and we can free them once the TLBs are clean. */
 	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+		proc_tlbshootdown(p, shootdown_start, shootdown_end);
+	__free_huge_list(&huge_pgs);
 	vmr = first_vmr;
 	while (vmr && vmr->vm_base < addr + len) {
 		/* there is rarely more than one VMR in this loop.  o/w, we'll need to
@@ -1220,10 +1621,22 @@ refault:
 	}
 	if (!vmr_has_file(vmr)) {
 		/* No file - just want anonymous memory */
+		if (vmr_wants_huge(vmr) && vmr_covers_huge_block(vmr, va)) {
+			int huge_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
+			                (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ?
+			                PTE_USER_RO : 0;
+			int huge_ret = map_huge_at_addr(p, va, huge_prot);
+
+			if (!huge_ret)
+				goto out;
+			if (huge_ret == -ENOMEM)
+				p->mm_stats.nr_huge_fallbacks++;
+		}
 		if (upage_alloc(p, &a_page, TRUE)) {
 			ret = -ENOMEM;
 			goto out;
 		}
+		p->mm_stats.nr_small_maps++;
 	} else {
 		if (!file_ok) {
 			ret = -EACCES;
@@ -1251,6 +1664,9 @@ refault:
 		if (ret) {
 			if (ret != -EAGAIN)
 				goto out;
+			/* Read ahead behind us, unless we already did on the refault */
+			if (first)
+				kick_readahead(p, file, f_idx + 1);
 			/* keep the file alive after we unlock */
 			foc_incref(file);
 			spin_unlock(&p->vmr_lock);
@@ -1282,6 +1698,8 @@ refault:
 	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
 	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	ret = map_page_at_addr(p, a_page, va, pte_prot);
+	if (!ret && vmr_has_file(vmr))
+		fault_around(p, vmr, va, pte_prot);
 	/* fall through, even for errors */
 out_put_pg:
 	/* the VMR's existence in the PM (via the mmap) allows us to have PTE point
@@ -1330,7 +1748,7 @@ unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
 		           (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 		nr_pgs_this_vmr = MIN(nr_pgs, (vmr->vm_end - va) >> PGSHIFT);
 		if (!vmr_has_file(vmr)) {
-			if (populate_anon_va(p, va, nr_pgs_this_vmr, pte_prot)) {
+			if (populate_anon_va(p, vmr, va, nr_pgs_this_vmr, pte_prot)) {
 				/* on any error, we can just bail.  we might be underestimating
 				 * nr_filled. */
 				break;
@@ -1504,3 +1922,69 @@ int vunmap_vmem(uintptr_t vaddr, size_t nr_bytes)
 	put_vmap_segment(PG_ADDR(vaddr), nr_bytes);
 	return 0;
 }
+
+/* Pins [va, va + len) of p's memory, faulting it in if needed, and returns the
+ * pages backing it in pages (one per page touched by the range).  Only plain
+ * anonymous memory can be pinned: file pages can be yanked by their page map.
+ * Returns 0 on success, -1 (without setting errno) if it can't be pinned.
+ *
+ * Until mm_unpin(), munmap() of any part of the range fails with EBUSY, and the
+ * process (and thus its memory) can't be freed. */
+int mm_pin(struct proc *p, struct mm_pin *pin, uintptr_t va, size_t len,
+           struct page **pages)
+{
+	uintptr_t start = ROUNDDOWN(va, PGSIZE);
+	uintptr_t end = ROUNDUP(va + len, PGSIZE);
+	unsigned long nr_pgs = (end - start) >> PGSHIFT;
+	struct vm_region *vmr = NULL;
+	struct page *page;
+	pte_t pte;
+
+	if (!len || !is_user_raddr((void*)va, len))
+		return -1;
+	if (populate_va(p, start, nr_pgs) != nr_pgs)
+		return -1;
+	spin_lock(&p->vmr_lock);
+	for (uintptr_t i = start; i < end; i += PGSIZE) {
+		if (!vmr || i >= vmr->vm_end) {
+			vmr = find_vmr(p, i);
+			if (!vmr || vmr_has_file(vmr) || !(vmr->vm_prot & PROT_READ))
+				goto fail;
+		}
+		page = page_lookup(p->env_pgdir, (void*)i, &pte);
+		if (!page || !pte_is_present(pte) || page_is_pagemap(page))
+			goto fail;
+		pages[(i - start) >> PGSHIFT] = page;
+	}
+	pin->proc = p;
+	pin->start = start;
+	pin->end = end;
+	proc_incref(p, 1);
+	TAILQ_INSERT_TAIL(&p->mm_pins, pin, link);
+	spin_unlock(&p->vmr_lock);
+	return 0;
+fail:
+	spin_unlock(&p->vmr_lock);
+	return -1;
+}
+
+/* Can block on the vmr_lock, so not from IRQ context. */
+void mm_unpin(struct mm_pin *pin)
+{
+	struct proc *p = pin->proc;
+
+	spin_lock(&p->vmr_lock);
+	TAILQ_REMOVE(&p->mm_pins, pin, link);
+	spin_unlock(&p->vmr_lock);
+	proc_decref(p);
+}
+
+bool mm_has_pins(struct proc *p)
+{
+	bool ret;
+
+	spin_lock(&p->vmr_lock);
+	ret = !TAILQ_EMPTY(&p->mm_pins);
+	spin_unlock(&p->vmr_lock);
+	return ret;
+}
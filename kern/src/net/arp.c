@@ -37,14 +37,34 @@
 #include <pmap.h>
 #include <smp.h>
 #include <net/ip.h>
+#include <endian.h>
+#include <hash.h>
+#include <rculist.h>
+#include <percpu_counter.h>
 
 /*
  *  address resolution tables
+ *
+ *  Entries live in a hash table that doubles as it fills, up to Narpmax
+ *  entries.  Past that, we evict the least recently used entry.
+ *
+ *  Every change to the table or to an entry happens with the arp qlocked.
+ *  arpget's lookup of a resolved entry doesn't take the qlock: it walks the
+ *  table under RCU and copies the mac out under the entry's seq counter.  Only
+ *  misses, stale entries and entries still being resolved take the qlock.
+ *
+ *  Entries are freed with kfree_rcu, so a lockless reader never sees one
+ *  reused for another address.  The lru list is only kept in order with the
+ *  qlock held; a lockless hit just bumps utime, and eviction gives entries
+ *  whose utime moved since they were last placed a second chance.
  */
 
 enum {
-	NHASH = (1 << 6),
-	NCACHE = 256,
+	Narpht = (1 << 6),			/* initial buckets, power of 2 */
+	Narpht_max = (1 << 12),
+	Narpmax = 4096,
+	Arpmaxage = 15 * 60 * 1000,	/* ms an entry stays good */
+	Arputime_slack = 1000,		/* ms between lockless utime updates */
 
 	AOK = 1,
 	AWAIT = 2,
@@ -56,58 +76,193 @@ char *arpstate[] = {
 	"WAIT",
 };
 
+struct arptab {
+	struct rcu_head rcu;
+	struct arp *arp;
+	unsigned int gen;
+	unsigned int nr_buckets;
+	struct hlist_head buckets[];
+};
+
+TAILQ_HEAD(arpent_tailq, arpent);
+
 /*
  *  one per Fs
  */
 struct arp {
 	qlock_t qlock;
 	struct Fs *f;
-	struct arpent *hash[NHASH];
-	struct arpent cache[NCACHE];
+	struct arptab *tab;			/* rcu protected */
+	bool resizing;				/* until the old table's readers are done */
+	struct arpent_tailq lru;	/* least recently used first */
+	unsigned int nr_ents;
+	struct percpu_counter hits;
+	struct percpu_counter misses;
+	uint64_t evictions;
 	struct arpent *rxmt;
 	struct proc *rxmitp;		/* neib sol re-transmit proc */
 	struct rendez rxmtq;
 	struct block *dropf, *dropl;
 };
 
-#define haship(s) ((s)[IPaddrlen-1]%NHASH)
-
 int ReTransTimer = RETRANS_TIMER;
 static void rxmitproc(void *v);
 
+static uint32_t arphash(uint8_t *ip)
+{
+	uint64_t key;
+
+	key = ((uint64_t)(nhgetl(ip) ^ nhgetl(ip + 4)) << 32) ^
+	      nhgetl(ip + 8) ^ nhgetl(ip + 12);
+	return hash_64(key, 32);
+}
+
+static struct arptab *arptab_alloc(struct arp *arp, unsigned int nr_buckets,
+                                   unsigned int gen)
+{
+	struct arptab *tab;
+
+	tab = kzmalloc(sizeof(struct arptab) +
+	               nr_buckets * sizeof(struct hlist_head), MEM_WAIT);
+	tab->arp = arp;
+	tab->gen = gen;
+	tab->nr_buckets = nr_buckets;
+	return tab;
+}
+
+static struct hlist_node *arp_link(struct arpent *a, struct arptab *tab)
+{
+	return &a->link[tab->gen & 1];
+}
+
+static struct arpent *arp_entry(struct hlist_node *n, struct arptab *tab)
+{
+	if (!n)
+		return NULL;
+	if (tab->gen & 1)
+		return container_of(n, struct arpent, link[1]);
+	return container_of(n, struct arpent, link[0]);
+}
+
+#define for_each_arpent_rcu(a, tab, hv)                                        \
+	for (a = arp_entry(rcu_dereference(hlist_first_rcu(                        \
+	             &(tab)->buckets[(hv) & ((tab)->nr_buckets - 1)])), tab);      \
+	     a;                                                                    \
+	     a = arp_entry(rcu_dereference(hlist_next_rcu(arp_link(a, tab))), tab))
+
 void arpinit(struct Fs *f)
 {
 	f->arp = kzmalloc(sizeof(struct arp), MEM_WAIT);
 	qlock_init(&f->arp->qlock);
 	rendez_init(&f->arp->rxmtq);
 	f->arp->f = f;
+	f->arp->tab = arptab_alloc(f->arp, Narpht, 0);
+	TAILQ_INIT(&f->arp->lru);
+	percpu_counter_init(&f->arp->hits, 0, MEM_WAIT);
+	percpu_counter_init(&f->arp->misses, 0, MEM_WAIT);
 	f->arp->rxmt = NULL;
 	f->arp->dropf = f->arp->dropl = NULL;
 	ktask("rxmitproc", rxmitproc, f->arp);
 }
 
+static void __arptab_free_rcu(struct rcu_head *head)
+{
+	struct arptab *tab = container_of(head, struct arptab, rcu);
+
+	WRITE_ONCE(tab->arp->resizing, FALSE);
+	kfree(tab);
+}
+
+/* Doubles the table once it averages more than an entry per bucket.  Entries
+ * are linked into the new table through their other link field, leaving the
+ * old one intact for lockless readers.  We don't grow again until they are
+ * done with it, since that would reuse the links they are walking.  Call with
+ * arp qlocked. */
+static void arp_maybe_grow(struct arp *arp)
+{
+	struct arptab *old = arp->tab;
+	struct arptab *new;
+	struct arpent *a;
+
+	if (arp->nr_ents <= old->nr_buckets || old->nr_buckets >= Narpht_max)
+		return;
+	if (READ_ONCE(arp->resizing))
+		return;
+	new = arptab_alloc(arp, old->nr_buckets * 2, old->gen + 1);
+	TAILQ_FOREACH(a, &arp->lru, lru)
+		hlist_add_head(arp_link(a, new),
+		               &new->buckets[a->hv & (new->nr_buckets - 1)]);
+	arp->resizing = TRUE;
+	rcu_assign_pointer(arp->tab, new);
+	call_rcu(&old->rcu, __arptab_free_rcu);
+}
+
+/* Called with arp qlocked. */
+static struct arpent *arp_find(struct arp *arp, uint8_t *ip, uint32_t hv,
+                               struct medium *type)
+{
+	struct arpent *a;
+
+	for_each_arpent_rcu(a, arp->tab, hv) {
+		if (a->hv == hv && ipcmp(ip, a->ip) == 0)
+			if (type == NULL || type == a->type)
+				return a;
+	}
+	return NULL;
+}
+
+/* Called with arp qlocked, when a is being used. */
+static void arp_touch(struct arp *arp, struct arpent *a)
+{
+	a->utime = NOW;
+	a->lru_time = a->utime;
+	TAILQ_REMOVE(&arp->lru, a, lru);
+	TAILQ_INSERT_TAIL(&arp->lru, a, lru);
+}
+
+/* called with arp qlocked */
+
+void cleanarpent(struct arp *arp, struct arpent *a)
+{
+	struct arpent *f, **l;
+
+	/* take out of the table */
+	hlist_del_rcu(arp_link(a, arp->tab));
+	TAILQ_REMOVE(&arp->lru, a, lru);
+	arp->nr_ents--;
+
+	/* take out of re-transmit chain */
+	l = &arp->rxmt;
+	for (f = *l; f; f = f->nextrxt) {
+		if (f == a) {
+			*l = a->nextrxt;
+			break;
+		}
+		l = &f->nextrxt;
+	}
+	kfree_rcu(a, rcu);
+}
+
 /*
- *  create a new arp entry for an ip address.
+ *  throw out the least recently used entry.  entries that were used locklessly
+ *  since they were last put in place go to the back of the lru instead.
  */
-static struct arpent *newarp6(struct arp *arp, uint8_t *ip, struct Ipifc *ifc,
-                              int addrxt)
+static void arp_evict(struct arp *arp)
 {
-	unsigned int t;
 	struct block *next, *xp;
-	struct arpent *a, *e, *f, **l;
-	struct medium *m = ifc->m;
-	int empty;
+	struct arpent *a;
+	uint64_t utime;
 
-	/* find oldest entry */
-	e = &arp->cache[NCACHE];
-	a = arp->cache;
-	t = a->utime;
-	for (f = a; f < e; f++) {
-		if (f->utime < t) {
-			t = f->utime;
-			a = f;
-		}
+	for (unsigned int i = 0; i < arp->nr_ents; i++) {
+		a = TAILQ_FIRST(&arp->lru);
+		utime = READ_ONCE(a->utime);
+		if (utime == a->lru_time)
+			break;
+		a->lru_time = utime;
+		TAILQ_REMOVE(&arp->lru, a, lru);
+		TAILQ_INSERT_TAIL(&arp->lru, a, lru);
 	}
+	a = TAILQ_FIRST(&arp->lru);
 
 	/* dump waiting packets */
 	xp = a->hold;
@@ -134,23 +289,28 @@ static struct arpent *newarp6(struct arp *arp, uint8_t *ip, struct Ipifc *ifc,
 		}
 	}
 
-	/* take out of current chain */
-	l = &arp->hash[haship(a->ip)];
-	for (f = *l; f; f = f->hash) {
-		if (f == a) {
-			*l = a->hash;
-			break;
-		}
-		l = &f->hash;
-	}
+	cleanarpent(arp, a);
+	arp->evictions++;
+}
+
+/*
+ *  create a new arp entry for an ip address.
+ */
+static struct arpent *newarp6(struct arp *arp, uint8_t *ip, uint32_t hv,
+                              struct Ipifc *ifc, int addrxt)
+{
+	struct arpent *a, *f, **l;
+	struct medium *m = ifc->m;
+	int empty;
 
-	/* insert into new chain */
-	l = &arp->hash[haship(ip)];
-	a->hash = *l;
-	*l = a;
+	if (arp->nr_ents >= Narpmax)
+		arp_evict(arp);
 
+	a = kzmalloc(sizeof(struct arpent), MEM_WAIT);
+	a->hv = hv;
 	memmove(a->ip, ip, sizeof(a->ip));
 	a->utime = NOW;
+	a->lru_time = a->utime;
 	a->ctime = 0;	/* somewhat of a "last sent time".  0, to trigger a send. */
 	a->type = m;
 
@@ -159,18 +319,16 @@ static struct arpent *newarp6(struct arp *arp, uint8_t *ip, struct Ipifc *ifc,
 	a->ifc = ifc;
 	a->ifcid = ifc->ifcid;
 
+	hlist_add_head_rcu(arp_link(a, arp->tab),
+	                   &arp->tab->buckets[hv & (arp->tab->nr_buckets - 1)]);
+	TAILQ_INSERT_TAIL(&arp->lru, a, lru);
+	arp->nr_ents++;
+	arp_maybe_grow(arp);
+
 	/* put to the end of re-transmit chain; addrxt is 0 when isv4(a->ip) */
 	if (!ipismulticast(a->ip) && addrxt) {
 		l = &arp->rxmt;
 		empty = (*l == NULL);
-
-		for (f = *l; f; f = f->nextrxt) {
-			if (f == a) {
-				*l = a->nextrxt;
-				break;
-			}
-			l = &f->nextrxt;
-		}
 		for (f = *l; f; f = f->nextrxt) {
 			l = &f->nextrxt;
 		}
@@ -184,41 +342,40 @@ static struct arpent *newarp6(struct arp *arp, uint8_t *ip, struct Ipifc *ifc,
 	return a;
 }
 
-/* called with arp qlocked */
-
-void cleanarpent(struct arp *arp, struct arpent *a)
+/*
+ *  the lockless half of arpget: copy out the mac if ip has a good entry.
+ */
+static bool arpget_rcu(struct arp *arp, uint8_t *ip, uint32_t hv,
+                       struct medium *type, uint8_t *mac)
 {
-	struct arpent *f, **l;
-
-	a->utime = 0;
-	a->ctime = 0;
-	a->type = 0;
-	a->state = 0;
-
-	/* take out of current chain */
-	l = &arp->hash[haship(a->ip)];
-	for (f = *l; f; f = f->hash) {
-		if (f == a) {
-			*l = a->hash;
-			break;
-		}
-		l = &f->hash;
-	}
-
-	/* take out of re-transmit chain */
-	l = &arp->rxmt;
-	for (f = *l; f; f = f->nextrxt) {
-		if (f == a) {
-			*l = a->nextrxt;
+	struct arptab *tab;
+	struct arpent *a;
+	seq_ctr_t seq;
+	uint64_t now = NOW;
+	bool found = FALSE;
+
+	rcu_read_lock();
+	tab = rcu_dereference(arp->tab);
+	for_each_arpent_rcu(a, tab, hv) {
+		if (a->hv != hv || ipcmp(ip, a->ip) != 0)
+			continue;
+		do {
+			seq = READ_ONCE(a->seq);
+			rmb();
+			found = a->state == AOK && a->type == type &&
+			        now - a->ctime <= Arpmaxage;
+			if (found)
+				memmove(mac, a->mac, type->maclen);
+		} while (seqctr_retry(seq, READ_ONCE(a->seq)));
+		if (found) {
+			/* don't bounce the entry's cache line on every packet */
+			if (now - READ_ONCE(a->utime) > Arputime_slack)
+				WRITE_ONCE(a->utime, now);
 			break;
 		}
-		l = &f->nextrxt;
 	}
-	a->nextrxt = NULL;
-	a->hash = NULL;
-	a->hold = NULL;
-	a->last = NULL;
-	a->ifc = NULL;
+	rcu_read_unlock();
+	return found;
 }
 
 /*
@@ -230,30 +387,29 @@ void cleanarpent(struct arp *arp, struct arpent *a)
 struct arpent *arpget(struct arp *arp, struct block *bp, int version,
                       struct Ipifc *ifc, uint8_t *ip, uint8_t *mac)
 {
-	int hash, len;
+	uint32_t hv;
 	struct arpent *a;
 	struct medium *type = ifc->m;
 	uint8_t v6ip[IPaddrlen];
-	uint16_t *s, *d;
 
 	if (version == V4) {
 		v4tov6(v6ip, ip);
 		ip = v6ip;
 	}
+	hv = arphash(ip);
 
-	qlock(&arp->qlock);
-	hash = haship(ip);
-	for (a = arp->hash[hash]; a; a = a->hash) {
-		if (ipcmp(ip, a->ip) == 0)
-			if (type == a->type)
-				break;
+	if (arpget_rcu(arp, ip, hv, type, mac)) {
+		percpu_counter_inc(&arp->hits);
+		return NULL;
 	}
 
+	qlock(&arp->qlock);
+	a = arp_find(arp, ip, hv, type);
 	if (a == NULL) {
-		a = newarp6(arp, ip, ifc, (version != V4));
+		a = newarp6(arp, ip, hv, ifc, (version != V4));
 		a->state = AWAIT;
 	}
-	a->utime = NOW;
+	arp_touch(arp, a);
 	if (a->state == AWAIT) {
 		if (bp != NULL) {
 			if (a->hold)
@@ -263,19 +419,15 @@ struct arpent *arpget(struct arp *arp, struct block *bp, int version,
 			a->last = bp;
 			bp->list = NULL;
 		}
+		percpu_counter_inc(&arp->misses);
 		return a;	/* return with arp qlocked */
 	}
 
-	s = (uint16_t *)a->mac;
-	d = (uint16_t *)mac;
-	len = a->type->maclen / 2;
-	while (len) {
-		*d++ = *s++;
-		len--;
-	}
+	memmove(mac, a->mac, a->type->maclen);
+	percpu_counter_inc(&arp->hits);
 
 	/* remove old entries */
-	if (NOW - a->ctime > 15 * 60 * 1000)
+	if (NOW - a->ctime > Arpmaxage)
 		cleanarpent(arp, a);
 
 	qunlock(&arp->qlock);
@@ -313,9 +465,11 @@ struct block *arpresolve(struct arp *arp, struct arpent *a, struct medium *type,
 		}
 	}
 
+	__seq_start_write(&a->seq);
 	memmove(a->mac, mac, type->maclen);
 	a->type = type;
 	a->state = AOK;
+	__seq_end_write(&a->seq);
 	a->utime = NOW;
 	bp = a->hold;
 	a->hold = NULL;
@@ -339,6 +493,7 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 	struct medium *type;
 	struct block *bp, *next;
 	uint8_t v6ip[IPaddrlen];
+	uint32_t hv;
 
 	arp = fs->arp;
 
@@ -366,15 +521,19 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 
 	ifc = r->rt.ifc;
 	type = ifc->m;
+	hv = arphash(ip);
 
 	qlock(&arp->qlock);
-	for (a = arp->hash[haship(ip)]; a; a = a->hash) {
+	for_each_arpent_rcu(a, arp->tab, hv) {
 		if (a->type != type || (a->state != AWAIT && a->state != AOK))
 			continue;
 
 		if (ipcmp(a->ip, ip) == 0) {
+			__seq_start_write(&a->seq);
 			a->state = AOK;
 			memmove(a->mac, mac, type->maclen);
+			a->ctime = NOW;
+			__seq_end_write(&a->seq);
 
 			if (version == V6) {
 				/* take out of re-transmit chain */
@@ -394,8 +553,7 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 			a->hold = NULL;
 			if (version == V4)
 				ip += IPv4off;
-			a->utime = NOW;
-			a->ctime = a->utime;
+			arp_touch(arp, a);
 			qunlock(&arp->qlock);
 
 			while (bp) {
@@ -421,11 +579,13 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 	}
 
 	if (refresh == 0) {
-		a = newarp6(arp, ip, ifc, 0);
+		a = newarp6(arp, ip, hv, ifc, 0);
+		__seq_start_write(&a->seq);
 		a->state = AOK;
 		a->type = type;
 		a->ctime = NOW;
 		memmove(a->mac, mac, type->maclen);
+		__seq_end_write(&a->seq);
 	}
 
 	qunlock(&arp->qlock);
@@ -437,7 +597,7 @@ int arpwrite(struct Fs *fs, char *s, long len)
 	struct route *r;
 	struct arp *arp;
 	struct block *bp;
-	struct arpent *a, *fl, **l;
+	struct arpent *a, *next;
 	struct medium *m;
 	char *f[4], buf[256];
 	uint8_t ip[IPaddrlen], mac[MAClen];
@@ -455,19 +615,14 @@ int arpwrite(struct Fs *fs, char *s, long len)
 	n = getfields(buf, f, 4, 1, " ");
 	if (strcmp(f[0], "flush") == 0) {
 		qlock(&arp->qlock);
-		for (a = arp->cache; a < &arp->cache[NCACHE]; a++) {
-			memset(a->ip, 0, sizeof(a->ip));
-			memset(a->mac, 0, sizeof(a->mac));
-			a->hash = NULL;
-			a->state = 0;
-			a->utime = 0;
+		TAILQ_FOREACH_SAFE(a, &arp->lru, lru, next) {
 			while (a->hold != NULL) {
 				bp = a->hold->list;
 				freeblist(a->hold);
 				a->hold = bp;
 			}
+			cleanarpent(arp, a);
 		}
-		memset(arp->hash, 0, sizeof(arp->hash));
 		/* clear all pkts on these lists (rxmt, dropf/l) */
 		arp->rxmt = NULL;
 		arp->dropf = NULL;
@@ -508,33 +663,14 @@ int arpwrite(struct Fs *fs, char *s, long len)
 		parseip(ip, f[1]);
 		qlock(&arp->qlock);
 
-		l = &arp->hash[haship(ip)];
-		for (a = *l; a; a = a->hash) {
-			if (memcmp(ip, a->ip, sizeof(a->ip)) == 0) {
-				*l = a->hash;
-				break;
-			}
-			l = &a->hash;
-		}
-
+		a = arp_find(arp, ip, arphash(ip), NULL);
 		if (a) {
-			/* take out of re-transmit chain */
-			l = &arp->rxmt;
-			for (fl = *l; fl; fl = fl->nextrxt) {
-				if (fl == a) {
-					*l = a->nextrxt;
-					break;
-				}
-				l = &fl->nextrxt;
+			while (a->hold != NULL) {
+				bp = a->hold->list;
+				freeblist(a->hold);
+				a->hold = bp;
 			}
-
-			a->nextrxt = NULL;
-			a->hash = NULL;
-			a->hold = NULL;
-			a->last = NULL;
-			a->ifc = NULL;
-			memset(a->ip, 0, sizeof(a->ip));
-			memset(a->mac, 0, sizeof(a->mac));
+			cleanarpent(arp, a);
 		}
 		qunlock(&arp->qlock);
 	} else
@@ -548,7 +684,11 @@ enum {
 };
 
 static char *aformat = "%-6.6s %-8.8s %-40.40I %E\n";
+static char *sformat = "stats  hits %llu misses %llu evictions %llu entries %u\n";
 
+/*
+ *  one line per entry, most recently used last, then a line of stats.
+ */
 int arpread(struct arp *arp, char *p, uint32_t offset, int len)
 {
 	struct arpent *a;
@@ -563,22 +703,29 @@ int arpread(struct arp *arp, char *p, uint32_t offset, int len)
 	len = len / Alinelen;
 
 	n = 0;
-	for (a = arp->cache; len > 0 && a < &arp->cache[NCACHE]; a++) {
-		if (a->state == 0)
-			continue;
+	qlock(&arp->qlock);
+	TAILQ_FOREACH(a, &arp->lru, lru) {
+		if (len <= 0)
+			break;
 		if (offset > 0) {
 			offset--;
 			continue;
 		}
 		len--;
 		left--;
-		qlock(&arp->qlock);
 		amt = snprintf(p + n, left, aformat, a->type->name, arpstate[a->state],
 		               a->ip, a->mac);
 		n += amt;
 		left -= amt;
-		qunlock(&arp->qlock);
 	}
+	if (len > 0 && offset == 0) {
+		amt = snprintf(p + n, left, sformat,
+		               percpu_counter_sum(&arp->hits),
+		               percpu_counter_sum(&arp->misses),
+		               arp->evictions, arp->nr_ents);
+		n += amt;
+	}
+	qunlock(&arp->qlock);
 
 	return n;
 }
@@ -589,7 +736,7 @@ static uint64_t rxmitsols(struct arp *arp)
 	struct block *next, *xp;
 	struct arpent *a, *b, **l;
 	struct Fs *f;
-	uint8_t ipsrc[IPaddrlen];
+	uint8_t ipsrc[IPaddrlen], targ[IPaddrlen];
 	struct Ipifc *ifc = NULL;
 	uint64_t nrxt;
 
@@ -605,7 +752,8 @@ static uint64_t rxmitsols(struct arp *arp)
 	if (nrxt > 3 * ReTransTimer / 4)
 		goto dodrops;	/* return nrxt; */
 
-	for (; a; a = a->nextrxt) {
+	/* cleanarpent frees a, so start over from the head each time */
+	for (; a; a = arp->rxmt) {
 		ifc = a->ifc;
 		assert(ifc != NULL);
 		if ((a->rxtsrem <= 0) || !(canrlock(&ifc->rwlock))
@@ -627,14 +775,16 @@ static uint64_t rxmitsols(struct arp *arp)
 	if (a == NULL)
 		goto dodrops;
 
+	memmove(targ, a->ip, sizeof(targ));
 	qunlock(&arp->qlock);	/* for icmpns */
 	if ((sflag = ipv6anylocal(ifc, ipsrc)) != SRC_UNSPEC)
-		icmpns(f, ipsrc, sflag, a->ip, TARG_MULTI, ifc->mac);
+		icmpns(f, ipsrc, sflag, targ, TARG_MULTI, ifc->mac);
 
 	runlock(&ifc->rwlock);
 	qlock(&arp->qlock);
 
-	/* put to the end of re-transmit chain */
+	/* put to the end of re-transmit chain, unless it went away while we
+	 * weren't holding the lock */
 	l = &arp->rxmt;
 	for (b = *l; b; b = b->nextrxt) {
 		if (b == a) {
@@ -643,13 +793,15 @@ static uint64_t rxmitsols(struct arp *arp)
 		}
 		l = &b->nextrxt;
 	}
-	for (b = *l; b; b = b->nextrxt) {
-		l = &b->nextrxt;
+	if (b) {
+		for (b = *l; b; b = b->nextrxt) {
+			l = &b->nextrxt;
+		}
+		*l = a;
+		a->rxtsrem--;
+		a->nextrxt = NULL;
+		a->rtime = NOW + ReTransTimer;
 	}
-	*l = a;
-	a->rxtsrem--;
-	a->nextrxt = NULL;
-	a->rtime = NOW + ReTransTimer;
 
 	a = arp->rxmt;
 	if (a == NULL)
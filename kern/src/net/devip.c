@@ -36,7 +36,10 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <rcu.h>
 #include <net/ip.h>
+#include <umem.h>
+#include <ros/mdata.h>
 
 struct dev ipdevtab;
 
@@ -69,11 +72,12 @@ enum {
 	Qlocal,
 	Qremote,
 	Qstatus,
+	Qmdata,
 	Qsnoop,
 
 	Logtype = 5,
 	Masktype = (1 << Logtype) - 1,
-	Logconv = 12,
+	Logconv = 18,
 	Maskconv = (1 << Logconv) - 1,
 	Shiftconv = Logtype,
 	Logproto = 8,
@@ -103,10 +107,23 @@ static void setup_proto_qio_bypass(struct conv *cv);
 static void undo_proto_qio_bypass(struct conv *cv);
 static int connected(void *a);
 
+/* Returns conv x of p.  proto_grow() can swap p->conv for a bigger table at any
+ * time and frees the old one after a grace period, so we look in it under the
+ * RCU read lock.  Convs themselves are never freed. */
+static struct conv *proto_conv(struct Proto *p, int x)
+{
+	struct conv *cv;
+
+	rcu_read_lock();
+	cv = READ_ONCE(p->conv)[x];
+	rcu_read_unlock();
+	return cv;
+}
+
 static struct conv *chan2conv(struct chan *chan)
 {
 	/* That's a lot of pointers to get to the conv! */
-	return ipfs[chan->dev]->p[PROTO(chan->qid)]->conv[CONV(chan->qid)];
+	return proto_conv(ipfs[chan->dev]->p[PROTO(chan->qid)], CONV(chan->qid));
 }
 
 static inline int founddevdir(struct chan *c, struct qid q, char *n,
@@ -193,6 +210,13 @@ static int ip3gen(struct chan *c, int i, struct dir *dp)
 		case Qremote:
 			p = "remote";
 			break;
+		case Qmdata:
+			/* Before Qsnoop, which ends the listing for everyone else. */
+			if (strcmp(cv->p->name, "udp") != 0)
+				return 0;
+			perm = qdata_stat_perm(cv);
+			return founddevdir(c, q, "mdata", qlen(cv->rq),
+							   cv->owner, perm, dp);
 		case Qsnoop:
 			if (strcmp(cv->p->name, "ipifc") != 0)
 				return -1;
@@ -297,7 +321,7 @@ ipgen(struct chan *c, char *unused_char_p_t, struct dirtab *d, int unused_int,
 			if (s == DEVDOTDOT)
 				return topdirgen(c, dp);
 			else if (s < f->p[PROTO(c->qid)]->ac) {
-				cv = f->p[PROTO(c->qid)]->conv[s];
+				cv = proto_conv(f->p[PROTO(c->qid)], s);
 				snprintf(get_cur_genbuf(), GENBUF_SZ, "%d", s);
 				mkqid(&q, QID(PROTO(c->qid), s, Qconvdir), 0, QTDIR);
 				return
@@ -323,6 +347,7 @@ ipgen(struct chan *c, char *unused_char_p_t, struct dirtab *d, int unused_int,
 		case Qlocal:
 		case Qremote:
 		case Qstatus:
+		case Qmdata:
 		case Qsnoop:
 			return ip3gen(c, TYPE(c->qid), dp);
 	}
@@ -362,6 +387,8 @@ static struct Fs *ipgetfs(int dev)
 		rwinit(&f->rwlock);
 		qlock_init(&f->iprouter.qlock);
 		ip_init(f);
+		iptrie_init(&f->v4trie, IPv4addrlen);
+		iptrie_init(&f->v6trie, IPaddrlen);
 		arpinit(f);
 		netloginit(f);
 		for (i = 0; ipprotoinit[i]; i++)
@@ -484,7 +511,7 @@ static struct chan *ipopen(struct chan *c, int omode)
 				error(EPERM, ERROR_FIXME);
 			/* might be racy.  note the lack of a proto lock, unlike Qdata */
 			p = f->p[PROTO(c->qid)];
-			cv = p->conv[CONV(c->qid)];
+			cv = proto_conv(p, CONV(c->qid));
 			if (strcmp(ATTACHER(c), cv->owner) != 0 && !iseve())
 				error(EPERM, ERROR_FIXME);
 			atomic_inc(&cv->snoopers);
@@ -506,6 +533,7 @@ static struct chan *ipopen(struct chan *c, int omode)
 			mkqid(&c->qid, QID(p->x, cv->x, Qctl), 0, QTFILE);
 			break;
 		case Qdata:
+		case Qmdata:
 		case Qctl:
 		case Qerr:
 			p = f->p[PROTO(c->qid)];
@@ -534,7 +562,7 @@ static struct chan *ipopen(struct chan *c, int omode)
 			poperror();
 			break;
 		case Qlisten:
-			cv = f->p[PROTO(c->qid)]->conv[CONV(c->qid)];
+			cv = chan2conv(c);
 			/* No permissions or Announce checks required.  We'll see if that's
 			 * a good idea or not. (the perm check would do nothing, as is,
 			 * since an O_PATH perm is 0).
@@ -640,7 +668,7 @@ static size_t ipwstat(struct chan *c, uint8_t *dp, size_t n)
 	if (n == 0)
 		error(ENODATA, ERROR_FIXME);
 	p = f->p[PROTO(c->qid)];
-	cv = p->conv[CONV(c->qid)];
+	cv = proto_conv(p, CONV(c->qid));
 	if (!iseve() && strcmp(ATTACHER(c), cv->owner) != 0)
 		error(EPERM, ERROR_FIXME);
 	if (!emptystr(d->uid))
@@ -668,7 +696,7 @@ static char *ipchaninfo(struct chan *ch, char *ret, size_t ret_l)
 			break;
 		case Qdata:
 			proto = f->p[PROTO(ch->qid)];
-			conv = proto->conv[CONV(ch->qid)];
+			conv = proto_conv(proto, CONV(ch->qid));
 			snprintf(ret, ret_l,
 			         "Qdata, %s, proto %s, conv idx %d, rq len %d, wq len %d, total read %llu",
 			         SLIST_EMPTY(&conv->data_taps) ? "untapped" : "tapped",
@@ -683,7 +711,7 @@ static char *ipchaninfo(struct chan *ch, char *ret, size_t ret_l)
 			break;
 		case Qlisten:
 			proto = f->p[PROTO(ch->qid)];
-			conv = proto->conv[CONV(ch->qid)];
+			conv = proto_conv(proto, CONV(ch->qid));
 			snprintf(ret, ret_l,
 			         "Qlisten, %s proto %s, conv idx %d, has %sincalls",
 			         SLIST_EMPTY(&conv->listen_taps) ? "untapped" : "tapped",
@@ -697,7 +725,7 @@ static char *ipchaninfo(struct chan *ch, char *ret, size_t ret_l)
 			break;
 		case Qctl:
 			proto = f->p[PROTO(ch->qid)];
-			conv = proto->conv[CONV(ch->qid)];
+			conv = proto_conv(proto, CONV(ch->qid));
 			snprintf(ret, ret_l, "Qctl, proto %s, conv idx %d", proto->name,
 					 conv->x);
 			break;
@@ -736,10 +764,12 @@ static void closeconv(struct conv *cv)
 
 	cv->r = NULL;
 	cv->rgen = 0;
+	rxring_detach(cv);
 	if (cv->state == Bypass)
 		undo_proto_qio_bypass(cv);
 	cv->p->close(cv);
 	cv->state = Idle;
+	Fsconvrelease(cv);
 	qunlock(&cv->qlock);
 	poperror();
 }
@@ -761,15 +791,16 @@ static void ipclose(struct chan *c)
 				iprouterclose(f);
 			break;
 		case Qdata:
+		case Qmdata:
 		case Qctl:
 		case Qerr:
 		case Qlisten:
 			if (c->flag & COPEN)
-				closeconv(f->p[PROTO(c->qid)]->conv[CONV(c->qid)]);
+				closeconv(chan2conv(c));
 			break;
 		case Qsnoop:
 			if (c->flag & COPEN)
-				atomic_dec(&f->p[PROTO(c->qid)]->conv[CONV(c->qid)]->snoopers);
+				atomic_dec(&chan2conv(c)->snoopers);
 			break;
 		case Qiproute:
 			if (c->flag & COPEN)
@@ -784,6 +815,40 @@ enum {
 	Statelen = 32 * 1024,
 };
 
+/* read() of mdata: one datagram, blocking for it, then all the queued ones
+ * that fit.  See ros/mdata.h. */
+static size_t ipread_mdata(struct conv *c, void *a, size_t n, bool nonblock)
+{
+	struct mdata_hdr hdr;
+	struct block *b;
+	size_t off = 0, room;
+	unsigned int nr = 0, max = READ_ONCE(c->mdata_max);
+
+	if (c->rxring)
+		error(EINVAL, "conversation has a receive ring");
+	if (n < MDATA_REC_SZ(1))
+		error(EINVAL, "mdata read of %lu is too small", n);
+	if (nonblock)
+		b = qbread_nonblock(c->rq, n);
+	else
+		b = qbread(c->rq, n);
+	while (b) {
+		/* off is aligned, so a record fits if it fits before the last
+		 * alignment boundary. */
+		room = ROUNDDOWN(n - off, MDATA_ALIGN) - sizeof(struct mdata_hdr);
+		hdr.len = MIN(BLEN(b), room);
+		hdr.flags = BLEN(b) > room ? MDATA_TRUNC : 0;
+		memcpy(a + off, &hdr, sizeof(struct mdata_hdr));
+		freeblist(bl2mem(a + off + sizeof(struct mdata_hdr), b, hdr.len));
+		off += MDATA_REC_SZ(hdr.len);
+		if (++nr == max || n - off < MDATA_REC_SZ(1))
+			break;
+		room = ROUNDDOWN(n - off, MDATA_ALIGN) - sizeof(struct mdata_hdr);
+		b = qget_whole(c->rq, room);
+	}
+	return off;
+}
+
 static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 {
 	struct conv *c;
@@ -821,7 +886,7 @@ static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 		case Qremote:
 			buf = kzmalloc(Statelen, 0);
 			x = f->p[PROTO(ch->qid)];
-			c = x->conv[CONV(ch->qid)];
+			c = proto_conv(x, CONV(ch->qid));
 			if (x->remote == NULL) {
 				snprintf(buf, Statelen, "%I!%d\n", c->raddr, c->rport);
 			} else {
@@ -833,7 +898,7 @@ static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 		case Qlocal:
 			buf = kzmalloc(Statelen, 0);
 			x = f->p[PROTO(ch->qid)];
-			c = x->conv[CONV(ch->qid)];
+			c = proto_conv(x, CONV(ch->qid));
 			if (x->local == NULL) {
 				snprintf(buf, Statelen, "%I!%d\n", c->laddr, c->lport);
 			} else {
@@ -850,7 +915,7 @@ static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 			 * changed sizes, it'll reprint the end of the buffer slightly. */
 			buf = kzmalloc(Statelen, 0);
 			x = f->p[PROTO(ch->qid)];
-			c = x->conv[CONV(ch->qid)];
+			c = proto_conv(x, CONV(ch->qid));
 			if (c->state == Bypass)
 				snprintf(buf, Statelen, "Bypassed\n");
 			else
@@ -859,16 +924,21 @@ static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 			kfree(buf);
 			return rv;
 		case Qdata:
-			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
+			c = chan2conv(ch);
+			if (c->rxring)
+				return rxring_read(c, n, ch->flag & O_NONBLOCK);
 			if (ch->flag & O_NONBLOCK)
 				return qread_nonblock(c->rq, a, n);
 			else
 				return qread(c->rq, a, n);
+		case Qmdata:
+			c = chan2conv(ch);
+			return ipread_mdata(c, a, n, ch->flag & O_NONBLOCK);
 		case Qerr:
-			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
+			c = chan2conv(ch);
 			return qread(c->eq, a, n);
 		case Qsnoop:
-			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
+			c = chan2conv(ch);
 			return qread(c->sq, a, n);
 		case Qstats:
 			x = f->p[PROTO(ch->qid)];
@@ -889,6 +959,8 @@ static struct block *ipbread(struct chan *ch, size_t n, off64_t offset)
 	switch (TYPE(ch->qid)) {
 		case Qdata:
 			c = chan2conv(ch);
+			if (c->rxring)
+				error(EINVAL, "conversation has a receive ring");
 			if (ch->flag & O_NONBLOCK)
 				return qbread_nonblock(c->rq, n);
 			else
@@ -906,6 +978,14 @@ static void setladdr(struct conv *c)
 	findlocalip(c->p->f, c->laddr, c->raddr);
 }
 
+/* Listeners that both asked for reuseport, from the same owner, can share an
+ * address.  Incoming calls get spread across them, see ipht_scan(). */
+static bool reuseport_ok(struct conv *c, struct conv *xp)
+{
+	return c->reuseport && xp->reuseport && xp->state == Announced
+	       && strcmp(c->owner, xp->owner) == 0;
+}
+
 /*
  *  set a local port making sure the quad of raddr,rport,laddr,lport is unique
  */
@@ -930,6 +1010,8 @@ static void setluniqueport(struct conv *c, int lport)
 			&& xp->rport == c->rport
 			&& ipcmp(xp->raddr, c->raddr) == 0
 			&& ipcmp(xp->laddr, c->laddr) == 0) {
+			if (reuseport_ok(c, xp))
+				continue;
 			qunlock(&p->qlock);
 			error(EFAIL, "address in use");
 		}
@@ -1373,6 +1455,41 @@ static void tosctlmsg(struct conv *c, struct cmdbuf *cb)
 		c->tos = atoi(cb->f[1]);
 }
 
+/* "reuseport [core]": lets several convs announce the same address, each with
+ * its own listen queue.  Calls that arrive on core go to this one. */
+static void reuseportctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	if (c->state != Idle)
+		error(EBUSY, "reuseport must come before announce");
+	c->reuseport = TRUE;
+	c->reuseport_core = -1;
+	if (cb->nf >= 2) {
+		c->reuseport_core = strtol(cb->f[1], 0, 0);
+		if (c->reuseport_core < 0 || c->reuseport_core >= num_cores)
+			error(EINVAL, "bad core %s", cb->f[1]);
+	}
+}
+
+/* "zerocopy [min]": writes of at least min bytes lend the user's buffer to the
+ * stack instead of copying it.  min of 0 turns it off. */
+static void zcopyctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	if (cb->nf < 2)
+		c->zcopy = Zcopymin;
+	else
+		c->zcopy = strtoul(cb->f[1], 0, 0);
+}
+
+/* "mdatamax [n]": a read of mdata returns at most n datagrams.  0, or no n,
+ * means as many as fit. */
+static void mdatamaxctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	if (cb->nf < 2)
+		c->mdata_max = 0;
+	else
+		c->mdata_max = strtoul(cb->f[1], 0, 0);
+}
+
 static void ttlctlmsg(struct conv *c, struct cmdbuf *cb)
 {
 	if (cb->nf < 2)
@@ -1397,6 +1514,64 @@ static void autobind(struct conv *cv)
 	kfree(cb);
 }
 
+/* Returns -1 if the buffer can't be used in place, e.g. it's a kernel buffer or
+ * file-backed memory. */
+static ssize_t ipwrite_zcopy(struct chan *ch, struct conv *c, void *a,
+                             size_t n)
+{
+	struct event_msg msg = {0};
+
+	if (!is_user_raddr(a, n))
+		return -1;
+	msg.ev_type = EV_ZCOPY_DONE;
+	msg.ev_arg1 = c->p->x;
+	msg.ev_arg2 = c->x;
+	msg.ev_arg3 = a;
+	if (ch->flag & O_NONBLOCK)
+		return qwrite_zcopy_nonblock(c->wq, a, n, &msg);
+	return qwrite_zcopy(c->wq, a, n, &msg);
+}
+
+/* write() of mdata: each record is a datagram, as if written to data. */
+static size_t ipwrite_mdata(struct conv *c, void *a, size_t n, bool nonblock)
+{
+	ERRSTACK(1);
+	struct mdata_hdr hdr;
+	struct block *b;
+	size_t volatile off = 0;	/* volatile for the waserror */
+
+	if (c->lport == 0)
+		autobind(c);
+	if (waserror()) {
+		/* Some went out: report them, like a short write. */
+		if (off) {
+			poperror();
+			return off;
+		}
+		nexterror();
+	}
+	while (off < n) {
+		if (n - off < sizeof(struct mdata_hdr))
+			error(EINVAL, "partial mdata header at %lu", off);
+		memcpy(&hdr, a + off, sizeof(struct mdata_hdr));
+		if (hdr.flags)
+			error(EINVAL, "bad mdata flags %x", hdr.flags);
+		if (hdr.len > n - off - sizeof(struct mdata_hdr))
+			error(EINVAL, "mdata record of %u at %lu overruns the write",
+			      hdr.len, off);
+		b = block_alloc(hdr.len, MEM_WAIT);
+		memcpy(b->wp, a + off + sizeof(struct mdata_hdr), hdr.len);
+		b->wp += hdr.len;
+		if (nonblock)
+			qbwrite_nonblock(c->wq, b);
+		else
+			qbwrite(c->wq, b);
+		off = MIN(off + MDATA_REC_SZ(hdr.len), n);
+	}
+	poperror();
+	return n;
+}
+
 static size_t ipwrite(struct chan *ch, void *v, size_t n, off64_t off)
 {
 	ERRSTACK(1);
@@ -1416,16 +1591,21 @@ static size_t ipwrite(struct chan *ch, void *v, size_t n, off64_t off)
 			error(EPERM, ERROR_FIXME);
 		case Qdata:
 			x = f->p[PROTO(ch->qid)];
-			c = x->conv[CONV(ch->qid)];
+			c = proto_conv(x, CONV(ch->qid));
 			/* connection-less protocols (UDP) can write without manually
 			 * binding. */
 			if (c->lport == 0)
 				autobind(c);
+			if (c->zcopy && n >= c->zcopy && ipwrite_zcopy(ch, c, a, n) >= 0)
+				break;
 			if (ch->flag & O_NONBLOCK)
 				qwrite_nonblock(c->wq, a, n);
 			else
 				qwrite(c->wq, a, n);
 			break;
+		case Qmdata:
+			c = chan2conv(ch);
+			return ipwrite_mdata(c, a, n, ch->flag & O_NONBLOCK);
 		case Qarp:
 			return arpwrite(f, a, n);
 		case Qiproute:
@@ -1437,7 +1617,7 @@ static size_t ipwrite(struct chan *ch, void *v, size_t n, off64_t off)
 			return ndbwrite(f, a, off, n);
 		case Qctl:
 			x = f->p[PROTO(ch->qid)];
-			c = x->conv[CONV(ch->qid)];
+			c = proto_conv(x, CONV(ch->qid));
 			cb = parsecmd(a, n);
 
 			qlock(&c->qlock);
@@ -1464,6 +1644,12 @@ static size_t ipwrite(struct chan *ch, void *v, size_t n, off64_t off)
 				tosctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "ignoreadvice") == 0)
 				c->ignoreadvice = 1;
+			else if (strcmp(cb->f[0], "zerocopy") == 0)
+				zcopyctlmsg(c, cb);
+			else if (strcmp(cb->f[0], "mdatamax") == 0)
+				mdatamaxctlmsg(c, cb);
+			else if (strcmp(cb->f[0], "reuseport") == 0)
+				reuseportctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "addmulti") == 0) {
 				if (cb->nf < 2)
 					error(EFAIL, "addmulti needs interface address");
@@ -1680,6 +1866,8 @@ int Fsproto(struct Fs *f, struct Proto *p)
 		return -1;
 
 	qlock_init(&p->qlock);
+	spinlock_init(&p->freelock);
+	p->freeconv = NULL;
 	p->f = f;
 
 	if (p->ipproto > 0) {
@@ -1690,6 +1878,11 @@ int Fsproto(struct Fs *f, struct Proto *p)
 
 	p->qid.type = QTDIR;
 	p->qid.path = QID(f->np, 0, Qprotodir);
+	if (p->maxnc < p->nc)
+		p->maxnc = p->nc;
+	static_assert(Maxconv <= Maskconv + 1);
+	if (p->maxnc > Maxconv)
+		p->maxnc = Maxconv;
 	p->conv = kzmalloc(sizeof(struct conv *) * (p->nc + 1), 0);
 	if (p->conv == NULL)
 		panic("Fsproto");
@@ -1712,61 +1905,169 @@ int Fsbuiltinproto(struct Fs *f, uint8_t proto)
 }
 
 /*
- *  called with protocol locked
+ *  called when a conversation may have become reusable: processes have closed
+ *  it or the protocol is done with it.  the conv goes on the protocol's free
+ *  list, and Fsprotoclone checks it for real when it takes it off.  whoever
+ *  finishes with a conv last must call this, or the conv is only found again
+ *  by the slow scan once the table is full.
  */
-struct conv *Fsprotoclone(struct Proto *p, char *user)
+void Fsconvrelease(struct conv *c)
 {
-	struct conv *c, **pp, **ep;
+	struct Proto *p = c->p;
 
-retry:
-	c = NULL;
-	ep = &p->conv[p->nc];
-	for (pp = p->conv; pp < ep; pp++) {
-		c = *pp;
-		if (c == NULL) {
-			c = kzmalloc(sizeof(struct conv), 0);
-			if (c == NULL)
-				error(ENOMEM,
-				      "conv kzmalloc(%d, 0) failed in Fsprotoclone",
-				      sizeof(struct conv));
-			qlock_init(&c->qlock);
-			qlock_init(&c->listenq);
-			rendez_init(&c->cr);
-			rendez_init(&c->listenr);
-			SLIST_INIT(&c->data_taps);	/* already = 0; set to be futureproof */
-			SLIST_INIT(&c->listen_taps);
-			spinlock_init(&c->tap_lock);
-			qlock(&c->qlock);
-			c->p = p;
-			c->x = pp - p->conv;
-			if (p->ptclsize != 0) {
-				c->ptcl = kzmalloc(p->ptclsize, 0);
-				if (c->ptcl == NULL) {
-					kfree(c);
-					error(ENOMEM,
-					      "ptcl kzmalloc(%d, 0) failed in Fsprotoclone",
-					      p->ptclsize);
-				}
-			}
-			*pp = c;
-			p->ac++;
-			c->eq = qopen(1024, Qmsg, 0, 0);
-			(*p->create) (c);
-			assert(c->rq && c->wq);
-			break;
+	spin_lock(&p->freelock);
+	if (!c->onfreelist) {
+		c->onfreelist = TRUE;
+		c->freenext = p->freeconv;
+		p->freeconv = c;
+	}
+	spin_unlock(&p->freelock);
+}
+
+/* make sure both processes and protocol are done with this conv */
+static bool conv_is_free(struct Proto *p, struct conv *c)
+{
+	return c->inuse == 0 && (p->inuse == NULL || (*p->inuse) (c) == 0);
+}
+
+enum {
+	Maxconvheld = 16,
+};
+
+/*
+ *  pop convs off the free list until we find one that is really free.  returns
+ *  it qlocked, or NULL.  convs that turn out to be busy are dropped; they'll be
+ *  released again when their users are done.  convs we can't lock might be
+ *  free, so they go back on the list.
+ */
+static struct conv *conv_reuse(struct Proto *p)
+{
+	struct conv *c, *held[Maxconvheld];
+	int nheld = 0;
+
+	for (;;) {
+		spin_lock(&p->freelock);
+		c = p->freeconv;
+		if (c != NULL) {
+			p->freeconv = c->freenext;
+			c->onfreelist = FALSE;
 		}
-		if (canqlock(&c->qlock)) {
-			/*
-			 *  make sure both processes and protocol
-			 *  are done with this Conv
-			 */
-			if (c->inuse == 0 && (p->inuse == NULL || (*p->inuse) (c) == 0))
+		spin_unlock(&p->freelock);
+		if (c == NULL)
+			break;
+		if (!canqlock(&c->qlock)) {
+			held[nheld++] = c;
+			if (nheld == Maxconvheld) {
+				c = NULL;
 				break;
+			}
+			continue;
+		}
+		if (conv_is_free(p, c))
+			break;
+		qunlock(&c->qlock);
+	}
+	while (nheld > 0)
+		Fsconvrelease(held[--nheld]);
+	return c;
+}
 
+/*
+ *  the slow path, for protocols whose inuse() can go false without calling
+ *  Fsconvrelease.
+ */
+static struct conv *conv_scan(struct Proto *p)
+{
+	struct conv *c;
+
+	for (int i = 0; i < p->ac; i++) {
+		c = p->conv[i];
+		if (canqlock(&c->qlock)) {
+			if (conv_is_free(p, c))
+				return c;
 			qunlock(&c->qlock);
 		}
 	}
-	if (pp >= ep) {
+	return NULL;
+}
+
+/*
+ *  double the conv table, up to maxnc.  lookups go through proto_conv()
+ *  without the protocol lock, so the old table lives until everyone is done
+ *  with it.
+ */
+static bool proto_grow(struct Proto *p)
+{
+	struct conv **old, **new;
+	int nc;
+
+	if (p->nc >= p->maxnc)
+		return FALSE;
+	nc = MIN(p->nc * 2, p->maxnc);
+	new = kzmalloc(sizeof(struct conv *) * (nc + 1), 0);
+	if (new == NULL)
+		return FALSE;
+	old = p->conv;
+	memcpy(new, old, sizeof(struct conv *) * p->nc);
+	/* publish the table before the size, so no one indexes past old */
+	wmb();
+	WRITE_ONCE(p->conv, new);
+	wmb();
+	WRITE_ONCE(p->nc, nc);
+	synchronize_rcu();
+	kfree(old);
+	return TRUE;
+}
+
+/* allocate the next conv in the table, returned qlocked */
+static struct conv *newconv(struct Proto *p)
+{
+	struct conv *c;
+
+	c = kzmalloc(sizeof(struct conv), 0);
+	if (c == NULL)
+		error(ENOMEM, "conv kzmalloc(%d, 0) failed in Fsprotoclone",
+		      sizeof(struct conv));
+	qlock_init(&c->qlock);
+	qlock_init(&c->listenq);
+	rendez_init(&c->cr);
+	rendez_init(&c->listenr);
+	SLIST_INIT(&c->data_taps);	/* already = 0; set to be futureproof */
+	SLIST_INIT(&c->listen_taps);
+	spinlock_init(&c->tap_lock);
+	qlock(&c->qlock);
+	c->p = p;
+	c->x = p->ac;
+	if (p->ptclsize != 0) {
+		c->ptcl = kzmalloc(p->ptclsize, 0);
+		if (c->ptcl == NULL) {
+			kfree(c);
+			error(ENOMEM, "ptcl kzmalloc(%d, 0) failed in Fsprotoclone",
+			      p->ptclsize);
+		}
+	}
+	p->conv[p->ac] = c;
+	p->ac++;
+	c->eq = qopen(1024, Qmsg, 0, 0);
+	(*p->create) (c);
+	assert(c->rq && c->wq);
+	return c;
+}
+
+/*
+ *  called with protocol locked
+ */
+struct conv *Fsprotoclone(struct Proto *p, char *user)
+{
+	struct conv *c;
+
+retry:
+	c = conv_reuse(p);
+	if (c == NULL && (p->ac < p->nc || proto_grow(p)))
+		c = newconv(p);
+	if (c == NULL)
+		c = conv_scan(p);
+	if (c == NULL) {
 		if (p->gc != NULL && (*p->gc) (p))
 			goto retry;
 		return NULL;
@@ -1785,6 +2086,10 @@ retry:
 	c->restricted = 0;
 	c->ttl = MAXTTL;
 	c->tos = DFLTTOS;
+	c->zcopy = 0;
+	c->mdata_max = 0;
+	c->reuseport = FALSE;
+	c->reuseport_core = -1;
 	qreopen(c->rq);
 	qreopen(c->wq);
 	qreopen(c->eq);
@@ -56,6 +56,9 @@ static uint8_t etherbroadcast[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 
 static void etherread4(void *a);
 static void etherread6(void *a);
+static void etherrx4(void *a, struct block *bp, int rxq);
+static void etherrx6(void *a, struct block *bp, int rxq);
+static void etherrxflush4(void *a, int rxq);
 static void etherbind(struct Ipifc *ifc, int argc, char **argv);
 static void etherunbind(struct Ipifc *ifc);
 static void etherbwrite(struct Ipifc *ifc, struct block *bp, int version,
@@ -114,6 +117,8 @@ struct Etherrock {
 	struct chan *cchan4;		/* Control channel for v4 */
 	struct chan *mchan6;		/* Data channel for v6 */
 	struct chan *cchan6;		/* Control channel for v6 */
+	struct gro *gro;			/* one per ether RX queue */
+	bool rxhooked;				/* RX queue workers call us directly */
 };
 
 /*
@@ -165,6 +170,8 @@ static unsigned int parsefeat(char *ptr)
 		feat |= NETF_LRO;
 	if (strstr(ptr, "rxcsum"))
 		feat |= NETF_RXCSUM;
+	if (strstr(ptr, "gso"))
+		feat |= NETF_GSO;
 	return feat;
 }
 
@@ -291,6 +298,9 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	er->mchan6 = mchan6;
 	er->cchan6 = cchan6;
 	er->f = ifc->conv->p->f;
+	er->gro = kzmalloc(sizeof(struct gro) * num_cores, MEM_WAIT);
+	for (int i = 0; i < num_cores; i++)
+		gro_init(&er->gro[i], er->f, ifc);
 	ifc->arg = er;
 
 	kfree(buf);
@@ -298,6 +308,14 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	kfree(dir);
 	poperror();
 
+	/* with RX queues, the ether device hands us packets from the queue's
+	 * core, skipping the readers. */
+	if (!strcmp(chan_dev_name(mchan4), "ether")) {
+		etherrxhook(mchan4, etherrx4, etherrxflush4, ifc);
+		etherrxhook(mchan6, etherrx6, NULL, ifc);
+		er->rxhooked = TRUE;
+	}
+
 	ktask("etherread4", etherread4, ifc);
 	ktask("recvarpproc", recvarpproc, ifc);
 	ktask("etherread6", etherread6, ifc);
@@ -321,6 +339,13 @@ static void etherunbind(struct Ipifc *ifc)
 		postnote(er->arpp, 1, "unbind", 0);
 #endif
 
+	/* stop the RX queue workers calling in, and wait for the ones that
+	 * already have, before we free er and its gro. */
+	if (er->rxhooked) {
+		etherrxhook(er->mchan4, NULL, NULL, NULL);
+		etherrxhook(er->mchan6, NULL, NULL, NULL);
+	}
+
 	/* wait for readers to die */
 	while (er->arpp != 0 || er->read4p != 0 || er->read6p != 0)
 		cpu_relax();
@@ -337,6 +362,9 @@ static void etherunbind(struct Ipifc *ifc)
 	if (er->cchan6 != NULL)
 		cclose(er->cchan6);
 
+	for (int i = 0; i < num_cores; i++)
+		gro_drop(&er->gro[i]);
+	kfree(er->gro);
 	kfree(er);
 }
 
@@ -416,12 +444,97 @@ etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 	ifc->out++;
 }
 
+/*
+ *  pass a packet from the ethernet up to ip, through RX queue rxq's gro if
+ *  rxq isn't -1.  er is only safe to touch once we have the ifc rlock; unbind
+ *  frees it under the wlock.
+ */
+static void etherrecv(struct Ipifc *ifc, struct block *bp, int version,
+                      int rxq)
+{
+	ERRSTACK(1);
+	Etherrock *er;
+
+	if (!canrlock(&ifc->rwlock)) {
+		freeb(bp);
+		return;
+	}
+	er = ifc->arg;
+	if (waserror()) {
+		runlock(&ifc->rwlock);
+		nexterror();
+	}
+	ifc->in++;
+	bp->rp += ifc->m->hsize;
+	if (ifc->lifc == NULL) {
+		freeb(bp);
+	} else {
+		ipifc_trace_block(ifc, bp);
+		if (version == V4 && rxq >= 0)
+			gro_receive(&er->gro[rxq], bp);
+		else if (version == V4)
+			ipiput4(er->f, ifc, bp);
+		else
+			ipiput6(er->f, ifc, bp);
+	}
+	runlock(&ifc->rwlock);
+	poperror();
+}
+
+/*
+ *  called by the ether RX queue workers.  v4 goes through the queue's gro,
+ *  which is flushed when the queue runs dry.
+ */
+static void etherrx(struct Ipifc *ifc, struct block *bp, int version, int rxq)
+{
+	ERRSTACK(1);
+
+	if (waserror()) {
+		warn("ether rx: %s", get_cur_errbuf());
+		poperror();
+		return;
+	}
+	etherrecv(ifc, bp, version, rxq);
+	poperror();
+}
+
+static void etherrx4(void *a, struct block *bp, int rxq)
+{
+	etherrx(a, bp, V4, rxq);
+}
+
+static void etherrx6(void *a, struct block *bp, int rxq)
+{
+	etherrx(a, bp, V6, -1);
+}
+
+static void etherrxflush4(void *a, int rxq)
+{
+	ERRSTACK(1);
+	struct Ipifc *ifc = a;
+	Etherrock *er;
+
+	/* Whoever holds the wlock may be unbinding, which drops the gro */
+	if (!canrlock(&ifc->rwlock))
+		return;
+	er = ifc->arg;
+	if (waserror()) {
+		runlock(&ifc->rwlock);
+		warn("ether rx flush: %s", get_cur_errbuf());
+		poperror();
+		return;
+	}
+	gro_flush(&er->gro[rxq]);
+	runlock(&ifc->rwlock);
+	poperror();
+}
+
 /*
  *  process to read from the ethernet
  */
 static void etherread4(void *a)
 {
-	ERRSTACK(2);
+	ERRSTACK(1);
 	struct Ipifc *ifc;
 	struct block *bp;
 	Etherrock *er;
@@ -437,24 +550,7 @@ static void etherread4(void *a)
 	}
 	for (;;) {
 		bp = devtab[er->mchan4->type].bread(er->mchan4, 128 * 1024, 0);
-		if (!canrlock(&ifc->rwlock)) {
-			freeb(bp);
-			continue;
-		}
-		if (waserror()) {
-			runlock(&ifc->rwlock);
-			nexterror();
-		}
-		ifc->in++;
-		bp->rp += ifc->m->hsize;
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput4(er->f, ifc, bp);
-		}
-		runlock(&ifc->rwlock);
-		poperror();
+		etherrecv(ifc, bp, V4, -1);
 	}
 	poperror();
 }
@@ -464,7 +560,7 @@ static void etherread4(void *a)
  */
 static void etherread6(void *a)
 {
-	ERRSTACK(2);
+	ERRSTACK(1);
 	struct Ipifc *ifc;
 	struct block *bp;
 	Etherrock *er;
@@ -480,24 +576,7 @@ static void etherread6(void *a)
 	}
 	for (;;) {
 		bp = devtab[er->mchan6->type].bread(er->mchan6, ifc->maxtu, 0);
-		if (!canrlock(&ifc->rwlock)) {
-			freeb(bp);
-			continue;
-		}
-		if (waserror()) {
-			runlock(&ifc->rwlock);
-			nexterror();
-		}
-		ifc->in++;
-		bp->rp += ifc->m->hsize;
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput6(er->f, ifc, bp);
-		}
-		runlock(&ifc->rwlock);
-		poperror();
+		etherrecv(ifc, bp, V6, -1);
 	}
 	poperror();
 }
@@ -555,6 +634,8 @@ static void sendarp(struct Ipifc *ifc, struct arpent *a)
 	struct block *bp;
 	Etherarp *e;
 	Etherrock *er = ifc->arg;
+	struct medium *type = a->type;
+	uint8_t tpa[IPv4addrlen];
 
 	/* don't do anything if it's been less than a second since the last.  ctime
 	 * is set to 0 for the first time through.  we hold the f->arp qlock, so
@@ -574,17 +655,18 @@ static void sendarp(struct Ipifc *ifc, struct arpent *a)
 		freeblist(bp);
 	}
 
-	/* update last sent time */
+	/* update last sent time.  a can go away once we release the arp. */
 	a->ctime = NOW;
+	memmove(tpa, a->ip + IPv4off, sizeof(tpa));
 	arprelease(er->f->arp, a);
 
 	n = sizeof(Etherarp);
-	if (n < a->type->mintu)
-		n = a->type->mintu;
+	if (n < type->mintu)
+		n = type->mintu;
 	bp = block_alloc(n, MEM_WAIT);
 	memset(bp->rp, 0, n);
 	e = (Etherarp *) bp->rp;
-	memmove(e->tpa, a->ip + IPv4off, sizeof(e->tpa));
+	memmove(e->tpa, tpa, sizeof(e->tpa));
 	ipv4local(ifc, e->spa);
 	memmove(e->sha, ifc->mac, sizeof(e->sha));
 	memset(e->d, 0xff, sizeof(e->d));	/* ethernet broadcast */
@@ -608,7 +690,7 @@ static void resolveaddr6(struct Ipifc *ifc, struct arpent *a)
 	int sflag;
 	struct block *bp;
 	Etherrock *er = ifc->arg;
-	uint8_t ipsrc[IPaddrlen];
+	uint8_t ipsrc[IPaddrlen], targ[IPaddrlen];
 
 	/* don't do anything if it's been less than a second since the last */
 	if (NOW - a->ctime < ReTransTimer) {
@@ -633,10 +715,11 @@ static void resolveaddr6(struct Ipifc *ifc, struct arpent *a)
 	}
 
 	a->rxtsrem--;
+	memmove(targ, a->ip, sizeof(targ));
 	arprelease(er->f->arp, a);
 
 	if ((sflag = ipv6anylocal(ifc, ipsrc)))
-		icmpns(er->f, ipsrc, sflag, a->ip, TARG_MULTI, ifc->mac);
+		icmpns(er->f, ipsrc, sflag, targ, TARG_MULTI, ifc->mac);
 }
 
 /*
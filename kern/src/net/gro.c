@@ -0,0 +1,255 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Software GRO (generic receive offload).
+ *
+ * A bulk TCP receiver gets a stream of MSS-sized segments, and each one used to
+ * go through ipiput4, the conversation lookup and tcpiput on its own.  Here we
+ * hold on to the first segment of a flow and glue the payloads of the segments
+ * that follow it on as extra_data, without copying, then pass the whole thing
+ * up as one big segment.
+ *
+ * We only merge plain, in-order data: IPv4 without options or fragments, TCP
+ * with just ACK (or ACK|PSH), the same ack, window and options as the first
+ * segment, and no more payload than the first segment had.  Anything else for
+ * the flow flushes it first, so the stack sees segments in the order they
+ * arrived.  We flush a flow on PSH, on a short segment, when it gets too big,
+ * and when the caller runs out of packets (gro_flush()).
+ *
+ * The merged block's TCP checksum is meaningless, so we check every segment's
+ * checksum before merging it and mark the result Btcpck.
+ */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <net/ip.h>
+
+enum {
+	Iphdr = 20,				/* IPv4, no options */
+	Tcphdr = 20,			/* TCP, no options */
+
+	/* TCP flags */
+	PSH = 0x08,
+	ACK = 0x10,
+
+	Tcpproto = 6,
+	IP_MF_OFF = 0x3fff,		/* frag offset and more-frags */
+};
+
+/* Where things are, relative to the start of the IP header. */
+#define TCP(h)		((h) + Iphdr)
+#define TCP_SEQ(h)	(TCP(h) + 4)
+#define TCP_ACK(h)	(TCP(h) + 8)
+#define TCP_HLEN(h)	((TCP(h)[12] >> 4) << 2)
+#define TCP_FLAGS(h)	(TCP(h)[13])
+#define TCP_WIN(h)	(TCP(h) + 14)
+
+void gro_init(struct gro *g, struct Fs *f, struct Ipifc *ifc)
+{
+	memset(g, 0, sizeof(struct gro));
+	g->f = f;
+	g->ifc = ifc;
+}
+
+/* The TCP checksum, using the same in-place pseudo-header trick as tcpiput:
+ * with the ttl zeroed and the IP checksum replaced by the TCP length, the
+ * bytes from the ttl on are the pseudo-header followed by the segment. */
+static bool gro_tcp_csum_ok(struct block *bp, int iplen)
+{
+	uint8_t *h = bp->rp;
+	uint8_t ttl = h[8], ck0 = h[10], ck1 = h[11];
+	bool ok;
+
+	if (bp->flag & Btcpck)
+		return TRUE;
+	h[8] = 0;
+	hnputs(h + 10, iplen - Iphdr);
+	ok = ptclcsum(bp, 8, iplen - 8) == 0;
+	h[8] = ttl;
+	h[10] = ck0;
+	h[11] = ck1;
+	return ok;
+}
+
+static void gro_deliver(struct gro *g, struct block *bp)
+{
+	ipiput4(g->f, g->ifc, bp);
+}
+
+static void gro_flush_flow(struct gro *g, struct gro_flow *fl)
+{
+	struct block *bp = fl->bp;
+	uint8_t *h;
+
+	if (!bp)
+		return;
+	fl->bp = NULL;
+	if (fl->nsegs > 1) {
+		h = bp->rp;
+		hnputs(h + 2, BLEN(bp));
+		h[10] = h[11] = 0;
+		hnputs(h + 10, ipcsum(h));
+		bp->flag |= Bipck | Btcpck;
+	}
+	gro_deliver(g, bp);
+}
+
+static struct gro_flow *gro_lookup(struct gro *g, uint8_t *h)
+{
+	struct gro_flow *fl;
+	uint16_t sport = nhgets(TCP(h));
+	uint16_t dport = nhgets(TCP(h) + 2);
+
+	for (int i = 0; i < Groflows; i++) {
+		fl = &g->flows[i];
+		if (fl->bp && fl->sport == sport && fl->dport == dport
+		    && !memcmp(fl->src, h + 12, IPv4addrlen)
+		    && !memcmp(fl->dst, h + 16, IPv4addrlen))
+			return fl;
+	}
+	return NULL;
+}
+
+static struct gro_flow *gro_new_flow(struct gro *g, struct block *bp,
+                                     int payload)
+{
+	struct gro_flow *fl = NULL;
+	uint8_t *h = bp->rp;
+
+	for (int i = 0; i < Groflows; i++) {
+		if (!g->flows[i].bp) {
+			fl = &g->flows[i];
+			break;
+		}
+	}
+	if (!fl) {
+		fl = &g->flows[g->evict++ % Groflows];
+		gro_flush_flow(g, fl);
+	}
+	fl->bp = bp;
+	memcpy(fl->src, h + 12, IPv4addrlen);
+	memcpy(fl->dst, h + 16, IPv4addrlen);
+	fl->sport = nhgets(TCP(h));
+	fl->dport = nhgets(TCP(h) + 2);
+	fl->seq = nhgetl(TCP_SEQ(h)) + payload;
+	fl->mss = payload;
+	fl->nsegs = 1;
+	return fl;
+}
+
+/* Can seg, with its headers at h, go on the end of fl? */
+static bool gro_can_merge(struct gro_flow *fl, uint8_t *h, int payload)
+{
+	uint8_t *fh = fl->bp->rp;
+	int thl = TCP_HLEN(h);
+
+	return nhgetl(TCP_SEQ(h)) == fl->seq
+	       && payload <= fl->mss
+	       && fl->nsegs < Gromaxsegs
+	       && BLEN(fl->bp) + payload <= 0xffff
+	       && thl == TCP_HLEN(fh)
+	       && h[1] == fh[1]		/* tos */
+	       && h[8] == fh[8]		/* ttl */
+	       && !memcmp(TCP_ACK(h), TCP_ACK(fh), 4)
+	       && !memcmp(TCP_WIN(h), TCP_WIN(fh), 2)
+	       && !memcmp(TCP(h) + Tcphdr, TCP(fh) + Tcphdr, thl - Tcphdr);
+}
+
+static bool gro_merge(struct gro_flow *fl, struct block *bp, int payload)
+{
+	struct block *head = fl->bp;
+	uint8_t *h = bp->rp;
+	int hlen = Iphdr + TCP_HLEN(h);
+	uint8_t flags = TCP_FLAGS(h);
+
+	if (fl->nsegs == 1 && block_add_extd(head, Gromaxsegs - 1, MEM_ATOMIC))
+		return FALSE;
+	bp->rp += hlen;
+	if (block_append_block(head, bp, MEM_ATOMIC)) {
+		bp->rp -= hlen;
+		return FALSE;
+	}
+	TCP_FLAGS(head->rp) |= flags & PSH;
+	fl->seq += payload;
+	fl->nsegs++;
+	return TRUE;
+}
+
+/*
+ * Takes an IPv4 packet, rp at the IP header, and either holds on to it or
+ * passes it (and maybe some held packets) up to ipiput4.
+ */
+void gro_receive(struct gro *g, struct block *bp)
+{
+	struct gro_flow *fl;
+	uint8_t *h = bp->rp;
+	int iplen, thl, payload;
+	uint8_t flags;
+	uint8_t dst6[IPaddrlen];
+
+	if (BHLEN(bp) < Iphdr + Tcphdr || bp->next || bp->extra_len
+	    || h[0] != (IP_VER4 | 5) || h[9] != Tcpproto)
+		goto deliver;
+	fl = gro_lookup(g, h);
+	iplen = nhgets(h + 2);
+	thl = TCP_HLEN(h);
+	flags = TCP_FLAGS(h);
+	if (nhgets(h + 6) & IP_MF_OFF || thl < Tcphdr || iplen < Iphdr + thl
+	    || iplen > BHLEN(bp))
+		goto flush_deliver;
+	payload = iplen - Iphdr - thl;
+	if (!payload || (flags & ~PSH) != ACK)
+		goto flush_deliver;
+	/* ether pads short frames */
+	bp->wp = bp->rp + iplen;
+	if ((!(bp->flag & Bipck) && ipcsum(h)) || !gro_tcp_csum_ok(bp, iplen))
+		goto flush_deliver;
+	bp->flag |= Bipck | Btcpck;
+
+	if (fl) {
+		if (gro_can_merge(fl, h, payload) && gro_merge(fl, bp, payload)) {
+			if (flags & PSH || payload < fl->mss)
+				gro_flush_flow(g, fl);
+			return;
+		}
+		gro_flush_flow(g, fl);
+	}
+	if (flags & PSH)
+		goto deliver;
+	v4tov6(dst6, h + 16);
+	if (ipforme(g->f, dst6) != Runi)
+		goto deliver;
+	gro_new_flow(g, bp, payload);
+	return;
+
+flush_deliver:
+	if (fl)
+		gro_flush_flow(g, fl);
+deliver:
+	gro_deliver(g, bp);
+}
+
+/* Passes up everything we're holding. */
+void gro_flush(struct gro *g)
+{
+	for (int i = 0; i < Groflows; i++)
+		gro_flush_flow(g, &g->flows[i]);
+}
+
+/* Frees everything we're holding, for when we can't pass it up. */
+void gro_drop(struct gro *g)
+{
+	struct gro_flow *fl;
+
+	for (int i = 0; i < Groflows; i++) {
+		fl = &g->flows[i];
+		if (fl->bp) {
+			freeb(fl->bp);
+			fl->bp = NULL;
+		}
+	}
+}
@@ -38,6 +38,8 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <endian.h>
+#include <hash.h>
+#include <rculist.h>
 
 /*
  *  well known IP addresses
@@ -594,24 +596,121 @@ int parsemac(uint8_t * to, char *from, int len)
 
 /*
  *  hashing tcp, udp, ... connections
- *  gcc weirdness: it gave a bogus result until ron split the %= out.
+ *
+ *  Mixes the low words of both addresses with the ports.  The table uses the
+ *  low bits, so they need to depend on all of the input.
  */
 uint32_t iphash(uint8_t * sa, uint16_t sp, uint8_t * da, uint16_t dp)
 {
-	uint32_t ret;
-	ret = (sa[IPaddrlen - 1] << 24) ^ (sp << 16) ^ (da[IPaddrlen - 1] << 8)
-		^ dp;
-	ret %= Nhash;
-	return ret;
+	uint64_t key;
+
+	key = ((uint64_t)nhgetl(sa + IPaddrlen - 4) << 32) ^
+	      nhgetl(da + IPaddrlen - 4) ^ ((uint64_t)sp << 16) ^ dp;
+	return hash_64(key, 32);
+}
+
+static struct iphtab *iphtab_alloc(unsigned int nr_buckets, unsigned int gen)
+{
+	struct iphtab *tab;
+
+	tab = kzmalloc(sizeof(struct iphtab) +
+	               nr_buckets * sizeof(struct hlist_head), MEM_WAIT);
+	tab->gen = gen;
+	tab->nr_buckets = nr_buckets;
+	return tab;
+}
+
+static struct hlist_node *iph_link(struct Iphash *h, struct iphtab *tab)
+{
+	return &h->link[tab->gen & 1];
+}
+
+static struct Iphash *iph_entry(struct hlist_node *n, struct iphtab *tab)
+{
+	if (!n)
+		return NULL;
+	if (tab->gen & 1)
+		return container_of(n, struct Iphash, link[1]);
+	return container_of(n, struct Iphash, link[0]);
+}
+
+#define for_each_iph_rcu(h, tab, hv)                                           \
+	for (h = iph_entry(rcu_dereference(hlist_first_rcu(                        \
+	             &(tab)->buckets[(hv) & ((tab)->nr_buckets - 1)])), tab);      \
+	     h;                                                                    \
+	     h = iph_entry(rcu_dereference(hlist_next_rcu(iph_link(h, tab))), tab))
+
+static spinlock_t *ipht_lock_of(struct Ipht *ht, uint32_t hv)
+{
+	return &ht->locks[hv & (Nipht_locks - 1)];
+}
+
+void iphtinit(struct Ipht *ht)
+{
+	static_assert(Nipht_locks <= Nipht);
+	ht->tab = iphtab_alloc(Nipht, 0);
+	atomic_init(&ht->nr_items, 0);
+	atomic_init(&ht->resizing, 0);
+	for (int i = 0; i < Nipht_locks; i++)
+		spinlock_init(&ht->locks[i]);
+}
+
+/* Grows the table, doubling until there is a bucket per conv.  Runs as a
+ * routine kernel message, since it blocks.
+ *
+ * Every bucket of the new table maps to the same lock stripe as the bucket it
+ * came from, so holding all of the stripes keeps out every writer.  Entries are
+ * linked into the new table through their other link field, leaving the old
+ * table intact for lockless readers.  Those fields are free since the last
+ * resize waited for its readers before clearing 'resizing'. */
+static void __ipht_grow(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct Ipht *ht = (struct Ipht*)a0;
+	struct iphtab *old = ht->tab;
+	struct iphtab *new;
+	struct Iphash *h;
+	unsigned int nr_buckets = old->nr_buckets * 2;
+
+	while (nr_buckets < atomic_read(&ht->nr_items) && nr_buckets < Nipht_max)
+		nr_buckets *= 2;
+	new = iphtab_alloc(nr_buckets, old->gen + 1);
+	for (int i = 0; i < Nipht_locks; i++)
+		spin_lock(&ht->locks[i]);
+	for (int i = 0; i < old->nr_buckets; i++) {
+		for_each_iph_rcu(h, old, i)
+			hlist_add_head(iph_link(h, new),
+			               &new->buckets[h->hv & (new->nr_buckets - 1)]);
+	}
+	rcu_assign_pointer(ht->tab, new);
+	for (int i = 0; i < Nipht_locks; i++)
+		spin_unlock(&ht->locks[i]);
+	synchronize_rcu();
+	kfree(old);
+	atomic_set(&ht->resizing, 0);
+}
+
+static void ipht_maybe_grow(struct Ipht *ht)
+{
+	struct iphtab *tab = ACCESS_ONCE(ht->tab);
+
+	if (atomic_read(&ht->nr_items) <= tab->nr_buckets)
+		return;
+	if (tab->nr_buckets >= Nipht_max)
+		return;
+	if (!atomic_cas(&ht->resizing, 0, 1))
+		return;
+	send_kernel_message(core_id(), __ipht_grow, (long)ht, 0, 0,
+	                    KMSG_ROUTINE);
 }
 
 void iphtadd(struct Ipht *ht, struct conv *c)
 {
-	uint32_t hv;
 	struct Iphash *h;
+	struct iphtab *tab;
+	spinlock_t *lock;
 
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	h = kzmalloc(sizeof(*h), 0);
+	h = kzmalloc(sizeof(*h), MEM_WAIT);
+	h->hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
 	if (ipcmp(c->raddr, IPnoaddr) != 0)
 		h->match = IPmatchexact;
 	else {
@@ -629,118 +728,149 @@ void iphtadd(struct Ipht *ht, struct conv *c)
 	}
 	h->c = c;
 
-	spin_lock(&ht->lock);
-	h->next = ht->tab[hv];
-	ht->tab[hv] = h;
-	spin_unlock(&ht->lock);
+	lock = ipht_lock_of(ht, h->hv);
+	spin_lock(lock);
+	/* The stripe keeps the table from changing under us. */
+	tab = ht->tab;
+	hlist_add_head_rcu(iph_link(h, tab),
+	                   &tab->buckets[h->hv & (tab->nr_buckets - 1)]);
+	spin_unlock(lock);
+	atomic_inc(&ht->nr_items);
+	ipht_maybe_grow(ht);
 }
 
 void iphtrem(struct Ipht *ht, struct conv *c)
 {
 	uint32_t hv;
-	struct Iphash **l, *h;
+	struct Iphash *h;
+	struct iphtab *tab;
+	spinlock_t *lock;
 
 	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	spin_lock(&ht->lock);
-	for (l = &ht->tab[hv]; (*l) != NULL; l = &(*l)->next)
-		if ((*l)->c == c) {
-			h = *l;
-			(*l) = h->next;
-			kfree(h);
+	lock = ipht_lock_of(ht, hv);
+	spin_lock(lock);
+	tab = ht->tab;
+	for_each_iph_rcu(h, tab, hv) {
+		if (h->c == c) {
+			hlist_del_rcu(iph_link(h, tab));
+			atomic_dec(&ht->nr_items);
+			kfree_rcu(h, rcu);
 			break;
 		}
-	spin_unlock(&ht->lock);
+	}
+	spin_unlock(lock);
 }
 
-/* look for a matching conversation with the following precedence
- *	connected && raddr,rport,laddr,lport
- *	announced && laddr,lport
- *	announced && *,lport
- *	announced && laddr,*
- *	announced && *,*
- */
-struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
-					  uint16_t dp)
+static bool ipht_match(struct Iphash *h, int match, uint8_t *sa, uint16_t sp,
+                       uint8_t *da, uint16_t dp)
 {
-	uint32_t hv;
-	struct Iphash *h;
-	struct conv *c;
-
-	/* exact 4 pair match (connection) */
-	hv = iphash(sa, sp, da, dp);
-	spin_lock(&ht->lock);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchexact)
-			continue;
-		c = h->c;
-		if (sp == c->rport && dp == c->lport
-			&& ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
+	struct conv *c = h->c;
+
+	if (h->match != match)
+		return FALSE;
+	switch (match) {
+	case IPmatchexact:
+		return sp == c->rport && dp == c->lport
+		       && ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0;
+	case IPmatchpa:
+		return dp == c->lport && ipcmp(da, c->laddr) == 0;
+	case IPmatchport:
+		return dp == c->lport;
+	case IPmatchaddr:
+		return ipcmp(da, c->laddr) == 0;
+	case IPmatchany:
+		return TRUE;
 	}
+	return FALSE;
+}
 
-	/* match local address and port */
-	hv = iphash(IPnoaddr, 0, da, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchpa)
-			continue;
-		c = h->c;
-		if (dp == c->lport && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+/* Scans hv's bucket for the first entry of type match that passes the check.
+ *
+ * Several reuseport convs can match the same address.  We prefer one that asked
+ * for this core, and o/w spread the flows across them by their hash.  If the
+ * bucket changes between our passes, we might not find the one we picked, and
+ * we'll settle for the first.
+ *
+ * Caller holds the rcu read lock. */
+static struct conv *ipht_scan(struct iphtab *tab, uint32_t hv, int match,
+                              uint8_t *sa, uint16_t sp, uint8_t *da,
+                              uint16_t dp, uint32_t flow)
+{
+	struct Iphash *h;
+	struct conv *c, *first = NULL;
+	unsigned int nr = 0;
 
-	/* match just port */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchport)
+	for_each_iph_rcu(h, tab, hv) {
+		if (!ipht_match(h, match, sa, sp, da, dp))
 			continue;
 		c = h->c;
-		if (dp == c->lport) {
-			spin_unlock(&ht->lock);
+		if (!c->reuseport || c->reuseport_core == core_id())
 			return c;
-		}
+		if (!first)
+			first = c;
+		nr++;
 	}
-
-	/* match local address */
-	hv = iphash(IPnoaddr, 0, da, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchaddr)
+	if (nr <= 1)
+		return first;
+	nr = flow % nr;
+	for_each_iph_rcu(h, tab, hv) {
+		if (!ipht_match(h, match, sa, sp, da, dp))
 			continue;
-		c = h->c;
-		if (ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
+		if (nr-- == 0)
+			return h->c;
 	}
+	return first;
+}
 
-	/* look for something that matches anything */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchany)
-			continue;
-		c = h->c;
-		spin_unlock(&ht->lock);
-		return c;
-	}
-	spin_unlock(&ht->lock);
-	return NULL;
+/* look for a matching conversation with the following precedence
+ *	connected && raddr,rport,laddr,lport
+ *	announced && laddr,lport
+ *	announced && *,lport
+ *	announced && laddr,*
+ *	announced && *,*
+ */
+struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
+					  uint16_t dp)
+{
+	struct iphtab *tab;
+	struct conv *c;
+	uint32_t flow = iphash(sa, sp, da, dp);
+
+	rcu_read_lock();
+	tab = rcu_dereference(ht->tab);
+	c = ipht_scan(tab, flow, IPmatchexact, sa, sp, da, dp, flow);
+	if (!c)
+		c = ipht_scan(tab, iphash(IPnoaddr, 0, da, dp), IPmatchpa, sa, sp,
+		              da, dp, flow);
+	if (!c)
+		c = ipht_scan(tab, iphash(IPnoaddr, 0, IPnoaddr, dp), IPmatchport,
+		              sa, sp, da, dp, flow);
+	if (!c)
+		c = ipht_scan(tab, iphash(IPnoaddr, 0, da, 0), IPmatchaddr, sa, sp,
+		              da, dp, flow);
+	if (!c)
+		c = ipht_scan(tab, iphash(IPnoaddr, 0, IPnoaddr, 0), IPmatchany, sa,
+		              sp, da, dp, flow);
+	rcu_read_unlock();
+	return c;
 }
 
 void dump_ipht(struct Ipht *ht)
 {
 	struct Iphash *h;
+	struct iphtab *tab;
 	struct conv *c;
 
-	spin_lock(&ht->lock);
-	for (int i = 0; i < Nipht; i++) {
-		for (h = ht->tab[i]; h != NULL; h = h->next) {
+	rcu_read_lock();
+	tab = rcu_dereference(ht->tab);
+	printk("%d convs in %u buckets\n", atomic_read(&ht->nr_items),
+	       tab->nr_buckets);
+	for (int i = 0; i < tab->nr_buckets; i++) {
+		for_each_iph_rcu(h, tab, i) {
 			c = h->c;
 			printk("Conv proto %s, idx %d: local %I:%d, remote %I:%d\n",
 			       c->p->name, c->x, c->laddr, c->lport, c->raddr, c->rport);
 		}
 	}
-	spin_unlock(&ht->lock);
+	rcu_read_unlock();
 }
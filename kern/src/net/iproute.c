@@ -36,11 +36,15 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <percpu.h>
+#include <hash.h>
 #include <net/ip.h>
 
 static void walkadd(struct Fs *, struct route **, struct route *);
 static void addnode(struct Fs *, struct route **, struct route *);
 static void calcd(struct route *);
+static void v4trie_sync(struct Fs *, uint32_t, int);
+static void v6trie_sync(struct Fs *, uint32_t *, int);
 
 /* these are used for all instances of IP */
 struct route *v4freelist;
@@ -321,6 +325,32 @@ static void addnode(struct Fs *f, struct route **cur, struct route *new)
 	balancetree(cur);
 }
 
+/*
+ *  number of leading ones in a mask.  the trees take any mask, but only the
+ *  prefix part of it makes sense to the tries.
+ */
+static int masklen(uint8_t *mask, int len)
+{
+	int n = 0;
+
+	while (n < len * 8 && (mask[n / 8] & (0x80 >> (n % 8))))
+		n++;
+	return n;
+}
+
+/*
+ *  the mask for a prefix of plen bits, as host order words
+ */
+static void plenmask(uint32_t *m, int nwords, int plen)
+{
+	int bits;
+
+	for (int i = 0; i < nwords; i++) {
+		bits = MIN(MAX(plen - 32 * i, 0), 32);
+		m[i] = bits ? ~0U << (32 - bits) : 0;
+	}
+}
+
 #define	V4H(a)	((a&0x07ffffff)>>(32-Lroot-5))
 
 void
@@ -354,6 +384,9 @@ v4addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		}
 		wunlock(&routelock);
 	}
+	wlock(&routelock);
+	v4trie_sync(f, sa, masklen(mask, IPv4addrlen));
+	wunlock(&routelock);
 	v4routegeneration++;
 
 	ipifcaddroute(f, Rv4, a, mask, gate, type);
@@ -400,6 +433,9 @@ v6addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		}
 		wunlock(&routelock);
 	}
+	wlock(&routelock);
+	v6trie_sync(f, sa, masklen(mask, IPaddrlen));
+	wunlock(&routelock);
 	v6routegeneration++;
 
 	ipifcaddroute(f, 0, a, mask, gate, type);
@@ -432,6 +468,72 @@ struct route **looknode(struct route **cur, struct route *r)
 	}
 }
 
+/*
+ *  make the v4 trie agree with the forest about the prefix sa/plen.  called
+ *  with routelock wlocked, after the prefix was added to or removed from the
+ *  forest.
+ */
+static void v4trie_sync(struct Fs *f, uint32_t sa, int plen)
+{
+	struct route **r, rt;
+	uint8_t key[IPv4addrlen];
+	uint32_t m;
+	int l;
+
+	hnputl(key, sa);
+	plenmask(&m, 1, plen);
+	rt.rt.type = Rv4;
+	rt.v4.address = sa;
+	rt.v4.endaddress = sa | ~m;
+	r = looknode(&f->v4root[V4H(sa)], &rt);
+	if (r) {
+		iptrie_add(&f->v4trie, key, plen, *r);
+		return;
+	}
+	/* the next longest prefix at the same level of the trie takes over */
+	for (l = plen - 1; l > (plen - 1) / Iptrie_stride * Iptrie_stride; l--) {
+		plenmask(&m, 1, l);
+		rt.v4.address = sa & m;
+		rt.v4.endaddress = rt.v4.address | ~m;
+		r = looknode(&f->v4root[V4H(rt.v4.address)], &rt);
+		if (r)
+			break;
+	}
+	iptrie_del(&f->v4trie, key, plen, r ? *r : NULL, r ? l : 0);
+}
+
+static void v6trie_sync(struct Fs *f, uint32_t *sa, int plen)
+{
+	struct route **r, rt;
+	uint8_t key[IPaddrlen];
+	uint32_t m[IPllen];
+	int h, l;
+
+	plenmask(m, IPllen, plen);
+	for (h = 0; h < IPllen; h++) {
+		hnputl(key + 4 * h, sa[h]);
+		rt.v6.address[h] = sa[h];
+		rt.v6.endaddress[h] = sa[h] | ~m[h];
+	}
+	rt.rt.type = 0;
+	r = looknode(&f->v6root[V6H(sa)], &rt);
+	if (r) {
+		iptrie_add(&f->v6trie, key, plen, *r);
+		return;
+	}
+	for (l = plen - 1; l > (plen - 1) / Iptrie_stride * Iptrie_stride; l--) {
+		plenmask(m, IPllen, l);
+		for (h = 0; h < IPllen; h++) {
+			rt.v6.address[h] = sa[h] & m[h];
+			rt.v6.endaddress[h] = rt.v6.address[h] | ~m[h];
+		}
+		r = looknode(&f->v6root[V6H(rt.v6.address)], &rt);
+		if (r)
+			break;
+	}
+	iptrie_del(&f->v6trie, key, plen, r ? *r : NULL, r ? l : 0);
+}
+
 void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 {
 	struct route **r, *p;
@@ -470,6 +572,11 @@ void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 		if (dolock)
 			wunlock(&routelock);
 	}
+	if (dolock)
+		wlock(&routelock);
+	v4trie_sync(f, rt.v4.address, masklen(mask, IPv4addrlen));
+	if (dolock)
+		wunlock(&routelock);
 	v4routegeneration++;
 
 	ipifcremroute(f, Rv4, a, mask);
@@ -516,33 +623,85 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 		if (dolock)
 			wunlock(&routelock);
 	}
+	if (dolock)
+		wlock(&routelock);
+	v6trie_sync(f, rt.v6.address, masklen(mask, IPaddrlen));
+	if (dolock)
+		wunlock(&routelock);
 	v6routegeneration++;
 
 	ipifcremroute(f, 0, a, mask);
 }
 
+/*
+ *  per core cache of recent lookups, for packets without a conv route cache:
+ *  forwarding and unconnected udp.  entries are good until the route
+ *  generation changes.
+ */
+enum {
+	Ndstcache = 64,				/* power of 2 */
+};
+
+struct dstcache {
+	struct Fs *f;
+	struct route *r;
+	uint32_t gen;
+	int version;
+	uint8_t a[IPaddrlen];
+};
+
+static DEFINE_PERCPU(struct dstcache[Ndstcache], dstcaches);
+
+static struct dstcache *dstcache_slot(uint8_t *a, int len)
+{
+	uint32_t x = 0;
+
+	for (int i = 0; i < len; i += 4)
+		x ^= nhgetl(a + i);
+	return &PERCPU_VAR(dstcaches)[hash_32(x, 32) & (Ndstcache - 1)];
+}
+
+static struct route *dstcache_get(struct Fs *f, int version, uint8_t *a,
+                                  int len, uint32_t gen)
+{
+	struct dstcache *d = dstcache_slot(a, len);
+
+	if (d->f != f || d->gen != gen || d->version != version ||
+	    memcmp(d->a, a, len) != 0)
+		return NULL;
+	return d->r;
+}
+
+static void dstcache_put(struct Fs *f, int version, uint8_t *a, int len,
+                         uint32_t gen, struct route *r)
+{
+	struct dstcache *d = dstcache_slot(a, len);
+
+	d->f = f;
+	d->r = r;
+	d->gen = gen;
+	d->version = version;
+	memmove(d->a, a, len);
+}
+
 struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 {
-	struct route *p, *q;
-	uint32_t la;
+	struct route *q;
+	uint32_t gen;
 	uint8_t gate[IPaddrlen];
 	struct Ipifc *ifc;
 
+	gen = READ_ONCE(v4routegeneration);
 	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
-		&& c->rgen == v4routegeneration)
+		&& c->rgen == gen)
 		return c->r;
 
-	la = nhgetl(a);
-	q = NULL;
-	for (p = f->v4root[V4H(la)]; p;)
-		if (la >= p->v4.address) {
-			if (la <= p->v4.endaddress) {
-				q = p;
-				p = p->rt.mid;
-			} else
-				p = p->rt.right;
-		} else
-			p = p->rt.left;
+	q = dstcache_get(f, V4, a, IPv4addrlen, gen);
+	if (q == NULL) {
+		q = iptrie_lookup(&f->v4trie, a);
+		if (q != NULL)
+			dstcache_put(f, V4, a, IPv4addrlen, gen, q);
+	}
 
 	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
 		if (q->rt.type & Rifc) {
@@ -559,7 +718,7 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 
 	if (c != NULL) {
 		c->r = q;
-		c->rgen = v4routegeneration;
+		c->rgen = gen;
 	}
 
 	return q;
@@ -567,10 +726,9 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 
 struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 {
-	struct route *p, *q;
-	uint32_t la[IPllen];
+	struct route *q;
+	uint32_t gen;
 	int h;
-	uint32_t x, y;
 	uint8_t gate[IPaddrlen];
 	struct Ipifc *ifc;
 
@@ -580,40 +738,16 @@ struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 			return q;
 	}
 
+	gen = READ_ONCE(v6routegeneration);
 	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
-		&& c->rgen == v6routegeneration)
+		&& c->rgen == gen)
 		return c->r;
 
-	for (h = 0; h < IPllen; h++)
-		la[h] = nhgetl(a + 4 * h);
-
-	q = 0;
-	for (p = f->v6root[V6H(la)]; p;) {
-		for (h = 0; h < IPllen; h++) {
-			x = la[h];
-			y = p->v6.address[h];
-			if (x == y)
-				continue;
-			if (x < y) {
-				p = p->rt.left;
-				goto next;
-			}
-			break;
-		}
-		for (h = 0; h < IPllen; h++) {
-			x = la[h];
-			y = p->v6.endaddress[h];
-			if (x == y)
-				continue;
-			if (x > y) {
-				p = p->rt.right;
-				goto next;
-			}
-			break;
-		}
-		q = p;
-		p = p->rt.mid;
-next:	;
+	q = dstcache_get(f, V6, a, IPaddrlen, gen);
+	if (q == NULL) {
+		q = iptrie_lookup(&f->v6trie, a);
+		if (q != NULL)
+			dstcache_put(f, V6, a, IPaddrlen, gen, q);
 	}
 
 	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
@@ -630,7 +764,7 @@ next:	;
 	}
 	if (c != NULL) {
 		c->r = q;
-		c->rgen = v6routegeneration;
+		c->rgen = gen;
 	}
 
 	return q;
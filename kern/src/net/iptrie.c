@@ -0,0 +1,227 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Longest prefix match tries for route lookups.
+ *
+ * The range trees in iproute.c still hold the routes; the trie is an index
+ * over them, keyed by address bytes in network order, so a lookup costs one
+ * node per byte at most and usually stops well before that.
+ *
+ * Each node splits on one byte of the key.  A prefix of length plen lives at
+ * level (plen - 1) / 8, expanded over every slot it covers there.  A slot
+ * holds either a route or, with the low bit set, a child node.  When a slot
+ * gets a child, its route moves to the child's 'r', which is the answer for
+ * addresses that match nothing longer below it.  The default route is the
+ * root's 'r'.  A lookup walks down, remembering the last route it saw.
+ *
+ * Writers are serialized by the caller (routelock).  Lookups are lockless:
+ * nodes are published after they are filled in and freed after an RCU grace
+ * period.  Routes themselves are never freed, see freeroute().
+ */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <rcu.h>
+#include <net/ip.h>
+
+enum {
+	Trie_stride = Iptrie_stride,
+	Trie_fanout = 1 << Trie_stride,
+	Trie_child = 1,				/* slot bit: points to a node */
+};
+
+struct iptrie_node {
+	struct rcu_head rcu;
+	struct route *r;			/* longest match from our parent's level */
+	unsigned int nr_used;		/* nonzero slots */
+	uint8_t plen[Trie_fanout];	/* prefix length of each slot's route */
+	uintptr_t slot[Trie_fanout];
+};
+
+static struct kmem_cache *iptrie_kcache;
+
+static bool slot_is_child(uintptr_t s)
+{
+	return s & Trie_child;
+}
+
+static struct iptrie_node *slot_child(uintptr_t s)
+{
+	return (struct iptrie_node*)(s & ~(uintptr_t)Trie_child);
+}
+
+static struct iptrie_node *iptrie_node_alloc(struct route *r)
+{
+	struct iptrie_node *n = kmem_cache_alloc(iptrie_kcache, MEM_WAIT);
+
+	memset(n, 0, sizeof(struct iptrie_node));
+	n->r = r;
+	return n;
+}
+
+static void __iptrie_node_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(iptrie_kcache,
+	                container_of(head, struct iptrie_node, rcu));
+}
+
+/* Called while the Fs is being set up, under the fslock. */
+void iptrie_init(struct iptrie *t, int keylen)
+{
+	if (!iptrie_kcache)
+		iptrie_kcache = kmem_cache_create("iptrie_nodes",
+		                                  sizeof(struct iptrie_node),
+		                                  __alignof__(struct iptrie_node),
+		                                  0, NULL, 0, 0, NULL);
+	t->keylen = keylen;
+	t->root = iptrie_node_alloc(NULL);
+}
+
+static void slot_set_route(struct iptrie_node *n, int i, struct route *r,
+                           int plen)
+{
+	uintptr_t s = n->slot[i];
+
+	if (slot_is_child(s)) {
+		WRITE_ONCE(slot_child(s)->r, r);
+	} else {
+		if (!s && r)
+			n->nr_used++;
+		if (s && !r)
+			n->nr_used--;
+		WRITE_ONCE(n->slot[i], (uintptr_t)r);
+	}
+	n->plen[i] = r ? plen : 0;
+}
+
+/* Returns the node for key at 'level', filling in the nodes above it in path.
+ * With 'create', missing nodes are added on the way. */
+static struct iptrie_node *iptrie_walk(struct iptrie *t, uint8_t *key,
+                                       int level, bool create,
+                                       struct iptrie_node **path)
+{
+	struct iptrie_node *n = t->root, *child;
+	uintptr_t s;
+
+	for (int i = 0; i < level; i++) {
+		path[i] = n;
+		s = n->slot[key[i]];
+		if (slot_is_child(s)) {
+			n = slot_child(s);
+			continue;
+		}
+		if (!create)
+			return NULL;
+		child = iptrie_node_alloc((struct route*)s);
+		if (!s)
+			n->nr_used++;
+		wmb();	/* child is filled in before readers can see it */
+		WRITE_ONCE(n->slot[key[i]], (uintptr_t)child | Trie_child);
+		n = child;
+	}
+	return n;
+}
+
+/* Points the prefix key/plen at r, unless something longer covers part of it.
+ * Also used to replace the route of an existing prefix. */
+void iptrie_add(struct iptrie *t, uint8_t *key, int plen, struct route *r)
+{
+	struct iptrie_node *path[IPaddrlen];
+	struct iptrie_node *n;
+	int level, span, first;
+
+	assert(plen <= t->keylen * 8);
+	if (plen == 0) {
+		WRITE_ONCE(t->root->r, r);
+		return;
+	}
+	level = (plen - 1) / Trie_stride;
+	n = iptrie_walk(t, key, level, TRUE, path);
+	span = 1 << ((level + 1) * Trie_stride - plen);
+	first = key[level] & ~(span - 1);
+	for (int i = first; i < first + span; i++) {
+		if (n->plen[i] <= plen)
+			slot_set_route(n, i, r, plen);
+	}
+}
+
+/* Removes the prefix key/plen.  Its slots go to repl, the next longest prefix
+ * covering it at the same level (repl_plen > 8 * level), or NULL if there is
+ * none and shorter prefixes from the levels above should match. */
+void iptrie_del(struct iptrie *t, uint8_t *key, int plen, struct route *repl,
+                int repl_plen)
+{
+	struct iptrie_node *path[IPaddrlen];
+	struct iptrie_node *n, *parent;
+	int level, span, first, i;
+
+	if (plen == 0) {
+		WRITE_ONCE(t->root->r, NULL);
+		return;
+	}
+	level = (plen - 1) / Trie_stride;
+	n = iptrie_walk(t, key, level, FALSE, path);
+	if (!n)
+		return;
+	span = 1 << ((level + 1) * Trie_stride - plen);
+	first = key[level] & ~(span - 1);
+	for (i = first; i < first + span; i++) {
+		if (n->plen[i] == plen)
+			slot_set_route(n, i, repl, repl_plen);
+	}
+	/* Prune empty nodes.  Their parent slot gets back their route, whose
+	 * length the parent already has in plen. */
+	while (level > 0 && !n->nr_used) {
+		parent = path[--level];
+		i = key[level];
+		if (!n->r)
+			parent->nr_used--;
+		WRITE_ONCE(parent->slot[i], (uintptr_t)n->r);
+		call_rcu(&n->rcu, __iptrie_node_free_rcu);
+		n = parent;
+	}
+}
+
+/* Returns the route for the longest prefix matching key, or NULL. */
+struct route *iptrie_lookup(struct iptrie *t, uint8_t *key)
+{
+	struct iptrie_node *n = t->root;
+	struct route *best, *r;
+	uintptr_t s;
+
+	rcu_read_lock();
+	best = READ_ONCE(n->r);
+	for (int i = 0; i < t->keylen; i++) {
+		s = READ_ONCE(n->slot[key[i]]);
+		if (!slot_is_child(s)) {
+			if (s)
+				best = (struct route*)s;
+			break;
+		}
+		n = slot_child(s);
+		r = READ_ONCE(n->r);
+		if (r)
+			best = r;
+	}
+	rcu_read_unlock();
+	return best;
+}
+
+/* Whether the trie has no routes, other than maybe a default. */
+bool iptrie_empty(struct iptrie *t)
+{
+	return !t->root->nr_used;
+}
+
+/* Frees an empty trie.  Nodes from earlier deletions may still be waiting for
+ * RCU. */
+void iptrie_destroy(struct iptrie *t)
+{
+	assert(iptrie_empty(t));
+	kmem_cache_free(iptrie_kcache, t->root);
+	t->root = NULL;
+}
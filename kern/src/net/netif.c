@@ -279,6 +279,8 @@ static int feature_appender(int features, char *p, int sofar)
 		sofar += snprintf(p + sofar, READSTR - sofar, "lro ");
 	if (features & NETF_RXCSUM)
 		sofar += snprintf(p + sofar, READSTR - sofar, "rxcsum ");
+	if (features & NETF_GSO)
+		sofar += snprintf(p + sofar, READSTR - sofar, "gso ");
 	return sofar;
 }
 
@@ -552,6 +554,9 @@ void netifclose(struct ether *nif, struct chan *c)
 		f->type = 0;
 		f->bridge = 0;
 		f->headersonly = 0;
+		f->rx = NULL;
+		f->rxflush = NULL;
+		f->rxarg = NULL;
 		qclose(f->in);
 	}
 	qunlock(&f->qlock);
@@ -0,0 +1,181 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Receive rings for conversations, see ros/rxring.h for the layout.
+ *
+ * The process hands us a chunk of its anonymous memory, which we pin for as
+ * long as the conversation is open.  As data arrives, the protocol moves it
+ * from the conv's rq into the ring's buffers, then the process reads it straight
+ * out of its own memory.  Data only stays in rq when the ring is full, so TCP's
+ * window still closes when the process stops consuming.
+ *
+ * Everything that touches the ring, other than the sleep condition, runs with
+ * the conv qlocked: tcpiput does, and so do the ctl and close paths.
+ */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <pmap.h>
+#include <mm.h>
+#include <rendez.h>
+#include <ros/rxring.h>
+#include <net/ip.h>
+
+struct rxring {
+	struct rxring_hdr *hdr;
+	uint32_t nr_bufs;
+	uint32_t prod;				/* our copy, hdr->prod is writable by the user */
+	struct mm_pin pin;
+	struct rendez rv;
+	struct page *pages[];		/* hdr page, then one per buffer */
+};
+
+static void *rxring_buf(struct rxring *r, uint32_t idx)
+{
+	return page2kva(r->pages[1 + idx % r->nr_bufs]);
+}
+
+/* Number of full buffers.  cons comes from the user; if it is nonsense, the
+ * ring looks full, which only hurts the user. */
+static uint32_t rxring_nr_full(struct rxring *r)
+{
+	uint32_t full = r->prod - READ_ONCE(r->hdr->cons);
+
+	return MIN(full, r->nr_bufs);
+}
+
+static size_t rxring_bytes(struct rxring *r)
+{
+	uint32_t full = rxring_nr_full(r);
+	size_t ret = 0;
+
+	for (uint32_t i = r->prod - full; i != r->prod; i++)
+		ret += READ_ONCE(r->hdr->desc[i % r->nr_bufs].len);
+	return ret;
+}
+
+static size_t __rxring_fill(struct rxring *r, struct queue *q, int mem_flags)
+{
+	uint32_t nr_free = r->nr_bufs - rxring_nr_full(r);
+	struct block *b;
+	size_t n, total = 0;
+
+	while (nr_free) {
+		b = qget_upto(q, nr_free * RXRING_BUF_SZ, mem_flags);
+		if (!b)
+			break;
+		/* Each block starts a new buffer, which might waste some space, but
+		 * it means a buffer never waits on a later block to be filled. */
+		while (b) {
+			n = MIN(BLEN(b), RXRING_BUF_SZ);
+			if (!n) {
+				freeblist(b);
+				break;
+			}
+			r->hdr->desc[r->prod % r->nr_bufs].len = n;
+			b = bl2mem(rxring_buf(r, r->prod), b, n);
+			r->prod++;
+			nr_free--;
+			total += n;
+		}
+	}
+	if (total) {
+		wmb();	/* data and descs before the new prod */
+		WRITE_ONCE(r->hdr->prod, r->prod);
+	}
+	return total;
+}
+
+/* Moves what we can from c's rq into its ring and wakes any reader.  Call with
+ * c qlocked. */
+void rxring_fill(struct conv *c, int mem_flags)
+{
+	struct rxring *r = c->rxring;
+
+	if (!r)
+		return;
+	if (__rxring_fill(r, c->rq, mem_flags) || qcanread(c->rq))
+		rendez_wakeup(&r->rv);
+}
+
+/* For when rq is hung up or closed, so a reader sees the EOF. */
+void rxring_wake(struct conv *c)
+{
+	if (c->rxring)
+		rendez_wakeup(&c->rxring->rv);
+}
+
+/* Sets up a ring in the current process's memory at [va, va + len).  Call with
+ * c qlocked.  The ring stays until the conversation is closed. */
+void rxring_attach(struct conv *c, uintptr_t va, size_t len)
+{
+	struct rxring *r;
+	size_t nr_pgs = len >> PGSHIFT;
+
+	if (c->rxring)
+		error(EBUSY, "conversation already has a receive ring");
+	if (PGOFF(va) || PGOFF(len) || nr_pgs < 2 || nr_pgs - 1 > RXRING_MAX_BUFS)
+		error(EINVAL, "bad receive ring %p, len %lu", va, len);
+	r = kzmalloc(sizeof(struct rxring) + nr_pgs * sizeof(struct page *),
+	             MEM_WAIT);
+	if (mm_pin(current, &r->pin, va, len, r->pages)) {
+		kfree(r);
+		error(EFAULT, "can't pin receive ring %p, len %lu", va, len);
+	}
+	r->hdr = page2kva(r->pages[0]);
+	r->nr_bufs = nr_pgs - 1;
+	rendez_init(&r->rv);
+	r->hdr->nr_bufs = r->nr_bufs;
+	r->hdr->prod = 0;
+	r->hdr->cons = 0;
+	r->hdr->flags = 0;
+	wmb();
+	c->rxring = r;
+	rxring_fill(c, MEM_WAIT);
+}
+
+/* Call with c qlocked, from a context that can block. */
+void rxring_detach(struct conv *c)
+{
+	struct rxring *r = c->rxring;
+
+	if (!r)
+		return;
+	c->rxring = NULL;
+	mm_unpin(&r->pin);
+	kfree(r);
+}
+
+static int rxring_ready(void *arg)
+{
+	struct conv *c = arg;
+
+	return rxring_nr_full(c->rxring) || qcanread(c->rq) || qisclosed(c->rq);
+}
+
+/* read() of a data file in ring mode: waits for something in the ring and
+ * returns how much is there, up to n.  0 is EOF.  The caller has the data file
+ * open, so the ring won't go away. */
+size_t rxring_read(struct conv *c, size_t n, bool nonblock)
+{
+	struct rxring *r = c->rxring;
+	size_t ret;
+
+	while (1) {
+		qlock(&c->qlock);
+		__rxring_fill(r, c->rq, MEM_WAIT);
+		ret = rxring_bytes(r);
+		qunlock(&c->qlock);
+		if (ret)
+			return MIN(ret, n);
+		if (qisclosed(c->rq) && !qcanread(c->rq))
+			return 0;
+		if (nonblock)
+			error(EAGAIN, "receive ring is empty");
+		rendez_sleep(&r->rv, rxring_ready, c);
+	}
+}
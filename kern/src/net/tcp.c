@@ -38,6 +38,7 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <net/tcp.h>
+#include <random/sha2.h>
 
 /* Must correspond to the enumeration in tcp.h */
 static char *tcpstates[] = {
@@ -66,6 +67,10 @@ static char *statnames[] = {
 	[HlenErrs] "HlenErrs",
 	[LenErrs] "LenErrs",
 	[OutOfOrder] "OutOfOrder",
+	[LimboOverflows] "LimboOverflows",
+	[SynCookiesSent] "SynCookiesSent",
+	[SynCookiesValid] "SynCookiesValid",
+	[SynCookiesFailed] "SynCookiesFailed",
 };
 
 /*
@@ -96,6 +101,7 @@ static void tcpkeepalive(void *);
 static void tcpsetkacounter(Tcpctl *);
 static void tcprxmit(struct conv *);
 static void tcpsettimer(Tcpctl *);
+static uint64_t tcptimer_count(Tcptimer *);
 static void tcpsynackrtt(struct conv *);
 static void tcpsetscale(struct conv *, Tcpctl *, uint16_t, uint16_t);
 static void tcp_loss_event(struct conv *s, Tcpctl *tcb);
@@ -141,8 +147,17 @@ static void tcpsetstate(struct conv *s, uint8_t newstate)
 			qhangup(s->rq, NULL);
 			break;
 	}
+	if (newstate == Closed || newstate == Close_wait)
+		rxring_wake(s);
 
 	tcb->state = newstate;
+	/* tcpinuse() just went false, the conv may be reusable.  Late acks and
+	 * status reads can still use tcb->cong, but the next user doesn't get
+	 * this one's pick. */
+	if (newstate == Closed) {
+		tcb->cong_pick = NULL;
+		Fsconvrelease(s);
+	}
 
 	if (oldstate == Syn_sent && newstate != Closed)
 		Fsconnected(s, NULL);
@@ -154,6 +169,17 @@ static void tcpconnect(struct conv *c, char **argv, int argc)
 	tcpstart(c, TCP_CONNECT);
 }
 
+/* Bytes per second: the algorithm's pacing rate, or what cwind gets us.  A
+ * conv that never connected has no algorithm yet. */
+static uint64_t tcp_pacing_rate(Tcpctl *tcb)
+{
+	if (!tcb->cong)
+		return 0;
+	if (tcb->cong->pacing_rate)
+		return tcb->cong->pacing_rate(tcb);
+	return (uint64_t)tcb->cwind * 1000 / MAX(tcb->srtt, 1);
+}
+
 static int tcpstate(struct conv *c, char *state, int n)
 {
 	Tcpctl *s;
@@ -161,14 +187,16 @@ static int tcpstate(struct conv *c, char *state, int n)
 	s = (Tcpctl *) (c->ptcl);
 
 	return snprintf(state, n,
-					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d cong %s ssthresh %u minrtt %u pacing %llu\n",
 					tcpstates[s->state],
 					c->rq ? qlen(c->rq) : 0,
 					c->wq ? qlen(c->wq) : 0,
 					s->srtt, s->mdev,
 					s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
-					s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-					s->katimer.start, s->katimer.count);
+					s->snd.scale, s->timer.start, tcptimer_count(&s->timer),
+					s->rerecv, s->katimer.start, tcptimer_count(&s->katimer),
+					s->cong ? s->cong->name : "none", s->ssthresh, s->min_rtt,
+					tcp_pacing_rate(s));
 }
 
 static int tcpinuse(struct conv *c)
@@ -345,44 +373,90 @@ static void tcpcreate(struct conv *c)
 	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
 }
 
-static void timerstate(struct tcppriv *priv, Tcptimer *t, int newstate)
+/* Files T in the wheel slot for its expiration.  Timers further out than the
+ * wheel reaches go in the farthest slot and get refiled as they cascade. */
+static void tw_insert(struct tcp_twheel *tw, Tcptimer *t)
 {
-	if (newstate != TcptimerON) {
-		if (t->state == TcptimerON) {
-			// unchain
-			if (priv->timers == t) {
-				priv->timers = t->next;
-				if (t->prev != NULL)
-					panic("timerstate1");
-			}
-			if (t->next)
-				t->next->prev = t->prev;
-			if (t->prev)
-				t->prev->next = t->next;
-			t->next = t->prev = NULL;
-		}
-	} else {
-		if (t->state != TcptimerON) {
-			// chain
-			if (t->prev != NULL || t->next != NULL)
-				panic("timerstate2");
-			t->prev = NULL;
-			t->next = priv->timers;
-			if (t->next)
-				t->next->prev = t;
-			priv->timers = t;
-		}
+	uint64_t expires = MAX(t->expires, tw->now);
+	uint64_t delta = expires - tw->now;
+	int level;
+
+	if (delta >= 1ULL << (TCP_TW_LEVELS * TCP_TW_BITS)) {
+		delta = (1ULL << (TCP_TW_LEVELS * TCP_TW_BITS)) - 1;
+		expires = tw->now + delta;
 	}
-	t->state = newstate;
+	for (level = 0; level < TCP_TW_LEVELS - 1; level++) {
+		if (delta < 1ULL << ((level + 1) * TCP_TW_BITS))
+			break;
+	}
+	BSD_LIST_INSERT_HEAD(&tw->slots[level][(expires >> (level * TCP_TW_BITS)) &
+	                                       TCP_TW_MASK], t, link);
+}
+
+static void tw_cascade(struct tcp_twheel *tw, struct tcptimer_list *slot)
+{
+	Tcptimer *t;
+
+	while ((t = BSD_LIST_FIRST(slot))) {
+		BSD_LIST_REMOVE(t, link);
+		tw_insert(tw, t);
+	}
+}
+
+/* Advances the wheel one tick.  Expired timers are marked DONE and pushed on
+ * the ready list.  Caller holds the wheel lock. */
+static void tw_tick(struct tcp_twheel *tw, Tcptimer **ready)
+{
+	struct tcptimer_list *slot;
+	Tcptimer *t;
+	uint64_t now = ++tw->now;
+
+	for (int level = 1; level < TCP_TW_LEVELS; level++) {
+		if (now & ((1ULL << (level * TCP_TW_BITS)) - 1))
+			break;
+		tw_cascade(tw, &tw->slots[level][(now >> (level * TCP_TW_BITS)) &
+		                                 TCP_TW_MASK]);
+	}
+	slot = &tw->slots[0][now & TCP_TW_MASK];
+	while ((t = BSD_LIST_FIRST(slot))) {
+		BSD_LIST_REMOVE(t, link);
+		t->state = TcptimerDONE;
+		t->count = 0;
+		t->readynext = *ready;
+		*ready = t;
+	}
+}
+
+/* Timers stay on the wheel of the core that set up their TCB, so every op on a
+ * timer serializes on the same wheel lock. */
+static void tcptimers_bind(struct tcppriv *priv, Tcpctl *tcb)
+{
+	struct tcp_twheel *tw = &priv->wheels[core_id()];
+
+	tcb->timer.wheel = tw;
+	tcb->acktimer.wheel = tw;
+	tcb->katimer.wheel = tw;
+	tcb->rtt_timer.wheel = tw;
+}
+
+/* Ticks left on T.  This is a lockless peek for armed timers. */
+static uint64_t tcptimer_count(Tcptimer *t)
+{
+	uint64_t now;
+
+	if (t->state != TcptimerON)
+		return t->count;
+	now = ACCESS_ONCE(t->wheel->now);
+	return t->expires > now ? t->expires - now : 0;
 }
 
 static void tcpackproc(void *a)
 {
 	ERRSTACK(1);
-	Tcptimer *t, *tp, *timeo;
+	Tcptimer *t, *timeo;
+	struct tcp_twheel *tw;
 	struct Proto *tcp;
 	struct tcppriv *priv;
-	int loop;
 
 	tcp = a;
 	priv = tcp->priv;
@@ -390,28 +464,15 @@ static void tcpackproc(void *a)
 	for (;;) {
 		kthread_usleep(MSPTICK * 1000);
 
-		qlock(&priv->tl);
 		timeo = NULL;
-		loop = 0;
-		for (t = priv->timers; t != NULL; t = tp) {
-			if (loop++ > 10000)
-				panic("tcpackproc1");
-			tp = t->next;
-			if (t->state == TcptimerON) {
-				t->count--;
-				if (t->count == 0) {
-					timerstate(priv, t, TcptimerDONE);
-					t->readynext = timeo;
-					timeo = t;
-				}
-			}
+		for (int i = 0; i < num_cores; i++) {
+			tw = &priv->wheels[i];
+			spin_lock(&tw->lock);
+			tw_tick(tw, &timeo);
+			spin_unlock(&tw->lock);
 		}
-		qunlock(&priv->tl);
 
-		loop = 0;
 		for (t = timeo; t != NULL; t = t->readynext) {
-			if (loop++ > 10000)
-				panic("tcpackproc2");
 			if (t->state == TcptimerDONE && t->func != NULL) {
 				/* discard error style */
 				if (!waserror())
@@ -426,23 +487,36 @@ static void tcpackproc(void *a)
 
 static void tcpgo(struct tcppriv *priv, Tcptimer *t)
 {
+	struct tcp_twheel *tw;
+
 	if (t == NULL || t->start == 0)
 		return;
 
-	qlock(&priv->tl);
-	t->count = t->start;
-	timerstate(priv, t, TcptimerON);
-	qunlock(&priv->tl);
+	tw = t->wheel;
+	spin_lock(&tw->lock);
+	if (t->state == TcptimerON)
+		BSD_LIST_REMOVE(t, link);
+	t->expires = tw->now + t->start;
+	tw_insert(tw, t);
+	t->state = TcptimerON;
+	spin_unlock(&tw->lock);
 }
 
 static void tcphalt(struct tcppriv *priv, Tcptimer *t)
 {
+	struct tcp_twheel *tw;
+
 	if (t == NULL)
 		return;
 
-	qlock(&priv->tl);
-	timerstate(priv, t, TcptimerOFF);
-	qunlock(&priv->tl);
+	tw = t->wheel;
+	spin_lock(&tw->lock);
+	if (t->state == TcptimerON) {
+		BSD_LIST_REMOVE(t, link);
+		t->count = t->expires > tw->now ? t->expires - tw->now : 0;
+	}
+	t->state = TcptimerOFF;
+	spin_unlock(&tw->lock);
 }
 
 static int backoff(int n)
@@ -511,12 +585,16 @@ static int tcpmtu(struct Ipifc *ifc, int version, int *scale)
 	return mtu;
 }
 
-static void tcb_check_tso(Tcpctl *tcb)
+static void tcb_check_tso(Tcpctl *tcb, int version)
 {
 	/* This can happen if the netdev isn't up yet. */
 	if (!tcb->ifc)
 		return;
-	if (tcb->ifc->feat & NETF_TSO)
+	/* Devices without TSO can still take big v4 segments and cut them up in
+	 * software (GSO), which is a lot cheaper than going through tcpoutput for
+	 * each MSS. */
+	if (tcb->ifc->feat & NETF_TSO
+	    || (tcb->ifc->feat & NETF_GSO && version == V4))
 		tcb->flags |= TSO;
 	else
 		tcb->flags &= ~TSO;
@@ -528,9 +606,12 @@ static void inittcpctl(struct conv *s, int mode)
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
 	int mss;
+	const struct tcp_cong_ops *cong;
 
 	tcb = (Tcpctl *) s->ptcl;
 
+	/* keep any algorithm the user picked before connecting */
+	cong = tcb->cong_pick;
 	memset(tcb, 0, sizeof(Tcpctl));
 
 	tcb->ssthresh = UINT32_MAX;
@@ -538,6 +619,7 @@ static void inittcpctl(struct conv *s, int mode)
 	tcb->mdev = 0;
 
 	/* setup timers */
+	tcptimers_bind(s->p->priv, tcb);
 	tcb->timer.start = tcp_irtt / MSPTICK;
 	tcb->timer.func = tcptimeout;
 	tcb->timer.arg = s;
@@ -585,13 +667,15 @@ static void inittcpctl(struct conv *s, int mode)
 	tcb->mss = mss;
 	tcb->typical_mss = mss;
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
+	tcb->cong = cong ? cong : tcp_cong_default;
+	tcb->cong->init(tcb);
 
 	/* default is no window scaling */
 	tcb->window = QMAX;
 	tcb->rcv.wnd = QMAX;
 	tcb->rcv.scale = 0;
 	tcb->snd.scale = 0;
-	tcb_check_tso(tcb);
+	tcb_check_tso(tcb, s->ipversion);
 }
 
 /*
@@ -1242,6 +1326,139 @@ static int sndsynack(struct Proto *tcp, Limbo *lp)
 
 #define hashipa(a, p) ( ( (a)[IPaddrlen-2] + (a)[IPaddrlen-1] + p )&LHTMASK )
 
+/* Puts lp on the rexmit wheel, in the slot for its next SYN ACK. */
+static void limbo_arm(struct tcppriv *tpriv, Limbo *lp)
+{
+	uint64_t due = lp->lastsend + (lp->rexmits + 1) * SYNACK_RXTIMER;
+
+	lp->wheel_tick = MAX(DIV_ROUND_UP(due, MSPTICK), tpriv->limbo_tick + 1);
+	TAILQ_INSERT_TAIL(&tpriv->limbo_wheel[lp->wheel_tick % NLIMBOWHEEL], lp,
+	                  wheel_link);
+}
+
+static void limbo_disarm(struct tcppriv *tpriv, Limbo *lp)
+{
+	TAILQ_REMOVE(&tpriv->limbo_wheel[lp->wheel_tick % NLIMBOWHEEL], lp,
+	             wheel_link);
+}
+
+/* Takes lp, which is off the wheel, out of the hash table and frees it. */
+static void limbo_free(struct tcppriv *tpriv, Limbo *lp)
+{
+	Limbo **l;
+
+	for (l = &tpriv->lht[hashipa(lp->raddr, lp->rport)]; *l; l = &(*l)->next) {
+		if (*l == lp) {
+			*l = lp->next;
+			break;
+		}
+	}
+	tpriv->nlimbo--;
+	kfree(lp);
+}
+
+/*
+ *  SYN cookies.  Our ISS is
+ *	count (5 bits) | mss index (3 bits) | hash (24 bits)
+ *  where count is the time in SYNCOOKIE_PERIODs and the hash is over a secret,
+ *  the addresses and ports, their ISN and the full count.  A cookie is good for
+ *  one to two periods.  We can't remember window scaling, SACK or timestamps
+ *  for the call, so the SYN ACK doesn't offer them.
+ */
+static const uint16_t syncookie_mss[8] = {
+	216, 536, 1024, 1220, 1440, 1460, 4312, 8960,
+};
+
+static uint32_t syncookie_hash(struct tcppriv *tpriv, Limbo *lp, uint64_t count)
+{
+	SHA256Ctx ctx;
+	uint8_t digest[SHA256DigestLength];
+	uint8_t buf[4 + 4 + 8];
+
+	hnputs(buf, lp->lport);
+	hnputs(buf + 2, lp->rport);
+	hnputl(buf + 4, lp->irs);
+	hnputv(buf + 8, count);
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, tpriv->syncookie_secret,
+	              sizeof(tpriv->syncookie_secret));
+	SHA256_Update(&ctx, lp->laddr, IPaddrlen);
+	SHA256_Update(&ctx, lp->raddr, IPaddrlen);
+	SHA256_Update(&ctx, buf, sizeof(buf));
+	SHA256_Final(digest, &ctx);
+	return nhgetl(digest) & 0xffffff;
+}
+
+/* Answers the SYN in lp, which isn't in limbo, with a cookie for an ISS. */
+static void syncookie_synack(struct Proto *tcp, Limbo *lp)
+{
+	struct tcppriv *tpriv = tcp->priv;
+	uint64_t count = NOW / SYNCOOKIE_PERIOD;
+	uint32_t idx = 1;	/* 536 if they didn't say */
+
+	if (!tpriv->syncookie_keyed) {
+		urandom_read(tpriv->syncookie_secret,
+		             sizeof(tpriv->syncookie_secret));
+		tpriv->syncookie_keyed = TRUE;
+	}
+	if (lp->mss) {
+		for (idx = ARRAY_SIZE(syncookie_mss) - 1; idx > 0; idx--) {
+			if (syncookie_mss[idx] <= lp->mss)
+				break;
+		}
+	}
+	lp->mss = syncookie_mss[idx];
+	lp->rcvscale = 0;
+	lp->sack_ok = FALSE;
+	lp->ts_val = 0;
+	lp->iss = (count & 0x1f) << 27 | idx << 24
+	          | syncookie_hash(tpriv, lp, count);
+	tpriv->last_overflow = NOW;
+	if (sndsynack(tcp, lp) == 0)
+		tpriv->stats[SynCookiesSent]++;
+}
+
+/* If segp acks one of our cookies, returns a limbo for the call, as if it had
+ * been waiting all along. */
+static Limbo *syncookie_check(struct conv *s, Tcp *segp, uint8_t *src,
+                              uint8_t *dst, uint8_t version)
+{
+	struct tcppriv *tpriv = s->p->priv;
+	uint64_t count = NOW / SYNCOOKIE_PERIOD;
+	uint32_t cookie = segp->ack - 1;
+	Limbo *lp;
+
+	/* Don't bother hashing every stray ACK if we haven't sent cookies. */
+	if (!tpriv->syncookie_keyed
+	    || NOW - tpriv->last_overflow > 2 * SYNCOOKIE_PERIOD)
+		return NULL;
+	lp = kzmalloc(sizeof(*lp), 0);
+	if (lp == NULL)
+		return NULL;
+	lp->version = version;
+	ipmove(lp->laddr, dst);
+	ipmove(lp->raddr, src);
+	lp->lport = segp->dest;
+	lp->rport = segp->source;
+	lp->irs = segp->seq - 1;
+	lp->iss = cookie;
+	for (int age = 0; age < 2; age++) {
+		if (((count - age) & 0x1f) != cookie >> 27)
+			continue;
+		if (syncookie_hash(tpriv, lp, count - age) != (cookie & 0xffffff))
+			break;
+		lp->mss = syncookie_mss[(cookie >> 24) & 0x7];
+		lp->ifc = findipifc(s->p->f, dst, 0);
+		/* We don't know when we sent the SYN ACK, so guess an RTT ago. */
+		lp->lastsend = NOW - tcp_irtt;
+		tpriv->stats[SynCookiesValid]++;
+		return lp;
+	}
+	tpriv->stats[SynCookiesFailed]++;
+	kfree(lp);
+	return NULL;
+}
+
 /*
  *  put a call into limbo and respond with a SYN ACK
  *
@@ -1250,7 +1467,7 @@ static int sndsynack(struct Proto *tcp, Limbo *lp)
 static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
                   int version)
 {
-	Limbo *lp, **l;
+	Limbo *lp, **l, cookie_lp;
 	struct tcppriv *tpriv;
 	int h;
 
@@ -1269,21 +1486,22 @@ static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
 
 		/* each new SYN restarts the retransmits */
 		lp->irs = seg->seq;
+		limbo_disarm(tpriv, lp);
 		break;
 	}
 	lp = *l;
 	if (lp == NULL) {
-		if (tpriv->nlimbo >= Maxlimbo && tpriv->lht[h]) {
-			lp = tpriv->lht[h];
-			tpriv->lht[h] = lp->next;
-			lp->next = NULL;
+		if (tpriv->nlimbo >= Maxlimbo) {
+			tpriv->stats[LimboOverflows]++;
+			lp = &cookie_lp;
 		} else {
 			lp = kzmalloc(sizeof(*lp), 0);
 			if (lp == NULL)
 				return;
 			tpriv->nlimbo++;
+			*l = lp;
 		}
-		*l = lp;
+		lp->next = NULL;
 		lp->version = version;
 		ipmove(lp->laddr, dest);
 		ipmove(lp->raddr, source);
@@ -1294,6 +1512,11 @@ static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
 		lp->sack_ok = seg->sack_ok;
 		lp->irs = seg->seq;
 		lp->ts_val = seg->ts_val;
+		lp->rexmits = 0;
+		if (lp == &cookie_lp) {
+			syncookie_synack(s->p, lp);
+			return;
+		}
 		urandom_read(&lp->iss, sizeof(lp->iss));
 	}
 
@@ -1301,7 +1524,9 @@ static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
 		*l = lp->next;
 		tpriv->nlimbo--;
 		kfree(lp);
+		return;
 	}
+	limbo_arm(tpriv, lp);
 }
 
 /*
@@ -1310,44 +1535,44 @@ static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
 static void limborexmit(struct Proto *tcp)
 {
 	struct tcppriv *tpriv;
-	Limbo **l, *lp;
-	int h;
-	int seen;
-	uint64_t now;
+	struct limbo_tailq *slot;
+	Limbo *lp, *temp;
+	uint64_t tick;
 
 	tpriv = tcp->priv;
 
 	if (!canqlock(&tcp->qlock))
 		return;
-	seen = 0;
-	now = NOW;
-	for (h = 0; h < NLHT && seen < tpriv->nlimbo; h++) {
-		for (l = &tpriv->lht[h]; *l != NULL && seen < tpriv->nlimbo;) {
-			lp = *l;
-			seen++;
-			if (now - lp->lastsend < (lp->rexmits + 1) * SYNACK_RXTIMER)
+	tick = NOW / MSPTICK;
+	/* if we fell behind, one lap of the wheel sees everything */
+	if (tick - tpriv->limbo_tick > NLIMBOWHEEL)
+		tpriv->limbo_tick = tick - NLIMBOWHEEL;
+	while (tpriv->limbo_tick < tick) {
+		tpriv->limbo_tick++;
+		slot = &tpriv->limbo_wheel[tpriv->limbo_tick % NLIMBOWHEEL];
+		TAILQ_FOREACH_SAFE(lp, slot, wheel_link, temp) {
+			/* due on a later lap */
+			if (lp->wheel_tick > tpriv->limbo_tick)
 				continue;
+			TAILQ_REMOVE(slot, lp, wheel_link);
 
 			/* time it out after 1 second */
 			if (++(lp->rexmits) > 5) {
-				tpriv->nlimbo--;
-				*l = lp->next;
-				kfree(lp);
+				limbo_free(tpriv, lp);
 				continue;
 			}
 
 			/* if we're being attacked, don't bother resending SYN ACK's */
-			if (tpriv->nlimbo > 100)
+			if (tpriv->nlimbo > 100) {
+				limbo_arm(tpriv, lp);
 				continue;
+			}
 
 			if (sndsynack(tcp, lp) < 0) {
-				tpriv->nlimbo--;
-				*l = lp->next;
-				kfree(lp);
+				limbo_free(tpriv, lp);
 				continue;
 			}
-
-			l = &lp->next;
+			limbo_arm(tpriv, lp);
 		}
 	}
 	qunlock(&tcp->qlock);
@@ -1381,6 +1606,7 @@ static void limborst(struct conv *s, Tcp *segp, uint8_t *src, uint8_t *dst,
 
 		/* RST can only follow the SYN */
 		if (segp->seq == lp->irs + 1) {
+			limbo_disarm(tpriv, lp);
 			tpriv->nlimbo--;
 			*l = lp->next;
 			kfree(lp);
@@ -1448,17 +1674,22 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 				   segp->seq, lp->irs + 1, segp->ack, lp->iss + 1);
 			lp = NULL;
 		} else {
+			limbo_disarm(tpriv, lp);
 			tpriv->nlimbo--;
 			*l = lp->next;
 		}
 		break;
 	}
+	if (lp == NULL)
+		lp = syncookie_check(s, segp, src, dst, version);
 	if (lp == NULL)
 		return NULL;
 
 	new = Fsnewcall(s, src, segp->source, dst, segp->dest, version);
-	if (new == NULL)
+	if (new == NULL) {
+		kfree(lp);
 		return NULL;
+	}
 
 	memmove(new->ptcl, s->ptcl, sizeof(Tcpctl));
 	tcb = (Tcpctl *) new->ptcl;
@@ -1471,6 +1702,7 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	tcb->katimer.state = TcptimerOFF;
 	tcb->rtt_timer.arg = new;
 	tcb->rtt_timer.state = TcptimerOFF;
+	tcptimers_bind(s->p->priv, tcb);
 
 	tcb->irs = lp->irs;
 	tcb->rcv.nxt = tcb->irs + 1;
@@ -1500,10 +1732,11 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	tcb->sack_ok = lp->sack_ok;
 	/* window scaling */
 	tcpsetscale(new, tcb, lp->rcvscale, lp->sndscale);
-	tcb_check_tso(tcb);
+	tcb_check_tso(tcb, new->ipversion);
 
 	tcb->snd.wnd = segp->wnd;
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
+	tcb->cong->init(tcb);
 
 	/* set initial round trip time */
 	tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
@@ -1925,6 +2158,8 @@ static void update_rtt(Tcpctl *tcb, int rtt_sample, int expected_samples)
 
 	tcb->backoff = 0;
 	tcb->backedoff = 0;
+	if (!tcb->min_rtt || rtt_sample < tcb->min_rtt)
+		tcb->min_rtt = rtt_sample;
 	if (tcb->srtt == 0) {
 		tcb->srtt = rtt_sample;
 		tcb->mdev = rtt_sample / 2;
@@ -1943,9 +2178,9 @@ static void update_rtt(Tcpctl *tcb, int rtt_sample, int expected_samples)
 
 static void update(struct conv *s, Tcp *seg)
 {
-	int rtt;
+	int rtt = 0;
 	Tcpctl *tcb;
-	uint32_t acked, expand;
+	uint32_t acked;
 	struct tcppriv *tpriv;
 
 	tpriv = s->p->priv;
@@ -2020,37 +2255,9 @@ static void update(struct conv *s, Tcp *seg)
 		goto done;
 	}
 
-	/* slow start as long as we're not recovering from lost packets */
-	if (tcb->cwind < tcb->snd.wnd && !tcb->snd.recovery) {
-		if (tcb->cwind < tcb->ssthresh) {
-			/* We increase the cwind by every byte we receive.  We want to
-			 * increase the cwind by one MSS for every MSS that gets ACKed.
-			 * Note that multiple MSSs can be ACKed in a single ACK.  If we had
-			 * a remainder of acked / MSS, we'd add just that remainder - not 0
-			 * or 1 MSS. */
-			expand = acked;
-		} else {
-			/* Every RTT, which consists of CWND bytes, we're supposed to expand
-			 * by MSS bytes.  The classic algorithm was
-			 * 		expand = (tcb->mss * tcb->mss) / tcb->cwind;
-			 * which assumes the ACK was for MSS bytes.  Instead, for every
-			 * 'acked' bytes, we increase the window by acked / CWND (in units
-			 * of MSS). */
-			expand = MAX(acked, tcb->typical_mss) * tcb->typical_mss
-			         / tcb->cwind;
-		}
-
-		if (tcb->cwind + expand < tcb->cwind)
-			expand = tcb->snd.wnd - tcb->cwind;
-		if (tcb->cwind + expand > tcb->snd.wnd)
-			expand = tcb->snd.wnd - tcb->cwind;
-		tcb->cwind += expand;
-	}
-	adjust_tx_qio_limit(s);
-
 	if (tcb->ts_recent) {
-		update_rtt(tcb, abs(milliseconds() - seg->ts_ecr),
-		           expected_samples_ts(tcb, acked));
+		rtt = abs(milliseconds() - seg->ts_ecr);
+		update_rtt(tcb, rtt, expected_samples_ts(tcb, acked));
 	} else if (tcb->rtt_timer.state == TcptimerON &&
 	           seq_ge(seg->ack, tcb->rttseq)) {
 		/* Adjust the timers according to the round trip time */
@@ -2064,6 +2271,11 @@ static void update(struct conv *s, Tcp *seg)
 		}
 	}
 
+	/* open the window as long as we're not recovering from lost packets */
+	if (!tcb->snd.recovery)
+		tcb->cong->ack(tcb, acked, rtt);
+	adjust_tx_qio_limit(s);
+
 done:
 	if (qdiscard(s->wq, acked) < acked) {
 		tcb->flgcnt--;
@@ -2547,6 +2759,7 @@ reset:
 							panic("tcp packblock");
 						qpassnolim(s->rq, bp);
 						bp = NULL;
+						rxring_fill(s, MEM_ATOMIC);
 
 						/*
 						 *  Force an ack every 2 data messages.  This is
@@ -3216,9 +3429,7 @@ static void tcp_loss_event(struct conv *s, Tcpctl *tcb)
 {
 	uint32_t old_cwnd = tcb->cwind;
 
-	/* Reno */
-	tcb->ssthresh = tcb->cwind / 2;
-	tcb->cwind = tcb->ssthresh;
+	tcb->cong->loss(tcb);
 	netlog(s->p->f, Logtcprxmt,
 	       "%I.%d -> %I.%d: loss event, cwnd was %d, now %d\n",
 	       s->laddr, s->lport, s->raddr, s->rport,
@@ -3356,6 +3567,7 @@ static void procsyn(struct conv *s, Tcp *seg)
 
 	tcb->snd.wnd = seg->wnd;
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
+	tcb->cong->init(tcb);
 }
 
 static int addreseq(Tcpctl *tcb, struct tcppriv *tpriv, Tcp *seg,
@@ -3519,7 +3731,7 @@ static void tcpadvise(struct Proto *tcp, struct block *bp, char *msg)
 	uint8_t source[IPaddrlen];
 	uint8_t dest[IPaddrlen];
 	uint16_t psource, pdest;
-	struct conv *s, **p;
+	struct conv *s, **p, *found;
 
 	h4 = (Tcp4hdr *) (bp->rp);
 	h6 = (Tcp6hdr *) (bp->rp);
@@ -3536,8 +3748,11 @@ static void tcpadvise(struct Proto *tcp, struct block *bp, char *msg)
 		pdest = nhgets(h6->tcpdport);
 	}
 
-	/* Look for a connection */
-	for (p = tcp->conv; *p; p++) {
+	/* Look for a connection.  The conv table can be replaced while we walk it
+	 * (see proto_grow()), but the convs themselves stay. */
+	found = NULL;
+	rcu_read_lock();
+	for (p = READ_ONCE(tcp->conv); *p; p++) {
 		s = *p;
 		tcb = (Tcpctl *) s->ptcl;
 		if (s->rport == pdest)
@@ -3545,17 +3760,22 @@ static void tcpadvise(struct Proto *tcp, struct block *bp, char *msg)
 				if (tcb->state != Closed)
 					if (ipcmp(s->raddr, dest) == 0)
 						if (ipcmp(s->laddr, source) == 0) {
-							qlock(&s->qlock);
-							switch (tcb->state) {
-								case Syn_sent:
-									localclose(s, msg);
-									break;
-							}
-							qunlock(&s->qlock);
-							freeblist(bp);
-							return;
+							found = s;
+							break;
 						}
 	}
+	rcu_read_unlock();
+	if (found) {
+		s = found;
+		tcb = (Tcpctl *) s->ptcl;
+		qlock(&s->qlock);
+		switch (tcb->state) {
+			case Syn_sent:
+				localclose(s, msg);
+				break;
+		}
+		qunlock(&s->qlock);
+	}
 	freeblist(bp);
 }
 
@@ -3580,6 +3800,12 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpsetchecksum(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
+	else if (n == 2 && strcmp(f[0], "cong") == 0)
+		tcp_cong_set((Tcpctl *) c->ptcl, f[1]);
+	else if (n == 2 && strcmp(f[0], "congdefault") == 0)
+		tcp_cong_default = tcp_cong_find(f[1]);
+	else if (n == 3 && strcmp(f[0], "rxring") == 0)
+		rxring_attach(c, strtoul(f[1], 0, 0), strtoul(f[2], 0, 0));
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -3668,7 +3894,14 @@ void tcpinit(struct Fs *fs)
 	tcp = kzmalloc(sizeof(struct Proto), 0);
 	tpriv = tcp->priv = kzmalloc(sizeof(struct tcppriv), 0);
 	debug_priv = tpriv;
-	qlock_init(&tpriv->tl);
+	iphtinit(&tpriv->ht);
+	tpriv->wheels = kzmalloc_align(num_cores * sizeof(struct tcp_twheel),
+	                               MEM_WAIT, ARCH_CL_SIZE);
+	for (int i = 0; i < num_cores; i++)
+		spinlock_init(&tpriv->wheels[i].lock);
+	for (int i = 0; i < NLIMBOWHEEL; i++)
+		TAILQ_INIT(&tpriv->limbo_wheel[i]);
+	tpriv->limbo_tick = NOW / MSPTICK;
 	qlock_init(&tpriv->apl);
 	tcp->name = "tcp";
 	tcp->connect = tcpconnect;
@@ -3686,8 +3919,9 @@ void tcpinit(struct Fs *fs)
 	tcp->gc = tcpgc;
 	tcp->ipproto = IP_TCPPROTO;
 	tcp->nc = 4096;
+	tcp->maxnc = Maxconv;
 	tcp->ptclsize = sizeof(Tcpctl);
-	tpriv->stats[MaxConn] = tcp->nc;
+	tpriv->stats[MaxConn] = tcp->maxnc;
 
 	Fsproto(fs, tcp);
 }
@@ -0,0 +1,279 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * BBR congestion control, after Cardwell et al., "BBR: Congestion-Based
+ * Congestion Control" (ACM Queue, 2016).
+ *
+ * Instead of reacting to loss, BBR models the path: the bottleneck bandwidth
+ * (the max delivery rate over the last BBR_BW_ROUNDS round trips) and the
+ * propagation delay (the min RTT over the last BBR_MIN_RTT_WIN ms).  It keeps
+ * about a BDP (bw * min_rtt) in flight, going through the usual modes:
+ * STARTUP doubles until the bandwidth stops growing, DRAIN empties the queue
+ * STARTUP built, PROBE_BW cycles a little above and below the BDP to find more
+ * bandwidth, and PROBE_RTT occasionally shrinks to a few packets to re-measure
+ * the min RTT.
+ *
+ * We don't pace: tcp.c sends whenever the window allows.  So the gains, which
+ * BBR applies to its pacing rate, are applied to cwind here, and DRAIN and the
+ * low PROBE_BW phase shrink the window rather than slow the sender.  The rate
+ * we would pace at is still reported through pacing_rate.
+ *
+ * Bandwidth is in bytes per ms and RTTs are in usec, so that a LAN, with round
+ * trips well under a ms, still gets a model.  tcp.c's RTT samples are in ms,
+ * so we also time each round ourselves.  Gains are fixed point, BBR_UNIT is
+ * 1.0.
+ */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+enum {
+	BBR_BW_ROUNDS = 10,
+	BBR_MIN_RTT_WIN = 10 * 1000,	/* ms */
+	BBR_PROBE_RTT_TIME = 200,		/* ms */
+	BBR_MIN_CWND_SEGS = 4,
+	BBR_CYCLE_LEN = 8,
+
+	BBR_UNIT = 256,
+	BBR_HIGH_GAIN = 739,			/* 2/ln(2), STARTUP */
+	BBR_DRAIN_GAIN = 89,			/* 1/HIGH_GAIN */
+};
+
+enum {
+	BBR_STARTUP,
+	BBR_DRAIN,
+	BBR_PROBE_BW,
+	BBR_PROBE_RTT,
+};
+
+static const uint16_t bbr_cycle_gain[BBR_CYCLE_LEN] = {
+	BBR_UNIT * 5 / 4, BBR_UNIT * 3 / 4,
+	BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT,
+};
+
+struct bbr {
+	uint64_t round_start;		/* when this round started (usec) */
+	uint64_t min_rtt_stamp;		/* when we saw min_rtt */
+	uint64_t probe_rtt_done;	/* when PROBE_RTT can end, 0 if not yet */
+	uint32_t bw[BBR_BW_ROUNDS];	/* delivery rate of recent rounds */
+	uint32_t round;
+	uint32_t next_round_seq;	/* the round ends when this is acked */
+	uint32_t round_delivered;	/* bytes acked this round */
+	uint32_t min_rtt;			/* usec */
+	uint32_t full_bw;			/* bw when STARTUP last grew */
+	uint8_t full_bw_cnt;		/* rounds since STARTUP last grew */
+	bool full_bw_reached;
+	uint8_t mode;
+	uint8_t cycle_idx;
+};
+
+static uint32_t bbr_bw(struct bbr *b)
+{
+	uint32_t max = 0;
+
+	for (int i = 0; i < BBR_BW_ROUNDS; i++)
+		max = MAX(max, b->bw[i]);
+	return max;
+}
+
+static uint64_t bbr_bdp(struct bbr *b)
+{
+	return (uint64_t)bbr_bw(b) * b->min_rtt / 1000;
+}
+
+static uint64_t bbr_usec(void)
+{
+	return tsc2usec(read_tsc());
+}
+
+static void bbr_init(Tcpctl *tcb)
+{
+	struct bbr *b = tcp_cong_priv(tcb);
+
+	static_assert(sizeof(struct bbr) <= TCP_CONG_PRIV_SZ);
+	memset(b, 0, sizeof(struct bbr));
+	b->round_start = bbr_usec();
+	b->min_rtt_stamp = milliseconds();
+	b->min_rtt = tcb->min_rtt * 1000;
+	b->next_round_seq = tcb->snd.nxt;
+	b->mode = BBR_STARTUP;
+}
+
+/* STARTUP is done once three rounds in a row didn't grow the bw by 25%. */
+static void bbr_check_full_bw(struct bbr *b)
+{
+	uint32_t bw = bbr_bw(b);
+
+	if (b->full_bw_reached)
+		return;
+	if (bw >= b->full_bw + b->full_bw / 4) {
+		b->full_bw = bw;
+		b->full_bw_cnt = 0;
+		return;
+	}
+	if (++b->full_bw_cnt >= 3)
+		b->full_bw_reached = TRUE;
+}
+
+/* Ends the round at now_us, returning how long it took. */
+static uint64_t bbr_round_end(Tcpctl *tcb, struct bbr *b, uint64_t now_us)
+{
+	uint64_t elapsed = now_us - b->round_start;
+	uint64_t bw = 0;
+
+	if (elapsed)
+		bw = MIN((uint64_t)b->round_delivered * 1000 / elapsed, UINT32_MAX);
+	b->bw[b->round % BBR_BW_ROUNDS] = bw;
+	b->round++;
+	b->round_start = now_us;
+	b->round_delivered = 0;
+	b->next_round_seq = tcb->snd.nxt;
+
+	bbr_check_full_bw(b);
+	if (b->mode == BBR_PROBE_BW)
+		b->cycle_idx = (b->cycle_idx + 1) % BBR_CYCLE_LEN;
+	return elapsed;
+}
+
+static void bbr_update_min_rtt(struct bbr *b, uint64_t rtt_us, uint64_t now)
+{
+	bool expired = now - b->min_rtt_stamp > BBR_MIN_RTT_WIN;
+
+	if (rtt_us && (!b->min_rtt || rtt_us <= b->min_rtt || expired)) {
+		b->min_rtt = MIN(rtt_us, UINT32_MAX);
+		b->min_rtt_stamp = now;
+	}
+}
+
+static void bbr_update_mode(Tcpctl *tcb, struct bbr *b, uint64_t now,
+                            bool rtt_expired)
+{
+	uint32_t min_cwnd = BBR_MIN_CWND_SEGS * tcb->typical_mss;
+
+	if (b->mode == BBR_STARTUP && b->full_bw_reached)
+		b->mode = BBR_DRAIN;
+	if (b->mode == BBR_DRAIN && tcb->snd.in_flight <= bbr_bdp(b)) {
+		b->mode = BBR_PROBE_BW;
+		/* Skip the 3/4 phase, we just drained. */
+		b->cycle_idx = 2;
+	}
+	if (b->mode != BBR_PROBE_RTT && rtt_expired) {
+		b->mode = BBR_PROBE_RTT;
+		b->probe_rtt_done = 0;
+	}
+	if (b->mode == BBR_PROBE_RTT) {
+		if (!b->probe_rtt_done && tcb->snd.in_flight <= min_cwnd)
+			b->probe_rtt_done = now + BBR_PROBE_RTT_TIME;
+		if (b->probe_rtt_done && now >= b->probe_rtt_done) {
+			b->min_rtt_stamp = now;
+			b->mode = b->full_bw_reached ? BBR_PROBE_BW : BBR_STARTUP;
+		}
+	}
+}
+
+static uint32_t bbr_cwnd_gain(struct bbr *b)
+{
+	switch (b->mode) {
+	case BBR_STARTUP:
+		return BBR_HIGH_GAIN;
+	case BBR_PROBE_BW:
+		return bbr_cycle_gain[b->cycle_idx];
+	default:
+		return BBR_UNIT;
+	}
+}
+
+static void bbr_set_cwnd(Tcpctl *tcb, struct bbr *b, uint32_t acked)
+{
+	uint32_t mss = tcb->typical_mss;
+	uint32_t min_cwnd = BBR_MIN_CWND_SEGS * mss;
+	uint64_t bdp = bbr_bdp(b);
+	uint64_t target;
+
+	if (b->mode == BBR_PROBE_RTT) {
+		tcb->cwind = MIN(tcb->cwind, min_cwnd);
+		return;
+	}
+	/* Until we have a model, grow like Reno. */
+	if (!bdp) {
+		if (tcb->cwind < tcb->ssthresh)
+			tcp_cong_grow(tcb, acked);
+		else
+			tcp_cong_grow(tcb, MAX(acked, mss) * mss / tcb->cwind);
+		return;
+	}
+	/* A few MSS on top for delayed and stretched acks. */
+	target = bdp * bbr_cwnd_gain(b) / BBR_UNIT + 3 * mss;
+	if (tcb->cwind + (uint64_t)acked <= target)
+		tcp_cong_grow(tcb, acked);
+	else if (b->full_bw_reached)
+		tcb->cwind = MAX(target, min_cwnd);
+}
+
+static void bbr_ack(Tcpctl *tcb, uint32_t acked, int rtt)
+{
+	struct bbr *b = tcp_cong_priv(tcb);
+	uint64_t now = milliseconds();
+	bool rtt_expired = now - b->min_rtt_stamp > BBR_MIN_RTT_WIN;
+
+	if (rtt > 0)
+		bbr_update_min_rtt(b, (uint64_t)rtt * 1000, now);
+	b->round_delivered += acked;
+	/* A round is at least a round trip, and sub-ms ones still count. */
+	if (seq_ge(tcb->snd.una, b->next_round_seq))
+		bbr_update_min_rtt(b, bbr_round_end(tcb, b, bbr_usec()), now);
+	bbr_update_mode(tcb, b, now, rtt_expired);
+	bbr_set_cwnd(tcb, b, acked);
+}
+
+/* BBR doesn't back off on loss.  We just drop anything above the model.  Until
+ * there is a model, we back off like Reno. */
+static void bbr_loss(Tcpctl *tcb)
+{
+	struct bbr *b = tcp_cong_priv(tcb);
+	uint64_t bdp = bbr_bdp(b);
+	uint32_t mss = tcb->typical_mss;
+	uint32_t min_cwnd = BBR_MIN_CWND_SEGS * mss;
+
+	if (!bdp) {
+		tcb->ssthresh = tcb->cwind / 2;
+		tcb->cwind = MAX(tcb->ssthresh, min_cwnd);
+		return;
+	}
+	tcb->cwind = MAX(MIN(tcb->cwind, bdp + 3 * mss), min_cwnd);
+}
+
+static uint64_t bbr_pacing_rate(Tcpctl *tcb)
+{
+	struct bbr *b = tcp_cong_priv(tcb);
+	uint32_t gain;
+
+	switch (b->mode) {
+	case BBR_STARTUP:
+		gain = BBR_HIGH_GAIN;
+		break;
+	case BBR_DRAIN:
+		gain = BBR_DRAIN_GAIN;
+		break;
+	case BBR_PROBE_BW:
+		gain = bbr_cycle_gain[b->cycle_idx];
+		break;
+	default:
+		gain = BBR_UNIT;
+	}
+	return (uint64_t)bbr_bw(b) * 1000 * gain / BBR_UNIT;
+}
+
+const struct tcp_cong_ops tcp_bbr = {
+	.name = "bbr",
+	.init = bbr_init,
+	.ack = bbr_ack,
+	.loss = bbr_loss,
+	.pacing_rate = bbr_pacing_rate,
+};
@@ -0,0 +1,102 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * TCP congestion control algorithms, and Reno, which is what tcp.c always did.
+ *
+ * The algorithm of a conversation can be changed with "cong <name>" on its ctl
+ * file.  "congdefault <name>" on any TCP ctl file picks the algorithm for new
+ * conversations; accepted calls get their listener's.
+ */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+static const struct tcp_cong_ops *tcp_congs[] = {
+	&tcp_reno,
+	&tcp_cubic,
+	&tcp_bbr,
+};
+
+const struct tcp_cong_ops *tcp_cong_default = &tcp_reno;
+
+const struct tcp_cong_ops *tcp_cong_find(const char *name)
+{
+	for (int i = 0; i < ARRAY_SIZE(tcp_congs); i++) {
+		if (!strcmp(tcp_congs[i]->name, name))
+			return tcp_congs[i];
+	}
+	error(ENOENT, "no TCP congestion control %s", name);
+}
+
+/* Switches tcb to the algorithm name, starting it from the current cwind.  If
+ * tcb isn't connected yet, inittcpctl() starts it later. */
+void tcp_cong_set(Tcpctl *tcb, const char *name)
+{
+	const struct tcp_cong_ops *cong = tcp_cong_find(name);
+
+	if (tcb->state == Closed) {
+		tcb->cong_pick = cong;
+		return;
+	}
+	tcb->cong = cong;
+	cong->init(tcb);
+}
+
+/* Grows cwind by expand, but never past the peer's window. */
+void tcp_cong_grow(Tcpctl *tcb, uint32_t expand)
+{
+	if (tcb->cwind >= tcb->snd.wnd)
+		return;
+	if (tcb->cwind + expand < tcb->cwind)
+		expand = tcb->snd.wnd - tcb->cwind;
+	if (tcb->cwind + expand > tcb->snd.wnd)
+		expand = tcb->snd.wnd - tcb->cwind;
+	tcb->cwind += expand;
+}
+
+static void reno_init(Tcpctl *tcb)
+{
+}
+
+static void reno_ack(Tcpctl *tcb, uint32_t acked, int rtt)
+{
+	uint32_t expand;
+
+	if (tcb->cwind < tcb->ssthresh) {
+		/* We increase the cwind by every byte we receive.  We want to
+		 * increase the cwind by one MSS for every MSS that gets ACKed.
+		 * Note that multiple MSSs can be ACKed in a single ACK.  If we had
+		 * a remainder of acked / MSS, we'd add just that remainder - not 0
+		 * or 1 MSS. */
+		expand = acked;
+	} else {
+		/* Every RTT, which consists of CWND bytes, we're supposed to expand
+		 * by MSS bytes.  The classic algorithm was
+		 * 		expand = (tcb->mss * tcb->mss) / tcb->cwind;
+		 * which assumes the ACK was for MSS bytes.  Instead, for every
+		 * 'acked' bytes, we increase the window by acked / CWND (in units
+		 * of MSS). */
+		expand = MAX(acked, tcb->typical_mss) * tcb->typical_mss
+		         / tcb->cwind;
+	}
+	tcp_cong_grow(tcb, expand);
+}
+
+static void reno_loss(Tcpctl *tcb)
+{
+	tcb->ssthresh = tcb->cwind / 2;
+	tcb->cwind = tcb->ssthresh;
+}
+
+const struct tcp_cong_ops tcp_reno = {
+	.name = "reno",
+	.init = reno_init,
+	.ack = reno_ack,
+	.loss = reno_loss,
+};
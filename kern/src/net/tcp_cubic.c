@@ -0,0 +1,142 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * CUBIC congestion control (RFC 8312).
+ *
+ * After a loss, cwind follows a cubic in the time since the loss, centered on
+ * the window we had when we lost (w_max): it climbs back quickly, flattens out
+ * around w_max, then probes beyond it.  The growth depends on time, not on the
+ * RTT, so long fat pipes recover in seconds rather than the many RTTs Reno's
+ * one MSS per RTT takes.  We never grow slower than Reno would have.
+ *
+ * Everything is in bytes and milliseconds.  C is 0.4 and beta is 0.7.
+ */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+enum {
+	CUBIC_MAX_T = 100 * 1000,	/* ms, keeps the cube in range */
+	CUBIC_EST_SHIFT = 10,		/* fixed point for w_est */
+};
+
+struct cubic {
+	uint64_t epoch_start;		/* when we started this curve, 0 for none */
+	uint64_t w_est;				/* Reno's cwind, << CUBIC_EST_SHIFT */
+	uint32_t w_max;				/* cwind at the last loss */
+	uint32_t origin;			/* top of the curve's plateau */
+	uint32_t k;					/* ms from epoch_start to origin */
+};
+
+/* Integer cube root, Hacker's Delight icbrt64. */
+static uint64_t cubic_cbrt(uint64_t x)
+{
+	uint64_t r = 0, b;
+
+	for (int s = 63; s >= 0; s -= 3) {
+		r <<= 1;
+		b = 3 * r * (r + 1) + 1;
+		if ((x >> s) >= b) {
+			x -= b << s;
+			r++;
+		}
+	}
+	return r;
+}
+
+static void cubic_init(Tcpctl *tcb)
+{
+	static_assert(sizeof(struct cubic) <= TCP_CONG_PRIV_SZ);
+	memset(tcp_cong_priv(tcb), 0, sizeof(struct cubic));
+}
+
+static void cubic_start_epoch(Tcpctl *tcb, struct cubic *c)
+{
+	uint64_t gap;
+
+	c->epoch_start = milliseconds();
+	if (tcb->cwind < c->w_max) {
+		/* K = cbrt((w_max - cwind) / C), with the window in MSS and K in
+		 * seconds.  We want ms, so the cube is 10^9 times bigger. */
+		gap = c->w_max - tcb->cwind;
+		c->k = cubic_cbrt(gap * 2500000 / tcb->typical_mss * 1000);
+		c->origin = c->w_max;
+	} else {
+		c->k = 0;
+		c->origin = tcb->cwind;
+	}
+	c->w_est = (uint64_t)tcb->cwind << CUBIC_EST_SHIFT;
+}
+
+/* W_cubic(t) = C * (t - K)^3 + origin */
+static uint32_t cubic_target(Tcpctl *tcb, struct cubic *c, uint64_t t)
+{
+	int64_t d = MIN(t, CUBIC_MAX_T) - (int64_t)c->k;
+	int64_t off = d * d * d * 4 / 10000 * tcb->typical_mss / 1000000;
+	int64_t target = c->origin + off;
+
+	if (target < 2 * tcb->typical_mss)
+		return 2 * tcb->typical_mss;
+	/* RFC 8312: no more than 1.5 * cwind, even when far from the origin. */
+	return MIN(target, tcb->cwind + tcb->cwind / 2);
+}
+
+static void cubic_ack(Tcpctl *tcb, uint32_t acked, int rtt)
+{
+	struct cubic *c = tcp_cong_priv(tcb);
+	uint64_t t;
+	uint32_t target, w_est;
+	uint32_t mss = tcb->typical_mss;
+	uint32_t rtt_est = tcb->min_rtt ? tcb->min_rtt : tcb->srtt;
+
+	if (tcb->cwind < tcb->ssthresh) {
+		tcp_cong_grow(tcb, acked);
+		return;
+	}
+	if (!c->epoch_start)
+		cubic_start_epoch(tcb, c);
+	/* Aim for where the curve will be an RTT from now. */
+	t = milliseconds() - c->epoch_start + rtt_est;
+	target = cubic_target(tcb, c, t);
+
+	/* Reno's window, growing by 3(1 - beta)/(1 + beta) MSS per RTT. */
+	c->w_est += ((uint64_t)acked * mss * 9 << CUBIC_EST_SHIFT)
+	            / (17 * (uint64_t)tcb->cwind);
+	w_est = c->w_est >> CUBIC_EST_SHIFT;
+	if (w_est > target)
+		target = w_est;
+
+	if (target > tcb->cwind)
+		tcp_cong_grow(tcb, (uint64_t)(target - tcb->cwind) * acked
+		                   / tcb->cwind);
+	else
+		tcp_cong_grow(tcb, (uint64_t)mss * acked / (100 * tcb->cwind));
+}
+
+static void cubic_loss(Tcpctl *tcb)
+{
+	struct cubic *c = tcp_cong_priv(tcb);
+
+	c->epoch_start = 0;
+	/* Fast convergence: if we lost below the last w_max, someone else wants
+	 * the bandwidth, so plateau a bit lower. */
+	if (tcb->cwind < c->w_max)
+		c->w_max = tcb->cwind * 17 / 20;
+	else
+		c->w_max = tcb->cwind;
+	tcb->ssthresh = MAX(tcb->cwind / 10 * 7, 2 * tcb->typical_mss);
+	tcb->cwind = tcb->ssthresh;
+}
+
+const struct tcp_cong_ops tcp_cubic = {
+	.name = "cubic",
+	.init = cubic_init,
+	.ack = cubic_ack,
+	.loss = cubic_loss,
+};
@@ -610,7 +610,7 @@ void udpadvise(struct Proto *udp, struct block *bp, char *msg)
 	Udp6hdr *h6;
 	uint8_t source[IPaddrlen], dest[IPaddrlen];
 	uint16_t psource, pdest;
-	struct conv *s, **p;
+	struct conv *s, **p, *found;
 	int version;
 
 	h4 = (Udp4hdr *) (bp->rp);
@@ -635,23 +635,28 @@ void udpadvise(struct Proto *udp, struct block *bp, char *msg)
 			return;	/* to avoid a warning */
 	}
 
-	/* Look for a connection */
-	for (p = udp->conv; *p; p++) {
+	/* Look for a connection.  The conv table can be replaced while we walk it
+	 * (see proto_grow()), but the convs themselves stay. */
+	found = NULL;
+	rcu_read_lock();
+	for (p = READ_ONCE(udp->conv); *p; p++) {
 		s = *p;
 		if (s->rport == pdest)
 			if (s->lport == psource)
 				if (ipcmp(s->raddr, dest) == 0)
 					if (ipcmp(s->laddr, source) == 0) {
-						if (s->ignoreadvice)
-							break;
-						qlock(&s->qlock);
-						qhangup(s->rq, msg);
-						qhangup(s->wq, msg);
-						qunlock(&s->qlock);
-						freeblist(bp);
-						return;
+						if (!s->ignoreadvice)
+							found = s;
+						break;
 					}
 	}
+	rcu_read_unlock();
+	if (found) {
+		qlock(&found->qlock);
+		qhangup(found->rq, msg);
+		qhangup(found->wq, msg);
+		qunlock(&found->qlock);
+	}
 	freeblist(bp);
 }
 
@@ -676,6 +681,7 @@ void udpinit(struct Fs *fs)
 
 	udp = kzmalloc(sizeof(struct Proto), 0);
 	udp->priv = kzmalloc(sizeof(Udppriv), 0);
+	iphtinit(&((Udppriv*)udp->priv)->ht);
 	udp->name = "udp";
 	udp->connect = udpconnect;
 	udp->bind = udpbind;
@@ -690,6 +696,7 @@ void udpinit(struct Fs *fs)
 	udp->stats = udpstats;
 	udp->ipproto = IP_UDPPROTO;
 	udp->nc = 4096;
+	udp->maxnc = Maxconv;
 	udp->ptclsize = sizeof(Udpcb);
 
 	Fsproto(fs, udp);
@@ -38,6 +38,7 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <process.h>
+#include <event.h>
 
 /* Note that Hdrspc is only available via padblock (to the 'left' of the rp). */
 enum {
@@ -75,6 +76,7 @@ struct block *block_alloc(size_t size, int mem_flags)
 	b->mss = 0;
 	b->network_offset = 0;
 	b->transport_offset = 0;
+	b->rx_hash = 0;
 
 	addr = (uintptr_t) b;
 	addr = ROUNDUP(addr + sizeof(struct block), BLOCKALIGN);
@@ -156,6 +158,14 @@ static struct extra_bdata *next_unused_slot(struct block *b)
  * Return 0 on success or -1 on error. */
 int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
                        uint32_t len, int mem_flags)
+{
+	return block_append_ubuf(b, NULL, base, off, len, mem_flags);
+}
+
+/* Same, but @base is user memory held by @ubuf.  The new extra_data takes over
+ * a ref on @ubuf from the caller. */
+int block_append_ubuf(struct block *b, struct block_ubuf *ubuf, uintptr_t base,
+                      uint32_t off, uint32_t len, int mem_flags)
 {
 	unsigned int nr_bufs = b->nr_extra_bufs + 1;
 	struct extra_bdata *ebd;
@@ -170,10 +180,94 @@ int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
 	ebd->base = base;
 	ebd->off = off;
 	ebd->len = len;
+	ebd->ubuf = ubuf;
 	b->extra_len += ebd->len;
 	return 0;
 }
 
+static void __block_ubuf_free(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct block_ubuf *ubuf = (struct block_ubuf*)a0;
+	struct proc *p = ubuf->pin.proc;
+
+	/* unpin first, so they can munmap as soon as they hear about it */
+	proc_incref(p, 1);
+	mm_unpin(&ubuf->pin);
+	if (ubuf->msg.ev_arg4)
+		send_kernel_event(p, &ubuf->msg, 0);
+	proc_decref(p);
+	kfree(ubuf);
+}
+
+static void block_ubuf_release(struct kref *kref)
+{
+	struct block_ubuf *ubuf = container_of(kref, struct block_ubuf, kref);
+
+	/* The last ref can go from anywhere, like a NIC's TX completion IRQ, but
+	 * unpinning needs the vmr_lock. */
+	send_kernel_message(core_id(), __block_ubuf_free, (long)ubuf, 0, 0,
+	                    KMSG_ROUTINE);
+}
+
+/* Pins the current process's [uva, uva + len) for use as extra_data, filling
+ * in the pages that back it (see mm_pin()).  The ubuf comes back with a ref for
+ * the caller.  Once the last ref is gone, msg is sent to the process, unless
+ * ev_arg4, the amount of data, is 0.
+ *
+ * Returns 0 if the memory can't be pinned. */
+struct block_ubuf *block_ubuf_pin(void *uva, size_t len, struct page **pages,
+                                  struct event_msg *msg)
+{
+	struct block_ubuf *ubuf;
+
+	if (!current)
+		return 0;
+	ubuf = kzmalloc(sizeof(struct block_ubuf), MEM_WAIT);
+	if (mm_pin(current, &ubuf->pin, (uintptr_t)uva, len, pages)) {
+		kfree(ubuf);
+		return 0;
+	}
+	kref_init(&ubuf->kref, block_ubuf_release, 1);
+	ubuf->msg = *msg;
+	return ubuf;
+}
+
+void block_ubuf_decref(struct block_ubuf *ubuf)
+{
+	kref_put(&ubuf->kref);
+}
+
+/* Refcounting for an extra_data's buffer, whatever its release method. */
+void ebd_incref(struct extra_bdata *ebd)
+{
+	if (ebd->ubuf)
+		kref_get(&ebd->ubuf->kref, 1);
+	else
+		kmalloc_incref((void*)ebd->base);
+}
+
+void ebd_decref(struct extra_bdata *ebd)
+{
+	if (ebd->ubuf)
+		block_ubuf_decref(ebd->ubuf);
+	else
+		kfree((void*)ebd->base);
+}
+
+/* Append @from's data (rp to wp) to @to as an extra data buffer, without a
+ * copy.  @to takes over @from's memory, which gets freed with @to, so the
+ * caller must not touch @from after this succeeds.  Only works for plain
+ * blocks: no extra data of their own, no free method, not part of a list.
+ * Return 0 on success or -1 on error, in which case @from is untouched. */
+int block_append_block(struct block *to, struct block *from, int mem_flags)
+{
+	if (from->free || from->extra_len || from->nr_extra_bufs || from->next)
+		return -1;
+	return block_append_extra(to, (uintptr_t)from,
+	                          from->rp - (uint8_t*)from, BHLEN(from),
+	                          mem_flags);
+}
+
 /* There's metadata in each block related to the data payload.  For instance,
  * the TSO mss, the offsets to various headers, whether csums are needed, etc.
  * When you create a new block, like in copyblock, this will copy those bits
@@ -185,6 +279,7 @@ void block_copy_metadata(struct block *new_b, struct block *old_b)
 	new_b->mss = old_b->mss;
 	new_b->network_offset = old_b->network_offset;
 	new_b->transport_offset = old_b->transport_offset;
+	new_b->rx_hash = old_b->rx_hash;
 }
 
 void block_reset_metadata(struct block *b)
@@ -194,18 +289,17 @@ void block_reset_metadata(struct block *b)
 	b->mss = 0;
 	b->network_offset = 0;
 	b->transport_offset = 0;
+	b->rx_hash = 0;
 }
 
 void free_block_extra(struct block *b)
 {
 	struct extra_bdata *ebd;
 
-	/* assuming our release method is kfree, which will change when we support
-	 * user buffers */
 	for (int i = 0; i < b->nr_extra_bufs; i++) {
 		ebd = &b->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			ebd_decref(ebd);
 	}
 	b->extra_len = 0;
 	b->nr_extra_bufs = 0;
@@ -290,7 +384,7 @@ void checkb(struct block *b, char *msg)
 			panic("checkb %s: ebd %d has no base, but has off %d and len %d",
 			      msg, i, ebd->off, ebd->len);
 		if (ebd->base) {
-			if (!kmalloc_refcnt((void*)ebd->base))
+			if (!ebd->ubuf && !kmalloc_refcnt((void*)ebd->base))
 				panic("checkb %s: buf %d, base %p has no refcnt!\n", msg, i,
 				      ebd->base);
 			extra_len += ebd->len;
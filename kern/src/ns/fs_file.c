@@ -300,7 +300,7 @@ static void fs_file_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
 			error(-error, "punch_hole pm_load_page failed");
 		zero_amt = MIN(PGSIZE - PGOFF(begin), end - begin);
 		memset(page2kva(page) + PGOFF(begin), 0, zero_amt);
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_set_page_dirty(page);
 		pm_put_page(page);
 		first_pg_idx++;
 		nr_pages--;
@@ -314,7 +314,7 @@ static void fs_file_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
 		if (error)
 			error(-error, "punch_hole pm_load_page failed");
 		memset(page2kva(page), 0, PGOFF(end));
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_set_page_dirty(page);
 		pm_put_page(page);
 		last_pg_idx--;
 		nr_pages--;
@@ -345,10 +345,51 @@ void fs_file_truncate(struct fs_file *f, off64_t to)
 	}
 }
 
+/* Sequential readers get an adaptive readahead window.  A read is sequential if
+ * it picks up where the last one left off (or in the partial page it stopped
+ * in).  The window starts at FSF_RA_MIN_PAGES and doubles each time we refill
+ * it, up to FSF_RA_MAX_PAGES.  Any other read resets it.  We refill once the
+ * reader gets within half a window of the end of what we've read ahead, and the
+ * refill covers the pages of the current read too, so the backend sees one big
+ * read instead of one per page.
+ *
+ * The RA state is per open chan and unlocked.  Concurrent readers of the same
+ * chan just make for a worse guess. */
+static void fs_file_readahead(struct fs_file *f, struct file_ra_state *ra,
+                              size_t count, off64_t offset)
+{
+	size_t len = fs_file_get_length(f);
+	unsigned long first_idx, last_idx, nr_file_pgs, start, end;
+
+	if (!ra || !count || offset >= len)
+		return;
+	first_idx = LA2PPN(offset);
+	last_idx = LA2PPN(MIN(offset + count, len) - 1);
+	nr_file_pgs = LA2PPN(ROUNDUP(len, PGSIZE));
+	if (first_idx == ra->next_idx || first_idx + 1 == ra->next_idx) {
+		if (!ra->window)
+			ra->window = FSF_RA_MIN_PAGES;
+	} else {
+		ra->window = 0;
+		ra->ra_end = 0;
+	}
+	ra->next_idx = last_idx + 1;
+	if (!ra->window)
+		return;
+	if (ra->ra_end > last_idx + 1 + ra->window / 2)
+		return;
+	start = MAX(first_idx, ra->ra_end);
+	end = MIN(last_idx + 1 + ra->window, nr_file_pgs);
+	if (start < end)
+		pm_readahead(f->pm, start, end - start);
+	ra->ra_end = end;
+	ra->window = MIN(ra->window * 2, FSF_RA_MAX_PAGES);
+}
+
 /* Standard read.  We sync with write, in that once the length is set, we'll
- * attempt to read those bytes. */
+ * attempt to read those bytes.  ra is optional; see fs_file_readahead(). */
 size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
-                    off64_t offset)
+                    off64_t offset, struct file_ra_state *ra)
 {
 	ERRSTACK(1);
 	struct page *page;
@@ -364,6 +405,7 @@ size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
 		}
 		nexterror();
 	}
+	fs_file_readahead(f, ra, count, offset);
 	while (buf < buf_end) {
 		/* Check early, so we don't load pages beyond length needlessly.  The
 		 * PM/FSF op might just create zeroed pages when asked. */
@@ -371,7 +413,11 @@ size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
 			break;
 		pg_off = PGOFF(offset + so_far);
 		pg_idx = LA2PPN(offset + so_far);
-		error = pm_load_page(f->pm, pg_idx, &page);
+		error = pm_load_page_nowait(f->pm, pg_idx, &page);
+		if (error) {
+			pm_ra_note_miss();
+			error = pm_load_page(f->pm, pg_idx, &page);
+		}
 		if (error)
 			error(-error, "read pm_load_page failed");
 		copy_amt = MIN(PGSIZE - pg_off, buf_end - buf);
@@ -425,7 +471,7 @@ size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
 		memcpy_from_safe(page2kva(page) + pg_off, buf, copy_amt);
 		buf += copy_amt;
 		so_far += copy_amt;
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_set_page_dirty(page);
 		pm_put_page(page);
 	}
 	assert(buf == buf_end);
@@ -436,6 +482,7 @@ size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
 	 * what we added. */
 	write_metadata(f, offset + so_far, false);
 	poperror();
+	pm_throttle_dirty(f->pm);
 	return so_far;
 }
 
@@ -96,6 +96,7 @@ enum {
 	QIO_JUST_ONE_BLOCK = (1 << 3),	/* when qbreading, just get one block */
 	QIO_NON_BLOCK = (1 << 4),		/* throw EAGAIN instead of blocking */
 	QIO_DONT_KICK = (1 << 5),		/* don't kick when waking */
+	QIO_WHOLE_BLOCK = (1 << 6),		/* all of the first block or nothing */
 };
 
 unsigned int qiomaxatomic = Maxatomic;
@@ -320,9 +321,10 @@ struct block *pullupblock(struct block *bp, int n)
 			ebd->off += seglen;
 			bp->extra_len -= seglen;
 			if (ebd->len == 0) {
-				kfree((void *)ebd->base);
+				ebd_decref(ebd);
 				ebd->off = 0;
 				ebd->base = 0;
+				ebd->ubuf = 0;
 			}
 		}
 		/* maybe just call pullupblock recursively here */
@@ -408,9 +410,11 @@ static int pullext(struct block *bp, int count)
 		ed->off += rem;
 		ed->len -= rem;
 		if (ed->len == 0) {
-			kfree((void *)ed->base);
+			if (ed->base)
+				ebd_decref(ed);
 			ed->base = 0;
 			ed->off = 0;
+			ed->ubuf = 0;
 		}
 	}
 	return bytes;
@@ -434,9 +438,11 @@ static int dropext(struct block *bp, int count)
 		bytes += rem;
 		ed->len -= rem;
 		if (ed->len == 0) {
-			kfree((void *)ed->base);
+			if (ed->base)
+				ebd_decref(ed);
 			ed->base = 0;
 			ed->off = 0;
+			ed->ubuf = 0;
 		}
 	}
 	return bytes;
@@ -583,8 +589,9 @@ struct block *adjustblock(struct block *bp, int len)
 	for (; i < bp->nr_extra_bufs; i++) {
 		ebd = &bp->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			ebd_decref(ebd);
 		ebd->base = ebd->off = ebd->len = 0;
+		ebd->ubuf = 0;
 	}
 	QDEBUG checkb(bp, "adjustblock 4");
 	return bp;
@@ -628,10 +635,12 @@ static size_t move_ebd(struct extra_bdata *ebd, struct block *to,
 {
 	size_t ret = ebd->len;
 
-	if (block_append_extra(to, ebd->base, ebd->off, ebd->len, MEM_ATOMIC))
+	if (block_append_ubuf(to, ebd->ubuf, ebd->base, ebd->off, ebd->len,
+	                      MEM_ATOMIC))
 		return 0;
 	block_and_q_lost_extra(from, from_q, ebd->len);
 	ebd->base = ebd->len = ebd->off = 0;
+	ebd->ubuf = 0;
 	return ret;
 }
 
@@ -749,6 +758,10 @@ static int __try_qbread(struct queue *q, size_t len, int qio_flags,
 		/* Need to retry to make sure we have a first block */
 		return QBR_AGAIN;
 	}
+	if ((qio_flags & QIO_WHOLE_BLOCK) && (blen > len)) {
+		spin_unlock_irqsave(&q->lock);
+		return QBR_FAIL;
+	}
 	/* Qmsg: just return the first block.  Be careful, since our caller might
 	 * not read all of the block and thus drop bytes.  Similar to SOCK_DGRAM. */
 	if (q->state & Qmsg) {
@@ -879,6 +892,21 @@ struct block *qget(struct queue *q)
 	return __qbread(q, SIZE_MAX, QIO_JUST_ONE_BLOCK, MEM_ATOMIC);
 }
 
+/* Like qget(), but only up to len bytes of the block.  Splitting the block
+ * takes memory, so this can return NULL with MEM_ATOMIC even if there's data. */
+struct block *qget_upto(struct queue *q, size_t len, int mem_flags)
+{
+	return __qbread(q, len, QIO_JUST_ONE_BLOCK, mem_flags);
+}
+
+/* Like qget(), but only if all of the next block fits in len.  Otherwise the
+ * block stays in the queue.  For pulling whole messages out of a Qmsg queue
+ * until a buffer is full. */
+struct block *qget_whole(struct queue *q, size_t len)
+{
+	return __qbread(q, len, QIO_JUST_ONE_BLOCK | QIO_WHOLE_BLOCK, MEM_ATOMIC);
+}
+
 /* Throw away the next 'len' bytes in the queue returning the number actually
  * discarded.
  *
@@ -980,8 +1008,9 @@ static size_t point_to_buf(struct block *b, unsigned int b_idx, uint32_t b_off,
 	assert(b_idx < b->nr_extra_bufs);
 	assert(newb_idx < newb->nr_extra_bufs);
 
-	kmalloc_incref((void*)b_ebd->base);
+	ebd_incref(b_ebd);
 	n_ebd->base = b_ebd->base;
+	n_ebd->ubuf = b_ebd->ubuf;
 	n_ebd->off = b_ebd->off + b_off;
 	n_ebd->len = MIN(b_ebd->len - b_off, len);
 	newb->extra_len += n_ebd->len;
@@ -1306,8 +1335,9 @@ static size_t read_from_block(struct block *b, uint8_t *to, size_t amt)
 		if (!ebd->len) {
 			/* we don't actually have to decref here.  it's also done in
 			 * freeb().  this is the earliest we can free. */
-			kfree((void*)ebd->base);
+			ebd_decref(ebd);
 			ebd->base = ebd->off = 0;
+			ebd->ubuf = 0;
 		}
 		to += copy_amt;
 		amt -= copy_amt;
@@ -1686,6 +1716,92 @@ ssize_t qiwrite(struct queue *q, void *vp, int len)
 	return __qwrite(q, vp, len, MEM_ATOMIC, 0);
 }
 
+/* Helper, builds a block whose extra_data points at [uva, uva + len) of ubuf's
+ * pinned memory, one entry per page.  pg0 is the page holding ubuf's first
+ * byte, and pages are its pages. */
+static struct block *build_ubuf_block(struct block_ubuf *ubuf, uintptr_t uva,
+                                      size_t len, uintptr_t pg0,
+                                      struct page **pages)
+{
+	struct block *b;
+	struct page *page;
+	size_t amt;
+
+	b = block_alloc(64, MEM_WAIT);
+	block_add_extd(b, (ROUNDUP(uva + len, PGSIZE) - ROUNDDOWN(uva, PGSIZE))
+	                  >> PGSHIFT, MEM_WAIT);
+	for (size_t sofar = 0; sofar < len; sofar += amt) {
+		amt = MIN(len - sofar, PGSIZE - PGOFF(uva + sofar));
+		page = pages[(ROUNDDOWN(uva + sofar, PGSIZE) - pg0) >> PGSHIFT];
+		kref_get(&ubuf->kref, 1);
+		block_append_ubuf(b, ubuf, (uintptr_t)page2kva(page),
+		                  PGOFF(uva + sofar), amt, MEM_WAIT);
+	}
+	return b;
+}
+
+static ssize_t __qwrite_zcopy(struct queue *q, void *uva, size_t len,
+                              struct event_msg *msg, int qio_flags)
+{
+	ERRSTACK(1);
+	uintptr_t pg0 = ROUNDDOWN((uintptr_t)uva, PGSIZE);
+	struct block_ubuf *ubuf;
+	struct page **pages;
+	size_t n;
+	volatile size_t sofar = 0;	/* volatile for the waserror */
+	struct block *b;
+
+	pages = kmalloc(((ROUNDUP((uintptr_t)uva + len, PGSIZE) - pg0) >> PGSHIFT)
+	                * sizeof(struct page *), MEM_WAIT);
+	ubuf = block_ubuf_pin(uva, len, pages, msg);
+	if (!ubuf) {
+		kfree(pages);
+		return -1;
+	}
+	if (waserror()) {
+		if (sofar)
+			goto out_ok;
+		kfree(pages);
+		block_ubuf_decref(ubuf);
+		nexterror();
+	}
+	do {
+		n = MIN(len - sofar, Maxatomic);
+		b = build_ubuf_block(ubuf, (uintptr_t)uva + sofar, n, pg0, pages);
+		if (__qbwrite(q, b, qio_flags) < 0)
+			break;
+		sofar += n;
+	} while ((sofar < len) && (q->state & Qmsg) == 0);
+out_ok:
+	poperror();
+	kfree(pages);
+	/* we hold a ref, so it can't be released yet */
+	ubuf->msg.ev_arg4 = sofar;
+	block_ubuf_decref(ubuf);
+	return sofar;
+}
+
+/* Zero-copy qwrite: instead of copying, the blocks point at the user's pages.
+ * The pages stay pinned until every block (and every clone of one, such as the
+ * segments TCP keeps for retransmission) is freed, and then msg is sent to the
+ * process, with ev_arg4 set to the amount written.  The user must not change
+ * the buffer until then.
+ *
+ * Returns -1, without throwing, if the memory can't be pinned (it's not plain
+ * anonymous memory), so the caller can fall back to qwrite. */
+ssize_t qwrite_zcopy(struct queue *q, void *uva, size_t len,
+                     struct event_msg *msg)
+{
+	return __qwrite_zcopy(q, uva, len, msg, QIO_CAN_ERR_SLEEP | QIO_LIMIT);
+}
+
+ssize_t qwrite_zcopy_nonblock(struct queue *q, void *uva, size_t len,
+                              struct event_msg *msg)
+{
+	return __qwrite_zcopy(q, uva, len, msg, QIO_CAN_ERR_SLEEP | QIO_LIMIT |
+	                                        QIO_NON_BLOCK);
+}
+
 /*
  *  be extremely careful when calling this,
  *  as there is no reference accounting
@@ -962,7 +962,7 @@ size_t tree_chan_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 
 	if (tree_file_is_dir(tf))
 		return tree_file_readdir(tf, ubuf, n, offset, &c->dri);
-	return fs_file_read(&tf->file, ubuf, n, offset);
+	return fs_file_read(&tf->file, ubuf, n, offset, &c->ra);
 }
 
 size_t tree_chan_write(struct chan *c, void *ubuf, size_t n, off64_t offset)
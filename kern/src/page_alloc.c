@@ -9,6 +9,433 @@
 #include <pmap.h>
 #include <kmalloc.h>
 #include <arena.h>
+#include <percpu_counter.h>
+#include <percpu.h>
+#include <arch/topology.h>
+
+/* NUMA page pools.
+ *
+ * kpages_arena imports from base without regard for which node the memory is
+ * on.  Once we know the topology, each NUMA node gets its own kpages-style
+ * arena, "kpages_numa%d", which imports only from the parts of base that SRAT
+ * assigns to that node.  kpages allocations try the calling core's node, then
+ * the other nodes, then kpages_arena.  Only the last attempt can block.
+ *
+ * The first struct page of every allocation records which arena it came from
+ * (pg_numa_src), so that kpages_free() can give it back.  We only set it once
+ * the pools are up; until then, everything is from kpages_arena and the boot
+ * zeroing of the pages array is correct.
+ *
+ * Slab caches still pull from kpages_arena, so kmalloc is not NUMA-aware. */
+#define NUMA_MAX_NODES			8
+#define NUMA_MAX_MEM_RANGES		8
+
+struct numa_range {
+	uintptr_t					start;
+	uintptr_t					end;
+};
+
+struct numa_node {
+	struct arena				*arena;
+	size_t						amt_total;
+	int							nr_ranges;
+	struct numa_range			ranges[NUMA_MAX_MEM_RANGES];
+	struct percpu_counter		amt_alloc;
+	struct percpu_counter		nr_allocs;
+	struct percpu_counter		nr_remote_allocs;
+	char						name[ARENA_NAME_SZ];
+};
+
+static struct numa_node numa_nodes[NUMA_MAX_NODES];
+/* 0 until the NUMA pools are ready */
+static int nr_numa_nodes;
+static struct percpu_counter numa_nr_fallbacks;
+
+/* Imports a span for a node's arena from the node's memory in base.  These are
+ * always atomic: if a node is out of memory, we want to try another node. */
+static void *__numa_import(int node_id, size_t size, int flags)
+{
+	struct numa_node *node = &numa_nodes[node_id];
+	void *ret;
+
+	for (int i = 0; i < node->nr_ranges; i++) {
+		ret = arena_xalloc(base_arena, size, PGSIZE, 0, 0,
+		                   (void*)node->ranges[i].start,
+		                   (void*)node->ranges[i].end, MEM_ATOMIC);
+		if (ret)
+			return ret;
+	}
+	return NULL;
+}
+
+/* An arena's afunc only gets the source arena (base), not the importer, so each
+ * node needs its own import function. */
+#define NUMA_IMPORT_FUNC(n)                                                    \
+static void *__numa_import_##n(struct arena *source, size_t size, int flags)   \
+{                                                                              \
+	return __numa_import(n, size, flags);                                  \
+}
+
+NUMA_IMPORT_FUNC(0)
+NUMA_IMPORT_FUNC(1)
+NUMA_IMPORT_FUNC(2)
+NUMA_IMPORT_FUNC(3)
+NUMA_IMPORT_FUNC(4)
+NUMA_IMPORT_FUNC(5)
+NUMA_IMPORT_FUNC(6)
+NUMA_IMPORT_FUNC(7)
+
+static void *(*numa_import_funcs[NUMA_MAX_NODES])(struct arena *, size_t,
+                                                    int) = {
+	__numa_import_0, __numa_import_1, __numa_import_2, __numa_import_3,
+	__numa_import_4, __numa_import_5, __numa_import_6, __numa_import_7,
+};
+
+static void __add_numa_range(int numa_id, physaddr_t start, size_t len,
+                             void *arg)
+{
+	struct numa_node *node;
+	physaddr_t end = start + len;
+
+	if (numa_id >= NUMA_MAX_NODES) {
+		printk("NUMA node %d's memory not pooled, max %d nodes\n", numa_id,
+		       NUMA_MAX_NODES);
+		return;
+	}
+	start = ROUNDUP(start, PGSIZE);
+	end = MIN(ROUNDDOWN(end, PGSIZE), max_paddr);
+	if (start >= end)
+		return;
+	node = &numa_nodes[numa_id];
+	if (node->nr_ranges == NUMA_MAX_MEM_RANGES) {
+		warn("NUMA node %d has too many memory ranges, ignoring [%p, %p)",
+		     numa_id, start, end);
+		return;
+	}
+	node->ranges[node->nr_ranges].start = (uintptr_t)KADDR_NOCHECK(start);
+	node->ranges[node->nr_ranges].end = (uintptr_t)KADDR_NOCHECK(end);
+	node->nr_ranges++;
+	node->amt_total += end - start;
+}
+
+/* Sets up the per-node arenas.  Call after topology_init() and percpu_init().
+ * Does nothing on non-NUMA machines. */
+void kpages_numa_init(void)
+{
+	struct numa_node *node;
+	int nr_nodes = MIN(num_numa, NUMA_MAX_NODES);
+
+	if (nr_nodes <= 1)
+		return;
+	numa_foreach_mem_range(__add_numa_range, NULL);
+	for (int i = 0; i < nr_nodes; i++) {
+		node = &numa_nodes[i];
+		percpu_counter_init(&node->amt_alloc, 0, MEM_WAIT);
+		percpu_counter_init(&node->nr_allocs, 0, MEM_WAIT);
+		percpu_counter_init(&node->nr_remote_allocs, 0, MEM_WAIT);
+		if (!node->nr_ranges) {
+			printk("NUMA node %d has no memory, using remote nodes\n", i);
+			continue;
+		}
+		snprintf(node->name, ARENA_NAME_SZ, "kpages_numa%d", i);
+		node->arena = arena_create(node->name, NULL, 0, PGSIZE,
+		                           numa_import_funcs[i], arena_xfree,
+		                           base_arena, 8 * PGSIZE, MEM_WAIT);
+	}
+	percpu_counter_init(&numa_nr_fallbacks, 0, MEM_WAIT);
+	wmb();	/* pools are ready before anyone sees nr_numa_nodes */
+	nr_numa_nodes = nr_nodes;
+	printk("NUMA page pools set up for %d nodes\n", nr_nodes);
+}
+
+/* Helper: allocates from @arena; @align of 0 means any page alignment. */
+static void *__pages_alloc(struct arena *arena, size_t size, size_t align,
+                           int flags)
+{
+	if (!align)
+		return arena_alloc(arena, size, flags);
+	return arena_xalloc(arena, size, align, 0, 0, NULL, NULL, flags);
+}
+
+static void __pages_free(struct arena *arena, void *addr, size_t size,
+                         size_t align)
+{
+	if (!align)
+		arena_free(arena, addr, size);
+	else
+		arena_xfree(arena, addr, size);
+}
+
+/* Allocates pages, preferring the calling core's NUMA node. */
+static void *numa_pages_alloc(size_t size, size_t align, int flags)
+{
+	struct numa_node *node;
+	int local, node_id;
+	int try_flags = (flags & ~MEM_FLAGS) | MEM_ATOMIC;
+	void *ret;
+
+	if (!nr_numa_nodes)
+		return __pages_alloc(kpages_arena, size, align, flags);
+	size = ROUNDUP(size, PGSIZE);
+	local = numa_id_of_core(core_id()) % nr_numa_nodes;
+	for (int i = 0; i < nr_numa_nodes; i++) {
+		node_id = (local + i) % nr_numa_nodes;
+		node = &numa_nodes[node_id];
+		if (!node->arena)
+			continue;
+		ret = __pages_alloc(node->arena, size, align, try_flags);
+		if (!ret)
+			continue;
+		kva2page(ret)->pg_numa_src = node_id + 1;
+		percpu_counter_add(&node->amt_alloc, size);
+		percpu_counter_inc(&node->nr_allocs);
+		if (i)
+			percpu_counter_inc(&node->nr_remote_allocs);
+		return ret;
+	}
+	percpu_counter_inc(&numa_nr_fallbacks);
+	ret = __pages_alloc(kpages_arena, size, align, flags);
+	if (ret)
+		kva2page(ret)->pg_numa_src = 0;
+	return ret;
+}
+
+static void numa_pages_free(void *addr, size_t size, size_t align)
+{
+	struct numa_node *node;
+	uint8_t src;
+
+	if (!nr_numa_nodes) {
+		__pages_free(kpages_arena, addr, size, align);
+		return;
+	}
+	src = kva2page(addr)->pg_numa_src;
+	if (!src) {
+		__pages_free(kpages_arena, addr, size, align);
+		return;
+	}
+	node = &numa_nodes[src - 1];
+	percpu_counter_add(&node->amt_alloc, -(int64_t)ROUNDUP(size, PGSIZE));
+	__pages_free(node->arena, addr, size, align);
+}
+
+int kpages_numa_nr_nodes(void)
+{
+	return nr_numa_nodes;
+}
+
+void kpages_numa_get_stats(int node_id, struct numa_node_stats *stats)
+{
+	struct numa_node *node = &numa_nodes[node_id];
+
+	stats->amt_total = node->amt_total;
+	stats->amt_alloc = percpu_counter_sum_positive(&node->amt_alloc);
+	stats->nr_allocs = percpu_counter_sum_positive(&node->nr_allocs);
+	stats->nr_remote_allocs =
+		percpu_counter_sum_positive(&node->nr_remote_allocs);
+}
+
+uint64_t kpages_numa_nr_fallbacks(void)
+{
+	if (!nr_numa_nodes)
+		return 0;
+	return percpu_counter_sum_positive(&numa_nr_fallbacks);
+}
+
+/* Per-core page caches (pcp).
+ *
+ * Single-page allocations (page faults, mostly) hit a small per-core list of
+ * free pages before going to the arenas.  When a core's list is empty, we
+ * refill it with PCP_BATCH pages.  When it grows past PCP_HIGH, we drain
+ * PCP_BATCH pages back.  Each list is only touched by its own core with IRQs
+ * disabled, so there are no locks.
+ *
+ * The arenas consider pages on a pcp list to be allocated, and those pages keep
+ * their pg_numa_src.  Frees of pages from other nodes (or from kpages_arena,
+ * once the NUMA pools are up) skip the cache, so that a core's list only holds
+ * its own node's memory.
+ *
+ * Each core can park up to PCP_HIGH pages.  When an allocation can't be met
+ * right away, kpages_pcp_drain() gives all of them back before we try again or
+ * block. */
+#define PCP_BATCH			16
+#define PCP_HIGH			(4 * PCP_BATCH)
+
+struct pcp_pages {
+	page_list_t					list;
+	unsigned int				count;
+	uint64_t					nr_allocs;
+	uint64_t					nr_hits;
+	uint64_t					nr_frees;
+	uint64_t					nr_refills;
+	uint64_t					nr_drains;
+};
+
+static DEFINE_PERCPU(struct pcp_pages, pcp_pages);
+/* Until percpu_init(), every core would share core 0's list. */
+static bool pcp_ready;
+
+DEFINE_PERCPU_INIT(pcp_pages_init);
+static void pcp_pages_init(void)
+{
+	struct pcp_pages *pcp;
+
+	for (int i = 0; i < num_cores; i++) {
+		pcp = _PERCPU_VARPTR(pcp_pages, i);
+		memset(pcp, 0, sizeof(struct pcp_pages));
+		BSD_LIST_INIT(&pcp->list);
+	}
+	wmb();	/* lists are ready before anyone sees pcp_ready */
+	pcp_ready = true;
+}
+
+static bool __pcp_page_is_local(struct page *page)
+{
+	if (!nr_numa_nodes)
+		return true;
+	return page->pg_numa_src ==
+	       numa_id_of_core(core_id()) % nr_numa_nodes + 1;
+}
+
+/* Adds up to PCP_BATCH pages to @pcp, returning how many we got. */
+static unsigned int __pcp_refill(struct pcp_pages *pcp)
+{
+	void *addr;
+	unsigned int i;
+
+	for (i = 0; i < PCP_BATCH; i++) {
+		addr = numa_pages_alloc(PGSIZE, 0, MEM_ATOMIC);
+		if (!addr)
+			break;
+		BSD_LIST_INSERT_HEAD(&pcp->list, kva2page(addr), pg_link);
+	}
+	pcp->count += i;
+	pcp->nr_refills++;
+	return i;
+}
+
+static void __pcp_drain(struct pcp_pages *pcp, unsigned int nr)
+{
+	struct page *page;
+
+	for (unsigned int i = 0; i < nr; i++) {
+		page = BSD_LIST_FIRST(&pcp->list);
+		if (!page)
+			break;
+		BSD_LIST_REMOVE(page, pg_link);
+		pcp->count--;
+		numa_pages_free(page2kva(page), PGSIZE, 0);
+	}
+	pcp->nr_drains++;
+}
+
+static void __pcp_drain_kmsg(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct pcp_pages *pcp = PERCPU_VARPTR(pcp_pages);
+
+	__pcp_drain(pcp, pcp->count);
+}
+
+/* Returns every core's cached pages to the arenas.  Other cores drain their own
+ * lists from an immediate kmsg, which runs with IRQs off like the rest of the
+ * pcp code, so their pages come back shortly after we return. */
+void kpages_pcp_drain(void)
+{
+	struct pcp_pages *pcp;
+	int8_t irq_state = 0;
+
+	if (!pcp_ready)
+		return;
+	disable_irqsave(&irq_state);
+	pcp = PERCPU_VARPTR(pcp_pages);
+	__pcp_drain(pcp, pcp->count);
+	for (int i = 0; i < num_cores; i++) {
+		if (i == core_id())
+			continue;
+		if (READ_ONCE(_PERCPU_VARPTR(pcp_pages, i)->count))
+			send_kernel_message(i, __pcp_drain_kmsg, 0, 0, 0,
+			                    KMSG_IMMEDIATE);
+	}
+	enable_irqsave(&irq_state);
+}
+
+/* Allocates without waiting first.  If that fails, we drain the pcp lists
+ * before trying for real, which might block. */
+static void *numa_pages_alloc_drain(size_t size, size_t align, int flags)
+{
+	void *ret;
+
+	ret = numa_pages_alloc(size, align, (flags & ~MEM_FLAGS) | MEM_ATOMIC);
+	if (ret)
+		return ret;
+	kpages_pcp_drain();
+	return numa_pages_alloc(size, align, flags);
+}
+
+static void *pcp_page_alloc(int flags)
+{
+	struct pcp_pages *pcp;
+	struct page *page;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	pcp = PERCPU_VARPTR(pcp_pages);
+	pcp->nr_allocs++;
+	if (pcp->count) {
+		pcp->nr_hits++;
+	} else if (!__pcp_refill(pcp)) {
+		enable_irqsave(&irq_state);
+		/* Out of atomic memory.  Get back what the other cores are sitting
+		 * on, then let the arenas block, if the caller can. */
+		kpages_pcp_drain();
+		return numa_pages_alloc(PGSIZE, 0, flags);
+	}
+	page = BSD_LIST_FIRST(&pcp->list);
+	BSD_LIST_REMOVE(page, pg_link);
+	pcp->count--;
+	enable_irqsave(&irq_state);
+	return page2kva(page);
+}
+
+static void pcp_page_free(void *addr)
+{
+	struct pcp_pages *pcp;
+	struct page *page = kva2page(addr);
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	if (!__pcp_page_is_local(page)) {
+		enable_irqsave(&irq_state);
+		numa_pages_free(addr, PGSIZE, 0);
+		return;
+	}
+	pcp = PERCPU_VARPTR(pcp_pages);
+	BSD_LIST_INSERT_HEAD(&pcp->list, page, pg_link);
+	pcp->count++;
+	pcp->nr_frees++;
+	if (pcp->count > PCP_HIGH)
+		__pcp_drain(pcp, PCP_BATCH);
+	enable_irqsave(&irq_state);
+}
+
+/* Sums the pcp stats over all cores.  Racy, but they are just stats. */
+void kpages_pcp_get_stats(struct pcp_page_stats *stats)
+{
+	struct pcp_pages *pcp;
+
+	memset(stats, 0, sizeof(struct pcp_page_stats));
+	if (!pcp_ready)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		pcp = _PERCPU_VARPTR(pcp_pages, i);
+		stats->nr_cached += pcp->count;
+		stats->nr_allocs += pcp->nr_allocs;
+		stats->nr_hits += pcp->nr_hits;
+		stats->nr_frees += pcp->nr_frees;
+		stats->nr_refills += pcp->nr_refills;
+		stats->nr_drains += pcp->nr_drains;
+	}
+}
 
 /* Helper, allocates a free page. */
 static struct page *get_a_free_page(void)
@@ -73,16 +500,19 @@ void *kpage_zalloc_addr(void)
 	return retval;
 }
 
-/* Helper function for allocating from the kpages_arena.  This may be useful
- * later since we might send the caller to a different NUMA domain. */
+/* Helper function for allocating from the kpages_arena, or from the local
+ * NUMA node's pool, if we have them.  Single pages come from the per-core
+ * cache. */
 void *kpages_alloc(size_t size, int flags)
 {
-	return arena_alloc(kpages_arena, size, flags);
+	if (size == PGSIZE && pcp_ready)
+		return pcp_page_alloc(flags);
+	return numa_pages_alloc_drain(size, 0, flags);
 }
 
 void *kpages_zalloc(size_t size, int flags)
 {
-	void *ret = arena_alloc(kpages_arena, size, flags);
+	void *ret = kpages_alloc(size, flags);
 
 	if (!ret)
 		return NULL;
@@ -92,7 +522,11 @@ void *kpages_zalloc(size_t size, int flags)
 
 void kpages_free(void *addr, size_t size)
 {
-	arena_free(kpages_arena, addr, size);
+	if (size == PGSIZE && pcp_ready) {
+		pcp_page_free(addr);
+		return;
+	}
+	numa_pages_free(addr, size, 0);
 }
 
 /* Returns naturally aligned, contiguous pages of amount PGSIZE << order.  Linux
@@ -100,19 +534,24 @@ void kpages_free(void *addr, size_t size)
  * bnx2x). */
 void *get_cont_pages(size_t order, int flags)
 {
-	return arena_xalloc(kpages_arena, PGSIZE << order, PGSIZE << order,
-	                    0, 0, NULL, NULL, flags);
+	return numa_pages_alloc_drain(PGSIZE << order, PGSIZE << order, flags);
 }
 
 void free_cont_pages(void *buf, size_t order)
 {
-	arena_xfree(kpages_arena, buf, PGSIZE << order);
+	numa_pages_free(buf, PGSIZE << order, PGSIZE << order);
 }
 
+static void jumbo_piece_decref(struct page *page);
+
 /* Frees the page */
 void page_decref(page_t *page)
 {
 	assert(!page_is_pagemap(page));
+	if (atomic_read(&page->pg_flags) & PG_HUGE) {
+		jumbo_piece_decref(page);
+		return;
+	}
 	kpages_free(page2kva(page), PGSIZE);
 }
 
@@ -142,7 +581,7 @@ static void *__jumbo_pml2_alloc(struct arena *a, size_t size, int flags)
 
 static struct arena *jumbo_pml2_arena;
 
-/* Just for example; we could add qcaches too.  Do this after kmalloc_init(). */
+/* We could add qcaches too.  Do this after kmalloc_init(). */
 void jumbo_arena_init(void)
 {
 	jumbo_pml2_arena = arena_create("jumbo_pml2", NULL, 0, PML2_PTE_REACH,
@@ -160,3 +599,27 @@ void jumbo_page_free(void *buf, size_t nr)
 {
 	arena_free(jumbo_pml2_arena, buf, nr * PML2_PTE_REACH);
 }
+
+/* Turns a single jumbo page into PGSIZE pieces, e.g. when a user's PML2 mapping
+ * gets split into PML1 PTEs.  Each piece is then freed with page_decref(), and
+ * the last one returns the whole jumbo to the arena.  The head page tracks the
+ * pieces, since the arena can't take back part of a segment. */
+void jumbo_page_split(void *buf)
+{
+	struct page *head = kva2page(buf);
+	size_t nr_pieces = PML2_PTE_REACH / PGSIZE;
+
+	assert(!((uintptr_t)buf & (PML2_PTE_REACH - 1)));
+	atomic_set(&head->pg_huge_refs, nr_pieces);
+	for (size_t i = 0; i < nr_pieces; i++)
+		atomic_or(&head[i].pg_flags, PG_HUGE);
+}
+
+static void jumbo_piece_decref(struct page *page)
+{
+	struct page *head = pa2page(ROUNDDOWN(page2pa(page), PML2_PTE_REACH));
+
+	atomic_and(&page->pg_flags, ~PG_HUGE);
+	if (atomic_sub_and_test(&head->pg_huge_refs, 1))
+		jumbo_page_free(page2kva(head), 1);
+}
@@ -13,6 +13,51 @@
 #include <stdio.h>
 #include <pagemap.h>
 #include <rcu.h>
+#include <rendez.h>
+#include <kthread.h>
+#include <arena.h>
+#include <kmalloc.h>
+
+/* Largest run of pages we hand to readpages at once. */
+#define PM_RA_BATCH				64
+/* Largest run of pages we hand to writepages at once. */
+#define PM_WB_BATCH				64
+
+static atomic_t nr_ra_pages;
+static atomic_t nr_ra_batches;
+static atomic_t nr_ra_hits;
+static atomic_t nr_ra_misses;
+static atomic_t nr_ra_wasted;
+
+/* Dirty page tracking and the flusher.  Once more than pm_dirty_bg_pct of
+ * memory is dirty page cache, the flusher writes back everything it can.  At
+ * pm_dirty_max_pct, writers flush their own files before returning.
+ * Otherwise, the flusher wakes up every pm_flush_period_ms and writes back PMs
+ * that have been dirty for pm_dirty_expire_ms. */
+uint64_t pm_flush_period_ms = 1000;
+uint64_t pm_dirty_expire_ms = 5000;
+unsigned long pm_dirty_bg_pct = 10;
+unsigned long pm_dirty_max_pct = 20;
+
+static atomic_t nr_dirty_pages;
+static atomic_t nr_wb_pages;
+static atomic_t nr_wb_ops;
+static atomic_t nr_wb_throttles;
+static unsigned long nr_flushes;
+
+TAILQ_HEAD(pm_flusher_tailq, pm_flusher);
+static struct pm_flusher_tailq pm_flushers =
+                               TAILQ_HEAD_INITIALIZER(pm_flushers);
+static qlock_t pm_flushers_qlock = QLOCK_INITIALIZER(pm_flushers_qlock);
+static struct rendez pm_flusher_rv;
+static bool pm_flusher_kicked;
+
+/* Collects consecutive dirty pages, so we can write them back in one op. */
+struct pm_wb_batch {
+	struct page_map				*pm;
+	unsigned int				nr;
+	struct page					*pages[PM_WB_BATCH];
+};
 
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr)
 {
@@ -96,6 +141,8 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host)
 	qlock_init(&pm->pm_qlock);
 	spinlock_init(&pm->pm_lock);
 	TAILQ_INIT(&pm->pm_vmrs);
+	atomic_init(&pm->pm_nr_dirty, 0);
+	pm->pm_dirty_since = 0;
 }
 
 /* Looks up the index'th page in the page map, returning a refcnt'd reference
@@ -181,6 +228,27 @@ void pm_put_page(struct page *page)
 	atomic_add((atomic_t*)tree_slot, -(1UL << PM_REFCNT_SHIFT));
 }
 
+/* The first user of a readahead page gets credit for the hit. */
+static void pm_ra_note_use(struct page *page)
+{
+	long old_flags;
+
+	do {
+		old_flags = atomic_read(&page->pg_flags);
+		if (!(old_flags & PG_READAHEAD))
+			return;
+	} while (!atomic_cas(&page->pg_flags, old_flags,
+	                     old_flags & ~PG_READAHEAD));
+	atomic_inc(&nr_ra_hits);
+}
+
+/* Called when we're about to drop the PM's ref on a page. */
+static void pm_ra_note_free(struct page *page)
+{
+	if (atomic_read(&page->pg_flags) & PG_READAHEAD)
+		atomic_inc(&nr_ra_wasted);
+}
+
 /* Makes sure the index'th page of the mapped object is loaded in the page cache
  * and returns its location via **pp.
  *
@@ -223,6 +291,7 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 	assert(pm_slot_check_refcnt(*page->pg_tree_slot));
 	assert(pm_slot_get_page(*page->pg_tree_slot) == page);
 	if (atomic_read(&page->pg_flags) & PG_UPTODATE) {
+		pm_ra_note_use(page);
 		*pp = page;
 		printd("pm %p FOUND page %p, addr %p, idx %d\n", pm, page,
 		       page2kva(page), index);
@@ -234,6 +303,7 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 	 * clobber newer writes) */
 	if (atomic_read(&page->pg_flags) & PG_UPTODATE) {
 		unlock_page(page);
+		pm_ra_note_use(page);
 		*pp = page;
 		return 0;
 	}
@@ -260,10 +330,191 @@ int pm_load_page_nowait(struct page_map *pm, unsigned long index,
 		pm_put_page(page);
 		return -EAGAIN;
 	}
+	pm_ra_note_use(page);
 	*pp = page;
 	return 0;
 }
 
+/* Fills and releases a run of locked, consecutive pages that we inserted into
+ * the PM.  Backends that can do it get the whole run in one op. */
+static void pm_read_batch(struct page_map *pm, struct page **batch,
+                          unsigned int nr)
+{
+	int error;
+
+	if (!nr)
+		return;
+	if (pm->pm_op->readpages && nr > 1) {
+		error = pm->pm_op->readpages(pm, batch, nr);
+		assert(!error);
+		atomic_inc(&nr_ra_batches);
+	} else {
+		for (int i = 0; i < nr; i++) {
+			error = pm->pm_op->readpage(pm, batch[i]);
+			assert(!error);
+		}
+	}
+	for (int i = 0; i < nr; i++) {
+		assert(atomic_read(&batch[i]->pg_flags) & PG_UPTODATE);
+		unlock_page(batch[i]);
+		pm_put_page(batch[i]);
+	}
+	atomic_add(&nr_ra_pages, nr);
+}
+
+/* Loads [index, index + nr) into the page cache, skipping pages that are
+ * already there.  Runs of missing pages are read with as few backend ops as the
+ * PM supports.  The pages are marked PG_READAHEAD until someone loads them.
+ * This blocks on IO.  Returns how many pages we loaded. */
+unsigned long pm_readahead(struct page_map *pm, unsigned long index,
+                           unsigned long nr)
+{
+	struct page *batch[PM_RA_BATCH];
+	unsigned int batch_sz = 0;
+	struct page *page;
+	unsigned long nr_loaded = 0;
+	int error;
+
+	for (unsigned long i = index; i < index + nr; i++) {
+		page = pm_find_page(pm, i);
+		if (page) {
+			pm_put_page(page);
+			goto flush;
+		}
+		if (kpage_alloc(&page))
+			break;
+		/* Same deal as in pm_load_page: locked and not UPTODATE */
+		atomic_set(&page->pg_flags, PG_LOCKED | PG_PAGEMAP | PG_READAHEAD);
+		sem_init(&page->pg_sem, 0);
+		error = pm_insert_page(pm, i, page);
+		if (error) {
+			atomic_set(&page->pg_flags, 0);
+			page_decref(page);
+			if (error != -EEXIST)
+				break;
+			goto flush;
+		}
+		batch[batch_sz++] = page;
+		if (batch_sz < PM_RA_BATCH)
+			continue;
+flush:
+		pm_read_batch(pm, batch, batch_sz);
+		nr_loaded += batch_sz;
+		batch_sz = 0;
+	}
+	pm_read_batch(pm, batch, batch_sz);
+	nr_loaded += batch_sz;
+	return nr_loaded;
+}
+
+/* For readers that had to wait on the backend for a page they asked for. */
+void pm_ra_note_miss(void)
+{
+	atomic_inc(&nr_ra_misses);
+}
+
+void pm_get_ra_stats(struct pm_ra_stats *stats)
+{
+	stats->nr_ra_pages = atomic_read(&nr_ra_pages);
+	stats->nr_batches = atomic_read(&nr_ra_batches);
+	stats->nr_hits = atomic_read(&nr_ra_hits);
+	stats->nr_misses = atomic_read(&nr_ra_misses);
+	stats->nr_wasted = atomic_read(&nr_ra_wasted);
+}
+
+/* Thresholds are a percentage of all of RAM.  kpages_arena only imports what
+ * it hands out, so its totals track usage, not RAM; base_arena has it all. */
+static unsigned long pm_dirty_thresh(unsigned long pct)
+{
+	return (arena_amt_total(base_arena) >> PGSHIFT) * pct / 100;
+}
+
+/* Whether RAM is low enough that flushers should drop clean pages too. */
+static bool pm_mem_low(void)
+{
+	return arena_amt_free(base_arena) < arena_amt_total(base_arena) / 8;
+}
+
+/* Whether pm's dirty pages count towards the global dirty thresholds. */
+static bool pm_counts_dirty(struct page_map *pm)
+{
+	return pm->pm_op->writeback;
+}
+
+/* Marks a PM page dirty, keeping count per PM and, if it has a backing store,
+ * overall. */
+void pm_set_page_dirty(struct page *page)
+{
+	struct page_map *pm = page->pg_mapping;
+	long old_flags, old_nr, thresh;
+
+	do {
+		old_flags = atomic_read(&page->pg_flags);
+		if (old_flags & PG_DIRTY)
+			return;
+	} while (!atomic_cas(&page->pg_flags, old_flags, old_flags | PG_DIRTY));
+	if (!atomic_fetch_and_add(&pm->pm_nr_dirty, 1))
+		pm->pm_dirty_since = read_tsc();
+	if (!pm_counts_dirty(pm))
+		return;
+	old_nr = atomic_fetch_and_add(&nr_dirty_pages, 1);
+	thresh = pm_dirty_thresh(pm_dirty_bg_pct);
+	if ((old_nr < thresh) && (old_nr + 1 >= thresh))
+		pm_flusher_kick();
+}
+
+/* Returns TRUE if the page was dirty, in which case the caller owns writing it
+ * back. */
+static bool pm_clear_page_dirty(struct page_map *pm, struct page *page)
+{
+	long old_flags;
+
+	do {
+		old_flags = atomic_read(&page->pg_flags);
+		if (!(old_flags & PG_DIRTY))
+			return false;
+	} while (!atomic_cas(&page->pg_flags, old_flags, old_flags & ~PG_DIRTY));
+	atomic_dec(&pm->pm_nr_dirty);
+	if (pm_counts_dirty(pm))
+		atomic_dec(&nr_dirty_pages);
+	return true;
+}
+
+/* Whether PM has had dirty pages for longer than pm_dirty_expire_ms.  This is
+ * a lockless peek, for the flusher to pick who to write back. */
+bool pm_dirty_expired(struct page_map *pm)
+{
+	uint64_t since = ACCESS_ONCE(pm->pm_dirty_since);
+
+	if (!atomic_read(&pm->pm_nr_dirty) || !since)
+		return false;
+	return tsc2msec(read_tsc() - since) >= pm_dirty_expire_ms;
+}
+
+/* Called by writers after dirtying pages.  Once there is too much dirty data
+ * overall, writers pay for it by writing back their own PM. */
+void pm_throttle_dirty(struct page_map *pm)
+{
+	if (!pm_counts_dirty(pm))
+		return;
+	if (atomic_read(&nr_dirty_pages) < pm_dirty_thresh(pm_dirty_max_pct))
+		return;
+	pm_flusher_kick();
+	if (!atomic_read(&pm->pm_nr_dirty))
+		return;
+	atomic_inc(&nr_wb_throttles);
+	pm_writeback_pages(pm);
+}
+
+void pm_get_wb_stats(struct pm_wb_stats *stats)
+{
+	stats->nr_dirty = atomic_read(&nr_dirty_pages);
+	stats->nr_wb_pages = atomic_read(&nr_wb_pages);
+	stats->nr_wb_ops = atomic_read(&nr_wb_ops);
+	stats->nr_flushes = nr_flushes;
+	stats->nr_throttles = atomic_read(&nr_wb_throttles);
+}
+
 static bool vmr_has_page_idx(struct vm_region *vmr, unsigned long pg_idx)
 {
 	unsigned long nr_pgs = (vmr->vm_end - vmr->vm_base) >> PGSHIFT;
@@ -346,6 +597,8 @@ static bool __remove_or_zero_cb(void **slot, unsigned long tree_idx, void *arg)
 	/* We yanked the page out.  The radix tree still has an item until we return
 	 * true, but this is fine.  Future lock-free lookups will now fail (since
 	 * the page is 0), and insertions will block on the write lock. */
+	pm_ra_note_free(page);
+	pm_clear_page_dirty(pm, page);
 	atomic_set(&page->pg_flags, 0);	/* cause/catch bugs */
 	page_decref(page);
 	return true;
@@ -371,8 +624,7 @@ static int __pm_mark_and_clear_dirty(struct proc *p, pte_t pte, void *va,
 
 	if (!pte_is_present(pte) || !pte_is_dirty(pte))
 		return 0;
-	if (!(atomic_read(&page->pg_flags) & PG_DIRTY))
-		atomic_or(&page->pg_flags, PG_DIRTY);
+	pm_set_page_dirty(page);
 	pte_clear_dirty(pte);
 	vmr->vm_shootdown_needed = true;
 	return 0;
@@ -422,31 +674,46 @@ static void shootdown_vmrs(struct page_map *pm)
 }
 
 /* Send any queued WBs that haven't been sent yet. */
-static void flush_queued_writebacks(struct page_map *pm)
+static void flush_queued_writebacks(struct pm_wb_batch *wb)
 {
-	/* TODO (WB) */
+	struct page_map *pm = wb->pm;
+
+	if (!wb->nr)
+		return;
+	if (pm->pm_op->writepages && wb->nr > 1) {
+		pm->pm_op->writepages(pm, wb->pages, wb->nr);
+		atomic_inc(&nr_wb_ops);
+	} else {
+		for (int i = 0; i < wb->nr; i++)
+			pm->pm_op->writepage(pm, wb->pages[i]);
+		atomic_add(&nr_wb_ops, wb->nr);
+	}
+	atomic_add(&nr_wb_pages, wb->nr);
+	wb->nr = 0;
 }
 
-/* Batches up pages to be written back, preferably as one big op.  If we have a
- * bunch outstanding, we'll send them. */
-static void queue_writeback(struct page_map *pm, struct page *page)
+/* Batches up pages to be written back, preferably as one big op.  Batches are
+ * runs of consecutive pages; we send the batch when the run breaks or fills.
+ *
+ * The pages are protected by the PM qlock (no removals), which we hold until
+ * after the last flush. */
+static void queue_writeback(struct pm_wb_batch *wb, struct page *page)
 {
-	/* TODO (WB): add a bulk op (instead of only writepage()), collect extents,
-	 * and send them to the device.  Probably do something similar for reads. */
-	pm->pm_op->writepage(pm, page);
+	if (wb->nr && ((wb->nr == PM_WB_BATCH) ||
+	               (wb->pages[wb->nr - 1]->pg_index + 1 != page->pg_index)))
+		flush_queued_writebacks(wb);
+	wb->pages[wb->nr++] = page;
 }
 
 static bool __writeback_cb(void **slot, unsigned long tree_idx, void *arg)
 {
-	struct page_map *pm = arg;
+	struct pm_wb_batch *wb = arg;
 	struct page *page = pm_slot_get_page(*slot);
 
 	/* We're qlocked, so all items should have pages. */
 	assert(page);
-	if (atomic_read(&page->pg_flags) & PG_DIRTY) {
-		atomic_and(&page->pg_flags, ~PG_DIRTY);
-		queue_writeback(pm, page);
-	}
+	if (pm_clear_page_dirty(wb->pm, page))
+		queue_writeback(wb, page);
 	return false;
 }
 
@@ -454,12 +721,19 @@ static bool __writeback_cb(void **slot, unsigned long tree_idx, void *arg)
  * not.  All the dirty bits get cleared too, before writing back. */
 void pm_writeback_pages(struct page_map *pm)
 {
+	struct pm_wb_batch *wb = kmalloc(sizeof(struct pm_wb_batch), MEM_WAIT);
+
+	wb->pm = pm;
+	wb->nr = 0;
 	qlock(&pm->pm_qlock);
 	mark_and_clear_dirty_ptes(pm);
 	shootdown_vmrs(pm);
-	radix_for_each_slot(&pm->pm_tree, __writeback_cb, pm);
-	flush_queued_writebacks(pm);
+	radix_for_each_slot(&pm->pm_tree, __writeback_cb, wb);
+	flush_queued_writebacks(wb);
+	/* Anything dirtied while we were writing back starts its clock now. */
+	pm->pm_dirty_since = atomic_read(&pm->pm_nr_dirty) ? read_tsc() : 0;
 	qunlock(&pm->pm_qlock);
+	kfree(wb);
 }
 
 static bool __flush_unused_cb(void **slot, unsigned long tree_idx, void *arg)
@@ -499,14 +773,17 @@ static bool __flush_unused_cb(void **slot, unsigned long tree_idx, void *arg)
 	/* Need to check PG_DIRTY *after* checking VMRs.  o/w we could check, PAUSE,
 	 * see no VMRs.  But in the meantime, we had a VMR that munmapped and
 	 * wrote-back the dirty flag. */
-	if (atomic_read(&page->pg_flags) & PG_DIRTY) {
+	if (pm_clear_page_dirty(pm, page)) {
 		/* If we want to batch these, we'll also have to batch the freeing,
 		 * which isn't a big deal.  Just do it before freeing and before
 		 * unlocking the PM; we don't want someone to load the page from the
 		 * backing store and get an old value. */
 		pm->pm_op->writepage(pm, page);
+		atomic_inc(&nr_wb_pages);
+		atomic_inc(&nr_wb_ops);
 	}
 	/* All clear - the page is unused and (now) clean. */
+	pm_ra_note_free(page);
 	atomic_set(&page->pg_flags, 0);	/* catch bugs */
 	page_decref(page);
 	return true;
@@ -526,10 +803,13 @@ void pm_free_unused_pages(struct page_map *pm)
 
 static bool __destroy_cb(void **slot, unsigned long tree_idx, void *arg)
 {
+	struct page_map *pm = arg;
 	struct page *page = pm_slot_get_page(*slot);
 
 	/* Should be no users or need to sync */
 	assert(pm_slot_check_refcnt(*slot) == 0);
+	pm_ra_note_free(page);
+	pm_clear_page_dirty(pm, page);
 	atomic_set(&page->pg_flags, 0);	/* catch bugs */
 	page_decref(page);
 	return true;
@@ -541,6 +821,66 @@ void pm_destroy(struct page_map *pm)
 	radix_tree_destroy(&pm->pm_tree);
 }
 
+void pm_flusher_register(struct pm_flusher *pf)
+{
+	qlock(&pm_flushers_qlock);
+	TAILQ_INSERT_TAIL(&pm_flushers, pf, link);
+	qunlock(&pm_flushers_qlock);
+}
+
+void pm_flusher_unregister(struct pm_flusher *pf)
+{
+	/* The flusher holds the qlock while it calls flush(). */
+	qlock(&pm_flushers_qlock);
+	TAILQ_REMOVE(&pm_flushers, pf, link);
+	qunlock(&pm_flushers_qlock);
+}
+
+static int __flusher_kicked(void *arg)
+{
+	return pm_flusher_kicked;
+}
+
+static void pm_flusher_ktask(void *arg)
+{
+	struct pm_flusher *pf_i;
+	int why;
+
+	for (;;) {
+		if (pm_flush_period_ms)
+			rendez_sleep_timeout(&pm_flusher_rv, __flusher_kicked, NULL,
+			                     pm_flush_period_ms * 1000);
+		else
+			rendez_sleep(&pm_flusher_rv, __flusher_kicked, NULL);
+		pm_flusher_kicked = FALSE;
+		if (pm_mem_low())
+			why = PM_FLUSH_PRESSURE;
+		else if (atomic_read(&nr_dirty_pages) >=
+		         pm_dirty_thresh(pm_dirty_bg_pct))
+			why = PM_FLUSH_ALL;
+		else
+			why = PM_FLUSH_EXPIRED;
+		qlock(&pm_flushers_qlock);
+		TAILQ_FOREACH(pf_i, &pm_flushers, link)
+			pf_i->flush(pf_i, why);
+		nr_flushes++;
+		qunlock(&pm_flushers_qlock);
+	}
+}
+
+/* Wakes the flusher ktask for an immediate pass.  Safe from IRQ context. */
+void pm_flusher_kick(void)
+{
+	pm_flusher_kicked = TRUE;
+	rendez_wakeup(&pm_flusher_rv);
+}
+
+void pm_flusher_init(void)
+{
+	rendez_init(&pm_flusher_rv);
+	ktask("pm_flusher", pm_flusher_ktask, NULL);
+}
+
 void print_page_map_info(struct page_map *pm)
 {
 	struct vm_region *vmr_i;
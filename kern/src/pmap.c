@@ -243,7 +243,7 @@ int page_insert(pgdir_t pgdir, struct page *page, void *va, int perm)
  * of the pte for this page.  This is used by page_remove
  * but should not be used by other callers.
  *
- * For jumbos, right now this returns the first Page* in the 4MB range
+ * For PML2 jumbos, this returns the Page* within the jumbo that holds va.
  *
  * @param[in]  pgdir     the page directory from which we should do the lookup
  * @param[in]  va        the virtual address of the page we are looking up
@@ -255,11 +255,17 @@ int page_insert(pgdir_t pgdir, struct page *page, void *va, int perm)
 page_t *page_lookup(pgdir_t pgdir, void *va, pte_t *pte_store)
 {
 	pte_t pte = pgdir_walk(pgdir, va, 0);
+	physaddr_t pa;
+
 	if (!pte_walk_okay(pte) || !pte_is_mapped(pte))
 		return 0;
 	if (pte_store)
 		*pte_store = pte;
-	return pa2page(pte_get_paddr(pte));
+	pa = pte_get_paddr(pte);
+	/* User jumbos are PML2s; we want the page within the jumbo */
+	if (pte_is_jumbo(pte))
+		pa += ROUNDDOWN((uintptr_t)va, PGSIZE) & (PML2_PTE_REACH - 1);
+	return pa2page(pa);
 }
 
 /**
@@ -68,14 +68,19 @@
  *   racily write and set pcc->magsize, or have the pcc's poll when they check
  *   the depot during free.  Either approach doesn't require someone else to
  *   grab a pcc lock.
+ * - How does reclaim decide what to give back?  Each depot tracks the min and
+ *   max length of its not_empty and empty lists over the current interval (the
+ *   working set, section 3.6 of the magazines paper).  The magazines below the
+ *   min were never touched during the interval, so the reclaim ktask frees that
+ *   many magazines, drains their rounds to the slab layer, then reaps empty
+ *   slabs back to the source arena.  A burst will leave piles of magazines
+ *   around for at most two intervals.
  *
  * TODO:
- * - Add reclaim function.
  * - When resizing, do we want to go through the depot and consolidate
  *   magazines?  (probably not a big deal.  maybe we'd deal with it when we
  *   clean up our excess mags.)
- * - Could do some working set tracking.  Like max/min over an interval, with
- *   resetting (in the depot, used for reclaim and maybe aggressive freeing).
+ * - Poke the reclaimer when an arena runs low, instead of just periodically.
  * - Debugging info
  */
 
@@ -86,14 +91,26 @@
 #include <kmalloc.h>
 #include <hash.h>
 #include <arena.h>
+#include <kthread.h>
+#include <rendez.h>
 
 #define SLAB_POISON ((void*)0xdead1111)
 
-/* Tunables.  I don't know which numbers to pick yet.  Maybe we play with it at
- * runtime.  Though once a mag increases, it'll never decrease. */
+/* Tunables.  I don't know which numbers to pick yet.  You can play with them at
+ * runtime via #mem/slab_stats.  Though once a mag increases, it'll never
+ * decrease. */
 uint64_t resize_timeout_ns = 1000000000;
 unsigned int resize_threshold = 1;
 
+/* Reclaim interval, which is also the working set interval. */
+uint64_t kmc_reclaim_period_ms = 15000;
+/* Protected by the arenas_and_slabs_lock. */
+unsigned long kmc_nr_reclaim_passes;
+size_t kmc_amt_reclaimed;
+
+static struct rendez kmc_reclaim_rv;
+static bool kmc_reclaim_kicked;
+
 /* Protected by the arenas_and_slabs_lock. */
 struct kmem_cache_tailq all_kmem_caches =
 		TAILQ_HEAD_INITIALIZER(all_kmem_caches);
@@ -162,11 +179,14 @@ static void lock_depot(struct kmem_depot *depot)
 	 * might then think the burst wasn't big enough. */
 	time = nsec();
 	spin_lock_irqsave(&depot->lock);
+	depot->nr_contended++;
 	/* If there are no not-empty mags, we're probably fighting for the lock not
 	 * because the magazines aren't big enough, but because there aren't enough
 	 * mags in the system yet. */
 	if (!depot->nr_not_empty)
 		return;
+	if (depot->magsize >= depot->magsize_max)
+		return;
 	if (time - depot->busy_start > resize_timeout_ns) {
 		depot->busy_count = 0;
 		depot->busy_start = time;
@@ -174,7 +194,8 @@ static void lock_depot(struct kmem_depot *depot)
 	depot->busy_count++;
 	if (depot->busy_count > resize_threshold) {
 		depot->busy_count = 0;
-		depot->magsize = MIN(KMC_MAG_MAX_SZ, depot->magsize + 1);
+		depot->magsize++;
+		depot->nr_resizes++;
 		/* That's all we do - the pccs will eventually notice and up their
 		 * magazine sizes. */
 	}
@@ -191,10 +212,32 @@ static void depot_init(struct kmem_depot *depot)
 	SLIST_INIT(&depot->not_empty);
 	SLIST_INIT(&depot->empty);
 	depot->magsize = KMC_MAG_MIN_SZ;
+	depot->magsize_max = KMC_MAG_MAX_SZ;
 	depot->nr_not_empty = 0;
 	depot->nr_empty = 0;
 	depot->busy_count = 0;
 	depot->busy_start = 0;
+	depot->nr_contended = 0;
+	depot->nr_resizes = 0;
+	memset(&depot->ws_not_empty, 0, sizeof(struct kmem_depot_ws));
+	memset(&depot->ws_empty, 0, sizeof(struct kmem_depot_ws));
+	memset(&depot->last_ws_not_empty, 0, sizeof(struct kmem_depot_ws));
+	memset(&depot->last_ws_empty, 0, sizeof(struct kmem_depot_ws));
+}
+
+/* Helper, updates the working set after a list's length changed to @nr.  Hold
+ * the depot lock. */
+static void __ws_update(struct kmem_depot_ws *ws, unsigned int nr)
+{
+	ws->min = MIN(ws->min, nr);
+	ws->max = MAX(ws->max, nr);
+}
+
+/* Helper, starts a new working set interval.  Hold the depot lock. */
+static void __ws_reset(struct kmem_depot_ws *ws, unsigned int nr)
+{
+	ws->min = nr;
+	ws->max = nr;
 }
 
 static bool mag_is_empty(struct kmem_magazine *mag)
@@ -220,9 +263,11 @@ static void __return_to_depot(struct kmem_cache *kc, struct kmem_magazine *mag)
 	if (mag_is_empty(mag)) {
 		SLIST_INSERT_HEAD(&depot->empty, mag, link);
 		depot->nr_empty++;
+		__ws_update(&depot->ws_empty, depot->nr_empty);
 	} else {
 		SLIST_INSERT_HEAD(&depot->not_empty, mag, link);
 		depot->nr_not_empty++;
+		__ws_update(&depot->ws_not_empty, depot->nr_not_empty);
 	}
 }
 
@@ -285,6 +330,9 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->priv = priv;
 	kc->nr_cur_alloc = 0;
 	kc->nr_direct_allocs_ever = 0;
+	kc->nr_reclaimed_mags = 0;
+	kc->nr_reclaimed_rounds = 0;
+	kc->amt_reclaimed = 0;
 	kc->alloc_hash = kc->static_hash;
 	hash_init_hh(&kc->hh);
 	for (int i = 0; i < kc->hh.nr_hash_lists; i++)
@@ -351,6 +399,20 @@ struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size,
 	return kc;
 }
 
+/* Caps how large @kc's magazines can grow due to depot contention, between
+ * KMC_MAG_MIN_SZ and KMC_MAG_MAX_SZ.  If the magazines are already bigger, they
+ * shrink as the pccs come back to the depot. */
+void kmem_cache_set_magsize_max(struct kmem_cache *kc, unsigned int max)
+{
+	struct kmem_depot *depot = &kc->depot;
+
+	max = MAX(KMC_MAG_MIN_SZ, MIN(KMC_MAG_MAX_SZ, max));
+	spin_lock_irqsave(&depot->lock);
+	depot->magsize_max = max;
+	depot->magsize = MIN(depot->magsize, max);
+	spin_unlock_irqsave(&depot->lock);
+}
+
 /* Helper during destruction.  No one should be touching the allocator anymore.
  * We just need to hand objects back to the depot, which will hand them to the
  * slab.  Locking is just a formality here. */
@@ -581,7 +643,11 @@ try_alloc:
 	if (mag) {
 		SLIST_REMOVE_HEAD(&depot->not_empty, link);
 		depot->nr_not_empty--;
+		__ws_update(&depot->ws_not_empty, depot->nr_not_empty);
 		__return_to_depot(kc, pcc->prev);
+		/* Pick up resizes here too, so cores that mostly allocate will fill
+		 * to the new size once they start freeing. */
+		pcc->magsize = depot->magsize;
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
 		pcc->loaded = mag;
@@ -658,6 +724,7 @@ try_free:
 	if (mag) {
 		SLIST_REMOVE_HEAD(&depot->empty, link);
 		depot->nr_empty--;
+		__ws_update(&depot->ws_empty, depot->nr_empty);
 		__return_to_depot(kc, pcc->prev);
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
@@ -675,6 +742,7 @@ try_free:
 		lock_depot(depot);
 		SLIST_INSERT_HEAD(&depot->empty, mag, link);
 		depot->nr_empty++;
+		__ws_update(&depot->ws_empty, depot->nr_empty);
 		unlock_depot(depot);
 		lock_pcu_cache(pcc);
 		goto try_free;
@@ -753,10 +821,13 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 
 /* This deallocs every slab from the empty list.  TODO: think a bit more about
  * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
-void kmem_cache_reap(struct kmem_cache *cp)
+ * thrashing.  See 3.4 in the paper.
+ *
+ * Returns the amount of memory given back to the source arena. */
+size_t kmem_cache_reap(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
+	size_t amt = 0;
 
 	// Destroy all empty slabs.  Refer to the notes about the while loop
 	spin_lock_irqsave(&cp->cache_lock);
@@ -764,7 +835,128 @@ void kmem_cache_reap(struct kmem_cache *cp)
 	while (a_slab) {
 		next = TAILQ_NEXT(a_slab, link);
 		kmem_slab_destroy(cp, a_slab);
+		amt += __use_bufctls(cp) ? cp->import_amt : PGSIZE;
 		a_slab = next;
 	}
+	TAILQ_INIT(&cp->empty_slab_list);
 	spin_unlock_irqsave(&cp->cache_lock);
+	return amt;
+}
+
+/* Helper, cuts all but the first @nr_keep magazines off of @list and puts them
+ * on @tail.  The list is LIFO, so the tail has the magazines that have been
+ * sitting around the longest. */
+static void __depot_cut_tail(struct kmem_mag_slist *list, unsigned int nr_keep,
+                             struct kmem_mag_slist *tail)
+{
+	struct kmem_magazine *mag;
+
+	if (!nr_keep) {
+		SLIST_FIRST(tail) = SLIST_FIRST(list);
+		SLIST_INIT(list);
+		return;
+	}
+	mag = SLIST_FIRST(list);
+	for (int i = 1; i < nr_keep; i++)
+		mag = SLIST_NEXT(mag, link);
+	SLIST_FIRST(tail) = SLIST_NEXT(mag, link);
+	SLIST_NEXT(mag, link) = NULL;
+}
+
+/* Gives back the magazines that were not part of the depot's working set during
+ * the last interval, then reaps the empty slabs.  Returns the amount of memory
+ * given back to the source arena.  Hold the arenas_and_slabs_lock. */
+size_t kmem_cache_reclaim(struct kmem_cache *kc)
+{
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_mag_slist excess_not_empty = SLIST_HEAD_INITIALIZER(excess);
+	struct kmem_mag_slist excess_empty = SLIST_HEAD_INITIALIZER(excess);
+	struct kmem_magazine *mag;
+	unsigned int nr_not_empty, nr_empty;
+	size_t amt;
+
+	/* Not lock_depot(): we don't want the reclaimer's contention to look like
+	 * a reason to grow the magazines. */
+	spin_lock_irqsave(&depot->lock);
+	nr_not_empty = MIN(depot->ws_not_empty.min, depot->nr_not_empty);
+	nr_empty = MIN(depot->ws_empty.min, depot->nr_empty);
+	if (nr_not_empty) {
+		__depot_cut_tail(&depot->not_empty, depot->nr_not_empty - nr_not_empty,
+		                 &excess_not_empty);
+		depot->nr_not_empty -= nr_not_empty;
+	}
+	if (nr_empty) {
+		__depot_cut_tail(&depot->empty, depot->nr_empty - nr_empty,
+		                 &excess_empty);
+		depot->nr_empty -= nr_empty;
+	}
+	depot->last_ws_not_empty = depot->ws_not_empty;
+	depot->last_ws_empty = depot->ws_empty;
+	__ws_reset(&depot->ws_not_empty, depot->nr_not_empty);
+	__ws_reset(&depot->ws_empty, depot->nr_empty);
+	spin_unlock_irqsave(&depot->lock);
+
+	/* Freeing mags may call back into this cache's depot (if kc is the
+	 * magazine cache), so we do it after unlocking. */
+	while ((mag = SLIST_FIRST(&excess_not_empty))) {
+		SLIST_REMOVE_HEAD(&excess_not_empty, link);
+		kc->nr_reclaimed_rounds += mag->nr_rounds;
+		drain_mag(kc, mag);
+		kmem_cache_free(kmem_magazine_cache, mag);
+	}
+	while ((mag = SLIST_FIRST(&excess_empty))) {
+		SLIST_REMOVE_HEAD(&excess_empty, link);
+		kmem_cache_free(kmem_magazine_cache, mag);
+	}
+	kc->nr_reclaimed_mags += nr_not_empty + nr_empty;
+	amt = kmem_cache_reap(kc);
+	kc->amt_reclaimed += amt;
+	return amt;
+}
+
+/* Runs a reclaim pass over every cache.  Returns the amount of memory given
+ * back to the arenas.  Can block. */
+size_t kmem_reclaim_all(void)
+{
+	struct kmem_cache *kc_i;
+	size_t amt = 0;
+
+	qlock(&arenas_and_slabs_lock);
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
+		amt += kmem_cache_reclaim(kc_i);
+	kmc_nr_reclaim_passes++;
+	kmc_amt_reclaimed += amt;
+	qunlock(&arenas_and_slabs_lock);
+	return amt;
+}
+
+static int __reclaim_kicked(void *arg)
+{
+	return kmc_reclaim_kicked;
+}
+
+static void kmem_reclaim_ktask(void *arg)
+{
+	for (;;) {
+		if (kmc_reclaim_period_ms)
+			rendez_sleep_timeout(&kmc_reclaim_rv, __reclaim_kicked, NULL,
+			                     kmc_reclaim_period_ms * 1000);
+		else
+			rendez_sleep(&kmc_reclaim_rv, __reclaim_kicked, NULL);
+		kmc_reclaim_kicked = FALSE;
+		kmem_reclaim_all();
+	}
+}
+
+/* Wakes the reclaim ktask for an immediate pass.  Safe from IRQ context. */
+void kmem_reclaim_kick(void)
+{
+	kmc_reclaim_kicked = TRUE;
+	rendez_wakeup(&kmc_reclaim_rv);
+}
+
+void kmem_reclaim_init(void)
+{
+	rendez_init(&kmc_reclaim_rv);
+	ktask("kmem_reclaim", kmem_reclaim_ktask, NULL);
 }
@@ -1148,6 +1148,11 @@ static int sys_exec(struct proc *p, char *path, size_t path_l,
 		set_error(ENOEXEC, "Program was not a valid ELF");
 		goto out_error_program;
 	}
+	/* We're about to free our memory out from under any zero-copy I/O. */
+	if (mm_has_pins(p)) {
+		set_error(EBUSY, "memory is pinned for I/O");
+		goto out_error_program;
+	}
 
 	/* This is the point of no return for the process.  Any errors here lead to
 	 * destruction. */
@@ -0,0 +1,282 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * UDP datagram rates, one syscall per datagram vs. sendmmsg/recvmmsg batches.
+ * ttcp-style: -t sends to a -r on another host.  With neither, it runs both
+ * ends over loopback, once with sendto/recvfrom and once with batches, and
+ * prints the cost per datagram of each.
+ *
+ * A batch of 1 uses sendto/recvfrom.  The sender ends with a few empty
+ * datagrams, which tell the receiver it's done. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <parlib/timing.h>
+
+#define MAX_BATCH			1024
+#define NR_FINS				8
+
+static long ncalls;
+
+static void sysfatal(char *msg)
+{
+	perror(msg);
+	exit(-1);
+}
+
+struct batch {
+	int nr;
+	struct mmsghdr msgs[MAX_BATCH];
+	struct iovec iovs[MAX_BATCH];
+	struct sockaddr_in addrs[MAX_BATCH];
+};
+
+/* Points each message at its own slice of buf, len bytes each. */
+static struct batch *batch_alloc(int nr, char *buf, int len,
+                                 struct sockaddr_in *to)
+{
+	struct batch *b = calloc(1, sizeof(struct batch));
+
+	if (!b)
+		sysfatal("calloc");
+	b->nr = nr;
+	for (int i = 0; i < nr; i++) {
+		b->iovs[i].iov_base = buf + i * len;
+		b->iovs[i].iov_len = len;
+		b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		if (to)
+			b->addrs[i] = *to;
+		b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+	return b;
+}
+
+/* Sends nr datagrams, batch at a time.  Returns how many went. */
+static long send_some(int fd, struct batch *b, struct sockaddr_in *to, long nr)
+{
+	long sent = 0;
+	int ret, amt;
+
+	while (sent < nr) {
+		amt = MIN(b->nr, nr - sent);
+		if (b->nr == 1) {
+			ret = sendto(fd, b->iovs[0].iov_base, b->iovs[0].iov_len, 0,
+			             (struct sockaddr*)to, sizeof(struct sockaddr_in));
+			ret = ret < 0 ? ret : 1;
+		} else {
+			ret = sendmmsg(fd, b->msgs, amt, 0);
+		}
+		ncalls++;
+		if (ret <= 0)
+			sysfatal("send");
+		sent += ret;
+	}
+	return sent;
+}
+
+/* Receives up to nr datagrams in one call.  Returns how many came, and sets
+ * *fin if one was empty. */
+static int recv_some(int fd, struct batch *b, int nr, int *fin)
+{
+	socklen_t alen = sizeof(struct sockaddr_in);
+	int ret;
+
+	if (b->nr == 1) {
+		ret = recvfrom(fd, b->iovs[0].iov_base, b->iovs[0].iov_len, 0,
+		               (struct sockaddr*)&b->addrs[0], &alen);
+		if (ret >= 0) {
+			b->msgs[0].msg_len = ret;
+			ret = 1;
+		}
+	} else {
+		for (int i = 0; i < nr; i++)
+			b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		ret = recvmmsg(fd, b->msgs, MIN(b->nr, nr), MSG_WAITFORONE, NULL);
+	}
+	ncalls++;
+	if (ret < 0)
+		sysfatal("recv");
+	for (int i = 0; i < ret; i++) {
+		if (!b->msgs[i].msg_len)
+			*fin = 1;
+	}
+	return ret;
+}
+
+static int udp_socket(int port)
+{
+	struct sockaddr_in addr = {0};
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (fd < 0)
+		sysfatal("socket");
+	if (port) {
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(port);
+		if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)))
+			sysfatal("bind");
+	}
+	return fd;
+}
+
+static void report(char *who, int batch, long nr, long calls, uint64_t ns)
+{
+	fprintf(stderr, "%s: batch %4d: %ld dgrams in %.3f sec, %.0f ns/dgram, "
+	        "%.3f calls/dgram\n", who, batch, nr, ns / 1E9,
+	        nr ? (double)ns / nr : 0.0, nr ? (double)calls / nr : 0.0);
+}
+
+static void reader(int port, int buflen, int batch)
+{
+	char *buf = malloc(MAX_BATCH * buflen);
+	struct batch *b = batch_alloc(batch, buf, buflen, NULL);
+	int fd = udp_socket(port);
+	int fin = 0, got;
+	long nr = 0;
+	uint64_t start = 0;
+
+	fprintf(stderr, "udp_mmsg-r: buflen=%d, batch=%d, port=%d\n", buflen,
+	        batch, port);
+	while (!fin) {
+		got = recv_some(fd, b, MAX_BATCH, &fin);
+		/* The clock starts when the sender does. */
+		if (!start) {
+			start = nsec();
+			ncalls = 0;
+			continue;
+		}
+		nr += got;
+	}
+	report("udp_mmsg-r", batch, nr, ncalls, nsec() - start);
+}
+
+static void writer(char *host, int port, int buflen, long nbuf, int batch)
+{
+	char *buf = calloc(MAX_BATCH, buflen);
+	struct sockaddr_in to = {0};
+	struct batch *b;
+	int fd = udp_socket(0);
+	uint64_t start;
+
+	to.sin_family = AF_INET;
+	to.sin_port = htons(port);
+	if (!inet_aton(host, &to.sin_addr))
+		sysfatal("inet_aton");
+	b = batch_alloc(batch, buf, buflen, &to);
+	fprintf(stderr, "udp_mmsg-t: buflen=%d, nbuf=%ld, batch=%d, port=%d -> %s\n",
+	        buflen, nbuf, batch, port, host);
+	ncalls = 0;
+	start = nsec();
+	send_some(fd, b, &to, nbuf);
+	report("udp_mmsg-t", batch, nbuf, ncalls, nsec() - start);
+	for (int i = 0; i < NR_FINS; i++)
+		sendto(fd, buf, 0, 0, (struct sockaddr*)&to, sizeof(to));
+}
+
+/* Both ends in this process: send a batch, receive it, repeat.  The receive
+ * queue only holds 128K, so keep a batch of datagrams, with their headers,
+ * under that. */
+static void loopback(int port, int buflen, long nbuf, int batch)
+{
+	char *buf = calloc(MAX_BATCH, buflen);
+	struct sockaddr_in to = {0};
+	struct batch *tb, *rb;
+	int rfd = udp_socket(port);
+	int tfd = udp_socket(0);
+	int fin = 0;
+	long left, got;
+	uint64_t start;
+
+	to.sin_family = AF_INET;
+	to.sin_port = htons(port);
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	tb = batch_alloc(batch, buf, buflen, &to);
+	rb = batch_alloc(batch, buf, buflen, NULL);
+	ncalls = 0;
+	start = nsec();
+	for (left = nbuf; left; left -= got) {
+		got = send_some(tfd, tb, &to, MIN(batch, left));
+		for (long r = 0; r < got; )
+			r += recv_some(rfd, rb, got - r, &fin);
+	}
+	report("udp_mmsg-l", batch, nbuf, ncalls, nsec() - start);
+	close(rfd);
+	close(tfd);
+	free(tb);
+	free(rb);
+	free(buf);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage:\tudp_mmsg -t [options] host\n"
+	        "\t\tudp_mmsg -r [options]\n"
+	        "\t\tudp_mmsg [options]\t(loopback, batch 1 then -b)\n"
+	        " options:\n"
+	        "  -b num\tdatagrams per call, max %d (default 32)\n"
+	        "  -l len\tlength of a datagram (default 64)\n"
+	        "  -n num\tnumber of datagrams sent (default 100000)\n"
+	        "  -p port\tport number (default 5001)\n", MAX_BATCH);
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	int buflen = 64;
+	long nbuf = 100000;
+	int batch = 32;
+	int port = 5001;
+	enum { loop, rcv, xmit } mode = loop;
+	int c;
+
+	while ((c = getopt(argc, argv, "rtb:l:n:p:")) != -1) {
+		switch (c) {
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'l':
+			buflen = atoi(optarg);
+			break;
+		case 'n':
+			nbuf = atol(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'r':
+			mode = rcv;
+			break;
+		case 't':
+			mode = xmit;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (batch < 1 || batch > MAX_BATCH || buflen < 1)
+		usage();
+	switch (mode) {
+	case loop:
+		loopback(port, buflen, nbuf, 1);
+		loopback(port, buflen, nbuf, batch);
+		break;
+	case xmit:
+		if (optind == argc)
+			usage();
+		writer(argv[optind], port, buflen, nbuf, batch);
+		break;
+	case rcv:
+		reader(port, buflen, batch);
+		break;
+	}
+	return 0;
+}
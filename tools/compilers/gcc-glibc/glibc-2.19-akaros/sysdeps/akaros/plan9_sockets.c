@@ -202,6 +202,8 @@ Rock *_sock_newrock(int fd)
 	r->other = -1;
 	r->has_listen_fd = FALSE;
 	r->listen_fd = -1;
+	r->mdata_fd = -1;
+	r->mdata_max = 0;
 	return r;
 }
 
@@ -218,6 +220,10 @@ void _sock_fd_closed(int fd)
 		/* This shouldn't matter - the rock is being closed anyways. */
 		r->has_listen_fd = FALSE;
 	}
+	if (r->mdata_fd >= 0) {
+		close(r->mdata_fd);
+		r->mdata_fd = -1;
+	}
 }
 
 /* For a ctlfd and a few other settings, it opens and returns the corresponding
@@ -374,6 +380,32 @@ void _sock_mirror_fcntl(int sock_fd, int cmd, long arg)
 		syscall(SYS_fcntl, r->ctl_fd, cmd, arg);
 	if (r->has_listen_fd)
 		syscall(SYS_fcntl, r->listen_fd, cmd, arg);
+	if (r->mdata_fd >= 0)
+		syscall(SYS_fcntl, r->mdata_fd, cmd, arg);
+}
+
+/* Returns the FD of the conversation's mdata file, for batches of datagrams,
+ * opening it the first time.  It gets the data file's O_NONBLOCK, and later
+ * fcntls are mirrored to it.  Returns -1 on error.  Racy, like the listen FD. */
+int _sock_get_mdata_fd(int sock_fd, Rock *r)
+{
+	char mdata_file[Ctlsize];
+	int fd, fl, open_flags;
+
+	if (r->mdata_fd >= 0)
+		return r->mdata_fd;
+	fl = fcntl(sock_fd, F_GETFL);
+	if (fl < 0)
+		return -1;
+	_sock_get_conv_filename(r, "mdata", mdata_file);
+	open_flags = O_RDWR;
+	open_flags |= (fl & O_NONBLOCK ? O_NONBLOCK : 0);
+	open_flags |= (r->sopts & SOCK_CLOEXEC ? O_CLOEXEC : 0);
+	fd = open(mdata_file, open_flags);
+	if (fd < 0)
+		return -1;
+	r->mdata_fd = fd;
+	return fd;
 }
 
 /* Given an FD, opens the FD with the name 'sibling' in the same directory.
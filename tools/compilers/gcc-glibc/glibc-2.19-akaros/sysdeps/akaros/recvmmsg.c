@@ -0,0 +1,165 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * recvmmsg().  UDP sockets read a batch of datagrams from the conversation's
+ * mdata file in one syscall, see ros/mdata.h.  Anything else is recvmsg() in a
+ * loop. */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ros/mdata.h>
+
+#include <sys/plan9_helpers.h>
+
+/* In recvmsg.c */
+extern ssize_t __recvmsg(int fd, struct msghdr *msg, int flags);
+
+static size_t iov_len(const struct iovec *iov, size_t iovcnt)
+{
+	size_t ret = 0;
+
+	for (size_t i = 0; i < iovcnt; i++)
+		ret += iov[i].iov_len;
+	return ret;
+}
+
+/* Copies up to len of from into iov, returning how much fit. */
+static size_t iov_scatter(const struct iovec *iov, size_t iovcnt,
+                          const uint8_t *from, size_t len)
+{
+	size_t amt, sofar = 0;
+
+	for (size_t i = 0; i < iovcnt && sofar < len; i++) {
+		amt = MIN(iov[i].iov_len, len - sofar);
+		memcpy(iov[i].iov_base, from + sofar, amt);
+		sofar += amt;
+	}
+	return sofar;
+}
+
+/* Tells the conversation to return at most vlen datagrams per read of mdata.
+ * We remember the last one, so this is usually free. */
+static int __set_mdata_max(Rock *r, unsigned int vlen)
+{
+	char msg[32];
+	int n;
+
+	if (r->mdata_max == vlen)
+		return 0;
+	n = snprintf(msg, sizeof(msg), "mdatamax %u", vlen);
+	if (write(r->ctl_fd, msg, n) != n)
+		return -1;
+	r->mdata_max = vlen;
+	return 0;
+}
+
+/* Fills in vmessages[i] from the record of a datagram, Udphdr and all. */
+static void __recvmmsg_fill(struct mmsghdr *mmsg, struct mdata_hdr *hdr)
+{
+	struct msghdr *msg = &mmsg->msg_hdr;
+	struct sockaddr_in *remote = msg->msg_name;
+	uint8_t *p = (uint8_t*)(hdr + 1);
+	size_t len = hdr->len;
+
+	msg->msg_flags = hdr->flags & MDATA_TRUNC ? MSG_TRUNC : 0;
+	msg->msg_controllen = 0;
+	if (len < P9_UDP_HDR_SZ) {
+		/* Truncated into the header, nothing for the user. */
+		msg->msg_flags = MSG_TRUNC;
+		msg->msg_namelen = 0;
+		mmsg->msg_len = 0;
+		return;
+	}
+	if (remote && msg->msg_namelen >= sizeof(struct sockaddr_in)) {
+		remote->sin_family = AF_INET;
+		remote->sin_addr.s_addr = plan9addr_to_naddr(p);
+		/* sin_port and the rport are both in network-ordering */
+		remote->sin_port = *(uint16_t*)(p + 16 + 16 + 16);
+		msg->msg_namelen = sizeof(struct sockaddr_in);
+	}
+	p += P9_UDP_HDR_SZ;
+	len -= P9_UDP_HDR_SZ;
+	mmsg->msg_len = iov_scatter(msg->msg_iov, msg->msg_iovlen, p, len);
+	if (mmsg->msg_len < len)
+		msg->msg_flags |= MSG_TRUNC;
+}
+
+/* One read of mdata, so this always acts as if MSG_WAITFORONE was set: on a
+ * blocking socket, we wait for the first datagram, then take whatever else
+ * already arrived.  The timeout never comes into play. */
+static int __recvmmsg_udp(Rock *r, int fd, struct mmsghdr *vmessages,
+                          unsigned int vlen, int flags)
+{
+	struct mdata_hdr *hdr;
+	uint8_t *buf;
+	size_t sz = 0, off = 0;
+	ssize_t ret;
+	int mfd;
+	unsigned int i;
+
+	mfd = _sock_get_mdata_fd(fd, r);
+	if (mfd < 0)
+		return -1;
+	if (__set_mdata_max(r, vlen))
+		return -1;
+	for (i = 0; i < vlen; i++)
+		sz += MDATA_REC_SZ(P9_UDP_HDR_SZ +
+		                   iov_len(vmessages[i].msg_hdr.msg_iov,
+		                           vmessages[i].msg_hdr.msg_iovlen));
+	buf = malloc(sz);
+	if (!buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ret = read(mfd, buf, sz);
+	if (ret < 0) {
+		free(buf);
+		return -1;
+	}
+	for (i = 0; i < vlen && off < (size_t)ret; i++) {
+		hdr = (struct mdata_hdr*)(buf + off);
+		__recvmmsg_fill(&vmessages[i], hdr);
+		off += MDATA_REC_SZ(hdr->len);
+	}
+	free(buf);
+	return i;
+}
+
+/* Receive up to VLEN messages as described by VMESSAGES from socket FD.
+ * Returns the number of messages received or -1 for errors. */
+int __recvmmsg(int fd, struct mmsghdr *vmessages, unsigned int vlen, int flags,
+               const struct timespec *tmo)
+{
+	Rock *r;
+	ssize_t ret;
+	unsigned int i;
+
+	if (flags & MSG_OOB) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (!vlen)
+		return 0;
+	r = udp_sock_get_rock(fd);
+	if (r)
+		return __recvmmsg_udp(r, fd, vmessages, vlen, flags);
+	for (i = 0; i < vlen; i++) {
+		ret = __recvmsg(fd, &vmessages[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? i : -1;
+		vmessages[i].msg_len = ret;
+		/* We can't check for more without blocking. */
+		if (flags & MSG_WAITFORONE)
+			return 1;
+	}
+	return vlen;
+}
+weak_alias(__recvmmsg, recvmmsg)
@@ -0,0 +1,128 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * sendmmsg().  UDP sockets write a batch of datagrams to the conversation's
+ * mdata file in one syscall, see ros/mdata.h.  Anything else is sendmsg() in a
+ * loop. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ros/mdata.h>
+
+#include <sys/plan9_helpers.h>
+
+/* In sendmsg.c */
+extern ssize_t __sendmsg(int fd, const struct msghdr *msg, int flags);
+
+static size_t iov_len(const struct iovec *iov, size_t iovcnt)
+{
+	size_t ret = 0;
+
+	for (size_t i = 0; i < iovcnt; i++)
+		ret += iov[i].iov_len;
+	return ret;
+}
+
+static size_t iov_gather(uint8_t *to, const struct iovec *iov, size_t iovcnt)
+{
+	size_t sofar = 0;
+
+	for (size_t i = 0; i < iovcnt; i++) {
+		memcpy(to + sofar, iov[i].iov_base, iov[i].iov_len);
+		sofar += iov[i].iov_len;
+	}
+	return sofar;
+}
+
+/* Writes the record for msg at p, Udphdr and all, like sendto() does for one
+ * datagram.  Returns the record's length. */
+static size_t __sendmmsg_fill(Rock *r, const struct msghdr *msg, uint8_t *p)
+{
+	struct mdata_hdr *hdr = (struct mdata_hdr*)p;
+	const struct sockaddr_in *to = msg->msg_name;
+	size_t len;
+
+	/* Without a to, this is a send() on a connected socket. */
+	if (!to)
+		to = (struct sockaddr_in*)&r->raddr;
+	p += sizeof(struct mdata_hdr);
+	memset(p, 0, P9_UDP_HDR_SZ);
+	naddr_to_plan9addr(to->sin_addr.s_addr, p);
+	/* sin_port and the rport are both in network-ordering.  We leave the
+	 * laddr, ifc and lport for the kernel. */
+	*(uint16_t*)(p + 16 + 16 + 16) = to->sin_port;
+	p += P9_UDP_HDR_SZ;
+	len = iov_gather(p, msg->msg_iov, msg->msg_iovlen);
+	hdr->len = P9_UDP_HDR_SZ + len;
+	hdr->flags = 0;
+	return len;
+}
+
+static int __sendmmsg_udp(Rock *r, int fd, struct mmsghdr *vmessages,
+                          unsigned int vlen, int flags)
+{
+	uint8_t *buf;
+	size_t sz = 0, off = 0;
+	ssize_t ret;
+	int mfd;
+	unsigned int i;
+
+	mfd = _sock_get_mdata_fd(fd, r);
+	if (mfd < 0)
+		return -1;
+	for (i = 0; i < vlen; i++)
+		sz += MDATA_REC_SZ(P9_UDP_HDR_SZ +
+		                   iov_len(vmessages[i].msg_hdr.msg_iov,
+		                           vmessages[i].msg_hdr.msg_iovlen));
+	buf = malloc(sz);
+	if (!buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < vlen; i++) {
+		vmessages[i].msg_len = __sendmmsg_fill(r, &vmessages[i].msg_hdr,
+		                                       buf + off);
+		off += MDATA_REC_SZ(P9_UDP_HDR_SZ + vmessages[i].msg_len);
+	}
+	ret = write(mfd, buf, sz);
+	free(buf);
+	if (ret < 0)
+		return -1;
+	/* A short write means only the datagrams of the first ret bytes went. */
+	for (i = 0, off = 0; i < vlen && off < (size_t)ret; i++)
+		off += MDATA_REC_SZ(P9_UDP_HDR_SZ + vmessages[i].msg_len);
+	return i;
+}
+
+/* Send VLEN messages as described by VMESSAGES to socket FD.  Returns the
+ * number of datagrams sent or -1 for errors. */
+int __sendmmsg(int fd, struct mmsghdr *vmessages, unsigned int vlen, int flags)
+{
+	Rock *r;
+	ssize_t ret;
+	unsigned int i;
+
+	if (flags & MSG_OOB) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (!vlen)
+		return 0;
+	r = udp_sock_get_rock(fd);
+	if (r)
+		return __sendmmsg_udp(r, fd, vmessages, vlen, flags);
+	for (i = 0; i < vlen; i++) {
+		ret = __sendmsg(fd, &vmessages[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? i : -1;
+		vmessages[i].msg_len = ret;
+	}
+	return vlen;
+}
+weak_alias(__sendmmsg, sendmmsg)
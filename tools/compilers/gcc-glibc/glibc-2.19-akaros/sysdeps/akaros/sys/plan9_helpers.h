@@ -62,6 +62,8 @@ struct Rock {
 	int other;					/* fd of the remote end for Unix domain */
 	bool has_listen_fd;			/* has set up a listen file, O_PATH */
 	int listen_fd;				/* fd of the listen file, if any */
+	int mdata_fd;				/* fd of the mdata file, -1 until used */
+	unsigned int mdata_max;		/* last "mdatamax" written to ctl */
 };
 
 extern Rock *_sock_findrock(int, struct stat *);
@@ -79,6 +81,7 @@ extern int _sock_get_opts(int type);
 extern void _sock_lookup_rock_fds(int sock_fd, bool can_open_listen_fd,
                                   int *listen_fd_r, int *ctl_fd_r);
 extern void _sock_mirror_fcntl(int sock_fd, int cmd, long arg);
+extern int _sock_get_mdata_fd(int sock_fd, Rock *r);
 
 int get_sibling_fd(int fd, const char *sibling);
 int write_hex_to_fd(int fd, uint64_t num);